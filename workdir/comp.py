@@ -85,12 +85,13 @@ def main():
     u64hashmap = Object("u64hashmap.obj", "src/hashmap.c", defines=['HASHMAP_U64'])
 
     Executable("autocmp.dll", "src/autocmp.c", *arg_src, "src/match_node.c",
-               "src/subprocess.c", whashmap, lhashmap, "src/json.c", 
-               "src/cli.c", "src/glob.c", "src/path_utils.c", ntdll,
-               "src/unicode/unicode_width.c",
+               "src/subprocess.c", whashmap, lhashmap, "src/json.c", "src/json_number.c",
+               "src/arena.c", "src/cli.c", "src/glob.c", "src/path_utils.c", "src/mutex.c",
+               "src/history.c", ntdll, "src/unicode/unicode_width.c",
                link_flags=DLLFLAGS, dll=True)
 
-    Executable("json_rpc.exe", "src/json_rpc_server.c", "src/json.c", lhashmap, *arg_src, 
+    Executable("json_rpc.exe", "src/json_rpc_server.c", "src/json.c", "src/json_number.c",
+               "src/arena.c", "src/mutex.c", lhashmap, *arg_src, 
                "src/unicode/tables.c", "src/printf.c", ntdll, defines=['JSON_RPC_TESTS'],
                namespace="json_rpc")
 
@@ -174,12 +175,19 @@ def main():
 
     Executable("autocmp-test", "src/autocmp-parser.c", *arg_src, lhashmap, whashmap,
                cmd_o, "src/subprocess.c",
-               "src/glob.c", "src/match_node.c", ntdll)
+               "src/glob.c", "src/match_node.c", "src/mutex.c", ntdll)
 
     with Context(group="tests", directory=f"{bin_dir()}/tests",
                  includes=["src"], namespace="tests"):
         Executable("test_regex.exe", "src/tests/test_regex.c", "src/regex.c", *unicode,
                    "src/printf.c", "src/dynamic_string.c", "src/args.c", ntdll)
+        Executable("test_json.exe", "src/tests/test_json.c", "src/json.c",
+                   "src/json_number.c", "src/arena.c", lhashmap, "src/printf.c",
+                   "src/dynamic_string.c", "src/mem.c", ntdll)
+        Executable("test_history.exe", "src/tests/test_history.c", "src/history.c",
+                   "src/arena.c", "src/printf.c", "src/dynamic_string.c", "src/mem.c", ntdll)
+        Executable("test_fuzzy.exe", "src/tests/test_fuzzy.c", "src/match_node.c",
+                   "src/subprocess.c", "src/glob.c", "src/mutex.c", whashmap, *arg_src, ntdll)
 
     with Context(group="compiler", includes=["src"], namespace="compiler",
                  defines=["NARROW_OCHAR"]):
@@ -218,7 +226,10 @@ def main():
                               "helpers/encodings.py", directory="src/compiler/asm")
 
         comp_src = ["src/compiler/format.c", "src/compiler/asm/amd64.c",
-                    "src/compiler/quads.c", "src/compiler/utils.c",
+                    "src/compiler/quads.c", "src/compiler/optimizer.c",
+                    "src/compiler/module_cache.c",
+                    "src/compiler/time_report.c",
+                    "src/compiler/utils.c",
                     "src/compiler/linker/linker.c", "src/compiler/linker/pe_coff.c",
                     "src/compiler/tokenizer.c", encodings_c.product,
                     "src/compiler/code_generation.c", "src/compiler/amd64_asm.c",
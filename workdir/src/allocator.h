@@ -0,0 +1,26 @@
+#ifndef ALLOCATOR_H_00
+#define ALLOCATOR_H_00
+#include <stddef.h>
+#include "mem.h"
+
+// Allocation vtable that containers can be bound to.
+// A NULL Allocator* always means the process heap (Mem_alloc and friends).
+typedef struct Allocator {
+    void* (*alloc)(void* ctx, size_t size);
+    // `old_size` is the size of the block pointed to by `ptr`
+    void* (*realloc)(void* ctx, void* ptr, size_t old_size, size_t new_size);
+    void (*free)(void* ctx, void* ptr);
+    void* ctx;
+} Allocator;
+
+#define Allocator_alloc(a, size) ((a) == NULL ? Mem_alloc(size) : \
+    (a)->alloc((a)->ctx, (size)))
+
+#define Allocator_realloc(a, ptr, old_size, new_size) ((a) == NULL ?         \
+    Mem_realloc((ptr), (new_size)) :                                          \
+    (a)->realloc((a)->ctx, (ptr), (old_size), (new_size)))
+
+#define Allocator_free(a, ptr) ((a) == NULL ? (void)Mem_free(ptr) : \
+    (a)->free((a)->ctx, (ptr)))
+
+#endif
@@ -1,6 +1,7 @@
 #include "arena.h"
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#include "allocator.h"
 
 #define ALLIGN_TO(i, size) if (((i) % (size)) != 0) { \
     (i) = (i) + ((size) - ((i) % (size)));            \
@@ -59,3 +60,41 @@ void Arena_free(Arena* arena) {
     arena->reserved_size = 0;
     arena->offset = 0;
 }
+
+static void* arena_alloc_fn(void* ctx, size_t size) {
+    return Arena_alloc(ctx, size, MEM_ALIGNMENT);
+}
+
+static void* arena_realloc_fn(void* ctx, void* ptr, size_t old_size, size_t new_size) {
+    Arena* arena = ctx;
+    if (ptr != NULL && (uint8_t*)ptr + old_size == arena->base + arena->offset) {
+        uint64_t offset = (uint8_t*)ptr - arena->base;
+        if (new_size <= old_size) {
+            arena->offset = offset + new_size;
+            return ptr;
+        }
+        if (offset + new_size <= arena->reserved_size &&
+            VirtualAlloc(ptr, new_size, MEM_COMMIT, PAGE_READWRITE) != NULL) {
+            arena->offset = offset + new_size;
+            return ptr;
+        }
+    }
+    void* new_ptr = Arena_alloc(arena, new_size, MEM_ALIGNMENT);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    if (ptr != NULL) {
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return new_ptr;
+}
+
+static void arena_free_fn(void* ctx, void* ptr) {
+}
+
+void Arena_allocator(Arena* arena, Allocator* allocator) {
+    allocator->alloc = arena_alloc_fn;
+    allocator->realloc = arena_realloc_fn;
+    allocator->free = arena_free_fn;
+    allocator->ctx = arena;
+}
@@ -2,6 +2,9 @@
 #define ARENA_H_00
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+
+struct Allocator;
 
 typedef struct Arena {
     uint8_t* base;
@@ -28,4 +31,8 @@ void* Arena_alloc(Arena* arena, size_t alloc_size, size_t allignment);
 // Frees all memory
 void Arena_free(Arena* arena);
 
+// Bind `allocator` to `arena`. Blocks are only reclaimed by Arena_release
+// or Arena_free, except that the latest block can be grown in place.
+void Arena_allocator(Arena* arena, struct Allocator* allocator);
+
 #endif
@@ -463,4 +463,7 @@ bool parse_file(ochar_t* filename) {
 int main() {
     MatchNode_init();
     parse_file(L"autocmp.txt");
+#ifdef MEM_DEBUG
+    _printf("Live allocations: %llu\n", Mem_count());
+#endif
 }
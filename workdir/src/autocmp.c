@@ -5,11 +5,13 @@
 #include "printf.h"
 #include "dynamic_string.h"
 #include "json.h"
+#include "arena.h"
 #include "match_node.h"
 #include "path_utils.h"
 #include "subprocess.h"
 #include "mem.h"
 #include "cli.h"
+#include "history.h"
 #include <limits.h>
 
 // TODO:
@@ -144,13 +146,10 @@ bool gDo_command_sub = false;
 bool gDo_history = true;
 bool gDo_autocmp = true;
 bool gDo_rsearch = true;
+bool gDo_fuzzy = false;
 
 bool gHas_history = false;
-wchar_t history_file_name[1025];
-
-wchar_t* last_cmd = NULL;
-DWORD last_cmd_len = 0;
-DWORD last_cmd_cap = 0;
+History gHistory;
 
 void add_history(wchar_t* buf, DWORD len) {
     if (!gDo_history || !gHas_history || len == 0) {
@@ -159,106 +158,14 @@ void add_history(wchar_t* buf, DWORD len) {
     if (buf[len - 1] != L'\n' && buf[len - 1] != L'\r' || buf[0] == L'@') {
         return;
     }
-    if (last_cmd == NULL) {
-        last_cmd = Mem_alloc(len * sizeof(wchar_t));
-        if (last_cmd != NULL) {
-            memcpy(last_cmd, buf, len * sizeof(wchar_t));
-            last_cmd_len = len;
-            last_cmd_cap = len;
-        }
-    } else {
-        if (last_cmd_len == len &&
-            memcmp(last_cmd, buf, len * sizeof(wchar_t)) == 0) {
-            return;
-        }
-        if (len > last_cmd_cap) {
-            Mem_free(last_cmd);
-            last_cmd = Mem_alloc(len * sizeof(wchar_t));
-            if (last_cmd != NULL) {
-                last_cmd_len = len;
-                last_cmd_cap = len;
-                memcpy(last_cmd, buf, len * sizeof(wchar_t));
-            }
-        } else {
-            memcpy(last_cmd, buf, len * sizeof(wchar_t));
-            last_cmd_len = len;
-        }
-    }
-
-    HANDLE file = CreateFileW(history_file_name, GENERIC_WRITE,
-                              0, NULL, OPEN_ALWAYS, 
-                              FILE_ATTRIBUTE_NORMAL, NULL);
-    if (file == NULL) {
-        return;
-    }
-    if (SetFilePointer(file, 0, NULL, FILE_END) == INVALID_SET_FILE_POINTER) {
-        if (GetLastError() != NO_ERROR) {
-            CloseHandle(file);
-            return;
-        }
-    }
-    DWORD written = 0;
-    while (written < len) {
-        DWORD w;
-        if (!WriteFile(file, buf + written, 
-                       (len - written) * sizeof(wchar_t), &w, NULL)) {
-            break;
-        }
-        written += w;
+    while (len > 0 && (buf[len - 1] == L'\n' || buf[len - 1] == L'\r')) {
+        --len;
     }
-    CloseHandle(file);
+    History_add(&gHistory, buf, len);
 }
 
-wchar_t** read_history(DWORD* count, WString_noinit* in) {
-    if (!gHas_history) {
-        *count = 0;
-        return NULL;
-    }
-    if (!read_utf16_file(in, history_file_name)) {
-        *count = 0;
-        return NULL;
-    }
-    DWORD line_count = 0;
-    for (uint32_t ix = 0; ix < in->length; ++ix) {
-        if (in->buffer[ix] == L'\r') {
-            ++line_count;
-            if (ix + 1 < in->length && in->buffer[ix + 1] == L'\n') {
-                ++ix;
-            }
-        } else if (in->buffer[ix] == L'\n') {
-            ++line_count;
-        }
-    }
-    if (line_count == 0) {
-        *count = 0;
-        WString_free(in);
-        return NULL;
-    }
-    wchar_t** res = Mem_alloc(line_count * sizeof(wchar_t*));
-    WString_replaceall(in, L'\n', L'\0');
-    WString_replaceall(in, L'\r', L'\0');
-
-    DWORD arg = 0;
-    for (uint32_t ix = 0; ix < in->length; ++ix) {
-        if (arg > line_count) {
-            break;
-        }
-        size_t len = wcslen(in->buffer + ix);
-        if (len > 0) {
-            res[line_count - arg - 1] = in->buffer + ix;
-            ix = ix + len;
-            ++arg;
-        }
-    }
-    *count = arg;
-    if (arg == 0) {
-        WString_free(in);
-        return NULL;
-    }
-    if (arg < line_count) {
-        memmove(res, res + line_count - arg, arg * sizeof(wchar_t*));
-    }
-    return res;
+const wchar_t* search_history(void* ctx, const wchar_t* query, int64_t* ix, int step) {
+    return History_find(ctx, query, ix, step);
 }
 
 WString pathext, pathbuf, progbuf, workdir;
@@ -442,6 +349,8 @@ void substitute_commands(wchar_t *str, DWORD *len, DWORD capacity) {
 typedef struct SearchContext {
     NodeIterator it;
     bool active_it;
+    // Used instead of `it` with gDo_fuzzy
+    FuzzyMatcher fuzzy;
 } SearchContext;
 
 bool get_autocomplete(MatchNode* node, SearchContext* it, WString* out, WString* rem, bool changed) {
@@ -452,7 +361,15 @@ bool get_autocomplete(MatchNode* node, SearchContext* it, WString* out, WString*
     WString_clear(out);
 
     const wchar_t* buf;
-    if (it->active_it) {
+    if (gDo_fuzzy) {
+        if (changed || !it->fuzzy.active) {
+            FuzzyMatcher_begin(&it->fuzzy, node, rem->buffer);
+        }
+        buf = FuzzyMatcher_next(&it->fuzzy);
+        if (buf == NULL) {
+            return false;
+        }
+    } else if (it->active_it) {
         buf = NodeIterator_next(&it->it);
         if (buf == NULL) {
             NodeIterator_restart(&it->it);
@@ -524,12 +441,14 @@ __declspec(dllexport) BOOL WINAPI ReadConsoleW_Hook(HANDLE hConsoleInput, LPVOID
     in.capacity = nNumberOfCharsToRead;
     in.buffer = lpBuffer;
     in.length = 0;
+    in.allocator = NULL;
     if (do_rsearch) {
         pInputControl->dwCtrlWakeupMask |= (1 << 18);
     }
 
     SearchContext context;
     context.active_it = false;
+    FuzzyMatcher_init(&context.fuzzy);
     BOOL success = FALSE;
 
     get_workdir(&rem);
@@ -538,7 +457,13 @@ __declspec(dllexport) BOOL WINAPI ReadConsoleW_Hook(HANDLE hConsoleInput, LPVOID
         WString_clear(&workdir);
         WString_append_count(&workdir, rem.buffer, rem.length);
     }
-    DynamicMatch_invalidate_many(chdir);
+    DynamicMatch_invalidate_many(chdir, workdir.buffer);
+    if (gHas_history) {
+        History_flush(&gHistory, false);
+    }
+    if (gRoot != NULL) {
+        MatchNode_prefetch(gRoot);
+    }
 read:
     if (!ReadConsoleW_Old(hConsoleInput, lpBuffer, nNumberOfCharsToRead, lpNumberOfCharsRead, pInputControl)) {
         goto end;
@@ -548,20 +473,17 @@ read:
     for (DWORD ix = 0; ix < in.length; ++ix) {
         if (in.buffer[ix] == 18) {
             if (do_rsearch) {
-                DWORD count;
-                WString buf;
-                wchar_t** entries = read_history(&count, &buf);
+                if (gHas_history) {
+                    History_sync(&gHistory);
+                }
                 *lpNumberOfCharsRead -= 1;
-                Cli_Search(lpBuffer, lpNumberOfCharsRead, nNumberOfCharsToRead, entries, count);
+                Cli_Search(lpBuffer, lpNumberOfCharsRead, nNumberOfCharsToRead,
+                           search_history, &gHistory);
                 WriteConsoleOutputW(out, rs_buf, rs_size, rs_corner, &rs_area);
                 SetConsoleCursorPosition(out, rs_cursor);
                 pInputControl->nInitialChars = *lpNumberOfCharsRead;
                 DWORD written;
                 WriteConsoleW(out, lpBuffer, *lpNumberOfCharsRead, &written, NULL);
-                if (entries != NULL) {
-                    Mem_free(entries);
-                    WString_free(&buf);
-                }
                 goto read;
             } else {
                 goto end;
@@ -658,6 +580,7 @@ end:
     if (context.active_it) {
         NodeIterator_stop(&context.it);
     }
+    FuzzyMatcher_free(&context.fuzzy);
     if (do_rsearch) {
         Mem_free(rs_buf);
     }
@@ -705,6 +628,81 @@ bool add_node(NodeBuilder* builder, const char* key, LinkedHashMap* extr_map, Ma
     return true;
 }
 
+#define JSON_ARENA_SIZE 0x4000000
+#define JSON_CHUNK_SIZE 0x10000
+
+// Parse `path` while reading it, so only one chunk of the file is held
+// in memory besides the resulting tape
+bool read_json_file(const wchar_t* path, JsonTape* tape, const Allocator* allocator,
+                    String_noinit* errormsg) {
+    errormsg->buffer = NULL;
+    HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    char* chunk = Mem_alloc(JSON_CHUNK_SIZE);
+    if (chunk == NULL) {
+        CloseHandle(file);
+        return false;
+    }
+    JsonReader reader;
+    JsonReader_create(&reader, allocator);
+    JsonTape_create(tape, allocator);
+    JsonEvent e;
+    while ((e = JsonReader_read_tape(&reader, tape)) == JSON_EVENT_NONE) {
+        DWORD r;
+        if (!ReadFile(file, chunk, JSON_CHUNK_SIZE, &r, NULL)) {
+            break;
+        }
+        if (r == 0) {
+            JsonReader_finish(&reader);
+        } else if (!JsonReader_feed(&reader, chunk, r)) {
+            break;
+        }
+    }
+    Mem_free(chunk);
+    CloseHandle(file);
+
+    bool res = false;
+    if (e == JSON_EVENT_DONE) {
+        if (JsonTape_type(tape, JSON_TAPE_ROOT) == JSON_OBJECT) {
+            res = true;
+        } else {
+            String_create(errormsg);
+            String_extend(errormsg, "Error: Expected an object");
+        }
+    } else if (e == JSON_EVENT_ERROR) {
+        *errormsg = reader.ctx.errormsg;
+        reader.ctx.errormsg.buffer = NULL;
+    }
+    if (!res) {
+        JsonTape_free(tape);
+    }
+    JsonReader_free(&reader);
+    return res;
+}
+
+// Find the compiled graph next to `json`, and the stamp of `json` it
+// has to be saved with
+static bool graph_path(const wchar_t* json, wchar_t* out, GraphStamp* stamp) {
+    WIN32_FILE_ATTRIBUTE_DATA data;
+    if (!GetFileAttributesExW(json, GetFileExInfoStandard, &data)) {
+        return false;
+    }
+    size_t len = wcslen(json);
+    if (len < 5 || len > 1024 || _wcsicmp(json + len - 5, L".json") != 0) {
+        return false;
+    }
+    memcpy(out, json, (len - 5) * sizeof(wchar_t));
+    memcpy(out + len - 5, L".bin", 5 * sizeof(wchar_t));
+    memset(stamp, 0, sizeof(GraphStamp));
+    stamp->mtime = ((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) |
+                   data.ftLastWriteTime.dwLowDateTime;
+    stamp->size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+    return true;
+}
+
 bool load_json() {
     HANDLE err = GetStdHandle(STD_ERROR_HANDLE);
     wchar_t json_buf[1025];
@@ -712,126 +710,146 @@ bool load_json() {
         _printf_h(err, "Could not find autocmp.json\n");
         return 1;
     }
+
+    // Options are stored in the extra bytes of the stamp, 2 if not given
+    bool* options[5] = {&gDo_rsearch, &gDo_autocmp, &gDo_history, &gDo_command_sub, &gDo_fuzzy};
+    const char* option_names[5] = {"rsearch", "autocmp", "history", "substitute", "fuzzy"};
+    wchar_t graph_buf[1025];
+    GraphStamp stamp;
+    bool has_graph = graph_path(json_buf, graph_buf, &stamp);
+    if (has_graph && MatchNode_load_graph(graph_buf, &stamp)) {
+        _wprintf(L"Loaded %s\n", graph_buf);
+        for (int i = 0; i < 5; ++i) {
+            if (stamp.extra[i] < 2) {
+                *options[i] = stamp.extra[i];
+            }
+        }
+        return true;
+    }
     _wprintf(L"Loading %s\n", json_buf);
 
-    String json_str;
-    if (!read_text_file(&json_str, json_buf)) {
-        _printf_h(err, "Could not read autocmp.json\n");
+    // The whole document is parsed into one arena and dropped at once
+    Arena arena;
+    if (!Arena_create(&arena, JSON_ARENA_SIZE, NULL, NULL)) {
         return 1;
     }
+    Allocator allocator;
+    Arena_allocator(&arena, &allocator);
 
-    JsonObject obj;
+    JsonTape tape;
     String error_msg;
-    if (!json_parse_object(json_str.buffer, &obj, &error_msg)) {
-        _wprintf_h(err, L"Failed parsing json file: %S\n", error_msg.buffer);
-        String_free(&json_str);
-        String_free(&error_msg);
+    if (!read_json_file(json_buf, &tape, &allocator, &error_msg)) {
+        if (error_msg.buffer != NULL) {
+            _wprintf_h(err, L"Failed parsing json file: %S\n", error_msg.buffer);
+            String_free(&error_msg);
+        } else {
+            _printf_h(err, "Could not read autocmp.json\n");
+        }
+        Arena_free(&arena);
         return 1;
     }
-    String_free(&json_str);
 
-    JsonObject *extr = JsonObject_get_obj(&obj, "extern");
-    JsonObject* root_obj = JsonObject_get_obj(&obj, "root");
-    if (root_obj == NULL) {
+    JsonTapeRef extr = JsonTapeObject_get_obj(&tape, JSON_TAPE_ROOT, "extern");
+    JsonTapeRef root_obj = JsonTapeObject_get_obj(&tape, JSON_TAPE_ROOT, "root");
+    if (root_obj == JSON_TAPE_NONE) {
         _printf_h(err, "Missing root node\n");
-        JsonObject_free(&obj);
+        Arena_free(&arena);
         return 1;
     }
 
     LinkedHashMap extr_map;
     LinkedHashMap_Create(&extr_map);
-    LinkedHashMapIterator it;
-    LinkedHashElement *elem;
-
-    if (extr != NULL) {
-        LinkedHashMapIter_Begin(&it, &extr->data);
-        while ((elem = LinkedHashMapIter_Next(&it)) != NULL) {
-            JsonType *type = elem->value;
-            if (type->type != JSON_OBJECT) {
+    JsonTapeIter it;
+    StrView key;
+    JsonTapeRef member;
+
+    if (extr != JSON_TAPE_NONE) {
+        JsonTapeIter_begin(&it, &tape, extr);
+        while (JsonTapeIter_next(&it, &key, &member)) {
+            if (JsonTape_type(&tape, member) != JSON_OBJECT) {
                 continue;
             }
-            JsonObject *dyn_obj = &type->object;
-
-            String *cmd = JsonObject_get_string(dyn_obj, "cmd");
-            String *sep = JsonObject_get_string(dyn_obj, "separator");
-            String *inval = JsonObject_get_string(dyn_obj, "invalidation");
-            if (cmd == NULL || sep == NULL || inval == NULL ||
-                cmd->length == 0 || inval->length == 0) {
-                _wprintf_h(err, L"Invalid extern spec for %S\n", elem->key);
+
+            StrView cmd, sep, inval;
+            if (!JsonTapeObject_get_string(&tape, member, "cmd", &cmd) ||
+                !JsonTapeObject_get_string(&tape, member, "separator", &sep) ||
+                !JsonTapeObject_get_string(&tape, member, "invalidation", &inval) ||
+                cmd.length == 0 || inval.length == 0) {
+                _wprintf_h(err, L"Invalid extern spec for %S\n", key.data);
                 continue;
             }
             WString wcmd;
             WString_create(&wcmd);
             // use buffer for separator as well
-            if (!WString_from_utf8_bytes(&wcmd, sep->buffer, sep->length) ||
+            if (!WString_from_utf8_bytes(&wcmd, sep.data, sep.length) ||
                 wcmd.length != 1) {
-                _wprintf_h(err, L"Invalid separator for %S\n", elem->key);
+                _wprintf_h(err, L"Invalid separator for %S\n", key.data);
                 WString_free(&wcmd);
                 continue;
             }
             wchar_t sep_char = wcmd.buffer[0];
-            if (!WString_from_utf8_bytes(&wcmd, cmd->buffer, cmd->length)) {
-                _wprintf_h(err, L"Invalid command from %S\n", elem->key);
+            if (!WString_from_utf8_bytes(&wcmd, cmd.data, cmd.length)) {
+                _wprintf_h(err, L"Invalid command from %S\n", key.data);
                 WString_free(&wcmd);
                 continue;
             }
             enum Invalidation invalidation = INVALID_NEVER;
-            if (inval->buffer[0] == 'c' || inval->buffer[0] == 'C') {
+            if (inval.data[0] == 'c' || inval.data[0] == 'C') {
                 invalidation = INVALID_CHDIR;
-            } else if (inval->buffer[0] == 'a' || inval->buffer[0] == 'A') {
+            } else if (inval.data[0] == 'a' || inval.data[0] == 'A') {
                 invalidation = INVALID_ALWAYS;
             }
 
             // wcmd.buffer is moved
             DynamicMatch *match =
                 DynamicMatch_create(wcmd.buffer, invalidation, sep_char);
-            LinkedHashMap_Insert(&extr_map, elem->key, match);
+            LinkedHashMap_Insert(&extr_map, key.data, match);
         }
     }
 
     struct {
         const char* key;
-        LinkedHashMapIterator it;
+        JsonTapeIter it;
         NodeBuilder node;
     } stack[32];
     unsigned stack_ix = 0;
 
-    LinkedHashMapIter_Begin(&stack[0].it, &root_obj->data);
+    JsonTapeIter_begin(&stack[0].it, &tape, root_obj);
     NodeBuilder_create(&stack[0].node);
     WString workbuf;
     WString_create(&workbuf);
     while (1) {
-        while ((elem = LinkedHashMapIter_Next(&stack[stack_ix].it)) != NULL) {
-            JsonType *type = elem->value;
-            if (elem->key[0] == '\0') {
+        while (JsonTapeIter_next(&stack[stack_ix].it, &key, &member)) {
+            JsonKind type = JsonTape_type(&tape, member);
+            if (key.length == 0) {
                 continue;
             }
             NodeBuilder* node = &stack[stack_ix].node;
-            if (type->type == JSON_NULL) {
-                add_node(node, elem->key, &extr_map, NULL, &workbuf);
+            if (type == JSON_NULL) {
+                add_node(node, key.data, &extr_map, NULL, &workbuf);
                 continue;
             }
-            if (type->type != JSON_OBJECT) {
+            if (type != JSON_OBJECT) {
                 continue;
             }
             if (stack_ix >= 31) {
                 _printf_h(err, "Too deep nesting in tree\n");
-                add_node(node, elem->key, &extr_map, NULL, &workbuf);
+                add_node(node, key.data, &extr_map, NULL, &workbuf);
                 continue;
             }
 
             ++stack_ix;
-            stack[stack_ix].key = elem->key;
-            LinkedHashMapIter_Begin(&stack[stack_ix].it, &type->object.data);
+            stack[stack_ix].key = key.data;
+            JsonTapeIter_begin(&stack[stack_ix].it, &tape, member);
             NodeBuilder_create(&stack[stack_ix].node);
         }
         if (stack_ix == 0) {
             break;
         }
-        const char* key = stack[stack_ix].key;
+        const char* name = stack[stack_ix].key;
         MatchNode* node = NodeBuilder_finalize(&stack[stack_ix].node);
         --stack_ix;
-        add_node(&stack[stack_ix].node, key, &extr_map, node, &workbuf);
+        add_node(&stack[stack_ix].node, name, &extr_map, node, &workbuf);
     }
     WString_free(&workbuf);
 
@@ -839,27 +857,21 @@ bool load_json() {
     MatchNode_set_root(root);
     LinkedHashMap_Free(&extr_map);
 
-    JsonObject* opt_obj = JsonObject_get_obj(&obj, "options");
-    if (opt_obj != NULL) {
-        bool* rs = JsonObject_get_bool(opt_obj, "rsearch");
-        if (rs != NULL) {
-            gDo_rsearch = *rs;
-        }
-        bool* ac = JsonObject_get_bool(opt_obj, "autocmp");
-        if (ac != NULL) {
-            gDo_autocmp = *ac;
-        }
-        bool* hi = JsonObject_get_bool(opt_obj, "history");
-        if (hi != NULL) {
-            gDo_history = *hi;
-        }
-        bool* su = JsonObject_get_bool(opt_obj, "substitute");
-        if (su != NULL) {
-            gDo_command_sub = *su;
+    JsonTapeRef opt_obj = JsonTapeObject_get_obj(&tape, JSON_TAPE_ROOT, "options");
+    for (int i = 0; i < 5; ++i) {
+        stamp.extra[i] = 2;
+        if (opt_obj != JSON_TAPE_NONE &&
+            JsonTapeObject_get_bool(&tape, opt_obj, option_names[i], options[i])) {
+            stamp.extra[i] = *options[i];
         }
     }
 
-    JsonObject_free(&obj);
+    Arena_free(&arena);
+
+    // Next start skips parsing as long as the json file is unchanged
+    if (has_graph && !MatchNode_save_graph(graph_buf, &stamp)) {
+        _wprintf_h(err, L"Could not write %s\n", graph_buf);
+    }
 
     return true;
 }
@@ -880,7 +892,9 @@ __declspec(dllexport) DWORD entry() {
         MatchNode_set_root(NodeBuilder_finalize(&b));
     }
 
-    if (!find_file_relative(history_file_name, 1024, L"cmdlog.txt", false)) {
+    wchar_t history_file_name[1025];
+    if (!find_file_relative(history_file_name, 1024, L"cmdlog.txt", false) ||
+        !History_open(&gHistory, history_file_name)) {
         gHas_history = false;
         _wprintf(L"History file failed\n");
     } else {
@@ -968,6 +982,7 @@ DWORD run() {
     gDo_history = true;
     gDo_rsearch = true;
     gDo_command_sub = false;
+    gDo_fuzzy = false;
 
     if (refcount == 0) {
         return entry();
@@ -992,13 +1007,17 @@ __declspec(dllexport) DWORD reload_with_cmd() {
 
 __declspec(dllexport) DWORD reload() {
     DWORD status = run();
-    _wprintf(L"autocmp: %d, rsearch: %d, history: %d, substitute: %d\n",
-             gDo_autocmp, gDo_rsearch, gDo_history, gDo_command_sub);
+    _wprintf(L"autocmp: %d, rsearch: %d, history: %d, substitute: %d, fuzzy: %d\n",
+             gDo_autocmp, gDo_rsearch, gDo_history, gDo_command_sub, gDo_fuzzy);
 
     return status;
 }
 
 
-BOOL DLLMain() {
+BOOL DLLMain(HINSTANCE instance, DWORD reason, LPVOID reserved) {
+    // Write out batched history before the shell exits
+    if (reason == DLL_PROCESS_DETACH && gHas_history) {
+        History_flush(&gHistory, true);
+    }
     return TRUE;
 }
@@ -759,76 +759,16 @@ void CliList_free(CliList *list) {
 }
 
 
-wchar_t* wcsstr_i(wchar_t* str, wchar_t* search) {
-    for (size_t ix = 0; str[ix] != L'\0'; ++ix) {
-        while (towlower(str[ix]) != towlower(search[0])) {
-            ++ix;
-            if (str[ix] == L'\0') {
-                return NULL;
-            }
-        }
-        size_t j = 1;
-        while (1) {
-            if (search[j] == L'\0') {
-                return &str[ix];
-            }
-            if (str[ix + j] == L'\0' || 
-                towlower(str[ix + j]) != towlower(search[j])) {
-                break;
-            }
-            ++j;
-        }
-    }
-    return NULL;
-}
-
-wchar_t* search_next(wchar_t* searchbuf, wchar_t** entries, DWORD entry_count, int64_t* ix, bool forwards, wchar_t* last) {
-    if (searchbuf[0] == L'\0') {
-        return NULL;
-    }
-    if (forwards) {
-        int64_t i = *ix < 0 ? 0 : *ix + 1;
-        for (; i < entry_count; ++i) {
-            if (wcsstr_i(entries[i], searchbuf)) {
-                *ix = i;
-                return entries[i];
-            }
-        }
-        return last;
-    } else {
-        int64_t i = *ix >= entry_count ? entry_count - 1 : *ix - 1;
-        for (; i >= 0; --i) {
-            if (wcsstr_i(entries[i], searchbuf)) {
-                *ix = i;
-                return entries[i];
-            }
-        }
-        return last;
-    }
-}
-
-wchar_t* search_strings(wchar_t* searchbuf, wchar_t** entries, DWORD entry_count, int64_t *ix) {
-    if (searchbuf[0] == L'\0') {
-        if (*ix >= 0 && *ix < entry_count) {
-            return entries[*ix];
-        }
+const wchar_t* search_next(CliSearchFn search, void* ctx, const wchar_t* query,
+                           int64_t* ix, int step, const wchar_t* last) {
+    if (query[0] == L'\0') {
         return NULL;
     }
-    if (*ix >= 0 && *ix < entry_count) {
-        if (wcsstr_i(entries[*ix], searchbuf)) {
-            return entries[*ix];
-        }
-    }
-    for (int64_t i = 0; i < entry_count; ++i) {
-        if (wcsstr_i(entries[i], searchbuf)) {
-            *ix = i;
-            return entries[i];
-        }
-    }
-    return NULL;
+    const wchar_t* res = search(ctx, query, ix, step);
+    return res == NULL ? last : res;
 }
 
-bool Cli_Search(wchar_t* buffer, DWORD* len, DWORD capacity, wchar_t** entries, DWORD entry_count) {
+bool Cli_Search(wchar_t* buffer, DWORD* len, DWORD capacity, CliSearchFn search, void* ctx) {
     HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
     HANDLE in = GetStdHandle(STD_INPUT_HANDLE);
     DWORD old_out_mode, old_in_mode;
@@ -853,7 +793,7 @@ bool Cli_Search(wchar_t* buffer, DWORD* len, DWORD capacity, wchar_t** entries,
         SetConsoleMode(out, old_out_mode);
         return false;
     }
-    int64_t ix = 0;
+    int64_t ix = -1;
     if (*len == capacity) {
         // It has to be done...
         *len -= 1;
@@ -861,7 +801,7 @@ bool Cli_Search(wchar_t* buffer, DWORD* len, DWORD capacity, wchar_t** entries,
     buffer[*len] = L'\0';
     *len = 0;
 
-    wchar_t* active_entry = buffer;
+    const wchar_t* active_entry = buffer;
 
     bool status = true;
 
@@ -931,11 +871,11 @@ bool Cli_Search(wchar_t* buffer, DWORD* len, DWORD capacity, wchar_t** entries,
                 }
             }
             WString_pop(&search_buffer, 1);
-            active_entry = search_strings(search_buffer.buffer, entries, entry_count, &ix);
+            active_entry = search(ctx, search_buffer.buffer, &ix, 0);
         } else if (keycode == VK_UP) {
-            active_entry = search_next(search_buffer.buffer, entries, entry_count, &ix, true, active_entry);
+            active_entry = search_next(search, ctx, search_buffer.buffer, &ix, 1, active_entry);
         } else if (keycode == VK_DOWN) {
-            active_entry = search_next(search_buffer.buffer, entries, entry_count, &ix, false, active_entry);
+            active_entry = search_next(search, ctx, search_buffer.buffer, &ix, -1, active_entry);
         } else if (keycode == VK_ESCAPE || keycode == VK_LEFT ||
             keycode == VK_RIGHT || keycode == VK_RETURN || c == '\t') {
             break;
@@ -953,7 +893,7 @@ bool Cli_Search(wchar_t* buffer, DWORD* len, DWORD capacity, wchar_t** entries,
                 }
             }
             WString_append(&search_buffer, c);
-            active_entry = search_strings(search_buffer.buffer, entries, entry_count, &ix);
+            active_entry = search(ctx, search_buffer.buffer, &ix, 0);
         } else {
             continue;
         }
@@ -41,5 +41,11 @@ DWORD CliList_run(CliList* list);
 
 void CliList_free(CliList* list);
 
-bool Cli_Search(wchar_t* buffer, DWORD* len, DWORD capacity, wchar_t** entries, DWORD entry_count);
+// Find an entry containing `query`. With `step` 0 keep `*ix` if it still
+// matches and otherwise find the first match, with 1 find the next and
+// with -1 the previous one. `*ix` starts at -1. Returns NULL if there is
+// no match.
+typedef const wchar_t* (*CliSearchFn)(void* ctx, const wchar_t* query, int64_t* ix, int step);
+
+bool Cli_Search(wchar_t* buffer, DWORD* len, DWORD capacity, CliSearchFn search, void* ctx);
 
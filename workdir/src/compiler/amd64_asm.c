@@ -1650,25 +1650,12 @@ void quad_to_asm(Quad* q, AsmCtx* ctx, NameTable* name_table, VarData* vars,
         // Therefore, the bitmask must be but in a 16-byte memory location
         asm_instr(ctx, OP_XORPS);
         emit_xmm_var(&vars[q->dest], ctx);
+        // Masks are declared by Backend_begin_asm
         if (vars[q->op1.var].byte_size == 4) {
-            if (saved_syms[0] == SYMBOL_IX_NONE) {
-                Object* obj = ctx->object;
-                saved_syms[0] = Object_declare_var(obj, rdata, (const uint8_t*)"", 
-                                                   0, 4, false);
-                uint8_t sign32[16] = {0x0, 0x0, 0x0, 0x80, 0x0, 0x0, 0x0, 0x0,
-                                      0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0};
-                Object_append_data(obj, rdata, sign32, 16);
-            }
+            assert(saved_syms[0] != SYMBOL_IX_NONE);
             asm_global_mem_var(ctx, 16, saved_syms[0], 0);
         } else {
-            if (saved_syms[1] == SYMBOL_IX_NONE) {
-                Object* obj = ctx->object;
-                saved_syms[1] = Object_declare_var(obj, rdata, (const uint8_t*)"", 
-                                                   0, 8, false);
-                uint8_t sign64[16] = {0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x80,
-                                      0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0};
-                Object_append_data(obj, rdata, sign64, 16);
-            }
+            assert(saved_syms[1] != SYMBOL_IX_NONE);
             asm_global_mem_var(ctx, 16, saved_syms[1], 0);
         }
         asm_instr_end(ctx);
@@ -1888,9 +1875,19 @@ static const uint8_t* str_literalname(uint64_t num, uint32_t* len, Arena* arena)
     return str;
 }
 
-Object* Backend_generate_asm(NameTable *name_table, FunctionTable *func_table,
-                             FunctionTable* externs, StringLiteral* literals,
-                             Arena* arena, bool serialize) {
+static symbol_ix declare_sign_mask(Object* object, section_ix rdata,
+                                   uint32_t size) {
+    uint8_t mask[16] = {0};
+    mask[size - 1] = 0x80;
+    symbol_ix sym = Object_declare_var(object, rdata, (const uint8_t*)"", 0,
+                                       size, false);
+    Object_append_data(object, rdata, mask, 16);
+    return sym;
+}
+
+void Backend_begin_asm(AsmModule* module, NameTable* name_table,
+                       FunctionTable* func_table, FunctionTable* externs,
+                       StringLiteral* literals, Arena* arena) {
     Object* object = Mem_alloc(sizeof(Object));
     if (object == NULL) {
         out_of_memory(NULL);
@@ -1900,15 +1897,51 @@ Object* Backend_generate_asm(NameTable *name_table, FunctionTable *func_table,
     section_ix code_section = Object_create_section(object, SECTION_CODE);
     section_ix rdata_section = Object_create_section(object, SECTION_RDATA);
 
-    AsmCtx ctx;
-    asm_ctx_create(&ctx, object, code_section);
+    module->object = object;
+    module->name_table = name_table;
+    module->code_section = code_section;
+    module->rdata_section = rdata_section;
+    module->saved_syms[0] = SYMBOL_IX_NONE;
+    module->saved_syms[1] = SYMBOL_IX_NONE;
+
+    // Every module sees all literals of the program, only emit the ones
+    // its own functions take the address of
+    var_id literal_end = 0;
+    for (StringLiteral* liter = literals; liter != NULL; liter = liter->next) {
+        if (liter->var >= literal_end) {
+            literal_end = liter->var + 1;
+        }
+    }
+    bool* used = Mem_alloc(literal_end * sizeof(bool));
+    if (used == NULL && literal_end > 0) {
+        out_of_memory(NULL);
+    }
+    for (var_id v = 0; v < literal_end; ++v) {
+        used[v] = false;
+    }
+    for (uint64_t ix = 0; ix < func_table->size; ++ix) {
+        FunctionDef* def = func_table->data[ix];
+        if (def->undefined) {
+            continue;
+        }
+        for (Quad* q = def->quad_start; q != NULL; q = q->next_quad) {
+            if (q->type == QUAD_ARRAY_TO_PTR && q->op1.var < literal_end) {
+                used[q->op1.var] = true;
+            }
+        }
+    }
 
     StringLiteral* liter = literals;
     uint64_t i = 0;
     while (liter != NULL) {
         var_id v = liter->var;
+        if (!used[v]) {
+            ++i;
+            liter = liter->next;
+            continue;
+        }
         uint32_t len;
-        const uint8_t* sym = str_literalname(i, &len, &ctx.arena);
+        const uint8_t* sym = str_literalname(i, &len, arena);
         symbol_ix symbol = Object_declare_var(object, rdata_section, sym, len, 1, false);
         Object_append_data(object, rdata_section, liter->bytes, liter->len + 1);
 
@@ -1921,6 +1954,7 @@ Object* Backend_generate_asm(NameTable *name_table, FunctionTable *func_table,
         ++i;
         liter = liter->next;
     }
+    Mem_free(used);
 
     for (uint64_t i = 0; i < externs->size; ++i) {
         name_id id = externs->data[i]->name;
@@ -1958,30 +1992,176 @@ Object* Backend_generate_asm(NameTable *name_table, FunctionTable *func_table,
         def->symbol = sym;
     }
 
-    symbol_ix saved_syms[2] = {SYMBOL_IX_NONE, SYMBOL_IX_NONE};
+    // Functions are generated in parallel, so the masks for QUAD_FNEGATE
+    // are declared up front instead of by the first function using them.
+    for (uint64_t ix = 0; ix < func_table->size; ++ix) {
+        FunctionDef* def = func_table->data[ix];
+        if (def->undefined) {
+            continue;
+        }
+        for (Quad* q = def->quad_start; q != def->quad_end->next_quad;
+             q = q->next_quad) {
+            if (q->type != QUAD_FNEGATE) {
+                continue;
+            }
+            uint32_t slot = def->vars.data[q->op1.var].byte_size == 4 ? 0 : 1;
+            if (module->saved_syms[slot] == SYMBOL_IX_NONE) {
+                module->saved_syms[slot] = declare_sign_mask(object, rdata_section,
+                                                             slot == 0 ? 4 : 8);
+            }
+        }
+    }
+}
+
+void AsmWorker_create(AsmWorker* worker, AsmModule* module) {
+    Object* object = &worker->object;
+    Object_create(object);
+    section_ix code_section = Object_create_section(object, SECTION_CODE);
+    section_ix rdata_section = Object_create_section(object, SECTION_RDATA);
+    assert(code_section == module->code_section);
+    assert(rdata_section == module->rdata_section);
+
+    Object* src = module->object;
+    if (src->symbol_count > object->symbol_cap) {
+        Symbol* symbols = Mem_realloc(object->symbols,
+                                      src->symbol_count * sizeof(Symbol));
+        if (symbols == NULL) {
+            out_of_memory(NULL);
+        }
+        object->symbols = symbols;
+        object->symbol_cap = src->symbol_count;
+    }
+    memcpy(object->symbols, src->symbols, src->symbol_count * sizeof(Symbol));
+    object->symbol_count = src->symbol_count;
+
+    asm_ctx_create(&worker->ctx, object, code_section);
+}
+
+void AsmWorker_free(AsmWorker* worker) {
+    // Symbol names are owned by the module object, not by the worker
+    Object* object = &worker->object;
+    for (uint32_t i = 0; i < object->section_count; ++i) {
+        Buffer_free(&object->sections[i].data);
+        Mem_free(object->sections[i].relocations);
+        Mem_free((uint8_t*)object->sections[i].name);
+    }
+    Mem_free(object->sections);
+    Mem_free(object->symbols);
+
+    Mem_free(worker->ctx.labels);
+    Arena_free(&worker->ctx.arena);
+}
+
+void Backend_generate_fragment(AsmModule* module, AsmWorker* worker,
+                               FunctionDef* def, AsmFragment* fragment) {
+    Object* object = &worker->object;
+    Section* code = object->sections + module->code_section;
+    Section* rdata = object->sections + module->rdata_section;
+
+    fragment->worker = worker;
+    fragment->code_start = code->data.size;
+    fragment->rdata_start = rdata->data.size;
+    fragment->reloc_start = code->relocation_count;
+    fragment->sym_start = object->symbol_count;
+    fragment->start = worker->ctx.start;
+
+    Backend_generate_fn(def, &worker->ctx.arena, &worker->ctx,
+                        module->name_table, module->rdata_section,
+                        module->saved_syms);
+    asm_assemble(&worker->ctx, def->symbol);
+
+    fragment->code_end = code->data.size;
+    fragment->rdata_end = rdata->data.size;
+    fragment->reloc_end = code->relocation_count;
+    fragment->sym_end = object->symbol_count;
+    fragment->end = worker->ctx.end;
+
+    // Keep the rdata of each fragment at a 16 byte boundary, so it can be
+    // moved as a whole without breaking alignment.
+    while (rdata->data.size % 16 != 0) {
+        Buffer_append(&rdata->data, 0);
+    }
+
+    asm_reset(&worker->ctx);
+}
+
+Object* Backend_end_asm(AsmModule* module, FunctionTable* func_table,
+                        AsmFragment* fragments, bool serialize) {
+    Object* object = module->object;
+    Section* code = object->sections + module->code_section;
+    Section* rdata = object->sections + module->rdata_section;
+
+    String out;
+    if (serialize && !String_create(&out)) {
+        serialize = false;
+    }
 
-    Amd64Op* start = ctx.start;
     for (uint64_t ix = 0; ix < func_table->size; ++ix) {
         FunctionDef* def = func_table->data[ix];
         if (def->undefined) {
             continue;
         }
-        object->symbols[def->symbol].offset = object->sections[code_section].data.size;
-        Backend_generate_fn(def, arena, &ctx, name_table, rdata_section,
-                            saved_syms);
-        asm_assemble(&ctx, def->symbol);
-        if (ix + 1 < func_table->size) {
-            asm_reset(&ctx);
+        AsmFragment* frag = &fragments[ix];
+        Object* src = &frag->worker->object;
+        Section* src_code = src->sections + module->code_section;
+        Section* src_rdata = src->sections + module->rdata_section;
+        assert(src_rdata->relocation_count == 0);
+
+        uint64_t rdata_base = rdata->data.size;
+        if (frag->rdata_end > frag->rdata_start) {
+            ALIGN_TO(rdata_base, 16);
+            while (rdata->data.size < rdata_base) {
+                Buffer_append(&rdata->data, 0);
+            }
+            Buffer_extend(&rdata->data, src_rdata->data.data + frag->rdata_start,
+                          frag->rdata_end - frag->rdata_start);
+            if (src_rdata->align > rdata->align) {
+                rdata->align = src_rdata->align;
+            }
+        }
+
+        uint64_t code_base = code->data.size;
+        Buffer_extend(&code->data, src_code->data.data + frag->code_start,
+                      frag->code_end - frag->code_start);
+        assert(code->data.size <= UINT32_MAX);
+        object->symbols[def->symbol].offset = code_base;
+
+        symbol_ix sym_base = object->symbol_count;
+        for (symbol_ix sym = frag->sym_start; sym < frag->sym_end; ++sym) {
+            Symbol* s = src->symbols + sym;
+            uint64_t offset = s->offset;
+            if (s->section == module->code_section) {
+                offset = offset - frag->code_start + code_base;
+            } else if (s->section == module->rdata_section) {
+                offset = offset - frag->rdata_start + rdata_base;
+            }
+            // The name is now owned by the module object
+            Object_add_symbol(object, s->section, s->name, s->name_len,
+                              s->external, s->type, offset);
+        }
+
+        for (uint32_t i = frag->reloc_start; i < frag->reloc_end; ++i) {
+            Relocation r = src_code->relocations[i];
+            r.offset = r.offset - frag->code_start + code_base;
+            if (r.symbol != SYMBOL_IX_NONE && r.symbol >= frag->sym_start) {
+                r.symbol = r.symbol - frag->sym_start + sym_base;
+            }
+            Object_add_relocation(object, module->code_section, r);
+        }
+
+        if (serialize) {
+            AsmCtx ctx = frag->worker->ctx;
+            ctx.start = frag->start;
+            ctx.end = frag->end;
+            asm_serialize(&ctx, &out);
         }
     }
 
     LOG_INFO("Done generating functions");
 
-    ctx.start = start;
-    String out;
-    if (serialize && String_create(&out)) {
-        asm_serialize(&ctx, &out);
+    if (serialize) {
         outputUtf8(out.buffer, out.length);
+        String_free(&out);
     }
 
     return object;
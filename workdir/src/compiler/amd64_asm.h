@@ -2,6 +2,7 @@
 #define COMPILER_AMD64_ASM_H_00
 #include "code_generation.h"
 #include "linker/linker.h"
+#include "asm/amd64.h"
 
 uint64_t Backend_get_regs();
 
@@ -10,8 +11,56 @@ void Backend_inital_contraints(ConflictGraph* graph, VarList* vars);
 void Backend_add_constrains(ConflictGraph* graph, VarSet* live_set, Quad* quad,
                             VarList* vars, FlowNode* node, Arena* arena);
 
-Object* Backend_generate_asm(NameTable* name_table, FunctionTable* func_table,
-                             FunctionTable* externs, StringLiteral* literals,
-                             Arena* arena, bool serialize);
+// Symbols and sections shared by all functions of a module. Read only
+// while functions are generated.
+typedef struct AsmModule {
+    Object* object;
+    NameTable* name_table;
+    section_ix code_section;
+    section_ix rdata_section;
+    symbol_ix saved_syms[2];
+} AsmModule;
+
+// Assembles functions into a private object, starting with a copy of the
+// module symbols so their indices stay valid.
+typedef struct AsmWorker {
+    AsmCtx ctx;
+    Object object;
+} AsmWorker;
+
+// The part of a worker object generated for one function
+typedef struct AsmFragment {
+    AsmWorker* worker;
+    uint64_t code_start;
+    uint64_t code_end;
+    uint64_t rdata_start;
+    uint64_t rdata_end;
+    uint32_t reloc_start;
+    uint32_t reloc_end;
+    // Symbols declared by the function
+    symbol_ix sym_start;
+    symbol_ix sym_end;
+    Amd64Op* start;
+    Amd64Op* end;
+} AsmFragment;
+
+void Backend_begin_asm(AsmModule* module, NameTable* name_table,
+                       FunctionTable* func_table, FunctionTable* externs,
+                       StringLiteral* literals, Arena* arena);
+
+void AsmWorker_create(AsmWorker* worker, AsmModule* module);
+
+void AsmWorker_free(AsmWorker* worker);
+
+// Generate and assemble <def> into the object of <worker>. Safe to call from
+// different threads with different workers.
+void Backend_generate_fragment(AsmModule* module, AsmWorker* worker,
+                               FunctionDef* def, AsmFragment* fragment);
+
+// Merge the fragments of all defined functions into the module object in
+// function order, so the output does not depend on which worker generated
+// what.
+Object* Backend_end_asm(AsmModule* module, FunctionTable* func_table,
+                        AsmFragment* fragments, bool serialize);
 
 #endif
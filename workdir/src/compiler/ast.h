@@ -124,6 +124,7 @@ typedef struct CastExpr {
 typedef struct MemberAccessExpr {
     Expression* structexpr;
     StrWithLength member;
+    intern_id member_intern;
     uint32_t member_offset;
     // set for expressions like &x.y;
     bool get_addr;
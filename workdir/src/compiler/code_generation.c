@@ -2,7 +2,9 @@
 #include "mem.h"
 #include "format.h"
 #include "amd64_asm.h"
+#include "time_report.h"
 #include <printf.h>
+#include <stdlib.h>
 #ifndef NO_TZCOUNT
 #include <intrin.h>
 #endif
@@ -27,24 +29,130 @@ VarSet VarSet_create(var_id max) {
     }
     s.max = len * 64;
     s.bitmap = bitmap;
+    s.items = NULL;
+    s.count = 0;
+    s.cap = 0;
     memset(s.bitmap, 0, len * sizeof(uint64_t));
 
     return s;
 }
 
+// max: highest variable value + 1
+VarSet VarSet_create_sparse(var_id max) {
+    // A bitmap of a few words is always cheaper
+    if (max <= 256) {
+        return VarSet_create(max);
+    }
+    uint64_t len = max / 64;
+    if (max & 0b111111) {
+        ++len;
+    }
+
+    VarSet s;
+    s.items = Mem_alloc(8 * sizeof(var_id));
+    if (s.items == NULL) {
+        out_of_memory(NULL);
+    }
+    s.max = len * 64;
+    s.bitmap = NULL;
+    s.count = 0;
+    s.cap = 8;
+
+    return s;
+}
+
+// Index of the first member of sparse set s not smaller than v
+static uint64_t VarSet_find(const VarSet* s, var_id v) {
+    uint64_t low = 0;
+    uint64_t high = s->count;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (s->items[mid] < v) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+
+// Turn sparse set s into a bitmap
+static void VarSet_make_dense(VarSet* s) {
+    uint64_t len = s->max / 64;
+    uint64_t* bitmap = Mem_alloc(len * sizeof(uint64_t));
+    if (bitmap == NULL) {
+        out_of_memory(NULL);
+    }
+    memset(bitmap, 0, len * sizeof(uint64_t));
+    for (uint64_t ix = 0; ix < s->count; ++ix) {
+        var_id v = s->items[ix];
+        bitmap[v >> 6] |= ((uint64_t)1 << ((uint64_t)v & 0b111111));
+    }
+    Mem_free(s->items);
+    s->bitmap = bitmap;
+    s->items = NULL;
+    s->count = 0;
+    s->cap = 0;
+}
+
+void VarSet_set_sparse(VarSet* s, var_id v) {
+    uint64_t ix = VarSet_find(s, v);
+    if (ix < s->count && s->items[ix] == v) {
+        return;
+    }
+    if (s->count + 1 > VARSET_SPARSE_LIMIT(s->max)) {
+        VarSet_make_dense(s);
+        VarSet_set(s, v);
+        return;
+    }
+    RESERVE(s->items, s->count + 1, s->cap);
+    memmove(s->items + ix + 1, s->items + ix, (s->count - ix) * sizeof(var_id));
+    s->items[ix] = v;
+    ++s->count;
+}
+
+void VarSet_clear_sparse(VarSet* s, var_id v) {
+    uint64_t ix = VarSet_find(s, v);
+    if (ix == s->count || s->items[ix] != v) {
+        return;
+    }
+    memmove(s->items + ix, s->items + ix + 1, (s->count - ix - 1) * sizeof(var_id));
+    --s->count;
+}
+
+bool VarSet_contains_sparse(const VarSet* s, var_id v) {
+    uint64_t ix = VarSet_find(s, v);
+    return ix < s->count && s->items[ix] == v;
+}
+
 void VarSet_clearall(VarSet* s) {
+    if (s->bitmap == NULL) {
+        s->count = 0;
+        return;
+    }
     uint64_t len = s->max / 64;
     memset(s->bitmap, 0, len * sizeof(uint64_t));
 }
 
 void VarSet_free(VarSet* s) {
     Mem_free(s->bitmap);
+    Mem_free(s->items);
     s->bitmap = NULL;
+    s->items = NULL;
     s->max = 0;
+    s->count = 0;
+    s->cap = 0;
 }
 
 
 var_id VarSet_getnext(VarSet* s, var_id min) {
+    if (s->bitmap == NULL) {
+        uint64_t ix = VarSet_find(s, min);
+        if (ix < s->count && s->items[ix] == min) {
+            ++ix;
+        }
+        return ix < s->count ? s->items[ix] : VAR_ID_INVALID;
+    }
     uint64_t len = s->max / 64;
     uint64_t start = min / 64;
     uint64_t val = start * 64;
@@ -62,11 +170,11 @@ var_id VarSet_getnext(VarSet* s, var_id min) {
             v >>= (zeroes);
             v >>= 1;
 #else
-            v >>= 1;
-            ++p;
             if ((v & 1) && p > min) {
                 return p;
             }
+            v >>= 1;
+            ++p;
 #endif
         }
         val += 64;
@@ -75,6 +183,9 @@ var_id VarSet_getnext(VarSet* s, var_id min) {
 }
 
 var_id VarSet_get(VarSet* s) {
+    if (s->bitmap == NULL) {
+        return s->count > 0 ? s->items[0] : VAR_ID_INVALID;
+    }
     uint64_t len = s->max / 64;
     uint64_t val = 0;
     for (uint64_t ix = 0; ix < len; ++ix) {
@@ -104,6 +215,10 @@ void VarSet_grow(VarSet* s, var_id new_max) {
     if (new_max & 0b111111) {
         ++new_len;
     }
+    if (s->bitmap == NULL) {
+        s->max = new_len * 64;
+        return;
+    }
     uint64_t old_len = s->max / 64;
     s->max = new_len * 64;
 
@@ -117,6 +232,48 @@ void VarSet_grow(VarSet* s, var_id new_max) {
 
 // Compute dest = dest U src
 void VarSet_union(VarSet* dest, const VarSet* src) {
+    if (dest->bitmap == NULL) {
+        if (src->bitmap != NULL) {
+            VarSet_make_dense(dest);
+            VarSet_union(dest, src);
+            return;
+        }
+        // Merge from the back, so members of dest are read before they
+        // can be overwritten
+        uint64_t total = dest->count + src->count;
+        RESERVE(dest->items, total, dest->cap);
+        uint64_t a = dest->count;
+        uint64_t b = src->count;
+        uint64_t out = total;
+        while (b > 0) {
+            var_id v;
+            if (a > 0 && dest->items[a - 1] >= src->items[b - 1]) {
+                v = dest->items[a - 1];
+                if (v == src->items[b - 1]) {
+                    --b;
+                }
+                --a;
+            } else {
+                v = src->items[b - 1];
+                --b;
+            }
+            --out;
+            dest->items[out] = v;
+        }
+        // Close the gap left by members found in both sets
+        memmove(dest->items + a, dest->items + out, (total - out) * sizeof(var_id));
+        dest->count = a + (total - out);
+        if (dest->count > VARSET_SPARSE_LIMIT(dest->max)) {
+            VarSet_make_dense(dest);
+        }
+        return;
+    }
+    if (src->bitmap == NULL) {
+        for (uint64_t ix = 0; ix < src->count; ++ix) {
+            VarSet_set(dest, src->items[ix]);
+        }
+        return;
+    }
     uint64_t len = dest->max / 64;
     for (uint64_t ix = 0; ix < len; ++ix) {
         dest->bitmap[ix] |= src->bitmap[ix];
@@ -128,6 +285,20 @@ void VarSet_copy(VarSet* dest, const VarSet* src) {
     if (dest->max < src->max) {
         VarSet_grow(dest, src->max);
     }
+    if (dest->bitmap == NULL) {
+        if (src->bitmap == NULL) {
+            RESERVE(dest->items, src->count, dest->cap);
+            memcpy(dest->items, src->items, src->count * sizeof(var_id));
+            dest->count = src->count;
+            return;
+        }
+        dest->count = 0;
+        VarSet_make_dense(dest);
+    } else if (src->bitmap == NULL) {
+        VarSet_clearall(dest);
+        VarSet_union(dest, src);
+        return;
+    }
     uint64_t len = src->max / 64;
     for (uint64_t ix = 0; ix < len; ++ix) {
         dest->bitmap[ix] = src->bitmap[ix];
@@ -144,6 +315,26 @@ void VarSet_copy(VarSet* dest, const VarSet* src) {
 
 // Compute dest = dest - src
 void VarSet_diff(VarSet* dest, const VarSet* src) {
+    if (dest->bitmap == NULL) {
+        uint64_t count = 0;
+        for (uint64_t ix = 0; ix < dest->count; ++ix) {
+            var_id v = dest->items[ix];
+            if (v >= src->max || !VarSet_contains(src, v)) {
+                dest->items[count] = v;
+                ++count;
+            }
+        }
+        dest->count = count;
+        return;
+    }
+    if (src->bitmap == NULL) {
+        for (uint64_t ix = 0; ix < src->count; ++ix) {
+            if (src->items[ix] < dest->max) {
+                VarSet_clear(dest, src->items[ix]);
+            }
+        }
+        return;
+    }
     uint64_t len = dest->max / 64;
     for (uint64_t ix = 0; ix < len; ++ix) {
         dest->bitmap[ix] &= ~src->bitmap[ix];
@@ -151,19 +342,64 @@ void VarSet_diff(VarSet* dest, const VarSet* src) {
 }
 
 bool VarSet_equal(const VarSet* a, const VarSet* b) {
-    uint64_t len = a->max / 64;
-    return memcmp(a->bitmap, b->bitmap, len * sizeof(uint64_t)) == 0;
+    if (a->bitmap != NULL && b->bitmap != NULL) {
+        uint64_t len = a->max / 64;
+        return memcmp(a->bitmap, b->bitmap, len * sizeof(uint64_t)) == 0;
+    }
+    if (a->bitmap != NULL) {
+        const VarSet* tmp = a;
+        a = b;
+        b = tmp;
+    }
+    if (b->bitmap == NULL) {
+        return a->count == b->count &&
+               memcmp(a->items, b->items, a->count * sizeof(var_id)) == 0;
+    }
+    // Sparse a and dense b
+    uint64_t len = b->max / 64;
+    uint64_t count = 0;
+    for (uint64_t ix = 0; ix < len; ++ix) {
+#ifndef NO_TZCOUNT
+        count += __popcnt64(b->bitmap[ix]);
+#else
+        uint64_t v = b->bitmap[ix];
+        while (v) {
+            v &= v - 1;
+            ++count;
+        }
+#endif
+    }
+    if (count != a->count) {
+        return false;
+    }
+    for (uint64_t ix = 0; ix < a->count; ++ix) {
+        if (a->items[ix] >= b->max || !VarSet_contains(b, a->items[ix])) {
+            return false;
+        }
+    }
+    return true;
 }
 
 
 #define INVALID_NODE ((uint64_t)-1)
 
 void ConflictGraph_clear(ConflictGraph* graph) {
+    if (graph->linear) {
+        memset(graph->reg_masks, 0, graph->var_count * sizeof(uint64_t));
+        for (var_id v = 0; v < graph->var_count; ++v) {
+            graph->adj[v].count = 0;
+        }
+        return;
+    }
     VarSet_clearall(&graph->edges);
     VarSet_clearall(&graph->members);
     for (uint64_t ix = 0; ix < graph->var_count + graph->reg_count; ++ix) {
         VarSet_set(&graph->members, ix);
     }
+    for (var_id v = 0; v < graph->var_count; ++v) {
+        graph->adj[v].count = 0;
+        graph->adj[v].degree = 0;
+    }
 }
 
 void ConflictGraph_add_var(ConflictGraph* graph, var_id var) {
@@ -171,35 +407,48 @@ void ConflictGraph_add_var(ConflictGraph* graph, var_id var) {
     uint64_t total = graph->reg_count + graph->var_count + 1;
 
     LOG_INFO("ConflictGraph add var: %llu, %llu", var, total);
-    if (total <= graph->width) {
-        VarSet_grow(&graph->members, total);
-        VarSet_set(&graph->members, var + graph->reg_count);
+    if (graph->linear) {
+        RESERVE(graph->reg_masks, graph->var_count + 1, graph->mask_cap);
+        graph->reg_masks[graph->var_count] = 0;
+        RESERVE(graph->adj, graph->var_count + 1, graph->adj_cap);
+        memset(&graph->adj[graph->var_count], 0, sizeof(ConflictAdj));
         graph->var_count += 1;
         return;
     }
-    // Reallocate and copy
-    ConflictGraph tmp;
-    ConflictGraph_create(&tmp, graph->reg_count, graph->var_count + 1);
-
-    for (uint64_t i = 0; i < graph->var_count + graph->reg_count; ++i) {
-        for (uint64_t j = 0; j < graph->var_count + graph->reg_count; ++j) {
-            if (i == j) {
-                continue;
+    if (total > graph->width) {
+        // Reallocate the matrix, refilling it from the lists
+        uint64_t width = graph->width;
+        uint64_t shifts = graph->shifts;
+        while (width < total) {
+            width <<= 1;
+            ++shifts;
+        }
+        VarSet edges = VarSet_create(width * width);
+        for (uint64_t a = 0; a < graph->reg_count; ++a) {
+            for (uint64_t b = 0; b < graph->reg_count; ++b) {
+                if (a != b && ConflictGraph_has_edge(graph, a, b)) {
+                    VarSet_set(&edges, (a << shifts) + b);
+                }
             }
-            if (ConflictGraph_has_edge(graph, i, j)) {
-                ConflictGraph_add_edge(&tmp, i, j);
+        }
+        for (var_id v = 0; v < graph->var_count; ++v) {
+            uint64_t a = v + graph->reg_count;
+            for (uint64_t ix = 0; ix < graph->adj[v].count; ++ix) {
+                uint64_t b = graph->adj[v].nodes[ix];
+                VarSet_set(&edges, (a << shifts) + b);
+                VarSet_set(&edges, (b << shifts) + a);
             }
         }
+        VarSet_free(&graph->edges);
+        graph->edges = edges;
+        graph->width = width;
+        graph->shifts = shifts;
+        VarSet_grow(&graph->members, width);
     }
-    VarSet_grow(&graph->members, tmp.members.max);
+    RESERVE(graph->adj, graph->var_count + 1, graph->adj_cap);
+    memset(&graph->adj[graph->var_count], 0, sizeof(ConflictAdj));
     VarSet_set(&graph->members, var + graph->reg_count);
-
-    VarSet_free(&tmp.members);
-    VarSet_free(&graph->edges);
-    graph->edges = tmp.edges;
-    graph->shifts = tmp.shifts;
-    graph->width = tmp.width;
-    graph->var_count = tmp.var_count;
+    graph->var_count += 1;
 }
 
 void ConflictGraph_add_edge(ConflictGraph* graph, uint64_t row, uint64_t col);
@@ -221,6 +470,14 @@ void ConflictGraph_create(ConflictGraph* graph, uint64_t reg_count, uint64_t var
     graph->shifts = shifts;
     graph->edges = VarSet_create(b * b);
     graph->members = VarSet_create(b);
+    graph->adj_cap = var_count < 8 ? 8 : var_count;
+    graph->adj = Mem_alloc(graph->adj_cap * sizeof(ConflictAdj));
+    if (graph->adj == NULL) {
+        out_of_memory(NULL);
+    }
+    memset(graph->adj, 0, graph->adj_cap * sizeof(ConflictAdj));
+    graph->linear = false;
+    graph->reg_masks = NULL;
     for (uint64_t ix = 0; ix < reg_count + var_count; ++ix) {
         VarSet_set(&graph->members, ix);
     }
@@ -228,60 +485,144 @@ void ConflictGraph_create(ConflictGraph* graph, uint64_t reg_count, uint64_t var
     LOG_INFO("ConflictGraph create: %llu", graph->edges.max);
 }
 
+void ConflictGraph_create_linear(ConflictGraph* graph, uint64_t reg_count, uint64_t var_count) {
+    assert(reg_count <= 64);
+    memset(graph, 0, sizeof(ConflictGraph));
+    graph->reg_count = reg_count;
+    graph->var_count = var_count;
+    graph->linear = true;
+    graph->mask_cap = var_count < 8 ? 8 : var_count;
+    graph->reg_masks = Mem_alloc(graph->mask_cap * sizeof(uint64_t));
+    graph->adj_cap = graph->mask_cap;
+    graph->adj = Mem_alloc(graph->adj_cap * sizeof(ConflictAdj));
+    if (graph->reg_masks == NULL || graph->adj == NULL) {
+        out_of_memory(NULL);
+    }
+    memset(graph->reg_masks, 0, var_count * sizeof(uint64_t));
+    memset(graph->adj, 0, graph->adj_cap * sizeof(ConflictAdj));
+}
+
 void ConflictGraph_free(ConflictGraph* graph) {
     VarSet_free(&graph->edges);
+    VarSet_free(&graph->members);
+    Mem_free(graph->reg_masks);
+    graph->reg_masks = NULL;
+    if (graph->adj != NULL) {
+        for (var_id v = 0; v < graph->var_count; ++v) {
+            Mem_free(graph->adj[v].nodes);
+        }
+        Mem_free(graph->adj);
+        graph->adj = NULL;
+    }
 }
 
 bool ConflictGraph_has_edge(ConflictGraph* graph, uint64_t a, uint64_t b) {
+    if (graph->linear) {
+        if (a < graph->reg_count && b < graph->reg_count) {
+            return a != b;
+        } else if (a < graph->reg_count) {
+            return (graph->reg_masks[b - graph->reg_count] >> a) & 1;
+        } else if (b < graph->reg_count) {
+            return (graph->reg_masks[a - graph->reg_count] >> b) & 1;
+        }
+        // Search the shorter list
+        ConflictAdj* adj = &graph->adj[a - graph->reg_count];
+        if (graph->adj[b - graph->reg_count].count < adj->count) {
+            adj = &graph->adj[b - graph->reg_count];
+            b = a;
+        }
+        for (uint64_t ix = 0; ix < adj->count; ++ix) {
+            if (adj->nodes[ix] == b) {
+                return true;
+            }
+        }
+        return false;
+    }
     uint64_t ix = (a << graph->shifts) + b;
     return VarSet_contains(&graph->edges, ix);
 }
 
+static void ConflictAdj_push(ConflictGraph* graph, var_id var, uint64_t node) {
+    ConflictAdj* adj = &graph->adj[var];
+    if (adj->count == adj->cap) {
+        uint64_t cap = adj->cap == 0 ? 8 : adj->cap * 2;
+        uint64_t* nodes = adj->nodes == NULL ?
+                          Mem_alloc(cap * sizeof(uint64_t)) :
+                          Mem_realloc(adj->nodes, cap * sizeof(uint64_t));
+        if (nodes == NULL) {
+            out_of_memory(NULL);
+        }
+        adj->nodes = nodes;
+        adj->cap = cap;
+    }
+    adj->nodes[adj->count] = node;
+    ++adj->count;
+    if (!graph->linear && VarSet_contains(&graph->members, node)) {
+        ++adj->degree;
+    }
+}
+
 void ConflictGraph_add_edge(ConflictGraph* graph, uint64_t a, uint64_t b) {
     assert(a != b);
+    if (graph->linear) {
+        if (a < graph->reg_count && b < graph->reg_count) {
+            return;
+        } else if (a < graph->reg_count) {
+            graph->reg_masks[b - graph->reg_count] |= (uint64_t)1 << a;
+        } else if (b < graph->reg_count) {
+            graph->reg_masks[a - graph->reg_count] |= (uint64_t)1 << b;
+        } else if (!ConflictGraph_has_edge(graph, a, b)) {
+            ConflictAdj_push(graph, a - graph->reg_count, b);
+            ConflictAdj_push(graph, b - graph->reg_count, a);
+        }
+        return;
+    }
     uint64_t ix = (a << graph->shifts) + b;
+    if (VarSet_contains(&graph->edges, ix)) {
+        return;
+    }
     VarSet_set(&graph->edges, ix);
     ix = (b << graph->shifts) + a;
     VarSet_set(&graph->edges, ix);
+    if (a >= graph->reg_count) {
+        ConflictAdj_push(graph, a - graph->reg_count, b);
+    }
+    if (b >= graph->reg_count) {
+        ConflictAdj_push(graph, b - graph->reg_count, a);
+    }
 }
 
-// Count number of edges for node
+// Number of neighbours of variable node in members
 uint64_t ConflictGraph_count(ConflictGraph* graph, uint64_t node) {
-    uint64_t row = (node << graph->shifts) >> 6;
-    uint64_t len = graph->width >> 6;
-    uint64_t count = 0;
-    for (uint64_t ix = 0; ix < len; ++ix) {
-        uint64_t mask = graph->edges.bitmap[row + ix] & graph->members.bitmap[ix];
-        count += __popcnt64(mask);
-    }
-    return count;
+    return graph->adj[node - graph->reg_count].degree;
 }
 
-uint64_t ConflictGraph_pick_register(ConflictGraph* graph, var_id var) {
-    uint64_t reg = VAR_ID_INVALID;
-    for (uint64_t ix = 0; ix < graph->reg_count; ++ix) {
-        if (!ConflictGraph_has_edge(graph, ix, var + graph->reg_count)) {
-            reg = ix;
-            break;
+void ConflictGraph_remove(ConflictGraph* graph, uint64_t node) {
+    VarSet_clear(&graph->members, node);
+    ConflictAdj* adj = &graph->adj[node - graph->reg_count];
+    for (uint64_t ix = 0; ix < adj->count; ++ix) {
+        if (adj->nodes[ix] >= graph->reg_count) {
+            --graph->adj[adj->nodes[ix] - graph->reg_count].degree;
         }
     }
-    if (reg == VAR_ID_INVALID) {
-        return VAR_ID_INVALID;
-    }
+}
 
-    for (var_id ix = 0; ix < graph->var_count; ++ix) {
-        if (ix == var) {
-            continue;
-        }
-        if (ConflictGraph_has_edge(graph, var + graph->reg_count, 
-                                   ix + graph->reg_count)) {
-            ConflictGraph_add_edge(graph, ix + graph->reg_count, reg);
+void ConflictGraph_reset_degrees(ConflictGraph* graph) {
+    for (var_id v = 0; v < graph->var_count; ++v) {
+        ConflictAdj* adj = &graph->adj[v];
+        adj->degree = 0;
+        for (uint64_t ix = 0; ix < adj->count; ++ix) {
+            if (VarSet_contains(&graph->members, adj->nodes[ix])) {
+                ++adj->degree;
+            }
         }
     }
-    return reg;
 }
 
 void ConflictGraph_update_for_live(ConflictGraph* graph, VarSet* live) {
+    if (graph->linear) {
+        return;
+    }
     var_id a = VarSet_get(live);
     while (a != VAR_ID_INVALID) {
         var_id next = VarSet_getnext(live, a);
@@ -299,10 +640,10 @@ void ConflictGraph_update_for_live(ConflictGraph* graph, VarSet* live) {
 FlowNode FlowNode_Create(Quad* start, Quad* end, var_id var_end) {
     FlowNode n = {
         start, end, 
-        VarSet_create(var_end),
-        VarSet_create(var_end),
-        VarSet_create(var_end),
-        VarSet_create(var_end),
+        VarSet_create_sparse(var_end),
+        VarSet_create_sparse(var_end),
+        VarSet_create_sparse(var_end),
+        VarSet_create_sparse(var_end),
         {INVALID_NODE, INVALID_NODE}
     };
 
@@ -337,33 +678,120 @@ var_id create_typed_temp_var(ConflictGraph* graph, VarList* vars, FlowNode* node
     return id;
 }
 
-void create_live_in_out(FlowNode* nodes, uint64_t node_count, VarSet* work) {
-    bool change;
-    do {
-        change = false;
-        for (uint64_t ix = 0; ix < node_count; ++ix) {
-            FlowNode* node = &nodes[node_count - ix - 1];
-            if (node->successors[0] == INVALID_NODE) {
-                VarSet_clearall(work);
-            } else if (node->successors[1] == INVALID_NODE) {
-                VarSet_copy(work, &nodes[node->successors[0]].live_in);
-            } else {
-                VarSet_copy(work, &nodes[node->successors[0]].live_in);
-                VarSet_union(work, &nodes[node->successors[1]].live_in);
+// Compute live_in and live_out of all nodes, returning the number of node
+// visits. Nodes start out in postorder, successors before predecessors,
+// and are only revisited once the live_in of a successor has changed.
+uint64_t create_live_in_out(FlowNode* nodes, uint64_t node_count, VarSet* work) {
+    if (node_count == 0) {
+        return 0;
+    }
+    // Predecessors of node ix are preds[pred_start[ix]] up to
+    // preds[pred_start[ix + 1]]
+    uint64_t* pred_start = Mem_alloc((node_count + 1) * sizeof(uint64_t));
+    uint64_t* preds = Mem_alloc(2 * node_count * sizeof(uint64_t));
+    uint64_t* queue = Mem_alloc(node_count * sizeof(uint64_t));
+    uint64_t* stack = Mem_alloc(node_count * sizeof(uint64_t));
+    uint8_t* state = Mem_alloc(node_count);
+    if (pred_start == NULL || preds == NULL || queue == NULL ||
+        stack == NULL || state == NULL) {
+        out_of_memory(NULL);
+    }
+
+    memset(pred_start, 0, (node_count + 1) * sizeof(uint64_t));
+    for (uint64_t ix = 0; ix < node_count; ++ix) {
+        for (uint64_t s = 0; s < 2; ++s) {
+            if (nodes[ix].successors[s] != INVALID_NODE) {
+                ++pred_start[nodes[ix].successors[s] + 1];
+            }
+        }
+    }
+    for (uint64_t ix = 0; ix < node_count; ++ix) {
+        pred_start[ix + 1] += pred_start[ix];
+    }
+    // Fill using stack as the next free slot of each node
+    memcpy(stack, pred_start, node_count * sizeof(uint64_t));
+    for (uint64_t ix = 0; ix < node_count; ++ix) {
+        for (uint64_t s = 0; s < 2; ++s) {
+            uint64_t succ = nodes[ix].successors[s];
+            if (succ != INVALID_NODE) {
+                preds[stack[succ]] = ix;
+                ++stack[succ];
+            }
+        }
+    }
+
+    // Depth first search from the entry, then from any node not reached.
+    // state counts the successors visited, 3 once the node is finished.
+    memset(state, 0, node_count);
+    uint64_t queue_size = 0;
+    for (uint64_t root = 0; root < node_count; ++root) {
+        if (state[root] != 0) {
+            continue;
+        }
+        uint64_t depth = 1;
+        stack[0] = root;
+        state[root] = 1;
+        while (depth > 0) {
+            uint64_t ix = stack[depth - 1];
+            if (state[ix] == 3) {
+                queue[queue_size] = ix;
+                ++queue_size;
+                --depth;
+                continue;
             }
-            VarSet_diff(work, &node->def);
-            VarSet_union(work, &node->use);
-            if (!VarSet_equal(&node->live_in, work)) {
-                change = true;
+            uint64_t succ = nodes[ix].successors[state[ix] - 1];
+            ++state[ix];
+            if (succ != INVALID_NODE && state[succ] == 0) {
+                state[succ] = 1;
+                stack[depth] = succ;
+                ++depth;
+            }
+        }
+    }
+    assert(queue_size == node_count);
+
+    // queue is a ring buffer, state is 1 for nodes in it
+    memset(state, 1, node_count);
+    uint64_t head = 0;
+    uint64_t visits = 0;
+    while (queue_size > 0) {
+        uint64_t ix = queue[head];
+        head = head + 1 == node_count ? 0 : head + 1;
+        --queue_size;
+        state[ix] = 0;
+        ++visits;
+
+        FlowNode* node = &nodes[ix];
+        if (node->successors[0] == INVALID_NODE) {
+            VarSet_clearall(work);
+        } else if (node->successors[1] == INVALID_NODE) {
+            VarSet_copy(work, &nodes[node->successors[0]].live_in);
+        } else {
+            VarSet_copy(work, &nodes[node->successors[0]].live_in);
+            VarSet_union(work, &nodes[node->successors[1]].live_in);
+        }
+        VarSet_diff(work, &node->def);
+        VarSet_union(work, &node->use);
+        if (VarSet_equal(&node->live_in, work)) {
+            continue;
+        }
+        VarSet tmp = *work;
+        *work = node->live_in;
+        node->live_in = tmp;
+
+        for (uint64_t p = pred_start[ix]; p < pred_start[ix + 1]; ++p) {
+            uint64_t pred = preds[p];
+            if (state[pred] == 0) {
+                state[pred] = 1;
+                uint64_t tail = head + queue_size;
+                queue[tail >= node_count ? tail - node_count : tail] = pred;
+                ++queue_size;
             }
-            VarSet tmp = *work;
-            *work = node->live_in;
-            node->live_in = tmp;
         }
-    } while (change);
+    }
 
     for (uint64_t ix = 0; ix < node_count; ++ix) {
-        FlowNode* node = &nodes[node_count - ix - 1];
+        FlowNode* node = &nodes[ix];
         if (node->successors[0] != INVALID_NODE) {
             VarSet_copy(&node->live_out, &nodes[node->successors[0]].live_in);
             if (node->successors[1] != INVALID_NODE) {
@@ -371,6 +799,38 @@ void create_live_in_out(FlowNode* nodes, uint64_t node_count, VarSet* work) {
             }
         }
     }
+
+    Mem_free(pred_start);
+    Mem_free(preds);
+    Mem_free(queue);
+    Mem_free(stack);
+    Mem_free(state);
+    return visits;
+}
+
+// Walk node backwards, adding its conflicts and constraints to graph.
+// Quads rewritten to use new temporaries have constraints of their own,
+// so the walk is repeated until no variables are added.
+void conflict_graph_add_node(ConflictGraph* graph, FlowNode* node, VarList* vars,
+                             VarSet* live, Arena* arena) {
+    uint64_t var_count;
+    do {
+        var_count = vars->size;
+        VarSet_grow(&node->live_out, vars->size);
+        VarSet_grow(&node->live_in, vars->size);
+        VarSet_copy(live, &node->live_out);
+        ConflictGraph_update_for_live(graph, live);
+        Quad* q = node->end;
+        while (1) {
+            Backend_add_constrains(graph, live, q, vars, node, arena);
+            Quad_update_live(q, live);
+            ConflictGraph_update_for_live(graph, live);
+            if (q == node->start) {
+                break;
+            }
+            q = q->last_quad;
+        }
+    } while (vars->size > var_count);
 }
 
 void create_conflict_graph(ConflictGraph* graph, FlowNode* nodes, uint64_t node_count,
@@ -380,57 +840,292 @@ void create_conflict_graph(ConflictGraph* graph, FlowNode* nodes, uint64_t node_
     VarSet_clearall(live);
 
     for (uint64_t ix = 0; ix < node_count; ++ix) {
-        VarSet_grow(&nodes[ix].live_out, vars->size);
-        VarSet_grow(&nodes[ix].live_in, vars->size);
-        VarSet_copy(live, &nodes[ix].live_out);
-        ConflictGraph_update_for_live(graph, live);
-        Quad* q = nodes[ix].end;
-        while (1) {
-            Backend_add_constrains(graph, live, q, vars, &nodes[ix], arena);
-            Quad_update_live(q, live);
-            ConflictGraph_update_for_live(graph, live);
-            if (q == nodes[ix].start) {
+        conflict_graph_add_node(graph, &nodes[ix], vars, live, arena);
+    }
+}
+
+// True if any quad of node reads or writes a variable in vars
+static bool node_references(FlowNode* node, VarSet* vars) {
+    Quad* q = node->start;
+    while (1) {
+        var_id def, use1, use2;
+        Quad_operands(q, &def, &use1, &use2);
+        if ((def != VAR_ID_INVALID && VarSet_contains(vars, def)) ||
+            (use1 != VAR_ID_INVALID && VarSet_contains(vars, use1)) ||
+            (use2 != VAR_ID_INVALID && VarSet_contains(vars, use2))) {
+            return true;
+        }
+        if (q == node->end) {
+            return false;
+        }
+        q = q->next_quad;
+    }
+}
+
+
+static uint64_t lowest_bit(uint64_t mask) {
+#ifndef NO_TZCOUNT
+    return _tzcnt_u64(mask);
+#else
+    uint64_t bit = 0;
+    while (!(mask & 1)) {
+        mask >>= 1;
+        ++bit;
+    }
+    return bit;
+#endif
+}
+
+typedef struct LiveInterval {
+    uint64_t start;
+    uint64_t end;
+    var_id var;
+} LiveInterval;
+
+static int interval_cmp(const void* a, const void* b) {
+    const LiveInterval* ia = a;
+    const LiveInterval* ib = b;
+    if (ia->start != ib->start) {
+        return ia->start < ib->start ? -1 : 1;
+    }
+    return ia->var < ib->var ? -1 : (ia->var > ib->var);
+}
+
+static inline void interval_touch(uint64_t* start, uint64_t* end, var_id v, uint64_t pos) {
+    if (v == VAR_ID_INVALID) {
+        return;
+    }
+    if (pos < start[v]) {
+        start[v] = pos;
+    }
+    if (pos > end[v]) {
+        end[v] = pos;
+    }
+}
+
+// Compute the range of positions each variable is live in. Quad i reads
+// its operands at position 2i and writes its result at 2i + 1. Variables
+// never referenced get start UINT64_MAX.
+void create_intervals(FlowNode* nodes, uint64_t node_count, uint64_t var_count,
+                      uint64_t* start, uint64_t* end) {
+    for (var_id v = 0; v < var_count; ++v) {
+        start[v] = UINT64_MAX;
+        end[v] = 0;
+    }
+    uint64_t pos = 0;
+    for (uint64_t ix = 0; ix < node_count; ++ix) {
+        uint64_t first = pos;
+        for (Quad* q = nodes[ix].start;; q = q->next_quad) {
+            var_id def, use1, use2;
+            Quad_operands(q, &def, &use1, &use2);
+            interval_touch(start, end, use1, pos);
+            interval_touch(start, end, use2, pos);
+            interval_touch(start, end, def, pos + 1);
+            pos += 2;
+            if (q == nodes[ix].end) {
                 break;
             }
-            q = q->last_quad;
+        }
+        var_id v = VarSet_get(&nodes[ix].live_in);
+        while (v != VAR_ID_INVALID) {
+            interval_touch(start, end, v, first);
+            v = VarSet_getnext(&nodes[ix].live_in, v);
+        }
+        v = VarSet_get(&nodes[ix].live_out);
+        while (v != VAR_ID_INVALID) {
+            interval_touch(start, end, v, pos - 1);
+            v = VarSet_getnext(&nodes[ix].live_out, v);
         }
     }
 }
 
-bool can_allocate(ConflictGraph* graph, uint64_t to_alloc, var_id* stack) {
-    VarSet old_members = VarSet_create(graph->members.max);
-    VarSet old_edges = VarSet_create(graph->edges.max);
-    VarSet_copy(&old_edges, &graph->edges);
-    VarSet_copy(&old_members, &graph->members);
+// Allocate registers by a linear scan over live intervals, honouring the
+// register constraints of the backend. This is plain linear scan, not
+// second chance binpacking: intervals are never split, a spilled variable
+// lives in memory for its whole lifetime and is never reloaded into a
+// register freed later. The backend instead gives each use of it that
+// needs a register its own short lived temporary, so liveness, intervals
+// and constraints are rebuilt and the scan repeated until nothing more is
+// spilled. Used for --fast-regalloc, trading code quality for compile time.
+void allocate_registers_linear(FlowNode* nodes, uint64_t node_count, Quads* quads,
+                               VarList* vars, Arena* arena) {
+    ConflictGraph graph;
+    ConflictGraph_create_linear(&graph, Backend_get_regs(), vars->size);
+    uint64_t all_regs = graph.reg_count == 64 ? UINT64_MAX :
+                        ((uint64_t)1 << graph.reg_count) - 1;
+    VarSet live = VarSet_create_sparse(vars->size);
 
-    var_id v = graph->reg_count - 1;
+    uint64_t rounds = 0;
     while (1) {
-        v = VarSet_getnext(&graph->members, v);
-        if (v == VAR_ID_INVALID) {
-            break;
+        create_conflict_graph(&graph, nodes, node_count, quads, vars, &live, arena);
+        ++rounds;
+
+        uint64_t var_count = vars->size;
+        uint64_t* start = Mem_alloc(var_count * sizeof(uint64_t));
+        uint64_t* end = Mem_alloc(var_count * sizeof(uint64_t));
+        uint64_t* regs = Mem_alloc(var_count * sizeof(uint64_t));
+        LiveInterval* intervals = Mem_alloc(var_count * sizeof(LiveInterval));
+        if (start == NULL || end == NULL || regs == NULL || intervals == NULL) {
+            out_of_memory(NULL);
+        }
+
+        create_intervals(nodes, node_count, var_count, start, end);
+        uint64_t interval_count = 0;
+        for (var_id v = 0; v < var_count; ++v) {
+            regs[v] = VAR_ID_INVALID;
+            if (vars->data[v].alloc_type != ALLOC_NONE &&
+                vars->data[v].alloc_type != ALLOC_REG) {
+                continue;
+            }
+            if (start[v] == UINT64_MAX) {
+                // Never referenced, any allowed register will do
+                uint64_t allowed = ~graph.reg_masks[v] & all_regs;
+                if (allowed != 0) {
+                    regs[v] = lowest_bit(allowed);
+                } else {
+                    vars->data[v].alloc_type = ALLOC_MEM;
+                }
+                continue;
+            }
+            intervals[interval_count].start = start[v];
+            intervals[interval_count].end = end[v];
+            intervals[interval_count].var = v;
+            ++interval_count;
+        }
+        qsort(intervals, interval_count, sizeof(LiveInterval), interval_cmp);
+
+        var_id active[64];
+        uint64_t active_count = 0;
+        uint64_t free_regs = all_regs;
+        uint64_t spilled = 0;
+        for (uint64_t ix = 0; ix < interval_count; ++ix) {
+            var_id v = intervals[ix].var;
+            for (uint64_t a = 0; a < active_count;) {
+                if (end[active[a]] < intervals[ix].start) {
+                    free_regs |= (uint64_t)1 << regs[active[a]];
+                    --active_count;
+                    active[a] = active[active_count];
+                } else {
+                    ++a;
+                }
+            }
+
+            // Variables that may not share a register with v
+            uint64_t* partners = graph.adj[v].nodes;
+            uint64_t partner_count = graph.adj[v].count;
+            uint64_t allowed = ~graph.reg_masks[v] & all_regs;
+            for (uint64_t p = 0; p < partner_count; ++p) {
+                var_id u = partners[p] - graph.reg_count;
+                if (regs[u] != VAR_ID_INVALID) {
+                    allowed &= ~((uint64_t)1 << regs[u]);
+                }
+            }
+            uint64_t avail = allowed & free_regs;
+            if (avail != 0) {
+                regs[v] = lowest_bit(avail);
+                free_regs &= ~((uint64_t)1 << regs[v]);
+                active[active_count] = v;
+                ++active_count;
+                continue;
+            }
+
+            // Take the register of the active variable ending last, unless
+            // v itself ends later
+            uint64_t victim = VAR_ID_INVALID;
+            for (uint64_t a = 0; a < active_count; ++a) {
+                var_id u = active[a];
+                if (vars->data[u].alloc_type == ALLOC_NONE && ((allowed >> regs[u]) & 1) &&
+                    (victim == VAR_ID_INVALID || end[u] > end[active[victim]])) {
+                    victim = a;
+                }
+            }
+            if (vars->data[v].alloc_type == ALLOC_REG && victim == VAR_ID_INVALID) {
+                // v has to be in a register, but the ones it may use are
+                // all taken or used by its partners. Spill whatever holds
+                // the first one that can be freed.
+                uint64_t candidates = ~graph.reg_masks[v] & all_regs;
+                uint64_t reg = VAR_ID_INVALID;
+                while (candidates != 0 && reg == VAR_ID_INVALID) {
+                    reg = lowest_bit(candidates);
+                    candidates &= candidates - 1;
+                    for (uint64_t a = 0; a < active_count; ++a) {
+                        if (regs[active[a]] == reg &&
+                            vars->data[active[a]].alloc_type != ALLOC_NONE) {
+                            reg = VAR_ID_INVALID;
+                            break;
+                        }
+                    }
+                    for (uint64_t p = 0; reg != VAR_ID_INVALID && p < partner_count; ++p) {
+                        var_id u = partners[p] - graph.reg_count;
+                        if (regs[u] == reg && vars->data[u].alloc_type != ALLOC_NONE) {
+                            reg = VAR_ID_INVALID;
+                        }
+                    }
+                }
+                assert(reg != VAR_ID_INVALID);
+                for (uint64_t a = 0; a < active_count;) {
+                    if (regs[active[a]] == reg) {
+                        LOG_DEBUG("Spilled var %llu for var %llu", active[a], v);
+                        regs[active[a]] = VAR_ID_INVALID;
+                        vars->data[active[a]].alloc_type = ALLOC_MEM;
+                        --active_count;
+                        active[a] = active[active_count];
+                    } else {
+                        ++a;
+                    }
+                }
+                for (uint64_t p = 0; p < partner_count; ++p) {
+                    var_id u = partners[p] - graph.reg_count;
+                    if (regs[u] == reg) {
+                        LOG_DEBUG("Spilled var %llu for var %llu", u, v);
+                        regs[u] = VAR_ID_INVALID;
+                        vars->data[u].alloc_type = ALLOC_MEM;
+                    }
+                }
+                regs[v] = reg;
+                free_regs &= ~((uint64_t)1 << reg);
+                active[active_count] = v;
+                ++active_count;
+            } else if (vars->data[v].alloc_type == ALLOC_REG ||
+                (victim != VAR_ID_INVALID && end[active[victim]] > end[v])) {
+                var_id u = active[victim];
+                LOG_DEBUG("Spilled var %llu for var %llu", u, v);
+                regs[v] = regs[u];
+                regs[u] = VAR_ID_INVALID;
+                vars->data[u].alloc_type = ALLOC_MEM;
+                active[victim] = v;
+            } else {
+                LOG_DEBUG("Spilled var %llu", v);
+                vars->data[v].alloc_type = ALLOC_MEM;
+            }
+            ++spilled;
+        }
+
+        if (spilled == 0) {
+            for (var_id v = 0; v < var_count; ++v) {
+                if (regs[v] != VAR_ID_INVALID) {
+                    vars->data[v].alloc_type = ALLOC_REG;
+                    vars->data[v].reg = regs[v];
+                }
+            }
+            LOG_INFO("Linear scan: %llu intervals, %llu rounds", interval_count, rounds);
         }
-        uint64_t reg = ConflictGraph_pick_register(graph, v - graph->reg_count);
-        if (reg == VAR_ID_INVALID) {
-            LOG_DEBUG("Failed to pick register for var %llu", v - graph->reg_count);
+        Mem_free(start);
+        Mem_free(end);
+        Mem_free(regs);
+        Mem_free(intervals);
+        if (spilled == 0) {
             break;
         }
-        LOG_DEBUG("Tried picking register %llu for var %llu", reg, v - graph->reg_count);
-        stack[to_alloc - 1] = v - graph->reg_count;
-        --to_alloc;
-        VarSet_clear(&graph->members, v);
-        v = graph->reg_count - 1;
     }
-    VarSet_copy(&graph->edges, &old_edges);
-    VarSet_copy(&graph->members, &old_members);
-    VarSet_free(&old_edges);
-    VarSet_free(&old_members);
 
-    return to_alloc == 0;
+    VarSet_free(&live);
+    ConflictGraph_free(&graph);
 }
 
-
 void allocate_registers(Quads* quads, Quad* start, Quad* end,
-                        uint64_t* label_map, VarList* vars, Arena* arena) {
+                        uint64_t* label_map, VarList* vars, Arena* arena,
+                        bool linear_scan) {
     FlowNode* nodes = Mem_alloc(8 * sizeof(FlowNode));
     if (nodes == NULL) {
         out_of_memory(NULL);
@@ -490,19 +1185,18 @@ void allocate_registers(Quads* quads, Quad* start, Quad* end,
             nodes[ix].successors[0] = ix + 1;
         }
     }
-    VarSet work = VarSet_create(vars->size);
-    create_live_in_out(nodes, node_count, &work);
-
-    VarSet_clearall(&work);
-
-    ConflictGraph graph;
-    ConflictGraph_create(&graph, Backend_get_regs(), vars->size);
-
-    var_id* stack = Mem_alloc(vars->size * sizeof(var_id));
-    if (stack == NULL) {
-        out_of_memory(NULL);
-    }
-    uint64_t stack_size = 0;
+    LARGE_INTEGER freq, live_start, live_end;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&live_start);
+    VarSet work = VarSet_create_sparse(vars->size);
+    uint64_t visits = create_live_in_out(nodes, node_count, &work);
+    QueryPerformanceCounter(&live_end);
+    LOG_INFO("Liveness: %llu nodes, %llu visits, %llu vars, %llu us", node_count,
+             visits, vars->size,
+             (live_end.QuadPart - live_start.QuadPart) * 1000000 / freq.QuadPart);
+
+    // work may hold any node's old live_in, and is used as a bitmap from here
+    VarSet_free(&work);
 
     for (var_id id = 0; id < vars->size; ++id) {
         if (vars->data[id].kind == VAR_FUNCTION ||
@@ -513,121 +1207,319 @@ void allocate_registers(Quads* quads, Quad* start, Quad* end,
         }
     }
 
-    // Save old variable count to make sure stack does not overflow
-    uint64_t var_cap = vars->size;
+    if (linear_scan) {
+        allocate_registers_linear(nodes, node_count, quads, vars, arena);
+        return;
+    }
+
+    work = VarSet_create(vars->size);
+
+    ConflictGraph graph;
+    ConflictGraph_create(&graph, Backend_get_regs(), vars->size);
+    create_conflict_graph(&graph, nodes, node_count, quads, vars, &work, arena);
+
+    uint64_t var_cap = 0;
+    var_id* stack = NULL;
+    var_id* worklist = NULL;
+    uint64_t* colors = NULL;
+    // Variables spilled this round, their blocks are walked again
+    VarSet spilled = VarSet_create_sparse(vars->size);
+    uint64_t rounds = 0;
+    uint64_t spill_count = 0;
+
     while (1) {
-        create_conflict_graph(&graph, nodes, node_count, quads, vars, &work, arena);
+        ++rounds;
         if (vars->size > var_cap) {
-            stack = Mem_realloc(stack, (vars->size + 10) * sizeof(var_id));
-            if (stack == NULL) {
+            var_cap = vars->size + 10;
+            Mem_free(stack);
+            Mem_free(worklist);
+            Mem_free(colors);
+            stack = Mem_alloc(var_cap * sizeof(var_id));
+            worklist = Mem_alloc(var_cap * sizeof(var_id));
+            colors = Mem_alloc(var_cap * sizeof(uint64_t));
+            if (stack == NULL || worklist == NULL || colors == NULL) {
                 out_of_memory(NULL);
             }
-            var_cap = vars->size + 10;
         }
 
         uint64_t to_alloc = 0;
         for (var_id id = 0; id < vars->size; ++id) {
+            colors[id] = VAR_ID_INVALID;
             if (vars->data[id].alloc_type != ALLOC_NONE &&
                 vars->data[id].alloc_type != ALLOC_REG) {
                 VarSet_clear(&graph.members, id + graph.reg_count);
             } else {
+                VarSet_set(&graph.members, id + graph.reg_count);
                 ++to_alloc;
-                assert(VarSet_contains(&graph.members, id + graph.reg_count));
             }
         }
+        ConflictGraph_reset_degrees(&graph);
 
-        var_id v = graph.reg_count - 1;
-        stack_size = 0;
-        VarSet_copy(&work, &graph.members);
-        while (1) {
-            v = VarSet_getnext(&graph.members, v);
-            if (v == VAR_ID_INVALID) {
-                break;
-            }
-            uint64_t count = ConflictGraph_count(&graph, v);
-            if (count < graph.reg_count) {
-                assert(stack_size < var_cap);
-                stack[stack_size] = v - graph.reg_count;
-                ++stack_size;
-                VarSet_clear(&graph.members, v);
-                v = graph.reg_count - 1;
+        // Simplify: remove variables with fewer neighbours than there are
+        // registers, they can always be colored. Once none are left, remove
+        // the one with most neighbours optimistically.
+        uint64_t stack_size = 0;
+        uint64_t work_size = 0;
+        for (var_id id = 0; id < vars->size; ++id) {
+            uint64_t v = id + graph.reg_count;
+            if (VarSet_contains(&graph.members, v) &&
+                ConflictGraph_count(&graph, v) < graph.reg_count) {
+                worklist[work_size++] = id;
             }
         }
-        if (stack_size < to_alloc) {
-            VarSet_copy(&graph.members, &work);
-
-            if (can_allocate(&graph, to_alloc, stack)) {
-                stack_size = to_alloc;
-                LOG_DEBUG("Successfull paint");
-                break;
+        while (stack_size < to_alloc) {
+            var_id id;
+            if (work_size > 0) {
+                id = worklist[--work_size];
+            } else {
+                uint64_t max_conflicts = 0;
+                id = VAR_ID_INVALID;
+                uint64_t v = VarSet_getnext(&graph.members, graph.reg_count - 1);
+                while (v != VAR_ID_INVALID) {
+                    uint64_t c = ConflictGraph_count(&graph, v);
+                    if (vars->data[v - graph.reg_count].alloc_type == ALLOC_REG) {
+                        // This variable has to be in a register...
+                        c = 0;
+                    }
+                    if (id == VAR_ID_INVALID || c > max_conflicts) {
+                        max_conflicts = c;
+                        id = v - graph.reg_count;
+                    }
+                    v = VarSet_getnext(&graph.members, v);
+                }
+                assert(id != VAR_ID_INVALID);
             }
-
-            v = graph.reg_count - 1;
-            v = VarSet_getnext(&graph.members, v);
-            assert(v != VAR_ID_INVALID);
-            // Find variable with most conflicts
-            uint64_t max_conflicts = ConflictGraph_count(&graph, v);
-            var_id max_var = v - graph.reg_count;
-            if (vars->data[max_var].alloc_type == ALLOC_REG) {
-                max_conflicts = 0;
+            stack[stack_size++] = id;
+            ConflictGraph_remove(&graph, id + graph.reg_count);
+            ConflictAdj* adj = &graph.adj[id];
+            for (uint64_t ix = 0; ix < adj->count; ++ix) {
+                uint64_t n = adj->nodes[ix];
+                if (n >= graph.reg_count && VarSet_contains(&graph.members, n) &&
+                    ConflictGraph_count(&graph, n) == graph.reg_count - 1) {
+                    worklist[work_size++] = n - graph.reg_count;
+                }
             }
-            do {
-                if (vars->data[v  - graph.reg_count].alloc_type == ALLOC_REG) {
-                    // This variable has to be in a register...
+        }
+
+        // Select: color in reverse order of removal. Variables requiring a
+        // specific register go first, so nothing else can take it.
+        VarSet_clearall(&spilled);
+        for (uint64_t pass = 0; pass < 2; ++pass) {
+            for (uint64_t ix = stack_size; ix > 0; --ix) {
+                var_id id = stack[ix - 1];
+                if ((vars->data[id].alloc_type == ALLOC_REG) != (pass == 0)) {
                     continue;
                 }
-                uint64_t c = ConflictGraph_count(&graph, v);
-                if (c > max_conflicts) {
-                    max_conflicts = c;
-                    max_var = v - graph.reg_count;
+                uint64_t used = 0;
+                ConflictAdj* adj = &graph.adj[id];
+                for (uint64_t n = 0; n < adj->count; ++n) {
+                    uint64_t node = adj->nodes[n];
+                    if (node < graph.reg_count) {
+                        used |= 1ull << node;
+                    } else if (colors[node - graph.reg_count] != VAR_ID_INVALID) {
+                        used |= 1ull << colors[node - graph.reg_count];
+                    }
                 }
-            } while ((v = VarSet_getnext(&graph.members, v)) != VAR_ID_INVALID);
-            // max_var is now variable with most conflicts
-            // spill it
-            assert(vars->data[max_var].alloc_type == ALLOC_NONE);
-            vars->data[max_var].alloc_type = ALLOC_MEM;
-            continue;
+                uint64_t avail = ~used;
+                if (graph.reg_count < 64) {
+                    avail &= (1ull << graph.reg_count) - 1;
+                }
+                if (avail != 0) {
+                    colors[id] = lowest_bit(avail);
+                    continue;
+                }
+                LOG_DEBUG("Failed to pick register for var %llu", id);
+                assert(vars->data[id].alloc_type == ALLOC_NONE);
+                vars->data[id].alloc_type = ALLOC_MEM;
+                VarSet_set(&spilled, id);
+                ++spill_count;
+            }
         }
-        break;
-    }
-    while (stack_size > 0) {
-        var_id v = stack[stack_size - 1];
-        --stack_size;
-        uint64_t reg = ConflictGraph_pick_register(&graph, v);
-        assert(reg != VAR_ID_INVALID);
-        LOG_DEBUG("Picked reg %llu for var %llu", reg, v);
-        vars->data[v].alloc_type = ALLOC_REG;
-        vars->data[v].reg = reg;
+        if (VarSet_get(&spilled) == VAR_ID_INVALID) {
+            for (uint64_t ix = 0; ix < stack_size; ++ix) {
+                var_id id = stack[ix];
+                LOG_DEBUG("Picked reg %llu for var %llu", colors[id], id);
+                vars->data[id].alloc_type = ALLOC_REG;
+                vars->data[id].reg = colors[id];
+            }
+            break;
+        }
+
+        // Only blocks referencing a spilled variable are rewritten, so only
+        // they can gain new conflicts. New temporaries add their own register
+        // class constraints. Old edges of the spilled variables stay, but
+        // they are no longer members.
+        VarSet_clearall(&work);
+        for (uint64_t ix = 0; ix < node_count; ++ix) {
+            if (node_references(&nodes[ix], &spilled)) {
+                conflict_graph_add_node(&graph, &nodes[ix], vars, &work, arena);
+            }
+        }
+        VarSet_grow(&spilled, vars->size);
     }
+    LOG_INFO("Graph coloring: %llu rounds, %llu spills, %llu vars", rounds,
+             spill_count, vars->size);
 
     Mem_free(stack);
+    Mem_free(worklist);
+    Mem_free(colors);
+    VarSet_free(&spilled);
+    VarSet_free(&work);
+    ConflictGraph_free(&graph);
 }
 
-Object* Generate_code(Quads* quads, FunctionTable* functions, FunctionTable* externs,
-                      NameTable* name_table, StringLiteral* literals, Arena* arena,
-                      bool serialze_asm) {
-    uint64_t* label_map = Mem_alloc(quads->label_count * sizeof(uint64_t));
-    if (label_map == NULL) {
-        out_of_memory(NULL);
+#define CODEGEN_MAX_WORKERS 64
+
+typedef struct CodegenJob {
+    Quads* quads;
+    FunctionTable* functions;
+    AsmModule* module;
+    AsmFragment* fragments;
+    bool fast_regalloc;
+    // Index of the next function to generate
+    volatile LONG64 next;
+} CodegenJob;
+
+typedef struct CodegenWorker {
+    CodegenJob* job;
+    // Holds quads created during register allocation
+    Arena arena;
+    uint64_t* label_map;
+    AsmWorker asm_worker;
+} CodegenWorker;
+
+static void codegen_run(CodegenWorker* worker) {
+    CodegenJob* job = worker->job;
+    FunctionTable* functions = job->functions;
+    uint64_t regalloc_ticks = 0, asm_ticks = 0, generated = 0;
+    while (1) {
+        uint64_t ix = InterlockedIncrement64(&job->next) - 1;
+        if (ix >= functions->size) {
+            break;
+        }
+        FunctionDef* def = functions->data[ix];
+        if (def->undefined) {
+            continue;
+        }
+        // The optimizer leaves gaps between quads, and moves inserted during
+        // allocation end up far from their neighbours. Keep each function
+        // contiguous in the worker arena while the backend walks it.
+        uint64_t start = TimeReport_now();
+        Quad_compact(&def->quad_start, &def->quad_end, &worker->arena);
+        allocate_registers(job->quads, def->quad_start, def->quad_end,
+                           worker->label_map, &def->vars, &worker->arena,
+                           job->fast_regalloc);
+        Quad_compact(&def->quad_start, &def->quad_end, &worker->arena);
+        uint64_t asm_start = TimeReport_now();
+        Backend_generate_fragment(job->module, &worker->asm_worker, def,
+                                  &job->fragments[ix]);
+        regalloc_ticks += asm_start - start;
+        asm_ticks += TimeReport_now() - asm_start;
+        ++generated;
     }
+    TimeReport_add(TIME_PHASE_REGALLOC, regalloc_ticks, 0, generated);
+    TimeReport_add(TIME_PHASE_ASM, asm_ticks, 0, generated);
+}
+
+static DWORD WINAPI codegen_worker(void* param) {
+    codegen_run(param);
+    return 0;
+}
 
+Object* Generate_code(Quads* quads, FunctionTable* functions, FunctionTable* externs,
+                      NameTable* name_table, StringLiteral* literals, Arena* arena,
+                      bool serialze_asm, bool fast_regalloc) {
+    uint64_t defined = 0;
     for (uint64_t ix = 0; ix < functions->size; ++ix) {
         if (functions->data[ix]->undefined) {
             continue;
         }
-        Quad* start = functions->data[ix]->quad_start;
-        Quad* end = functions->data[ix]->quad_end;
         // Break up quads
-        start->last_quad = NULL;
-        end->next_quad = NULL;
-        var_id var_start = 0;
-        var_id var_end = functions->data[ix]->vars.size;
-        const char* name = name_table->data[functions->data[ix]->name].name;
-        uint32_t name_len = name_table->data[functions->data[ix]->name].name_len;
-        allocate_registers(quads, start, end, label_map,
-                          &functions->data[ix]->vars, arena);
-    }
-    Mem_free(label_map);
-    return Backend_generate_asm(name_table, functions, externs, literals, 
-                                arena, serialze_asm);
+        functions->data[ix]->quad_start->last_quad = NULL;
+        functions->data[ix]->quad_end->next_quad = NULL;
+        ++defined;
+    }
+
+    uint64_t start = TimeReport_now();
+    uint64_t arena_start = arena->offset;
+    AsmModule module;
+    Backend_begin_asm(&module, name_table, functions, externs, literals, arena);
+    TimeReport_add(TIME_PHASE_ASM, TimeReport_now() - start, 0, 0);
+
+    AsmFragment* fragments = Mem_alloc(functions->size * sizeof(AsmFragment));
+    if (fragments == NULL && functions->size > 0) {
+        out_of_memory(NULL);
+    }
+
+    // Functions are independent from here on, each worker allocates
+    // registers and assembles whole functions into its own object.
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    uint32_t worker_count = info.dwNumberOfProcessors;
+    if (worker_count > CODEGEN_MAX_WORKERS) {
+        worker_count = CODEGEN_MAX_WORKERS;
+    }
+    if (worker_count > defined) {
+        worker_count = defined;
+    }
+    if (worker_count == 0) {
+        worker_count = 1;
+    }
+
+    CodegenJob job;
+    job.quads = quads;
+    job.functions = functions;
+    job.module = &module;
+    job.fragments = fragments;
+    job.fast_regalloc = fast_regalloc;
+    job.next = 0;
+
+    CodegenWorker* workers = Mem_alloc(worker_count * sizeof(CodegenWorker));
+    if (workers == NULL) {
+        out_of_memory(NULL);
+    }
+    for (uint32_t i = 0; i < worker_count; ++i) {
+        workers[i].job = &job;
+        if (!Arena_create(&workers[i].arena, 0xffffffff, out_of_memory, NULL)) {
+            out_of_memory(NULL);
+        }
+        workers[i].label_map = Mem_alloc(quads->label_count * sizeof(uint64_t));
+        if (workers[i].label_map == NULL && quads->label_count > 0) {
+            out_of_memory(NULL);
+        }
+        AsmWorker_create(&workers[i].asm_worker, &module);
+    }
+
+    // The calling thread is the first worker
+    HANDLE threads[CODEGEN_MAX_WORKERS];
+    uint32_t started = 1;
+    for (; started < worker_count; ++started) {
+        threads[started] = CreateThread(NULL, 0, codegen_worker, &workers[started],
+                                        0, NULL);
+        if (threads[started] == NULL) {
+            break;
+        }
+    }
+    codegen_run(&workers[0]);
+    for (uint32_t i = 1; i < started; ++i) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+    LOG_DEBUG("Generated %llu functions on %u threads", defined, started);
+
+    start = TimeReport_now();
+    Object* object = Backend_end_asm(&module, functions, fragments, serialze_asm);
+    TimeReport_add(TIME_PHASE_ASM, TimeReport_now() - start,
+                   arena->offset - arena_start, 0);
+
+    // Quads created during register allocation are not valid after this
+    for (uint32_t i = 0; i < worker_count; ++i) {
+        TimeReport_add(TIME_PHASE_REGALLOC, 0, workers[i].arena.offset, 0);
+        AsmWorker_free(&workers[i].asm_worker);
+        Mem_free(workers[i].label_map);
+        Arena_free(&workers[i].arena);
+    }
+    Mem_free(workers);
+    Mem_free(fragments);
+    return object;
 }
@@ -4,13 +4,36 @@
 #include "quads.h"
 #include "linker/linker.h"
 
+// Neighbours of a variable in a ConflictGraph, registers included
+typedef struct ConflictAdj {
+    uint64_t* nodes;
+    uint64_t count;
+    uint64_t cap;
+    // Neighbours currently in members
+    uint64_t degree;
+} ConflictAdj;
+
 typedef struct ConflictGraph {
     uint64_t reg_count;
     uint64_t var_count;
     uint64_t width;
     uint64_t shifts;
+    // Bit matrix of edges, for constant time lookups
     VarSet edges;
     VarSet members;
+    // The same edges as lists, indexed by variable
+    ConflictAdj* adj;
+    uint64_t adj_cap;
+
+    // Set for graphs from ConflictGraph_create_linear, which only record
+    // the register constraints. Interference between variables then comes
+    // from their live intervals. `adj` then only lists the variables that
+    // may not share a register, without duplicates, and `edges` and
+    // `members` are unused.
+    bool linear;
+    // Registers each variable may not use
+    uint64_t* reg_masks;
+    uint64_t mask_cap;
 } ConflictGraph;
 
 void ConflictGraph_add_edge(ConflictGraph* graph, uint64_t row, uint64_t col);
@@ -19,12 +42,23 @@ bool ConflictGraph_has_edge(ConflictGraph* graph, uint64_t a, uint64_t b);
 
 void ConflictGraph_create(ConflictGraph* graph, uint64_t reg_count, uint64_t var_count);
 
+void ConflictGraph_create_linear(ConflictGraph* graph, uint64_t reg_count, uint64_t var_count);
+
 void ConflictGraph_clear(ConflictGraph* graph);
 
 void ConflictGraph_add_var(ConflictGraph* graph, var_id var);
 
+// Remove variable node from members, updating the degree of its neighbours
+void ConflictGraph_remove(ConflictGraph* graph, uint64_t node);
+
+// Recount the degree of every variable after members changed
+void ConflictGraph_reset_degrees(ConflictGraph* graph);
+
 void ConflictGraph_update_for_live(ConflictGraph* graph, VarSet* live);
 
+// Basic block. A function's blocks are one flat array in quad order, and
+// successors index into it. create_live_in_out derives the predecessor
+// arrays from the successors once per function.
 typedef struct FlowNode {
     // First quad in node
     Quad* start;
@@ -52,7 +86,7 @@ var_id create_typed_temp_var(ConflictGraph* graph, VarList* vars, FlowNode* node
 
 Object* Generate_code(Quads* quads, FunctionTable* functions, FunctionTable* externs,
                       NameTable* name_table, StringLiteral* literals, Arena* arena,
-                      bool serialze_asm);
+                      bool serialze_asm, bool fast_regalloc);
 
 bool Backend_arg_is_ptr(AllocInfo info);
 
@@ -4,6 +4,9 @@
 #include "type_checker.h"
 #include "quads.h"
 #include "code_generation.h"
+#include "optimizer.h"
+#include "module_cache.h"
+#include "time_report.h"
 #include "log.h"
 #include <path_utils.h>
 #include <glob.h>
@@ -28,8 +31,52 @@ void dump_errors(Parser* parser) {
     }
 }
 
+// Generate an object with only the functions defined in module
+static Object* generate_module(Parser* parser, Quads* q, Module* module,
+                               bool show_asm, bool fast_regalloc) {
+    FunctionTable* functions = &parser->function_table;
+    bool* hidden = Mem_alloc(functions->size * sizeof(bool));
+    if (hidden == NULL && functions->size > 0) {
+        out_of_memory(NULL);
+    }
+    for (uint64_t ix = 0; ix < functions->size; ++ix) {
+        FunctionDef* def = functions->data[ix];
+        hidden[ix] = !def->undefined && def->line.filename != module->filename;
+        if (hidden[ix]) {
+            def->undefined = true;
+        }
+    }
+
+    Object* object = Generate_code(q, functions, &parser->externs,
+                                   &parser->name_table,
+                                   parser->first_str, &parser->arena,
+                                   show_asm, fast_regalloc);
+
+    for (uint64_t ix = 0; ix < functions->size; ++ix) {
+        if (hidden[ix]) {
+            functions->data[ix]->undefined = false;
+        }
+    }
+    Mem_free(hidden);
+    return object;
+}
+
+static uint64_t count_lines(ModuleList* modules) {
+    uint64_t lines = 0;
+    for (uint32_t ix = 0; ix < modules->count; ++ix) {
+        String* content = &modules->modules[ix].content;
+        for (uint64_t i = 0; i < content->length; ++i) {
+            if (content->buffer[i] == '\n') {
+                ++lines;
+            }
+        }
+    }
+    return lines;
+}
+
 int compiler(char** argv, int argc) {
     FlagValue outfile = { FLAG_STRING };
+    FlagValue cache_dir = { FLAG_STRING };
     FlagInfo flags[] = {
         {'s', "log-to-socket", NULL}, // 0
         {'\0', "show-ast"},           // 1
@@ -40,6 +87,10 @@ int compiler(char** argv, int argc) {
         {'\0', "show-all"},           // 6
         {'c', NULL},                  // 7
         {'o', NULL, &outfile},        // 8
+        {'\0', "fast-regalloc"},      // 9
+        {'\0', "show-optimized-quads"}, // 10
+        {'\0', "cache-dir", &cache_dir}, // 11
+        {'\0', "time-report"},        // 12
     };
     const uint32_t flag_count = sizeof(flags) / sizeof(FlagInfo);
     ErrorInfo err;
@@ -59,11 +110,22 @@ int compiler(char** argv, int argc) {
     bool show_asm = flags[4].count > 0 || flags[6].count > 0;
     bool show_object = flags[5].count > 0 || flags[6].count > 0;
     bool compile_only = flags[7].count > 0;
+    bool fast_regalloc = flags[9].count > 0;
+    bool show_optimized_quads = flags[10].count > 0 || flags[6].count > 0;
+    bool use_cache = cache_dir.has_value;
+    bool time_report = flags[12].count > 0;
+    if (time_report) {
+        TimeReport_enable();
+    }
 
     if (argc < 2) {
         LOG_USER_ERROR("Missing argument");
         return 1;
     }
+    if (use_cache && compile_only) {
+        LOG_USER_ERROR("--cache-dir cannot be combined with -c");
+        return 1;
+    }
 
     Parser parser;
     Parser_create(&parser);
@@ -76,33 +138,59 @@ int compiler(char** argv, int argc) {
     }
 
 
-    for (uint32_t mod = 0; mod < parser.modules.count; ++mod) {
-        String s;
-        const char* filename = parser.modules.modules[mod].filename;
-        if (!read_text_file(&s, filename)) {
-            LOG_USER_ERROR("Failed to read '%s'\n", filename);
-            return 1;
-        }
-        parser.modules.modules[mod].content = s;
-        scan_program(&parser, &s, filename);
+    if (!scan_modules(&parser)) {
+        dump_errors(&parser);
+        return 1;
+    }
 
-        if (parser.first_error != NULL) {
-            dump_errors(&parser);
+    ObjectSet objects;
+    ObjectSet_create(&objects);
+
+    // Modules with a cached object are only parsed for their declarations,
+    // like imports. With nothing left to compile it goes straight to linking.
+    ModuleCache cache;
+    uint64_t* keys = NULL;
+    uint32_t stale = 0;
+    if (use_cache) {
+        if (!ModuleCache_open(&cache, cache_dir.str)) {
+            LOG_USER_ERROR("Failed opening cache '%s'", cache_dir.str);
             return 1;
         }
-    }
-    if (parser.first_error == NULL) {
+        keys = Mem_alloc(parser.modules.count * sizeof(uint64_t));
+        if (keys == NULL) {
+            out_of_memory(NULL);
+        }
         for (uint32_t ix = 0; ix < parser.modules.count; ++ix) {
             Module* mod = &parser.modules.modules[ix];
-
-            parse_program(&parser, &mod->content, mod->filename, mod->import);
-
-            if (parser.first_error != NULL) {
-                dump_errors(&parser);
-                return 1;
+            if (mod->import) {
+                continue;
             }
+            keys[ix] = ModuleCache_key(&cache, &parser.modules, ix, fast_regalloc);
+            Object* cached = ModuleCache_load(&cache, keys[ix]);
+            if (cached == NULL) {
+                ++stale;
+                continue;
+            }
+            ObjectSet_add(&objects, cached);
+            mod->import = true;
         }
+        LOG_USER_INFO("Compiling %u modules, %u cached", stale, objects.object_count);
+    }
+
+    if (use_cache && stale == 0) {
+        goto link;
+    }
+
+    uint64_t start = TimeReport_now();
+    uint64_t arena_start = parser.arena.offset;
+    uint64_t function_count = parser.function_table.size;
+    if (parser.first_error == NULL && !parse_modules(&parser)) {
+        dump_errors(&parser);
+        return 1;
     }
+    TimeReport_add(TIME_PHASE_PARSE, TimeReport_now() - start,
+                   parser.arena.offset - arena_start,
+                   parser.function_table.size - function_count);
 
 
     for (int i = 0; i < parser.function_table.size; ++i) {
@@ -114,11 +202,15 @@ int compiler(char** argv, int argc) {
         }
     }
 
+    start = TimeReport_now();
+    arena_start = parser.arena.offset;
     TypeChecker_run(&parser);
     if (parser.first_error != NULL) {
         dump_errors(&parser);
         return 1;
     }
+    TimeReport_add(TIME_PHASE_TYPECHECK, TimeReport_now() - start,
+                   parser.arena.offset - arena_start, parser.function_table.size);
 
     for (int i = 0; i < parser.function_table.size; ++i) {
         String s;
@@ -132,7 +224,11 @@ int compiler(char** argv, int argc) {
     Quads q;
     q.quads_count = 0;
     Arena* a;
+    start = TimeReport_now();
+    arena_start = parser.arena.offset;
     Quad_GenerateQuads(&parser, &q, &parser.arena);
+    TimeReport_add(TIME_PHASE_QUADS, TimeReport_now() - start,
+                   parser.arena.offset - arena_start, q.quads_count);
 
     dump_errors(&parser);
 
@@ -143,11 +239,38 @@ int compiler(char** argv, int argc) {
         String_free(&out);
     }
 
+    OptStats opt_stats;
+    start = TimeReport_now();
+    arena_start = parser.arena.offset;
+    Optimize_quads(&q, &parser.function_table, &opt_stats);
+    TimeReport_add(TIME_PHASE_OPTIMIZE, TimeReport_now() - start,
+                   parser.arena.offset - arena_start, opt_stats.functions);
+
+    if (show_optimized_quads && String_create(&out)) {
+        fmt_quads(&q, &out);
+        fmt_opt_stats(&opt_stats, &out);
+        outputUtf8(out.buffer, out.length);
+        String_free(&out);
+    }
+
+    if (use_cache) {
+        for (uint32_t ix = 0; ix < parser.modules.count; ++ix) {
+            Module* mod = &parser.modules.modules[ix];
+            if (mod->import) {
+                continue;
+            }
+            Object* object = generate_module(&parser, &q, mod, show_asm, fast_regalloc);
+            ModuleCache_store(&cache, keys[ix], object);
+            ObjectSet_add(&objects, object);
+        }
+        goto link;
+    }
+
     Object* object = Generate_code(&q, &parser.function_table,
                                     &parser.externs,
                                     &parser.name_table,
                                     parser.first_str, &parser.arena,
-                                    show_asm);
+                                    show_asm, fast_regalloc);
 
     if (compile_only) {
         const char* outname = outfile.str;
@@ -160,6 +283,9 @@ int compiler(char** argv, int argc) {
 
         if (write_file(outname, b.data, b.size)) {
             LOG_USER_WARNING("Created '%s'", outname);
+            if (time_report) {
+                TimeReport_print(count_lines(&parser.modules));
+            }
             return 0;
         } else {
             LOG_USER_ERROR("Failed creating '%s'", outname);
@@ -167,10 +293,14 @@ int compiler(char** argv, int argc) {
         }
     }
 
-    ObjectSet objects;
-    ObjectSet_create(&objects);
     ObjectSet_add(&objects, object);
 
+link:
+    if (use_cache) {
+        ModuleCache_close(&cache);
+        Mem_free(keys);
+    }
+
     String kernel32Path;
     String_create(&kernel32Path);
 
@@ -209,9 +339,16 @@ int compiler(char** argv, int argc) {
     }
     //linker_args[arg_count++] = "stdlib.obj";
 
+    uint64_t link_start = TimeReport_now();
     Linker_run(&objects, linker_args, arg_count, show_object);
+    TimeReport_add(TIME_PHASE_LINK, TimeReport_now() - link_start, 0,
+                   objects.object_count);
     String_free(&kernel32Path);
 
+    if (time_report) {
+        TimeReport_print(count_lines(&parser.modules));
+    }
+
     return 0;
 }
 
@@ -132,6 +132,16 @@ void fmt_quads(const Quads* quads, String* dest) {
     } 
 }
 
+void fmt_opt_stats(const OptStats* stats, String* dest) {
+    String_format_append(dest, "%llu functions, %llu quads -> %llu\n",
+                         stats->functions, stats->quads_before, stats->quads_after);
+    for (uint32_t ix = 0; ix < OPT_PASS_COUNT; ++ix) {
+        const OptPassStats* s = &stats->passes[ix];
+        String_format_append(dest, "%-24s %4llu runs %6llu changes %6llu removed %8llu us\n",
+                             s->name, s->runs, s->changes, s->removed, s->time_us);
+    }
+}
+
 void fmt_functiondef(const FunctionDef* def, const Parser* parser, String* dest) {
     String_extend(dest, "FunctionDef ");
     fmt_name(def->name, parser, dest);
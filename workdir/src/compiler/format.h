@@ -3,6 +3,7 @@
 
 #include "ast.h"
 #include "quads.h"
+#include "optimizer.h"
 #include "dynamic_string.h"
 
 void fmt_name(name_id name, const Parser* parser, String* dest);
@@ -30,4 +31,6 @@ void fmt_quad(const Quad* quad, String* dest);
 
 void fmt_quads(const Quads* quads, String* dest);
 
+void fmt_opt_stats(const OptStats* stats, String* dest);
+
 #endif
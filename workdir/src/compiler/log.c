@@ -12,8 +12,9 @@ const char* LOG_FORMAT = "{\"name\":\"%s\",\"level\":\"%s\",\"pathname\":\"%s\",
 const char* PRIORITIES[] = {"DEBUG","INFO","WARNING","ERROR","CRITICAL"};
 const char* CATAGORIES[LOG_CATAGORY_MAX] = {
     "User", "Tables", "Tokenizer", "Scanner", "Parser", "Type Checker",
-    "Quads Generator", "Register Allocator", "Assembly Generator",
-    "Assembler", "Object Parser", "Linker", "Object Writer"
+    "Quads Generator", "Optimizer", "Register Allocator",
+    "Assembly Generator", "Assembler", "Object Parser", "Linker", "Object Writer",
+    "Module Cache"
 };
 
 const enum LogLevel MIN_LEVEL[LOG_CATAGORY_MAX] = {
@@ -29,6 +30,8 @@ const enum LogLevel MIN_LEVEL[LOG_CATAGORY_MAX] = {
     LOG_LEVEL_WARNING,
     LOG_LEVEL_WARNING,
     LOG_LEVEL_WARNING,
+    LOG_LEVEL_WARNING,
+    LOG_LEVEL_WARNING,
     LOG_LEVEL_WARNING
 };
 
@@ -110,17 +113,10 @@ void Log_Shutdown() {
     log_socket = INVALID_SOCKET;
 }
 
-void Log_LogStrAtLevel(enum LogCatagory catagory, enum LogLevel level,
-                       const char* file, int32_t line,
-                       const char* str, uint32_t len) {
-    if (level >= MIN_LEVEL[catagory]) {
-        outputUtf8_e(str, len);
-    }
-
-    if (log_socket == INVALID_SOCKET) {
-        return;
-    }
-
+// Write the start of a record to buf, up to the opening quote of msg.
+// Returns the length, or -1 if it does not fit in cap.
+static int format_head(char* buf, uint32_t cap, enum LogLevel level,
+                       const char* file, int32_t line) {
     const char* prio = PRIORITIES[level];
 
     DWORD id = GetCurrentThreadId();
@@ -148,28 +144,18 @@ void Log_LogStrAtLevel(enum LogCatagory catagory, enum LogLevel level,
     filename[name_ix] = '\0';
     modname[mod_ix] = '\0';
 
-    char args_buf[2053];
-    int size = _snprintf_s(args_buf + 4, 2048, _TRUNCATE, LOG_FORMAT, modname, prio, filename, line, id);
-    if (size < 0) {
-        return;
-    }
-
-    if (size + 6 + len > 2052) {
-        len = 2052 - size - 6;
-    }
-
-    memcpy(args_buf + size + 4, str, len);
-
-    size = size + len + 2;
+    return _snprintf_s(buf, cap, _TRUNCATE, LOG_FORMAT, modname, prio,
+                       filename, line, id);
+}
 
+// Send a record of size bytes, starting at buf + 4. The first four
+// bytes are filled with the length.
+static void send_record(char* buf, int size) {
     uint32_t s = size;
-    args_buf[0] = 0;
-    args_buf[1] = 0;
-    args_buf[2] = (s >> 8) & 0xff;
-    args_buf[3] = s & 0xff;
-    args_buf[4 + size - 2] = '"';
-    args_buf[4 + size - 1] = '}';
-    args_buf[4 + size] = '\0';
+    buf[0] = 0;
+    buf[1] = 0;
+    buf[2] = (s >> 8) & 0xff;
+    buf[3] = s & 0xff;
 
     AcquireSRWLockExclusive(&log_lock);
 
@@ -192,11 +178,43 @@ void Log_LogStrAtLevel(enum LogCatagory catagory, enum LogLevel level,
         return;
     }
 
-    res = send(log_socket, args_buf, size + 4, 0);
+    res = send(log_socket, buf, size + 4, 0);
 
     ReleaseSRWLockExclusive(&log_lock);
 }
 
+void Log_LogStrAtLevel(enum LogCatagory catagory, enum LogLevel level,
+                       const char* file, int32_t line,
+                       const char* str, uint32_t len) {
+    if (level >= MIN_LEVEL[catagory]) {
+        outputUtf8_e(str, len);
+    }
+
+    if (log_socket == INVALID_SOCKET) {
+        return;
+    }
+
+    char args_buf[2053];
+    int size = format_head(args_buf + 4, 2048, level, file, line);
+    if (size < 0) {
+        return;
+    }
+
+    if (size + 6 + len > 2052) {
+        len = 2052 - size - 6;
+    }
+
+    memcpy(args_buf + size + 4, str, len);
+
+    size = size + len + 2;
+
+    args_buf[4 + size - 2] = '"';
+    args_buf[4 + size - 1] = '}';
+    args_buf[4 + size] = '\0';
+
+    send_record(args_buf, size);
+}
+
 void Log_LogAtLevel(enum LogCatagory catagory, enum LogLevel level, const char* file, int32_t line, const char* fmt, ...) {
 
     va_list args;
@@ -205,35 +223,7 @@ void Log_LogAtLevel(enum LogCatagory catagory, enum LogLevel level, const char*
     int size = 0;
 
     if (log_socket != INVALID_SOCKET) {
-        const char* prio = PRIORITIES[level];
-
-        DWORD id = GetCurrentThreadId();
-
-        char filename[513];
-        char modname[513];
-        int name_ix = 0, offset = 0, mod_ix = 0;
-        while (file[offset] != '\0' && name_ix < 512) {
-            if (file[offset] == '\\') {
-                filename[name_ix++] = '\\';
-                filename[name_ix++] = '\\';
-                modname[mod_ix++] = '.';
-            } else {
-                filename[name_ix++] = file[offset];
-                if (file[offset] == '/') {
-                    modname[mod_ix++] = '.';
-                } else if (file[offset] == '.') {
-                    modname[mod_ix++] = '_';
-                } else {
-                    modname[mod_ix++] = file[offset];
-                }
-            }
-            ++offset;
-        }
-        filename[name_ix] = '\0';
-        modname[mod_ix] = '\0';
-
-        size = _snprintf_s(args_buf + 4, 2048, _TRUNCATE, LOG_FORMAT, modname, 
-                           prio, filename, line, id);
+        size = format_head(args_buf + 4, 2048, level, file, line);
         if (size < 0) {
             return;
         }
@@ -258,39 +248,33 @@ void Log_LogAtLevel(enum LogCatagory catagory, enum LogLevel level, const char*
         return;
     }
 
-    uint32_t s = size;
-    args_buf[0] = 0;
-    args_buf[1] = 0;
-    args_buf[2] = (s >> 8) & 0xff;
-    args_buf[3] = s & 0xff;
     args_buf[4 + size - 2] = '"';
     args_buf[4 + size - 1] = '}';
     args_buf[4 + size] = '\0';
 
-    AcquireSRWLockExclusive(&log_lock);
+    send_record(args_buf, size);
 
+    va_end(args);
+}
+
+void Log_LogFieldsAtLevel(enum LogCatagory catagory, enum LogLevel level,
+                          const char* file, int32_t line,
+                          const char* msg, const char* fields) {
     if (log_socket == INVALID_SOCKET) {
-        ReleaseSRWLockExclusive(&log_lock);
         return;
     }
 
-    fd_set write;
-    FD_ZERO(&write);
-    FD_SET(log_socket, &write);
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 10000;
-
-    int res = select(log_socket + 1, NULL, &write, NULL, &timeout);
-    if (res != 1) {
-        ReleaseSRWLockExclusive(&log_lock);
+    char args_buf[2053];
+    int size = format_head(args_buf + 4, 2048, level, file, line);
+    if (size < 0) {
+        return;
+    }
+    // A truncated record would not be valid json, so it is dropped
+    int rest = _snprintf_s(args_buf + size + 4, 2048 - size, _TRUNCATE,
+                           "%s\",%s}", msg, fields);
+    if (rest < 0) {
         return;
     }
 
-    res = send(log_socket, args_buf, size + 4, 0);
-
-    ReleaseSRWLockExclusive(&log_lock);
-
-    va_end(args);
+    send_record(args_buf, size + rest);
 }
@@ -29,6 +29,8 @@ enum LogCatagory {
     LOG_CATAGORY_TYPE_CHECKER,
     // Logs from the quads generator
     LOG_CATAGORY_QUADS_GENERATION,
+    // Logs from the quad optimizer
+    LOG_CATAGORY_OPTIMIZER,
     // Logs from the register allocator
     LOG_CATAGORY_REGISTER_ALLOCATION,
     // Logs from the assembly generator
@@ -41,6 +43,8 @@ enum LogCatagory {
     LOG_CATAGORY_LINKER,
     // Logs from the linker object writer
     LOG_CATAGORY_OBJECT_WRITER,
+    // Logs from the module cache
+    LOG_CATAGORY_MODULE_CACHE,
 
     LOG_CATAGORY_MAX
 };
@@ -67,6 +71,8 @@ enum LogCatagory {
 #define LOG_STR_WARNING(str, len)
 #define LOG_STR_ERROR(str, len)
 #define LOG_STR_CRITICAL(str, len)
+
+#define LOG_FIELDS_INFO(msg, fields)
 #else
 void Log_Init(bool log_to_socket);
 void Log_Shutdown();
@@ -77,6 +83,12 @@ void Log_LogStrAtLevel(enum LogCatagory catagory, enum LogLevel level,
                        const char* file, int32_t line,
                        const char* str, uint32_t len);
 
+// Send a record with extra json fields, "\"key\":value,..." added after
+// msg. Neither is escaped. Only sent to the log socket.
+void Log_LogFieldsAtLevel(enum LogCatagory catagory, enum LogLevel level,
+                          const char* file, int32_t line,
+                          const char* msg, const char* fields);
+
 #define LOG_USER_DEBUG(...) Log_LogAtLevel(LOG_CATAGORY_USER, LOG_LEVEL_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
 #define LOG_USER_INFO(...) Log_LogAtLevel(LOG_CATAGORY_USER, LOG_LEVEL_INFO, __FILE__, __LINE__, __VA_ARGS__)
 #define LOG_USER_WARNING(...) Log_LogAtLevel(LOG_CATAGORY_USER, LOG_LEVEL_WARNING, __FILE__, __LINE__, __VA_ARGS__)
@@ -100,6 +112,8 @@ void Log_LogStrAtLevel(enum LogCatagory catagory, enum LogLevel level,
 #define LOG_STR_WARNING(str, len) Log_LogStrAtLevel(LOG_CATAGORY, LOG_LEVEL_WARNING, __FILE__, __LINE__, str, len)
 #define LOG_STR_ERROR(str, len) Log_LogStrAtLevel(LOG_CATAGORY, LOG_LEVEL_ERROR, __FILE__, __LINE__, str, len)
 #define LOG_STR_CRITICAL(str, len) Log_LogStrAtLevel(LOG_CATAGORY, LOG_LEVEL_CRITICAL, __FILE__, __LINE__, str, len)
+
+#define LOG_FIELDS_INFO(msg, fields) Log_LogFieldsAtLevel(LOG_CATAGORY, LOG_LEVEL_INFO, __FILE__, __LINE__, msg, fields)
 #endif
 
 
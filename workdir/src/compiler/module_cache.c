@@ -0,0 +1,182 @@
+#include "module_cache.h"
+#include "linker/pe_coff.h"
+#include "mem.h"
+#include <glob.h>
+
+const static enum LogCatagory LOG_CATAGORY = LOG_CATAGORY_MODULE_CACHE;
+
+// Hash of the running compiler, so objects from another build are never
+// reused even if MODULE_CACHE_VERSION was not bumped
+static bool compiler_hash(uint64_t* hash) {
+    wchar_t path[MAX_PATH];
+    DWORD len = GetModuleFileNameW(NULL, path, MAX_PATH);
+    if (len == 0 || len >= MAX_PATH) {
+        return false;
+    }
+    HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    uint8_t* buf = Mem_alloc(0x10000);
+    if (buf == NULL) {
+        out_of_memory(NULL);
+    }
+    bool success = true;
+    *hash = HASH_SEED;
+    while (1) {
+        DWORD r;
+        if (!ReadFile(file, buf, 0x10000, &r, NULL)) {
+            success = false;
+            break;
+        }
+        if (r == 0) {
+            break;
+        }
+        *hash = hash_bytes(*hash, buf, r);
+    }
+    Mem_free(buf);
+    CloseHandle(file);
+    return success;
+}
+
+bool ModuleCache_open(ModuleCache* cache, const char* dir) {
+    if (!compiler_hash(&cache->build_hash)) {
+        LOG_ERROR("Failed reading compiler executable");
+        return false;
+    }
+    if (!String_create(&cache->dir) || !String_extend(&cache->dir, dir)) {
+        return false;
+    }
+    DWORD attrs = get_file_attrs(dir);
+    if (attrs != INVALID_FILE_ATTRIBUTES) {
+        if (attrs & FILE_ATTRIBUTE_DIRECTORY) {
+            return true;
+        }
+        LOG_ERROR("'%s' is not a directory", dir);
+        String_free(&cache->dir);
+        return false;
+    }
+
+    WString win;
+    if (!WString_create(&win)) {
+        String_free(&cache->dir);
+        return false;
+    }
+    bool created = to_windows_path(dir, &win) && CreateDirectoryW(win.buffer, NULL);
+    WString_free(&win);
+    if (!created) {
+        LOG_ERROR("Failed creating '%s'", dir);
+        String_free(&cache->dir);
+        return false;
+    }
+    LOG_INFO("Created module cache '%s'", dir);
+    return true;
+}
+
+void ModuleCache_close(ModuleCache* cache) {
+    String_free(&cache->dir);
+}
+
+static uint64_t hash_u64(uint64_t hash, uint64_t val) {
+    return hash_bytes(hash, (const uint8_t*)&val, sizeof(val));
+}
+
+uint64_t ModuleCache_key(ModuleCache* cache, ModuleList* modules, uint32_t ix,
+                         uint64_t options) {
+    uint64_t key = hash_u64(HASH_SEED, MODULE_CACHE_VERSION);
+    key = hash_u64(key, cache->build_hash);
+    key = hash_u64(key, options);
+    key = hash_u64(key, modules->modules[ix].content_hash);
+    for (uint32_t i = 0; i < modules->count; ++i) {
+        if (i == ix) {
+            continue;
+        }
+        key = hash_u64(key, modules->modules[i].signature_hash);
+    }
+    return key;
+}
+
+static bool cache_path(ModuleCache* cache, uint64_t key, String* path) {
+    if (!String_copy(path, &cache->dir)) {
+        return false;
+    }
+    if (!String_format_append(path, "/%016llx.obj", key)) {
+        String_free(path);
+        return false;
+    }
+    return true;
+}
+
+Object* ModuleCache_load(ModuleCache* cache, uint64_t key) {
+    String path;
+    if (!cache_path(cache, key, &path)) {
+        return NULL;
+    }
+    if (!is_file(path.buffer)) {
+        String_free(&path);
+        return NULL;
+    }
+
+    String data;
+    if (!read_text_file(&data, path.buffer)) {
+        LOG_WARNING("Failed reading '%s'", path.buffer);
+        String_free(&path);
+        return NULL;
+    }
+    Object* object = PeObject_read((const uint8_t*)data.buffer, data.length);
+    if (object == NULL) {
+        // Treated as a miss, the object is replaced once the module
+        // has been compiled again
+        LOG_WARNING("Ignoring invalid object '%s'", path.buffer);
+    } else {
+        LOG_DEBUG("Loaded '%s'", path.buffer);
+    }
+    String_free(&data);
+    String_free(&path);
+    return object;
+}
+
+bool ModuleCache_store(ModuleCache* cache, uint64_t key, Object* object) {
+    String path;
+    if (!cache_path(cache, key, &path)) {
+        return false;
+    }
+    ByteBuffer b;
+    Buffer_create(&b);
+    PeObject_write(object, &b);
+
+    // Written next to the entry and moved over it, so a concurrent load or
+    // a crash mid-write never sees a partial object
+    String tmp;
+    if (!String_copy(&tmp, &path)) {
+        Buffer_free(&b);
+        String_free(&path);
+        return false;
+    }
+    WString from, to;
+    bool success = false;
+    if (WString_create(&from)) {
+        if (WString_create(&to)) {
+            success = String_format_append(&tmp, ".%lu.tmp", GetCurrentProcessId()) &&
+                      write_file(tmp.buffer, b.data, b.size) &&
+                      to_windows_path(tmp.buffer, &from) &&
+                      to_windows_path(path.buffer, &to) &&
+                      MoveFileExW(from.buffer, to.buffer, MOVEFILE_REPLACE_EXISTING);
+            if (!success && from.length > 0) {
+                DeleteFileW(from.buffer);
+            }
+            WString_free(&to);
+        }
+        WString_free(&from);
+    }
+    if (!success) {
+        LOG_WARNING("Failed writing '%s'", path.buffer);
+    } else {
+        LOG_DEBUG("Stored '%s'", path.buffer);
+    }
+    Buffer_free(&b);
+    String_free(&tmp);
+    String_free(&path);
+    return success;
+}
@@ -0,0 +1,35 @@
+#ifndef COMPILER_MODULE_CACHE_H_00
+#define COMPILER_MODULE_CACHE_H_00
+
+#include "tables.h"
+#include "linker/linker.h"
+
+// Bump when the generated code changes for the same input
+#define MODULE_CACHE_VERSION 1
+
+// Directory of objects, one for each compiled module, named by the
+// key of the module
+typedef struct ModuleCache {
+    String dir;
+    // Hash of the compiler executable, part of every key
+    uint64_t build_hash;
+} ModuleCache;
+
+// Open the cache in dir, creating the directory if it does not exist
+bool ModuleCache_open(ModuleCache* cache, const char* dir);
+
+void ModuleCache_close(ModuleCache* cache);
+
+// Key of the object for module ix. All modules share one name table, so
+// besides the content of the module itself this covers the signatures of
+// every other module. options are the flags that affect code generation.
+// Objects from a different build of the compiler never match.
+uint64_t ModuleCache_key(ModuleCache* cache, ModuleList* modules, uint32_t ix,
+                         uint64_t options);
+
+// Returns NULL if there is no usable object for key
+Object* ModuleCache_load(ModuleCache* cache, uint64_t key);
+
+bool ModuleCache_store(ModuleCache* cache, uint64_t key, Object* object);
+
+#endif
@@ -0,0 +1,665 @@
+#include "optimizer.h"
+#include "ast.h"
+#include "mem.h"
+
+const static enum LogCatagory LOG_CATAGORY = LOG_CATAGORY_OPTIMIZER;
+
+// Upper limit of pipeline runs per function
+#define OPT_MAX_ROUNDS 4
+// Upper limit of copies and expressions remembered within a block
+#define OPT_WINDOW 64
+
+typedef struct OptExpr {
+    enum QuadType type;
+    enum QuadScale scale;
+    var_id op1;
+    var_id op2;
+    var_id dest;
+} OptExpr;
+
+typedef struct OptContext {
+    Quads* quads;
+    VarList* vars;
+    // Label starting the function, and last quad of it. Neither is removed.
+    Quad* start;
+    Quad* end;
+
+    // Variables the passes reason about
+    VarSet tracked;
+
+    // Incremented for each block, per variable facts are only valid while
+    // their stamp matches
+    uint64_t block;
+    uint64_t* const_stamp;
+    uint64_t* const_value;
+    uint64_t* copy_stamp;
+    var_id* copy_of;
+
+    // Variables with a copy_of in the current block
+    var_id copies[OPT_WINDOW];
+    uint32_t copy_count;
+    // Expressions available in the current block
+    OptExpr exprs[OPT_WINDOW];
+    uint32_t expr_count;
+
+    uint32_t* reads;
+} OptContext;
+
+typedef uint64_t (*OptPassFn)(OptContext* ctx);
+
+static bool is_tracked(OptContext* ctx, var_id v) {
+    return v != VAR_ID_INVALID && VarSet_contains(&ctx->tracked, v);
+}
+
+static bool is_integer(const VarData* var) {
+    return var->datatype == VARTYPE_UINT || var->datatype == VARTYPE_SINT ||
+           var->datatype == VARTYPE_BOOL;
+}
+
+static bool same_type(const VarData* a, const VarData* b) {
+    return a->datatype == b->datatype && a->byte_size == b->byte_size;
+}
+
+static bool ends_block(enum QuadType type) {
+    return type == QUAD_JMP || type == QUAD_JMP_TRUE || type == QUAD_JMP_FALSE ||
+           type == QUAD_RETURN;
+}
+
+// True if the first operand of q is the variable in op1, false if it is
+// a label, constant or op2
+static bool op1_is_var(const Quad* q) {
+    var_id def, use1, use2;
+    Quad_operands(q, &def, &use1, &use2);
+    return use1 != VAR_ID_INVALID && q->type != QUAD_JMP_TRUE &&
+           q->type != QUAD_JMP_FALSE && q->type != QUAD_PUT_ARG &&
+           q->type != QUAD_STRUCT_ADDR;
+}
+
+// Quads without effects other than writing dest
+static bool is_pure(enum QuadType type) {
+    switch (type) {
+    case QUAD_JMP:
+    case QUAD_JMP_FALSE:
+    case QUAD_JMP_TRUE:
+    case QUAD_LABEL:
+    case QUAD_PUT_ARG:
+    case QUAD_CALL:
+    case QUAD_CALL_PTR:
+    case QUAD_RETURN:
+    case QUAD_GET_RET:
+    case QUAD_GET_ARG:
+    case QUAD_SET_ADDR:
+        return false;
+    default:
+        return true;
+    }
+}
+
+static bool is_symmetric(enum QuadType type) {
+    return type == QUAD_ADD || type == QUAD_MUL || type == QUAD_BIT_AND ||
+           type == QUAD_BIT_OR || type == QUAD_BIT_XOR || type == QUAD_BOOL_AND ||
+           type == QUAD_BOOL_OR || type == QUAD_CMP_EQ || type == QUAD_CMP_NEQ ||
+           type == QUAD_FADD || type == QUAD_FMUL;
+}
+
+static void remove_quad(OptContext* ctx, Quad* q) {
+    assert(q != ctx->start && q != ctx->end);
+    q->last_quad->next_quad = q->next_quad;
+    q->next_quad->last_quad = q->last_quad;
+    --ctx->quads->quads_count;
+}
+
+static void begin_block(OptContext* ctx) {
+    ++ctx->block;
+    ctx->copy_count = 0;
+    ctx->expr_count = 0;
+}
+
+// Forget everything known about v, which is written
+static void kill_var(OptContext* ctx, var_id v) {
+    ctx->const_stamp[v] = 0;
+    ctx->copy_stamp[v] = 0;
+    uint32_t count = 0;
+    for (uint32_t ix = 0; ix < ctx->copy_count; ++ix) {
+        var_id c = ctx->copies[ix];
+        if (ctx->copy_stamp[c] != ctx->block) {
+            continue;
+        }
+        if (ctx->copy_of[c] == v) {
+            ctx->copy_stamp[c] = 0;
+            continue;
+        }
+        ctx->copies[count++] = c;
+    }
+    ctx->copy_count = count;
+
+    count = 0;
+    for (uint32_t ix = 0; ix < ctx->expr_count; ++ix) {
+        OptExpr* e = &ctx->exprs[ix];
+        if (e->op1 != v && e->op2 != v && e->dest != v) {
+            ctx->exprs[count++] = *e;
+        }
+    }
+    ctx->expr_count = count;
+}
+
+// Value of bits as a variable of type var, truncated and sign extended
+static uint64_t normalize(const VarData* var, uint64_t bits) {
+    if (var->datatype == VARTYPE_BOOL) {
+        return bits != 0;
+    }
+    if (var->byte_size >= 8) {
+        return bits;
+    }
+    uint32_t width = var->byte_size * 8;
+    uint64_t mask = (1ull << width) - 1;
+    bits &= mask;
+    if (var->datatype == VARTYPE_SINT && ((bits >> (width - 1)) & 1)) {
+        bits |= ~mask;
+    }
+    return bits;
+}
+
+static bool get_const(OptContext* ctx, var_id v, uint64_t* value) {
+    if (!is_tracked(ctx, v) || ctx->const_stamp[v] != ctx->block) {
+        return false;
+    }
+    *value = ctx->const_value[v];
+    return true;
+}
+
+// Compute the value written by q if all its operands are known. Only
+// integer operations are folded, and never ones that would trap.
+static bool fold_quad(OptContext* ctx, const Quad* q, uint64_t* res) {
+    VarData* vars = ctx->vars->data;
+    var_id def, use1, use2;
+    Quad_operands(q, &def, &use1, &use2);
+    if (!is_tracked(ctx, def) || !is_integer(&vars[def]) || use1 == VAR_ID_INVALID) {
+        return false;
+    }
+    if (!op1_is_var(q) || q->scale != QUADSCALE_NONE) {
+        return false;
+    }
+    uint64_t a, b = 0;
+    if (!get_const(ctx, use1, &a)) {
+        return false;
+    }
+    if (use2 != VAR_ID_INVALID && !get_const(ctx, use2, &b)) {
+        return false;
+    }
+    const VarData* dest = &vars[def];
+    const VarData* op1 = &vars[use1];
+    bool sint = op1->datatype == VARTYPE_SINT;
+
+    switch (q->type) {
+    case QUAD_ADD:
+    case QUAD_SUB:
+    case QUAD_MUL:
+    case QUAD_DIV:
+    case QUAD_MOD:
+    case QUAD_BIT_AND:
+    case QUAD_BIT_OR:
+    case QUAD_BIT_XOR:
+        if (!same_type(op1, dest) || !same_type(&vars[use2], dest) ||
+            dest->datatype == VARTYPE_BOOL) {
+            return false;
+        }
+        break;
+    case QUAD_LSHIFT:
+    case QUAD_RSHIFT:
+        if (!same_type(op1, dest) || dest->datatype == VARTYPE_BOOL ||
+            b >= dest->byte_size * 8) {
+            return false;
+        }
+        break;
+    case QUAD_CMP_EQ:
+    case QUAD_CMP_NEQ:
+    case QUAD_CMP_G:
+    case QUAD_CMP_L:
+    case QUAD_CMP_GE:
+    case QUAD_CMP_LE:
+        if (!is_integer(op1) || !same_type(op1, &vars[use2])) {
+            return false;
+        }
+        break;
+    case QUAD_NEGATE:
+    case QUAD_BIT_NOT:
+    case QUAD_MOVE:
+        if (!same_type(op1, dest)) {
+            return false;
+        }
+        break;
+    case QUAD_BOOL_NOT:
+    case QUAD_BOOL_AND:
+    case QUAD_BOOL_OR:
+    case QUAD_CAST_TO_INT64:
+    case QUAD_CAST_TO_INT32:
+    case QUAD_CAST_TO_INT16:
+    case QUAD_CAST_TO_INT8:
+    case QUAD_CAST_TO_UINT64:
+    case QUAD_CAST_TO_UINT32:
+    case QUAD_CAST_TO_UINT16:
+    case QUAD_CAST_TO_UINT8:
+        if (!is_integer(op1)) {
+            return false;
+        }
+        break;
+    default:
+        return false;
+    }
+
+    uint64_t v;
+    switch (q->type) {
+    case QUAD_ADD:
+        v = a + b;
+        break;
+    case QUAD_SUB:
+        v = a - b;
+        break;
+    case QUAD_MUL:
+        v = a * b;
+        break;
+    case QUAD_DIV:
+    case QUAD_MOD:
+        if (b == 0 || (sint && b == (uint64_t)-1)) {
+            return false;
+        }
+        if (sint) {
+            v = q->type == QUAD_DIV ? (uint64_t)((int64_t)a / (int64_t)b) :
+                                      (uint64_t)((int64_t)a % (int64_t)b);
+        } else {
+            v = q->type == QUAD_DIV ? a / b : a % b;
+        }
+        break;
+    case QUAD_BIT_AND:
+        v = a & b;
+        break;
+    case QUAD_BIT_OR:
+        v = a | b;
+        break;
+    case QUAD_BIT_XOR:
+        v = a ^ b;
+        break;
+    case QUAD_LSHIFT:
+        v = a << b;
+        break;
+    case QUAD_RSHIFT:
+        v = sint ? (uint64_t)((int64_t)a >> b) : a >> b;
+        break;
+    case QUAD_CMP_EQ:
+        v = a == b;
+        break;
+    case QUAD_CMP_NEQ:
+        v = a != b;
+        break;
+    case QUAD_CMP_G:
+        v = sint ? (int64_t)a > (int64_t)b : a > b;
+        break;
+    case QUAD_CMP_L:
+        v = sint ? (int64_t)a < (int64_t)b : a < b;
+        break;
+    case QUAD_CMP_GE:
+        v = sint ? (int64_t)a >= (int64_t)b : a >= b;
+        break;
+    case QUAD_CMP_LE:
+        v = sint ? (int64_t)a <= (int64_t)b : a <= b;
+        break;
+    case QUAD_NEGATE:
+        v = -a;
+        break;
+    case QUAD_BIT_NOT:
+        v = ~a;
+        break;
+    case QUAD_BOOL_NOT:
+        v = a == 0;
+        break;
+    case QUAD_BOOL_AND:
+        v = a != 0 && b != 0;
+        break;
+    case QUAD_BOOL_OR:
+        v = a != 0 || b != 0;
+        break;
+    default:
+        // Moves and casts, a is already extended according to op1
+        v = a;
+        break;
+    }
+    *res = normalize(dest, v);
+    return true;
+}
+
+// Replace arithmetic on known constants by QUAD_CREATE
+static uint64_t pass_fold(OptContext* ctx) {
+    VarData* vars = ctx->vars->data;
+    uint64_t changes = 0;
+    begin_block(ctx);
+    for (Quad* q = ctx->start;; q = q->next_quad) {
+        if (q->type == QUAD_LABEL) {
+            begin_block(ctx);
+        }
+        uint64_t value;
+        if (fold_quad(ctx, q, &value)) {
+            LOG_DEBUG("Folded quad into <%llu> = %llu", q->dest, value);
+            q->type = QUAD_CREATE;
+            q->scale = QUADSCALE_NONE;
+            q->op1.uint64 = value;
+            q->op2 = VAR_ID_INVALID;
+            ++changes;
+        }
+        var_id def, use1, use2;
+        Quad_operands(q, &def, &use1, &use2);
+        if (def != VAR_ID_INVALID) {
+            kill_var(ctx, def);
+            if (q->type == QUAD_CREATE && is_tracked(ctx, def) &&
+                is_integer(&vars[def])) {
+                ctx->const_stamp[def] = ctx->block;
+                ctx->const_value[def] = normalize(&vars[def], q->op1.uint64);
+            }
+        }
+        if (ends_block(q->type)) {
+            begin_block(ctx);
+        }
+        if (q == ctx->end) {
+            break;
+        }
+    }
+    return changes;
+}
+
+static var_id copy_source(OptContext* ctx, var_id v) {
+    if (is_tracked(ctx, v) && ctx->copy_stamp[v] == ctx->block) {
+        return ctx->copy_of[v];
+    }
+    return v;
+}
+
+// Read the source of QUAD_MOVE quads instead of their destination, for
+// as long as neither is written again in the block
+static uint64_t pass_copy(OptContext* ctx) {
+    VarData* vars = ctx->vars->data;
+    uint64_t changes = 0;
+    begin_block(ctx);
+    Quad* q = ctx->start;
+    while (1) {
+        if (q->type == QUAD_LABEL) {
+            begin_block(ctx);
+        }
+        var_id def, use1, use2;
+        Quad_operands(q, &def, &use1, &use2);
+        // The address of a variable is not the address of its copy
+        if (q->type != QUAD_ADDROF) {
+            if (op1_is_var(q)) {
+                var_id src = copy_source(ctx, q->op1.var);
+                if (src != q->op1.var) {
+                    q->op1.var = src;
+                    ++changes;
+                }
+                if (use2 != VAR_ID_INVALID) {
+                    src = copy_source(ctx, q->op2);
+                    if (src != q->op2) {
+                        q->op2 = src;
+                        ++changes;
+                    }
+                }
+            } else if (use1 != VAR_ID_INVALID) {
+                var_id src = copy_source(ctx, q->op2);
+                if (src != q->op2) {
+                    q->op2 = src;
+                    ++changes;
+                }
+            }
+        }
+        Quad* next = q->next_quad;
+        if (q->type == QUAD_MOVE && q->op1.var == q->dest && is_tracked(ctx, q->dest) &&
+            q != ctx->end) {
+            remove_quad(ctx, q);
+            ++changes;
+            q = next;
+            continue;
+        }
+        if (def != VAR_ID_INVALID) {
+            kill_var(ctx, def);
+            var_id src = q->op1.var;
+            if (q->type == QUAD_MOVE && is_tracked(ctx, def) && is_tracked(ctx, src) &&
+                same_type(&vars[def], &vars[src])) {
+                if (ctx->copy_count == OPT_WINDOW) {
+                    ctx->copy_stamp[ctx->copies[0]] = 0;
+                    memmove(ctx->copies, ctx->copies + 1,
+                            (OPT_WINDOW - 1) * sizeof(var_id));
+                    --ctx->copy_count;
+                }
+                ctx->copy_of[def] = src;
+                ctx->copy_stamp[def] = ctx->block;
+                ctx->copies[ctx->copy_count++] = def;
+            }
+        }
+        if (ends_block(q->type)) {
+            begin_block(ctx);
+        }
+        if (q == ctx->end) {
+            break;
+        }
+        q = next;
+    }
+    return changes;
+}
+
+static bool can_share(enum QuadType type) {
+    switch (type) {
+    case QUAD_MOVE:
+    case QUAD_CREATE:
+    case QUAD_FCREATE:
+    case QUAD_DEREF:
+    case QUAD_GET_ARRAY_ADDR:
+    case QUAD_CALC_ARRAY_ADDR:
+    case QUAD_STRUCT_ADDR:
+    case QUAD_ADDROF:
+        return false;
+    default:
+        return is_pure(type);
+    }
+}
+
+// Replace a computation done before in the same block by a move from its
+// earlier result
+static uint64_t pass_cse(OptContext* ctx) {
+    VarData* vars = ctx->vars->data;
+    uint64_t changes = 0;
+    begin_block(ctx);
+    for (Quad* q = ctx->start;; q = q->next_quad) {
+        if (q->type == QUAD_LABEL) {
+            begin_block(ctx);
+        }
+        var_id def, use1, use2;
+        Quad_operands(q, &def, &use1, &use2);
+        bool candidate = can_share(q->type) && is_tracked(ctx, def) &&
+                         is_tracked(ctx, use1) &&
+                         (use2 == VAR_ID_INVALID || is_tracked(ctx, use2)) &&
+                         def != use1 && def != use2;
+        if (candidate) {
+            for (uint32_t ix = 0; ix < ctx->expr_count; ++ix) {
+                OptExpr* e = &ctx->exprs[ix];
+                if (e->type != q->type || e->scale != q->scale ||
+                    !same_type(&vars[e->dest], &vars[def])) {
+                    continue;
+                }
+                if ((e->op1 == use1 && e->op2 == use2) ||
+                    (is_symmetric(q->type) && e->op1 == use2 && e->op2 == use1)) {
+                    LOG_DEBUG("Reusing <%llu> for <%llu>", e->dest, def);
+                    q->type = QUAD_MOVE;
+                    q->scale = QUADSCALE_NONE;
+                    q->op1.var = e->dest;
+                    q->op2 = VAR_ID_INVALID;
+                    candidate = false;
+                    ++changes;
+                    break;
+                }
+            }
+        }
+        if (def != VAR_ID_INVALID) {
+            kill_var(ctx, def);
+        }
+        if (candidate) {
+            if (ctx->expr_count == OPT_WINDOW) {
+                memmove(ctx->exprs, ctx->exprs + 1, (OPT_WINDOW - 1) * sizeof(OptExpr));
+                --ctx->expr_count;
+            }
+            OptExpr e = {q->type, q->scale, use1, use2, def};
+            ctx->exprs[ctx->expr_count++] = e;
+        }
+        if (ends_block(q->type)) {
+            begin_block(ctx);
+        }
+        if (q == ctx->end) {
+            break;
+        }
+    }
+    return changes;
+}
+
+// Remove pure quads writing variables that are never read
+static uint64_t pass_dce(OptContext* ctx) {
+    memset(ctx->reads, 0, ctx->vars->size * sizeof(uint32_t));
+    for (Quad* q = ctx->start;; q = q->next_quad) {
+        var_id def, use1, use2;
+        Quad_operands(q, &def, &use1, &use2);
+        if (use1 != VAR_ID_INVALID) {
+            ++ctx->reads[use1];
+        }
+        if (use2 != VAR_ID_INVALID) {
+            ++ctx->reads[use2];
+        }
+        if (q == ctx->end) {
+            break;
+        }
+    }
+
+    uint64_t changes = 0;
+    bool removed = true;
+    while (removed) {
+        removed = false;
+        // Walking backwards removes chains of dead quads in one sweep
+        Quad* q = ctx->end->last_quad;
+        while (q != ctx->start) {
+            Quad* last = q->last_quad;
+            var_id def, use1, use2;
+            Quad_operands(q, &def, &use1, &use2);
+            if (is_pure(q->type) && is_tracked(ctx, def) && ctx->reads[def] == 0) {
+                if (use1 != VAR_ID_INVALID) {
+                    --ctx->reads[use1];
+                }
+                if (use2 != VAR_ID_INVALID) {
+                    --ctx->reads[use2];
+                }
+                remove_quad(ctx, q);
+                removed = true;
+                ++changes;
+            }
+            q = last;
+        }
+    }
+    return changes;
+}
+
+static const struct {
+    const char* name;
+    OptPassFn fn;
+} PASSES[OPT_PASS_COUNT] = {
+    {"constant folding", pass_fold},
+    {"copy propagation", pass_copy},
+    {"local cse", pass_cse},
+    {"dead code elimination", pass_dce},
+};
+
+static void optimize_function(OptContext* ctx, OptStats* stats, uint64_t* ticks) {
+    VarList* vars = ctx->vars;
+    ctx->tracked = VarSet_create(vars->size);
+    for (var_id v = 0; v < vars->size; ++v) {
+        enum VarDatatype type = vars->data[v].datatype;
+        if (var_local(vars->data[v].kind) && type != VARTYPE_ARRAY &&
+            type != VARTYPE_STRUCT && type != VARTYPE_FUNCTION) {
+            VarSet_set(&ctx->tracked, v);
+        }
+    }
+    for (Quad* q = ctx->start;; q = q->next_quad) {
+        if (q->type == QUAD_ADDROF) {
+            // May be read and written through the pointer
+            VarSet_clear(&ctx->tracked, q->op1.var);
+        }
+        if (q == ctx->end) {
+            break;
+        }
+    }
+
+    uint64_t size = vars->size == 0 ? 1 : vars->size;
+    ctx->const_stamp = Mem_alloc(size * sizeof(uint64_t));
+    ctx->const_value = Mem_alloc(size * sizeof(uint64_t));
+    ctx->copy_stamp = Mem_alloc(size * sizeof(uint64_t));
+    ctx->copy_of = Mem_alloc(size * sizeof(var_id));
+    ctx->reads = Mem_alloc(size * sizeof(uint32_t));
+    if (ctx->const_stamp == NULL || ctx->const_value == NULL ||
+        ctx->copy_stamp == NULL || ctx->copy_of == NULL || ctx->reads == NULL) {
+        out_of_memory(NULL);
+    }
+    memset(ctx->const_stamp, 0, size * sizeof(uint64_t));
+    memset(ctx->copy_stamp, 0, size * sizeof(uint64_t));
+    ctx->block = 0;
+
+    for (uint32_t round = 0; round < OPT_MAX_ROUNDS; ++round) {
+        uint64_t changes = 0;
+        for (uint32_t ix = 0; ix < OPT_PASS_COUNT; ++ix) {
+            LARGE_INTEGER t0, t1;
+            uint64_t count = ctx->quads->quads_count;
+            QueryPerformanceCounter(&t0);
+            uint64_t c = PASSES[ix].fn(ctx);
+            QueryPerformanceCounter(&t1);
+            OptPassStats* s = &stats->passes[ix];
+            ++s->runs;
+            s->changes += c;
+            s->removed += count - ctx->quads->quads_count;
+            ticks[ix] += t1.QuadPart - t0.QuadPart;
+            changes += c;
+        }
+        if (changes == 0) {
+            break;
+        }
+    }
+
+    VarSet_free(&ctx->tracked);
+    Mem_free(ctx->const_stamp);
+    Mem_free(ctx->const_value);
+    Mem_free(ctx->copy_stamp);
+    Mem_free(ctx->copy_of);
+    Mem_free(ctx->reads);
+}
+
+void Optimize_quads(Quads* quads, FunctionTable* functions, OptStats* stats) {
+    memset(stats, 0, sizeof(OptStats));
+    for (uint32_t ix = 0; ix < OPT_PASS_COUNT; ++ix) {
+        stats->passes[ix].name = PASSES[ix].name;
+    }
+    stats->quads_before = quads->quads_count;
+
+    uint64_t ticks[OPT_PASS_COUNT] = {0};
+    for (uint64_t ix = 0; ix < functions->size; ++ix) {
+        FunctionDef* def = functions->data[ix];
+        if (def->undefined || def->quad_start == def->quad_end) {
+            continue;
+        }
+        OptContext ctx;
+        ctx.quads = quads;
+        ctx.vars = &def->vars;
+        ctx.start = def->quad_start;
+        ctx.end = def->quad_end;
+        optimize_function(&ctx, stats, ticks);
+        ++stats->functions;
+    }
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    for (uint32_t ix = 0; ix < OPT_PASS_COUNT; ++ix) {
+        stats->passes[ix].time_us = ticks[ix] * 1000000 / freq.QuadPart;
+    }
+    stats->quads_after = quads->quads_count;
+    LOG_INFO("Optimized %llu functions: %llu quads -> %llu", stats->functions,
+             stats->quads_before, stats->quads_after);
+}
@@ -0,0 +1,36 @@
+#ifndef COMPILER_OPTIMIZER_H_00
+#define COMPILER_OPTIMIZER_H_00
+
+#include "quads.h"
+
+enum OptPass {
+    OPT_PASS_FOLD, // Constant folding
+    OPT_PASS_COPY, // Copy propagation
+    OPT_PASS_CSE, // Local common subexpression elimination
+    OPT_PASS_DCE, // Dead code elimination
+    OPT_PASS_COUNT
+};
+
+typedef struct OptPassStats {
+    const char* name;
+    uint64_t runs;
+    // Quads rewritten or removed
+    uint64_t changes;
+    // Quads removed
+    uint64_t removed;
+    uint64_t time_us;
+} OptPassStats;
+
+typedef struct OptStats {
+    uint64_t quads_before;
+    uint64_t quads_after;
+    uint64_t functions;
+    OptPassStats passes[OPT_PASS_COUNT];
+} OptStats;
+
+// Run all passes over the quads of each defined function, until none of
+// them changes anything. Passes only reason about local variables whose
+// address is never taken, anything else is left as it is.
+void Optimize_quads(Quads* quads, FunctionTable* functions, OptStats* stats);
+
+#endif
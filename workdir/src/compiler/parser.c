@@ -1,6 +1,7 @@
 #include "language/parse.h"
 #include "tokenizer.h"
 #include "glob.h"
+#include "time_report.h"
 
 const LineInfo LINE_INFO_NONE = {"", -1, -1};
 
@@ -68,6 +69,9 @@ bool add_module(Parser* parser, const char* filename, bool is_import) {
     list->modules[list->count].content.buffer = NULL;
     list->modules[list->count].content.capacity = 0;
     list->modules[list->count].content.length = 0;
+    list->modules[list->count].content.allocator = NULL;
+    list->modules[list->count].content_hash = 0;
+    list->modules[list->count].signature_hash = 0;
     ++list->count;
 
     LOG_INFO("Module: %s", parser->modules.modules[parser->modules.count - 1].filename);
@@ -123,9 +127,7 @@ void Parser_create(Parser* parser) {
     parser->name_table.size = 0;
     parser->name_table.data = name_data;
 
-    for (uint64_t ix = 0; ix < NAME_TABLE_HASH_ENTRIES; ++ix) {
-        parser->name_table.hash_map[ix] = NAME_ID_INVALID;
-    }
+    intern_table_create(&parser->name_table.interns);
 
     parser->name_table.scope_stack = Mem_alloc(8 * sizeof(name_id));
     if (parser->name_table.scope_stack == NULL) {
@@ -196,13 +198,41 @@ void Parser_create(Parser* parser) {
     parser->name_table.scope_stack[0] = parser->name_table.size - 1;
 }
 
+#define PARSER_MAX_WORKERS 64
+
 #define PARSER(ctx) (((struct Tokenizer*)ctx)->parser)
 
+// What parsing one module added to its copy of the tables, before it is
+// merged into the parser. Ids from index base on are local to the module.
+typedef struct ParseResult {
+    uint64_t name_base;
+    NameData* names;
+    uint64_t name_count;
+    uint32_t intern_base;
+    InternData* interns;
+    uint32_t intern_count;
+    uint64_t type_base;
+    TypeData* types;
+    uint64_t type_count;
+    FunctionDef** functions;
+    uint64_t function_count;
+    FunctionDef** externs;
+    uint64_t extern_count;
+    // Structs defined by the module, whose fields use local ids
+    TypeDef** structs;
+    uint64_t struct_count;
+    uint64_t struct_cap;
+    StringLiteral* first_str;
+    StringLiteral* last_str;
+    Error* first_error;
+} ParseResult;
+
 struct Tokenizer {
     Parser* parser;
     Token last_token;
     uint64_t start;
     uint64_t end;
+    ParseResult* result;
 };
 
 static inline Statement* create_stmt(Parser* p, enum StatementKind kind, uint64_t start,
@@ -548,14 +578,25 @@ type_id handle_struct(Parser* p, uint64_t start, uint64_t end,
     return type;
 }
 
+static void record_struct(struct Tokenizer* t, type_id type) {
+    ParseResult* r = t->result;
+    RESERVE(r->structs, r->struct_count + 1, r->struct_cap);
+    r->structs[r->struct_count] = t->parser->type_table.data[type].type_def;
+    ++r->struct_count;
+}
+
 type_id OnUnion(void *ctx, uint64_t start, uint64_t end,
                 type_id type, FieldList * fields) {
-    return handle_struct(PARSER(ctx), start, end, type, fields);
+    type = handle_struct(PARSER(ctx), start, end, type, fields);
+    record_struct(ctx, type);
+    return type;
 }
 
 type_id OnStruct(void* ctx, uint64_t start, uint64_t end,
                  type_id type, FieldList* fields) {
-    return handle_struct(PARSER(ctx), start, end, type, fields);
+    type = handle_struct(PARSER(ctx), start, end, type, fields);
+    record_struct(ctx, type);
+    return type;
 }
 
 
@@ -569,6 +610,7 @@ FieldList* OnField(void* ctx, uint64_t start, uint64_t end, FieldList* fields,
     FieldList* f = Arena_alloc_type(&p->arena, FieldList);
     f->field.type = type;
     f->field.name = ident;
+    f->field.intern = intern_insert(&p->name_table.interns, ident, &p->arena);
     f->field.line = (LineInfo){p->filename, start, end};
     f->field.offset = 0;
     f->next = fields;
@@ -707,10 +749,10 @@ Expression* OnMemberRef(void* ctx, uint64_t start, uint64_t end,
     Expression* e = create_expr(p, EXPRESSION_ACCESS_MEMBER, start, end);
     e->member_access.structexpr = structvar;
     e->member_access.member_offset = 0;
-    uint8_t* member = Arena_alloc_count(&p->arena, uint8_t, ident.len);
-    memcpy(member, ident.str, ident.len);
-    e->member_access.member.str = member;
+    intern_id member = intern_insert(&p->name_table.interns, ident, &p->arena);
+    e->member_access.member.str = p->name_table.interns.data[member].str;
     e->member_access.member.len = ident.len;
+    e->member_access.member_intern = member;
     e->member_access.get_addr = false;
     e->member_access.via_ptr = false;
     return e;
@@ -904,16 +946,369 @@ void consume_token(void* ctx, uint64_t* start, uint64_t* end) {
     t->end = p->pos;
 }
 
-void parse_program(Parser* parser, String *indata, const char* filename, bool is_import) {
-    parser_set_input(parser, indata, filename, is_import);
+static void* copy_tail(const void* src, uint64_t count, size_t elem_size) {
+    void* dest = Mem_alloc(count * elem_size);
+    if (dest == NULL) {
+        out_of_memory(NULL);
+    }
+    memcpy(dest, src, count * elem_size);
+    return dest;
+}
+
+// Parse the function bodies of one module into local, starting from a copy
+// of the tables of parser
+static void parse_module(Parser* local, Parser* parser, Module* mod,
+                         ParseResult* result) {
+    name_table_copy(&local->name_table, &parser->name_table);
+    type_table_copy(&local->type_table, &parser->type_table);
+    local->function_table.size = 0;
+    local->externs.size = 0;
+    local->first_str = NULL;
+    local->last_str = NULL;
+    local->first_error = NULL;
+    local->last_error = NULL;
+    parser_set_input(local, &mod->content, mod->filename, mod->import);
+
     struct Tokenizer t;
-    t.parser = parser;
+    t.parser = local;
     t.start = 0;
     t.end = 0;
+    t.result = result;
     uint64_t start, end;
     consume_token(&t, &start, &end);
 
     parse(&t);
+
+    // The tables are reused for the next module, so keep what was added
+    NameTable* names = &local->name_table;
+    result->name_base = parser->name_table.size;
+    result->name_count = names->size - result->name_base;
+    result->names = copy_tail(names->data + result->name_base, result->name_count,
+                              sizeof(NameData));
+    result->intern_base = parser->name_table.interns.size;
+    result->intern_count = names->interns.size - result->intern_base;
+    result->interns = copy_tail(names->interns.data + result->intern_base,
+                                result->intern_count, sizeof(InternData));
+    result->type_base = parser->type_table.size;
+    result->type_count = local->type_table.size - result->type_base;
+    result->types = copy_tail(local->type_table.data + result->type_base,
+                              result->type_count, sizeof(TypeData));
+    result->function_count = local->function_table.size;
+    result->functions = copy_tail(local->function_table.data, result->function_count,
+                                  sizeof(FunctionDef*));
+    result->extern_count = local->externs.size;
+    result->externs = copy_tail(local->externs.data, result->extern_count,
+                                sizeof(FunctionDef*));
+    result->first_str = local->first_str;
+    result->last_str = local->last_str;
+    result->first_error = local->first_error;
+}
+
+typedef struct ParseJob {
+    Parser* parser;
+    ParseResult* results;
+    uint32_t count;
+    // Index of the next module to parse
+    volatile LONG64 next;
+} ParseJob;
+
+typedef struct ParseWorker {
+    ParseJob* job;
+    // Position, errors and copies of the tables for the module being parsed.
+    // The arena holds the AST of every module the worker parsed.
+    Parser local;
+} ParseWorker;
+
+static void parse_run(ParseWorker* worker) {
+    ParseJob* job = worker->job;
+    while (1) {
+        uint64_t ix = InterlockedIncrement64(&job->next) - 1;
+        if (ix >= job->count) {
+            break;
+        }
+        parse_module(&worker->local, job->parser, &job->parser->modules.modules[ix],
+                     &job->results[ix]);
+    }
+}
+
+static DWORD WINAPI parse_worker(void* param) {
+    parse_run(param);
+    return 0;
+}
+
+// Global ids of what one module added
+typedef struct ParseRemap {
+    ParseResult* result;
+    name_id first_name;
+    func_id first_function;
+    intern_id* interns;
+    type_id* types;
+} ParseRemap;
+
+static name_id remap_name(ParseRemap* m, name_id id) {
+    if (id == NAME_ID_INVALID || id < m->result->name_base) {
+        return id;
+    }
+    return m->first_name + (id - m->result->name_base);
+}
+
+static intern_id remap_intern(ParseRemap* m, intern_id id) {
+    if (id == INTERN_ID_INVALID || id < m->result->intern_base) {
+        return id;
+    }
+    return m->interns[id - m->result->intern_base];
+}
+
+static type_id remap_type(ParseRemap* m, type_id id) {
+    if (id == TYPE_ID_INVALID || id < m->result->type_base) {
+        return id;
+    }
+    return m->types[id - m->result->type_base];
+}
+
+static void remap_expression(ParseRemap* m, Expression* e) {
+    if (e->kind == EXPRESSION_VARIABLE) {
+        e->variable.ix = remap_name(m, e->variable.ix);
+    } else if (e->kind == EXPRESSION_ACCESS_MEMBER) {
+        e->member_access.member_intern = remap_intern(m, e->member_access.member_intern);
+    }
+    Expression* child;
+    for (uint64_t ix = 0; (child = get_subexpression(e, ix)) != NULL; ++ix) {
+        remap_expression(m, child);
+    }
+}
+
+static void remap_statements(ParseRemap* m, Statement** statements, uint64_t count) {
+    for (uint64_t ix = 0; ix < count; ++ix) {
+        Statement* s = statements[ix];
+        switch (s->type) {
+        case STATEMENT_ASSIGN:
+            remap_expression(m, s->assignment.lhs);
+            remap_expression(m, s->assignment.rhs);
+            break;
+        case STATEMENT_EXPRESSION:
+            remap_expression(m, s->expression);
+            break;
+        case STATEMENT_IF:
+            if (s->if_.condition != NULL) {
+                remap_expression(m, s->if_.condition);
+            }
+            remap_statements(m, s->if_.statements, s->if_.statement_count);
+            if (s->if_.else_branch != NULL) {
+                remap_statements(m, &s->if_.else_branch, 1);
+            }
+            break;
+        case STATEMENT_WHILE:
+            remap_expression(m, s->while_.condition);
+            remap_statements(m, s->while_.statements, s->while_.statement_count);
+            break;
+        case STATEMENT_RETURN:
+            remap_expression(m, s->return_.return_value);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void merge_functions(ParseRemap* m, FunctionTable* table, FunctionDef** functions,
+                            uint64_t count) {
+    RESERVE(table->data, table->size + count, table->capacity);
+    for (uint64_t ix = 0; ix < count; ++ix) {
+        FunctionDef* f = functions[ix];
+        f->return_type = remap_type(m, f->return_type);
+        for (uint64_t i = 0; i < f->arg_count; ++i) {
+            f->args[i].name = remap_name(m, f->args[i].name);
+            f->args[i].type = remap_type(m, f->args[i].type);
+        }
+        remap_statements(m, f->statements, f->statement_count);
+        table->data[table->size++] = f;
+    }
+}
+
+// Add what parsing a module added to its copy of the tables to the
+// parser, with the ids it would have gotten parsing the modules in order.
+// Returns false if the module has errors.
+static bool merge_parsed(Parser* parser, Module* mod, ParseResult* result) {
+    parser_set_input(parser, &mod->content, mod->filename, mod->import);
+    for (Error* e = result->first_error; e != NULL; e = e->next) {
+        error_cb(parser, e->kind, e->pos, e->file, e->internal_line);
+    }
+    if (parser->first_error != NULL) {
+        return false;
+    }
+
+    ParseRemap m;
+    m.result = result;
+    m.first_name = parser->name_table.size;
+    m.first_function = parser->function_table.size;
+    m.interns = Mem_alloc((result->intern_count + 1) * sizeof(intern_id));
+    m.types = Mem_alloc((result->type_count + 1) * sizeof(type_id));
+    if (m.interns == NULL || m.types == NULL) {
+        out_of_memory(NULL);
+    }
+
+    // Strings another module interned first keep its id
+    for (uint32_t ix = 0; ix < result->intern_count; ++ix) {
+        StrWithLength str = {result->interns[ix].str, result->interns[ix].len};
+        m.interns[ix] = intern_insert(&parser->name_table.interns, str, &parser->arena);
+    }
+
+    // Types only refer to earlier ones, and pointer types are shared like
+    // in type_ptr_of
+    for (uint64_t ix = 0; ix < result->type_count; ++ix) {
+        TypeData* t = &result->types[ix];
+        type_id parent = remap_type(&m, t->parent);
+        if (t->kind == TYPE_PTR) {
+            m.types[ix] = type_ptr_of(&parser->type_table, parent);
+        } else {
+            assert(t->kind == TYPE_ARRAY);
+            m.types[ix] = type_array_of(&parser->type_table, parent, t->array_size);
+        }
+    }
+
+    // Every scope of the module is closed, so the names are not in scope
+    NameTable* names = &parser->name_table;
+    RESERVE(names->data, names->size + result->name_count, names->capacity);
+    for (uint64_t ix = 0; ix < result->name_count; ++ix) {
+        NameData* n = &names->data[names->size++];
+        *n = result->names[ix];
+        assert(n->kind == NAME_VARIABLE);
+        n->shadowed = remap_name(&m, n->shadowed);
+        n->intern = remap_intern(&m, n->intern);
+        n->name = names->interns.data[n->intern].str;
+        n->type = remap_type(&m, n->type);
+        if (n->function != FUNC_ID_GLOBAL && n->function != FUNC_ID_NONE) {
+            n->function += m.first_function;
+        }
+    }
+
+    merge_functions(&m, &parser->function_table, result->functions, result->function_count);
+    merge_functions(&m, &parser->externs, result->externs, result->extern_count);
+
+    for (uint64_t ix = 0; ix < result->struct_count; ++ix) {
+        StructDef* def = &result->structs[ix]->struct_;
+        for (uint32_t i = 0; i < def->field_count; ++i) {
+            def->fields[i].type = remap_type(&m, def->fields[i].type);
+            def->fields[i].intern = remap_intern(&m, def->fields[i].intern);
+        }
+    }
+
+    if (result->first_str != NULL) {
+        if (parser->first_str == NULL) {
+            parser->first_str = result->first_str;
+        } else {
+            parser->last_str->next = result->first_str;
+        }
+        parser->last_str = result->last_str;
+    }
+
+    Mem_free(m.interns);
+    Mem_free(m.types);
+    return true;
+}
+
+bool parse_modules(Parser* parser) {
+    uint32_t count = parser->modules.count;
+    if (count == 0) {
+        return true;
+    }
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    uint32_t worker_count = info.dwNumberOfProcessors;
+    if (worker_count > PARSER_MAX_WORKERS) {
+        worker_count = PARSER_MAX_WORKERS;
+    }
+    if (worker_count > count) {
+        worker_count = count;
+    }
+    if (worker_count == 0) {
+        worker_count = 1;
+    }
+
+    ParseResult* results = Mem_alloc(count * sizeof(ParseResult));
+    if (results == NULL) {
+        out_of_memory(NULL);
+    }
+    for (uint32_t ix = 0; ix < count; ++ix) {
+        results[ix].structs = Mem_alloc(4 * sizeof(TypeDef*));
+        if (results[ix].structs == NULL) {
+            out_of_memory(NULL);
+        }
+        results[ix].struct_count = 0;
+        results[ix].struct_cap = 4;
+    }
+
+    ParseJob job;
+    job.parser = parser;
+    job.results = results;
+    job.count = count;
+    job.next = 0;
+
+    ParseWorker* workers = Mem_alloc(worker_count * sizeof(ParseWorker));
+    if (workers == NULL) {
+        out_of_memory(NULL);
+    }
+    for (uint32_t i = 0; i < worker_count; ++i) {
+        workers[i].job = &job;
+        Parser* local = &workers[i].local;
+        memset(local, 0, sizeof(Parser));
+        if (!Arena_create(&local->arena, 0x7fffffff, out_of_memory, NULL)) {
+            out_of_memory(NULL);
+        }
+        local->function_table.data = Mem_alloc(16 * sizeof(FunctionDef*));
+        local->externs.data = Mem_alloc(16 * sizeof(FunctionDef*));
+        if (local->function_table.data == NULL || local->externs.data == NULL) {
+            out_of_memory(NULL);
+        }
+        local->function_table.capacity = 16;
+        local->externs.capacity = 16;
+    }
+
+    // The calling thread is the first worker
+    HANDLE threads[PARSER_MAX_WORKERS];
+    uint32_t started = 1;
+    for (; started < worker_count; ++started) {
+        threads[started] = CreateThread(NULL, 0, parse_worker, &workers[started],
+                                        0, NULL);
+        if (threads[started] == NULL) {
+            break;
+        }
+    }
+    parse_run(&workers[0]);
+    for (uint32_t i = 1; i < started; ++i) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+    LOG_DEBUG("Parsed %u modules on %u threads", count, started);
+
+    // Merge in module order, stopping at the first module with errors like
+    // parsing them one after another would
+    bool success = true;
+    for (uint32_t ix = 0; ix < count && success; ++ix) {
+        success = merge_parsed(parser, &parser->modules.modules[ix], &results[ix]);
+    }
+
+    for (uint32_t ix = 0; ix < count; ++ix) {
+        Mem_free(results[ix].names);
+        Mem_free(results[ix].interns);
+        Mem_free(results[ix].types);
+        Mem_free(results[ix].functions);
+        Mem_free(results[ix].externs);
+        Mem_free(results[ix].structs);
+    }
+    Mem_free(results);
+    // The arenas are kept, since they hold the AST and the errors
+    for (uint32_t i = 0; i < worker_count; ++i) {
+        Parser* local = &workers[i].local;
+        TimeReport_add(TIME_PHASE_PARSE, 0, local->arena.offset, 0);
+        name_table_free(&local->name_table);
+        Mem_free(local->type_table.data);
+        Mem_free(local->function_table.data);
+        Mem_free(local->externs.data);
+    }
+    Mem_free(workers);
+    return success;
 }
 
 
@@ -5,8 +5,15 @@
 
 void Parser_create(Parser* parser);
 
-void scan_program(Parser* parser, String* indata, const char* filename);
+// Read every module, including the ones they import, and declare their
+// functions and structs. Modules are scanned in parallel, but declared in
+// module order.
+bool scan_modules(Parser* parser);
 
-void parse_program(Parser* parser, String* indata, const char* filename, bool is_import);
+// Parse the function bodies of every scanned module. Modules are parsed in
+// parallel into copies of the tables, and merged in module order so that
+// names, types and functions get the same ids as parsing them in order.
+// Returns false if a module has errors.
+bool parse_modules(Parser* parser);
 
 #endif
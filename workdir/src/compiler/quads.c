@@ -1232,7 +1232,10 @@ void quads_statements(Parser* parser, QuadList* quads, Statement** statements,
 }
 
 
-void Quad_update_live(const Quad* q, VarSet* live) {
+void Quad_operands(const Quad* q, var_id* def, var_id* use1, var_id* use2) {
+    *def = VAR_ID_INVALID;
+    *use1 = VAR_ID_INVALID;
+    *use2 = VAR_ID_INVALID;
     switch (q->type) {
     case QUAD_DIV:
     case QUAD_MUL:
@@ -1258,9 +1261,9 @@ void Quad_update_live(const Quad* q, VarSet* live) {
     case QUAD_BIT_XOR:
     case QUAD_GET_ARRAY_ADDR:
     case QUAD_CALC_ARRAY_ADDR:
-        VarSet_clear(live, q->dest);
-        VarSet_set(live, q->op1.var);
-        VarSet_set(live, q->op2);
+        *def = q->dest;
+        *use1 = q->op1.var;
+        *use2 = q->op2;
         break;
     case QUAD_JMP:
     case QUAD_LABEL:
@@ -1268,25 +1271,25 @@ void Quad_update_live(const Quad* q, VarSet* live) {
     case QUAD_JMP_FALSE:
     case QUAD_JMP_TRUE:
     case QUAD_PUT_ARG:
-        VarSet_set(live, q->op2);
+        *use1 = q->op2;
         break;
     case QUAD_RETURN:
     case QUAD_CALL_PTR:
-        VarSet_set(live, q->op1.var);
+        *use1 = q->op1.var;
         break;
     case QUAD_CALL:
         break;
     case QUAD_GET_RET:
     case QUAD_GET_ARG:
-        VarSet_clear(live, q->dest);
+        *def = q->dest;
         break;
     case QUAD_SET_ADDR:
-        VarSet_set(live, q->op1.var);
-        VarSet_set(live, q->op2);
+        *use1 = q->op1.var;
+        *use2 = q->op2;
         break;
     case QUAD_CREATE:
     case QUAD_FCREATE:
-        VarSet_clear(live, q->dest);
+        *def = q->dest;
         break;
     case QUAD_NEGATE:
     case QUAD_FNEGATE:
@@ -1307,18 +1310,49 @@ void Quad_update_live(const Quad* q, VarSet* live) {
     case QUAD_MOVE:
     case QUAD_DEREF:
     case QUAD_ADDROF:
-        VarSet_clear(live, q->dest);
-        VarSet_set(live, q->op1.var);
+        *def = q->dest;
+        *use1 = q->op1.var;
         break;
     case QUAD_STRUCT_ADDR:
-        VarSet_clear(live, q->dest);
-        VarSet_set(live, q->op2);
+        *def = q->dest;
+        *use1 = q->op2;
         break;
     default:
         assert(false);
     }
 }
 
+void Quad_update_live(const Quad* q, VarSet* live) {
+    var_id def, use1, use2;
+    Quad_operands(q, &def, &use1, &use2);
+    if (def != VAR_ID_INVALID) {
+        VarSet_clear(live, def);
+    }
+    if (use1 != VAR_ID_INVALID) {
+        VarSet_set(live, use1);
+    }
+    if (use2 != VAR_ID_INVALID) {
+        VarSet_set(live, use2);
+    }
+}
+
+void Quad_compact(Quad** start, Quad** end, Arena* arena) {
+    uint64_t count = 0;
+    for (Quad* q = *start; q != (*end)->next_quad; q = q->next_quad) {
+        ++count;
+    }
+    Quad* block = Arena_alloc_count(arena, Quad, count);
+    Quad* q = *start;
+    for (uint64_t ix = 0; ix < count; ++ix) {
+        block[ix] = *q;
+        block[ix].last_quad = ix > 0 ? &block[ix - 1] : NULL;
+        block[ix].next_quad = ix + 1 < count ? &block[ix + 1] : NULL;
+        q = q->next_quad;
+    }
+    *start = &block[0];
+    *end = &block[count - 1];
+}
+
 void Quad_add_usages(const Quad* q, VarSet* use, VarSet* define, VarList* vars) {
     switch (q->type) {
     case QUAD_DIV:
@@ -122,8 +122,18 @@ typedef struct Quads {
 // Adds dest to define
 void Quad_add_usages(const Quad* q, VarSet* use, VarSet* define, VarList* vars);
 
+// Sets def to the variable written by q and use1, use2 to the variables
+// read by it, VAR_ID_INVALID where there is none
+void Quad_operands(const Quad* q, var_id* def, var_id* use1, var_id* use2);
+
 void Quad_update_live(const Quad* q, VarSet* live);
 
+// Copy the quads from <start> to <end> (inclusive) into one contiguous block
+// allocated from <arena>, in order. <start> and <end> are set to the copies,
+// whose first and last links are NULL. Walking the copies touches
+// consecutive memory, even after quads have been inserted or removed.
+void Quad_compact(Quad** start, Quad** end, Arena* arena);
+
 void Quad_GenerateQuads(Parser* parser, Quads* quads, Arena* arena);
 
 #endif
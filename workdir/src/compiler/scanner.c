@@ -1,15 +1,63 @@
 #include "language/scan.h"
 #include "tokenizer.h"
+#include "mem.h"
+#include "time_report.h"
+#include <glob.h>
 
 const static enum LogCatagory LOG_CATAGORY = LOG_CATAGORY_SCANNER;
 
+#define SCAN_MAX_WORKERS 64
+
+enum ScanDeclKind {
+    SCAN_FUNCTION, // Functions and externs
+    SCAN_STRUCT,
+    SCAN_UNION,
+    SCAN_IMPORT
+};
+
+typedef struct ScanDecl {
+    enum ScanDeclKind kind;
+    StrWithLength name;
+    uint64_t start;
+    uint64_t end;
+    uint64_t arg_count;
+} ScanDecl;
+
+// What scanning one module found, before it is added to the name table
+typedef struct ScanResult {
+    String content;
+    bool read_failed;
+    uint64_t content_hash;
+    // Hash of every declaration, with function bodies left out
+    uint64_t signature_hash;
+    ScanDecl* decls;
+    uint64_t decl_count;
+    uint64_t decl_cap;
+    Error* first_error;
+} ScanResult;
+
 struct Tokenizer {
     Parser* parser;
     Token last_token;
     uint64_t start;
     uint64_t end;
+    ScanResult* result;
 };
 
+// Add the declaration in [start, end) to the signature hash. Bodies are
+// the only braces a function declaration can contain, so skip_body stops
+// at the first one.
+static void scan_signature(struct Tokenizer* t, uint64_t start, uint64_t end,
+                           bool skip_body) {
+    const uint8_t* indata = t->parser->indata;
+    uint64_t pos = start;
+    while (pos < end && !(skip_body && indata[pos] == '{')) {
+        ++pos;
+    }
+    t->result->signature_hash = hash_bytes(t->result->signature_hash, indata + start,
+                                           pos - start);
+}
+
 Token scanner_peek_token(void* ctx, uint64_t* start, uint64_t* end) {
     struct Tokenizer* t = ctx;
     *start = t->start;
@@ -73,81 +121,98 @@ void scanner_consume_token(void* ctx, uint64_t* start, uint64_t* end) {
     t->end = p->pos;
 }
 
+static void scan_record(struct Tokenizer* t, enum ScanDeclKind kind, StrWithLength name,
+                        uint64_t start, uint64_t end, uint64_t arg_count) {
+    ScanResult* r = t->result;
+    RESERVE(r->decls, r->decl_count + 1, r->decl_cap);
+    r->decls[r->decl_count].kind = kind;
+    r->decls[r->decl_count].name = name;
+    r->decls[r->decl_count].start = start;
+    r->decls[r->decl_count].end = end;
+    r->decls[r->decl_count].arg_count = arg_count;
+    ++r->decl_count;
+}
+
+// Declarations are only recorded here, scan_modules adds them to the name
+// table once every module of the round has been scanned
 FunctionDef* OnScanFunction(void* ctx, uint64_t start, uint64_t end, StrWithLength name, 
                         uint64_t arg_count) {
     struct Tokenizer *t = ctx;
-    Parser* parser = t->parser;
-    uint64_t len = end - start;
     LOG_DEBUG("Scanned function %.*s (%llu - %llu) with %llu args\n", 
               name.len, name.str, start, end, arg_count);
+    scan_signature(t, start, end, true);
+    scan_record(t, SCAN_FUNCTION, name, start, end, arg_count);
+    return NULL;
+}
+
+type_id OnScanUnion(void* ctx, uint64_t start, uint64_t end, StrWithLength name) {
+    scan_signature(ctx, start, end, false);
+    scan_record(ctx, SCAN_UNION, name, start, end, 0);
+    return TYPE_ID_INVALID;
+}
+
+type_id OnScanStruct(void* ctx, uint64_t start, uint64_t end, StrWithLength name) {
+    scan_signature(ctx, start, end, false);
+    scan_record(ctx, SCAN_STRUCT, name, start, end, 0);
+    return TYPE_ID_INVALID;
+}
+
+
+FunctionDef* OnScanExtern(void* ctx, uint64_t start, uint64_t end, StrWithLength name,
+                          uint64_t arg_count) {
+    return OnScanFunction(ctx, start, end, name, arg_count);
+}
+
+
+void OnScanImport(void* ctx, uint64_t start, uint64_t end, StrWithLength file) {
+    scan_signature(ctx, start, end, false);
+    scan_record(ctx, SCAN_IMPORT, file, start, end, 0);
+}
 
+static void merge_function(Parser* parser, ScanDecl* decl) {
     FunctionDef* func = Arena_alloc_type(&parser->arena, FunctionDef);
-    func->arg_count = arg_count;
+    func->arg_count = decl->arg_count;
     func->return_type = TYPE_ID_INVALID;
     func->line.filename = parser->filename;
     func->undefined = false;
-    func->line.start = start;
-    func->line.end = end;
+    func->line.start = decl->start;
+    func->line.end = decl->end;
     func->quad_start = NULL;
     func->quad_end = NULL;
     func->symbol = -1;
     func->end_label = LABEL_ID_INVALID;
 
-    name_id id = name_function_insert(&parser->name_table, name, &parser->type_table,
+    name_id id = name_function_insert(&parser->name_table, decl->name, &parser->type_table,
                                       func, &parser->arena);
     if (id == NAME_ID_INVALID) {
-        LineInfo l = {parser->filename, start, end};
+        LineInfo l = {parser->filename, decl->start, decl->end};
         add_error(parser, PARSE_ERROR_BAD_NAME, l);
-        return NULL;
+        return;
     }
 
     func->name = id;
-    return func;
 }
 
-type_id scan_struct(struct Tokenizer* t, uint64_t start, uint64_t end, StrWithLength name,
-                    enum StructType type) {
-    Parser* p = t->parser;
+static void merge_struct(Parser* p, ScanDecl* decl, enum StructType type) {
     type_id struct_type = type_struct_create(&p->type_table, &p->arena);
     TypeDef* def = p->type_table.data[struct_type].type_def;
     def->struct_.line.filename = p->filename;
-    def->struct_.line.start = start;
-    def->struct_.line.end = end;
+    def->struct_.line.start = decl->start;
+    def->struct_.line.end = decl->end;
     def->struct_.type = type;
     
-    name_id id = name_type_insert(&p->name_table, name, struct_type, 
+    name_id id = name_type_insert(&p->name_table, decl->name, struct_type, 
                                   def, &p->arena);
     def->struct_.name = id;
 
     if (id == NAME_ID_INVALID) {
-        LineInfo l = {p->filename, start, end};
+        LineInfo l = {p->filename, decl->start, decl->end};
         add_error(p, PARSE_ERROR_BAD_NAME, l);
-        return TYPE_ID_INVALID;
     }
-
-    return struct_type;
-}
-
-
-type_id OnScanUnion(void* ctx, uint64_t start, uint64_t end, StrWithLength name) {
-    return scan_struct(ctx, start, end, name, STRUCTTYPE_UNION);
-}
-
-type_id OnScanStruct(void* ctx, uint64_t start, uint64_t end, StrWithLength name) {
-    return scan_struct(ctx, start, end, name, STRUCTTYPE_STRUCT);
-}
-
-
-FunctionDef* OnScanExtern(void* ctx, uint64_t start, uint64_t end, StrWithLength name,
-                          uint64_t arg_count) {
-    return OnScanFunction(ctx, start, end, name, arg_count);
 }
 
-
-void OnScanImport(void* ctx, uint64_t start, uint64_t end, StrWithLength file) {
-    struct Tokenizer *t = ctx;
-    Parser* parser = t->parser;
-
+static void merge_import(Parser* parser, ScanDecl* decl) {
+    StrWithLength file = decl->name;
     char* filename = Mem_alloc(file.len + 5);
     if (filename == NULL) {
         out_of_memory(parser);
@@ -163,18 +228,224 @@ void OnScanImport(void* ctx, uint64_t start, uint64_t end, StrWithLength file) {
     Mem_free(filename);
 
     if (!success) {
-        LineInfo l = {parser->filename, start, end};
+        LineInfo l = {parser->filename, decl->start, decl->end};
         add_error(parser, PARSE_ERROR_BAD_NAME, l); // TODO: fix error type
     }
 }
 
-void scan_program(Parser* parser, String* indata, const char* filename) {
-    parser_set_input(parser, indata, filename, false);
+// Read and scan one module, using only the state in local
+static void scan_module(Parser* local, const char* filename, ScanResult* result) {
+    uint64_t read_start = TimeReport_now();
+    if (!read_text_file(&result->content, filename)) {
+        result->read_failed = true;
+        return;
+    }
+    result->content_hash = hash_bytes(HASH_SEED, (const uint8_t*)result->content.buffer,
+                                      result->content.length);
+    uint64_t scan_start = TimeReport_now();
+    TimeReport_add(TIME_PHASE_READ, scan_start - read_start, 0, 1);
+    parser_set_input(local, &result->content, filename, false);
+    local->first_error = NULL;
+    local->last_error = NULL;
 
     struct Tokenizer t;
-    t.parser = parser;
+    t.parser = local;
+    t.result = result;
     uint64_t start, end;
     scanner_consume_token(&t, &start, &end);
 
     scanner_parse(&t);
+    result->first_error = local->first_error;
+    TimeReport_add(TIME_PHASE_SCAN, TimeReport_now() - scan_start, 0, result->decl_count);
+}
+
+typedef struct ScanJob {
+    Parser* parser;
+    ScanResult* results;
+    // First module of the round
+    uint32_t first;
+    uint32_t count;
+    // Index of the next module to scan
+    volatile LONG64 next;
+} ScanJob;
+
+typedef struct ScanWorker {
+    ScanJob* job;
+    // Position, arena and errors of the module being scanned. The name table
+    // is shared with the parser, and only read until the round is merged.
+    Parser local;
+} ScanWorker;
+
+static void scan_run(ScanWorker* worker) {
+    ScanJob* job = worker->job;
+    while (1) {
+        uint64_t ix = InterlockedIncrement64(&job->next) - 1;
+        if (ix >= job->count) {
+            break;
+        }
+        const char* filename = job->parser->modules.modules[job->first + ix].filename;
+        scan_module(&worker->local, filename, &job->results[ix]);
+    }
+}
+
+static DWORD WINAPI scan_worker(void* param) {
+    scan_run(param);
+    return 0;
+}
+
+// Add what a module declares to the name and type tables
+static void merge_module(Parser* parser, Module* mod, ScanResult* result) {
+    mod->content = result->content;
+    mod->content_hash = result->content_hash;
+    mod->signature_hash = result->signature_hash;
+    parser_set_input(parser, &mod->content, mod->filename, false);
+
+    // Syntax errors are reported in the same order as when declaring
+    // while scanning, before any declaration ending after them
+    Error* e = result->first_error;
+    for (uint64_t ix = 0; ix < result->decl_count; ++ix) {
+        ScanDecl* decl = &result->decls[ix];
+        for (; e != NULL && e->pos.start < decl->end; e = e->next) {
+            error_cb(parser, e->kind, e->pos, e->file, e->internal_line);
+        }
+        switch (decl->kind) {
+        case SCAN_FUNCTION:
+            merge_function(parser, decl);
+            break;
+        case SCAN_STRUCT:
+            merge_struct(parser, decl, STRUCTTYPE_STRUCT);
+            break;
+        case SCAN_UNION:
+            merge_struct(parser, decl, STRUCTTYPE_UNION);
+            break;
+        case SCAN_IMPORT:
+            merge_import(parser, decl);
+            break;
+        }
+    }
+    for (; e != NULL; e = e->next) {
+        error_cb(parser, e->kind, e->pos, e->file, e->internal_line);
+    }
+}
+
+bool scan_modules(Parser* parser) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    uint32_t max_workers = info.dwNumberOfProcessors;
+    if (max_workers > SCAN_MAX_WORKERS) {
+        max_workers = SCAN_MAX_WORKERS;
+    }
+    if (max_workers == 0) {
+        max_workers = 1;
+    }
+
+    // Workers keep their arena for all rounds, it is only created the first
+    // time a round needs the worker
+    ScanWorker* workers = Mem_alloc(max_workers * sizeof(ScanWorker));
+    if (workers == NULL) {
+        out_of_memory(NULL);
+    }
+    uint32_t created = 0;
+
+    // Imports are only known after merging, so they are scanned in the
+    // next round
+    uint32_t scanned = 0;
+    bool success = true;
+    while (success && scanned < parser->modules.count) {
+        uint32_t count = parser->modules.count - scanned;
+        ScanResult* results = Mem_alloc(count * sizeof(ScanResult));
+        if (results == NULL) {
+            out_of_memory(NULL);
+        }
+        for (uint32_t ix = 0; ix < count; ++ix) {
+            results[ix].read_failed = false;
+            results[ix].content_hash = 0;
+            results[ix].signature_hash = HASH_SEED;
+            results[ix].decls = Mem_alloc(16 * sizeof(ScanDecl));
+            if (results[ix].decls == NULL) {
+                out_of_memory(NULL);
+            }
+            results[ix].decl_count = 0;
+            results[ix].decl_cap = 16;
+            results[ix].first_error = NULL;
+        }
+
+        ScanJob job;
+        job.parser = parser;
+        job.results = results;
+        job.first = scanned;
+        job.count = count;
+        job.next = 0;
+
+        uint32_t worker_count = max_workers < count ? max_workers : count;
+        for (; created < worker_count; ++created) {
+            memset(&workers[created].local, 0, sizeof(Parser));
+            if (!Arena_create(&workers[created].local.arena, 0x7fffffff, out_of_memory, NULL)) {
+                out_of_memory(NULL);
+            }
+        }
+        for (uint32_t i = 0; i < worker_count; ++i) {
+            workers[i].job = &job;
+            // Merging may have grown the name table
+            workers[i].local.name_table = parser->name_table;
+        }
+
+        // The calling thread is the first worker
+        HANDLE threads[SCAN_MAX_WORKERS];
+        uint32_t started = 1;
+        for (; started < worker_count; ++started) {
+            threads[started] = CreateThread(NULL, 0, scan_worker, &workers[started],
+                                            0, NULL);
+            if (threads[started] == NULL) {
+                break;
+            }
+        }
+        scan_run(&workers[0]);
+        for (uint32_t i = 1; i < started; ++i) {
+            WaitForSingleObject(threads[i], INFINITE);
+            CloseHandle(threads[i]);
+        }
+        LOG_DEBUG("Scanned %u modules on %u threads", count, started);
+
+        // Merge in module order, so names get the same ids however the
+        // modules were scheduled
+        uint64_t merge_start = TimeReport_now();
+        uint64_t arena_start = parser->arena.offset;
+        uint32_t merged = 0;
+        for (; merged < count; ++merged) {
+            // Merging imports may move the module list
+            Module* mod = &parser->modules.modules[scanned + merged];
+            if (results[merged].read_failed) {
+                LOG_USER_ERROR("Failed to read '%s'\n", mod->filename);
+                success = false;
+                break;
+            }
+            merge_module(parser, mod, &results[merged]);
+            if (parser->first_error != NULL) {
+                ++merged;
+                success = false;
+                break;
+            }
+        }
+        TimeReport_add(TIME_PHASE_SCAN, TimeReport_now() - merge_start,
+                       parser->arena.offset - arena_start, 0);
+        for (uint32_t ix = 0; ix < count; ++ix) {
+            if (ix >= merged && !results[ix].read_failed) {
+                String_free(&results[ix].content);
+            }
+            Mem_free(results[ix].decls);
+        }
+        // Errors were copied by merge_module
+        for (uint32_t i = 0; i < worker_count; ++i) {
+            TimeReport_add(TIME_PHASE_SCAN, 0, workers[i].local.arena.offset, 0);
+            Arena_release(&workers[i].local.arena);
+        }
+        Mem_free(results);
+        scanned += count;
+    }
+    for (uint32_t i = 0; i < created; ++i) {
+        Arena_free(&workers[i].local.arena);
+    }
+    Mem_free(workers);
+    return success;
 }
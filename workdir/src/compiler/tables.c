@@ -74,21 +74,152 @@ void name_scope_end(NameTable *name_table) {
     name_table->scope_count -= 1;
     name_id id = name_table->size - 1;
     while (id > name_table->scope_stack[name_table->scope_count]) {
-        hash_id link = name_table->data[id].hash_link;
-        name_id parent = name_table->data[id].parent;
-        name_table->hash_map[link] = parent;
+        intern_id intern = name_table->data[id].intern;
+        name_table->interns.data[intern].name = name_table->data[id].shadowed;
         --id;
     }
 }
 
-static hash_id hash(const uint8_t* str, uint32_t len) {
-    uint64_t hash = 5381;
-    int c;
+static uint32_t hash(const uint8_t* str, uint32_t len) {
+    uint32_t hash = 5381;
     for (uint32_t ix = 0; ix < len; ++ix) {
-        c = str[ix];
-        hash = ((hash << 5) + hash) + c;
+        hash = ((hash << 5) + hash) + str[ix];
     }
-    return hash % NAME_TABLE_HASH_ENTRIES;
+    return hash;
+}
+
+void intern_table_create(InternTable* table) {
+    table->size = 0;
+    table->capacity = 64;
+    table->data = Mem_alloc(64 * sizeof(InternData));
+    table->map_size = 128;
+    table->map = Mem_alloc(128 * sizeof(intern_id));
+    if (table->data == NULL || table->map == NULL) {
+        out_of_memory(NULL);
+    }
+    memset(table->map, 0xff, 128 * sizeof(intern_id));
+}
+
+// Slot of <str> in the map, or the empty slot where it belongs
+static uint32_t intern_slot(InternTable* table, const uint8_t* str,
+                            uint32_t len, uint32_t h) {
+    uint32_t mask = table->map_size - 1;
+    uint32_t slot = h & mask;
+    while (table->map[slot] != INTERN_ID_INVALID) {
+        InternData* d = &table->data[table->map[slot]];
+        if (d->hash == h && d->len == len && memcmp(d->str, str, len) == 0) {
+            break;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+intern_id intern_find(InternTable* table, StrWithLength str) {
+    uint32_t h = hash(str.str, str.len);
+    return table->map[intern_slot(table, str.str, str.len, h)];
+}
+
+intern_id intern_insert(InternTable* table, StrWithLength str, Arena* arena) {
+    uint32_t h = hash(str.str, str.len);
+    uint32_t slot = intern_slot(table, str.str, str.len, h);
+    if (table->map[slot] != INTERN_ID_INVALID) {
+        return table->map[slot];
+    }
+
+    if (table->size == table->capacity) {
+        uint32_t cap = table->capacity * 2;
+        InternData* d = Mem_realloc(table->data, cap * sizeof(InternData));
+        if (d == NULL) {
+            out_of_memory(NULL);
+        }
+        table->data = d;
+        table->capacity = cap;
+    }
+    intern_id id = table->size;
+    uint8_t* str_ptr = Arena_alloc(arena, str.len, 1);
+    memcpy(str_ptr, str.str, str.len);
+    table->data[id].str = str_ptr;
+    table->data[id].len = str.len;
+    table->data[id].hash = h;
+    table->data[id].name = NAME_ID_INVALID;
+    table->size += 1;
+
+    // Keep the map at most half full
+    if (table->size * 2 > table->map_size) {
+        uint32_t map_size = table->map_size * 2;
+        intern_id* map = Mem_alloc(map_size * sizeof(intern_id));
+        if (map == NULL) {
+            out_of_memory(NULL);
+        }
+        memset(map, 0xff, map_size * sizeof(intern_id));
+        for (intern_id i = 0; i < table->size; ++i) {
+            uint32_t s = table->data[i].hash & (map_size - 1);
+            while (map[s] != INTERN_ID_INVALID) {
+                s = (s + 1) & (map_size - 1);
+            }
+            map[s] = i;
+        }
+        Mem_free(table->map);
+        table->map = map;
+        table->map_size = map_size;
+    } else {
+        table->map[slot] = id;
+    }
+    return id;
+}
+
+// Copy count elements of src to *dest, growing it to at least cap
+static void copy_table(void** dest, uint64_t* dest_cap, const void* src,
+                       uint64_t count, uint64_t cap, size_t elem_size) {
+    if (*dest_cap < cap) {
+        if (*dest != NULL) {
+            Mem_free(*dest);
+        }
+        *dest = Mem_alloc(cap * elem_size);
+        if (*dest == NULL) {
+            out_of_memory(NULL);
+        }
+        *dest_cap = cap;
+    }
+    memcpy(*dest, src, count * elem_size);
+}
+
+void name_table_copy(NameTable* dest, const NameTable* src) {
+    copy_table((void**)&dest->data, &dest->capacity, src->data, src->size,
+               src->capacity, sizeof(NameData));
+    dest->size = src->size;
+    copy_table((void**)&dest->scope_stack, &dest->scope_capacity, src->scope_stack,
+               src->scope_count, src->scope_capacity, sizeof(name_id));
+    dest->scope_count = src->scope_count;
+
+    uint64_t cap = dest->interns.capacity;
+    copy_table((void**)&dest->interns.data, &cap, src->interns.data, src->interns.size,
+               src->interns.capacity, sizeof(InternData));
+    dest->interns.capacity = cap;
+    dest->interns.size = src->interns.size;
+    // The map is searched by its size, so it has to be the same
+    if (dest->interns.map_size != src->interns.map_size && dest->interns.map != NULL) {
+        Mem_free(dest->interns.map);
+        dest->interns.map = NULL;
+    }
+    cap = dest->interns.map == NULL ? 0 : src->interns.map_size;
+    copy_table((void**)&dest->interns.map, &cap, src->interns.map, src->interns.map_size,
+               src->interns.map_size, sizeof(intern_id));
+    dest->interns.map_size = src->interns.map_size;
+}
+
+void name_table_free(NameTable* name_table) {
+    Mem_free(name_table->data);
+    Mem_free(name_table->scope_stack);
+    Mem_free(name_table->interns.data);
+    Mem_free(name_table->interns.map);
+}
+
+void type_table_copy(TypeTable* dest, const TypeTable* src) {
+    copy_table((void**)&dest->data, &dest->capacity, src->data, src->size,
+               src->capacity, sizeof(TypeData));
+    dest->size = src->size;
 }
 
 name_id name_type_insert(NameTable* name_table, StrWithLength name,
@@ -124,28 +255,20 @@ name_id name_variable_insert(NameTable* name_table, StrWithLength name, type_id
 
 name_id name_insert(NameTable *names, StrWithLength name,
                     type_id type, enum NameKind kind, Arena* arena) {
+    intern_id intern = intern_insert(&names->interns, name, arena);
+    InternData* interned = &names->interns.data[intern];
 
-    hash_id h = hash(name.str, name.len);
-
-    name_id id = names->hash_map[h];
-    name_id n_id = id;
-
-    while (n_id != NAME_ID_INVALID) {
-        if (names->data[n_id].name_len == name.len &&
-            memcmp(names->data[n_id].name, name.str, name.len) == 0) {
-            if (n_id > names->scope_stack[names->scope_count - 1] ||
-                n_id <= names->scope_stack[0]) {
-                // Name already taken in this scope, or in builtin scope
-                LOG_DEBUG("insert_name: Name '%.*s' already taken", name.len, name.str);
-                return NAME_ID_INVALID;
-            }
-        }
-        n_id = names->data[n_id].parent;
+    // Builtin names are never shadowed, so they are always innermost
+    name_id id = interned->name;
+    if (id != NAME_ID_INVALID &&
+        (id > names->scope_stack[names->scope_count - 1] ||
+         id <= names->scope_stack[0])) {
+        // Name already taken in this scope, or in builtin scope
+        LOG_DEBUG("insert_name: Name '%.*s' already taken", name.len, name.str);
+        return NAME_ID_INVALID;
     }
-    n_id = names->size;
+    name_id n_id = names->size;
     LOG_DEBUG("insert_name: Inserted name '%.*s', id %llu", name.len, name.str, n_id);
-    uint8_t* name_ptr = Arena_alloc(arena, name.len, 1);
-    memcpy(name_ptr, name.str, name.len);
     if (names->size == names->capacity) {
         size_t new_cap = names->capacity * 2;
         NameData* new_nd = Mem_realloc(names->data,
@@ -161,27 +284,22 @@ name_id name_insert(NameTable *names, StrWithLength name,
     names->data[n_id].kind = kind;
     names->data[n_id].has_var = false;
     names->data[n_id].implicit_ptr = false;
-    names->data[n_id].parent = id;
-    names->data[n_id].hash_link = h;
-    names->data[n_id].name = name_ptr;
+    names->data[n_id].shadowed = id;
+    names->data[n_id].intern = intern;
+    names->data[n_id].name = interned->str;
     names->data[n_id].name_len = name.len;
     names->data[n_id].type = type;
 
-    names->hash_map[h] = n_id;
+    interned->name = n_id;
     return n_id;
 }
 
 name_id name_find(NameTable *name_table, StrWithLength name) {
-    hash_id h = hash(name.str, name.len);
-    name_id id = name_table->hash_map[h];
-    while (id != NAME_ID_INVALID) {
-        if (name_table->data[id].name_len == name.len &&
-            memcmp(name_table->data[id].name, name.str, name.len) == 0) {
-            return id;
-        }
-        id = name_table->data[id].parent;
+    intern_id intern = intern_find(&name_table->interns, name);
+    if (intern == INTERN_ID_INVALID) {
+        return NAME_ID_INVALID;
     }
-    return id;
+    return name_table->interns.data[intern].name;
 }
 
 type_id type_of(NameTable* name_table, name_id name) {
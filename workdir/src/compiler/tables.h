@@ -64,8 +64,9 @@ typedef uint64_t name_id;
 #define NAME_ID_IMPORT 11
 #define NAME_ID_BUILTIN_COUNT 12
 
-// Index into hash table
-typedef uint32_t hash_id;
+// Index into intern table, one per distinct identifier string
+typedef uint32_t intern_id;
+#define INTERN_ID_INVALID ((intern_id) -1)
 
 enum NameKind {
     NAME_VARIABLE,
@@ -78,13 +79,13 @@ typedef struct FunctionDef FunctionDef;
 typedef struct TypeDef TypeDef;
 
 typedef struct NameData {
-    // NameData entry with same hash
-    name_id parent;
+    // Name with the same string shadowed by this one
+    name_id shadowed;
 
-    hash_id hash_link;
+    intern_id intern;
 
     uint32_t name_len;
-    const uint8_t* name; // Ptr with ownership (arena?)
+    const uint8_t* name; // Interned, shared by all names with this string
  
     enum NameKind kind;
     bool has_var;
@@ -108,14 +109,30 @@ typedef struct NameData {
     type_id type;
 } NameData;
 
-#define NAME_TABLE_HASH_ENTRIES 1024
+typedef struct InternData {
+    const uint8_t* str;
+    uint32_t len;
+    uint32_t hash;
+    // Innermost name in scope with this string, NAME_ID_INVALID if none
+    name_id name;
+} InternData;
+
+typedef struct InternTable {
+    uint32_t size;
+    uint32_t capacity;
+    InternData* data;
+
+    // Open addressing with linear probing, map_size is a power of two
+    uint32_t map_size;
+    intern_id* map;
+} InternTable;
 
 typedef struct NameTable {
     uint64_t size;
     uint64_t capacity;
     NameData* data;
 
-    name_id hash_map[NAME_TABLE_HASH_ENTRIES];
+    InternTable interns;
 
     uint64_t scope_count;
     uint64_t scope_capacity;
@@ -185,6 +202,7 @@ typedef struct VarList {
 typedef struct StructMember {
     type_id type;
     StrWithLength name;
+    intern_id intern;
     uint32_t offset;
     LineInfo line;
 } StructMember;
@@ -264,6 +282,9 @@ typedef struct Module {
     const char* filename; // Null-terminated
     bool import; // True if no code should be generated for this module
     String content;
+    uint64_t content_hash;
+    // Hash of the declarations other modules can see, from scan_program
+    uint64_t signature_hash;
 } Module;
 
 typedef struct ModuleList {
@@ -309,6 +330,24 @@ type_id type_function_create(TypeTable* type_table, FunctionDef* def, Arena* are
 
 type_id type_struct_create(TypeTable* type_table, Arena* arena);
 
+void intern_table_create(InternTable* table);
+
+// Intern id of <str>, adding it if not yet interned
+intern_id intern_insert(InternTable* table, StrWithLength str, Arena* arena);
+
+// Intern id of <str>, INTERN_ID_INVALID if not interned
+intern_id intern_find(InternTable* table, StrWithLength str);
+
+// Make dest a copy of src, reusing the memory of an earlier copy.
+// dest must be zeroed before the first copy.
+void name_table_copy(NameTable* dest, const NameTable* src);
+
+// Free a table made by name_table_copy
+void name_table_free(NameTable* name_table);
+
+// Make dest a copy of src, like name_table_copy
+void type_table_copy(TypeTable* dest, const TypeTable* src);
+
 void name_scope_begin(NameTable* name_table);
 
 void name_scope_end(NameTable* name_table);
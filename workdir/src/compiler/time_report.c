@@ -0,0 +1,104 @@
+#include "time_report.h"
+#include "log.h"
+#include <dynamic_string.h>
+#include <printf.h>
+
+const static enum LogCatagory LOG_CATAGORY = LOG_CATAGORY_USER;
+
+typedef struct PhaseTotals {
+    volatile LONG64 ticks;
+    volatile LONG64 arena_bytes;
+    volatile LONG64 count;
+} PhaseTotals;
+
+// Names are part of the json records, keep them stable
+static const char* PHASE_NAMES[TIME_PHASE_COUNT] = {
+    "read", "scan", "parse", "typecheck", "quads", "optimize", "regalloc",
+    "asm", "link"
+};
+
+// What count is for each phase
+static const char* COUNT_UNITS[TIME_PHASE_COUNT] = {
+    "modules", "decls", "functions", "functions", "quads", "functions",
+    "functions", "functions", "objects"
+};
+
+static bool report_enabled = false;
+static uint64_t report_start;
+static PhaseTotals totals[TIME_PHASE_COUNT];
+
+void TimeReport_enable() {
+    report_enabled = true;
+    report_start = TimeReport_now();
+}
+
+uint64_t TimeReport_now() {
+    if (!report_enabled) {
+        return 0;
+    }
+    LARGE_INTEGER t;
+    QueryPerformanceCounter(&t);
+    return t.QuadPart;
+}
+
+void TimeReport_add(enum TimePhase phase, uint64_t ticks, uint64_t arena_bytes,
+                    uint64_t count) {
+    if (!report_enabled) {
+        return;
+    }
+    InterlockedAdd64(&totals[phase].ticks, ticks);
+    InterlockedAdd64(&totals[phase].arena_bytes, arena_bytes);
+    InterlockedAdd64(&totals[phase].count, count);
+}
+
+void TimeReport_print(uint64_t lines) {
+    if (!report_enabled) {
+        return;
+    }
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    uint64_t total_us = (TimeReport_now() - report_start) * 1000000 / freq.QuadPart;
+
+    String out, fields;
+    if (!String_create(&out)) {
+        return;
+    }
+    if (!String_create(&fields)) {
+        String_free(&out);
+        return;
+    }
+
+    String_format_append(&out, "%-10s %12s %14s %10s\n", "Phase", "Time (us)",
+                         "Arena (bytes)", "Count");
+    for (uint32_t ix = 0; ix < TIME_PHASE_COUNT; ++ix) {
+        uint64_t us = totals[ix].ticks * 1000000 / freq.QuadPart;
+        uint64_t bytes = totals[ix].arena_bytes;
+        uint64_t count = totals[ix].count;
+        String_format_append(&out, "%-10s %12llu %14llu %10llu %s\n", PHASE_NAMES[ix],
+                             us, bytes, count, COUNT_UNITS[ix]);
+
+        String_clear(&fields);
+        String_format_append(&fields, "\"report_version\":%u,\"phase\":\"%s\","
+                             "\"time_us\":%llu,\"arena_bytes\":%llu,"
+                             "\"count\":%llu,\"unit\":\"%s\"",
+                             TIME_REPORT_VERSION, PHASE_NAMES[ix], us, bytes,
+                             count, COUNT_UNITS[ix]);
+        LOG_FIELDS_INFO("Time report phase", fields.buffer);
+    }
+
+    uint64_t lines_per_sec = 0;
+    if (total_us > 0) {
+        lines_per_sec = lines * 1000000 / total_us;
+    }
+    String_format_append(&out, "%-10s %12llu us, %llu lines, %llu lines/s\n", "total",
+                         total_us, lines, lines_per_sec);
+    String_clear(&fields);
+    String_format_append(&fields, "\"report_version\":%u,\"phase\":\"total\","
+                         "\"time_us\":%llu,\"lines\":%llu,\"lines_per_sec\":%llu",
+                         TIME_REPORT_VERSION, total_us, lines, lines_per_sec);
+    LOG_FIELDS_INFO("Time report", fields.buffer);
+
+    outputUtf8(out.buffer, out.length);
+    String_free(&fields);
+    String_free(&out);
+}
@@ -0,0 +1,40 @@
+#ifndef COMPILER_TIME_REPORT_H_00
+#define COMPILER_TIME_REPORT_H_00
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum TimePhase {
+    TIME_PHASE_READ, // Reading source files
+    TIME_PHASE_SCAN, // Scanning and declaring modules
+    TIME_PHASE_PARSE,
+    TIME_PHASE_TYPECHECK,
+    TIME_PHASE_QUADS,
+    TIME_PHASE_OPTIMIZE,
+    TIME_PHASE_REGALLOC,
+    TIME_PHASE_ASM, // Instruction selection, assembly and object creation
+    TIME_PHASE_LINK,
+    TIME_PHASE_COUNT
+};
+
+// Bump when the fields of the json records change
+#define TIME_REPORT_VERSION 1
+
+// Start collecting, the total time is measured from here. Until then the
+// functions below do nothing.
+void TimeReport_enable();
+
+// Current time in ticks, 0 if not enabled
+uint64_t TimeReport_now();
+
+// Add to the totals of phase. Phases run on worker threads add the time of
+// every worker, so they can add up to more than the wall time.
+void TimeReport_add(enum TimePhase phase, uint64_t ticks, uint64_t arena_bytes,
+                    uint64_t count);
+
+// Print a table of all phases to stdout, and send the same as one json
+// record for each phase plus one for the whole run to the log socket.
+// lines is the number of source lines compiled.
+void TimeReport_print(uint64_t lines);
+
+#endif
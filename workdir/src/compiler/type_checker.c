@@ -405,16 +405,13 @@ type_id typecheck_access_member(Parser* parser, Expression* e) {
         return TYPE_ID_INT64;
     }
 
-    StrWithLength str = e->member_access.member;
+    intern_id member_intern = e->member_access.member_intern;
 
     uint32_t i = 0;
 
     for (; i < def->struct_.field_count; ++i) {
         StructMember* member = &def->struct_.fields[i];
-        if (member->name.len != str.len) {
-            continue;
-        }
-        if (memcmp(member->name.str, str.str, str.len) == 0) {
+        if (member->intern == member_intern) {
             e->member_access.member_offset = member->offset;
             break;
         }
@@ -111,3 +111,11 @@ void Buffer_free(ByteBuffer* buf) {
     buf->capacity = 0;
 }
 
+
+uint64_t hash_bytes(uint64_t hash, const uint8_t* data, uint64_t len) {
+    for (uint64_t ix = 0; ix < len; ++ix) {
+        hash ^= data[ix];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
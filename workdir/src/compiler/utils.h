@@ -103,4 +103,10 @@ uint8_t* Buffer_reserve_space(ByteBuffer* buf, uint32_t len);
 
 void Buffer_free(ByteBuffer* buf);
 
+#define HASH_SEED 0xcbf29ce484222325ull
+
+// FNV-1a, continuing from hash. Used for keys stored on disk, where
+// djb2 collides too easily on small edits.
+uint64_t hash_bytes(uint64_t hash, const uint8_t* data, uint64_t len);
+
 #endif
@@ -2,13 +2,26 @@
 #define VARSET_H
 #include "tables.h"
 
+// Sets from VarSet_create are always bitmaps. Sets from
+// VarSet_create_sparse keep their members in a sorted array until they
+// hold more than VARSET_SPARSE_LIMIT of them, and are bitmaps from then on.
 typedef struct VarSet {
     var_id max;
+    // NULL while the set is sparse
     uint64_t* bitmap;
+    // Members of a sparse set, in increasing order
+    var_id* items;
+    uint64_t count;
+    uint64_t cap;
 } VarSet;
 
+// A sparse set is no bigger than the bitmap below this many members
+#define VARSET_SPARSE_LIMIT(max) ((max) / 64)
+
 VarSet VarSet_create(var_id max);
 
+VarSet VarSet_create_sparse(var_id max);
+
 void VarSet_clearall(VarSet* s);
 
 // Compute dest = dest U src
@@ -32,18 +45,35 @@ var_id VarSet_getnext(VarSet* s, var_id last);
 
 bool VarSet_equal(const VarSet* a, const VarSet* b);
 
+void VarSet_set_sparse(VarSet* s, var_id v);
+
+void VarSet_clear_sparse(VarSet* s, var_id v);
+
+bool VarSet_contains_sparse(const VarSet* s, var_id v);
+
 static inline void VarSet_set(VarSet* s, var_id v) {
     assert(v < s->max);
+    if (s->bitmap == NULL) {
+        VarSet_set_sparse(s, v);
+        return;
+    }
     s->bitmap[v >> 6] |= ((uint64_t)1 << ((uint64_t)v & 0b111111));
 }
 
 static inline void VarSet_clear(VarSet* s, var_id v) {
     assert(v < s->max);
+    if (s->bitmap == NULL) {
+        VarSet_clear_sparse(s, v);
+        return;
+    }
     s->bitmap[v >> 6] &= ~((uint64_t)1 << ((uint64_t)v & 0b111111));
 }
 
 static inline bool VarSet_contains(const VarSet* s, var_id v) {
     assert(v < s->max);
+    if (s->bitmap == NULL) {
+        return VarSet_contains_sparse(s, v);
+    }
     return s->bitmap[v >> 6] & ((uint64_t)1 << ((uint64_t)v & 0b111111));
 }
 
@@ -13,6 +13,9 @@ extern int _vsnwprintf(wchar_t *buffer, size_t count, const wchar_t *format,
 #endif
 #include "dynamic_string.h"
 #include "mem.h"
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 
 bool String_append(String *s, const char c) {
     if (!String_reserve(s, s->length + 1)) {
@@ -83,8 +86,13 @@ void String_clear(String *s) {
 }
 
 bool String_create(String *s) {
+    return String_create_with(s, NULL);
+}
+
+bool String_create_with(String_noinit* s, const Allocator* allocator) {
     s->length = 0;
-    s->buffer = Mem_alloc(MEM_ALIGNMENT);
+    s->allocator = allocator;
+    s->buffer = Allocator_alloc(allocator, MEM_ALIGNMENT);
     if (s->buffer == NULL) {
         s->capacity = 0;
         return false;
@@ -95,15 +103,21 @@ bool String_create(String *s) {
 }
 
 bool String_create_capacity(String_noinit* s, string_size_t cap) {
+    return String_create_capacity_with(s, cap, NULL);
+}
+
+bool String_create_capacity_with(String_noinit* s, string_size_t cap,
+                                 const Allocator* allocator) {
     if (cap > 0x7fffffff) {
         return false;
     }
     s->length = 0;
+    s->allocator = allocator;
     s->capacity = MEM_ALIGNMENT;
     while (s->capacity < cap) {
         s->capacity *= 2;
     }
-    s->buffer = Mem_alloc(s->capacity);
+    s->buffer = Allocator_alloc(allocator, s->capacity);
     if (s->buffer == NULL) {
         s->capacity = 0;
         return false;
@@ -160,8 +174,57 @@ bool String_equals_str(const String* s, const char* str) {
     return memcmp(s->buffer, str, s->length) == 0;
 }
 
+StrView StrView_from_str(const char* c_str) {
+    StrView v;
+    v.data = c_str;
+    v.length = strlen(c_str);
+    return v;
+}
+
+StrView String_view(const String* s) {
+    StrView v;
+    v.data = s->buffer;
+    v.length = s->length;
+    return v;
+}
+
+StrView String_slice(const String* s, string_size_t ix, string_size_t count) {
+    StrView v;
+    if (ix > s->length) {
+        ix = s->length;
+    }
+    if (count > s->length - ix) {
+        count = s->length - ix;
+    }
+    v.data = s->buffer + ix;
+    v.length = count;
+    return v;
+}
+
+bool StrView_equals(StrView a, StrView b) {
+    if (a.length != b.length) {
+        return false;
+    }
+    return memcmp(a.data, b.data, a.length) == 0;
+}
+
+bool StrView_startswith(StrView v, StrView prefix) {
+    if (v.length < prefix.length) {
+        return false;
+    }
+    return memcmp(v.data, prefix.data, prefix.length) == 0;
+}
+
+bool String_equals_view(const String* s, StrView v) {
+    return StrView_equals(String_view(s), v);
+}
+
+bool String_startswith_view(const String* s, StrView v) {
+    return StrView_startswith(String_view(s), v);
+}
+
 void String_free(String *s) {
-    Mem_free(s->buffer);
+    Allocator_free(s->allocator, s->buffer);
     s->capacity = 0;
     s->length = 0;
     s->buffer = NULL;
@@ -169,6 +232,7 @@ void String_free(String *s) {
 
 bool String_copy(String* dest, String* source) {
     dest->length = source->length;
+    dest->allocator = NULL;
     dest->capacity = 4;
     while (dest->capacity <= source->length) {
         dest->capacity = dest->capacity * 2;
@@ -193,6 +257,20 @@ bool String_append_count(String* s, const char* buf, string_size_t count) {
     return true;
 }
 
+bool String_append_view(String* s, StrView v) {
+    return String_append_count(s, v.data, v.length);
+}
+
+bool String_from_view(String* dest, StrView v) {
+    if (!String_create_capacity(dest, v.length + 1)) {
+        return false;
+    }
+    memcpy(dest->buffer, v.data, v.length);
+    dest->length = v.length;
+    dest->buffer[v.length] = '\0';
+    return true;
+}
+
 
 bool String_reserve(String* s, size_t count) {
     if (s->capacity <= count) {
@@ -206,7 +284,7 @@ bool String_reserve(String* s, size_t count) {
         while (new_cap <= count) {
             new_cap *= 2;
         }
-        char* buf = Mem_realloc(s->buffer, new_cap);
+        char* buf = Allocator_realloc(s->allocator, s->buffer, s->capacity, new_cap);
         if (buf == NULL) {
             return false;
         }
@@ -216,43 +294,324 @@ bool String_reserve(String* s, size_t count) {
     return true;
 }
 
-bool String_append_utf16_bytes(String* s, const wchar_t* str, size_t count) {
-    if (count == 0) {
-        return true;
+// UTF-8 <-> UTF-16 transcoding.
+// Valid input is converted here, with an exact length pass so the
+// destination is only reserved once. Invalid utf8 or lone surrogates
+// return -1 from the length pass, the callers then fall back to
+// MultiByteToWideChar/WideCharToMultiByte to get the same replacement
+// characters as before.
+#if defined(__AVX2__)
+#define UTF_BLOCK 32
+#elif defined(__SSE2__) || defined(_M_X64)
+#define UTF_BLOCK 16
+#endif
+
+// Same layout as utf8_valid_table in unicode/tables.c, indexed by lead
+// byte - 128. 0 means the byte can not start a sequence, an odd value
+// is the inclusive upper bound of the second byte and an even value its
+// inclusive lower bound.
+static const uint8_t utf8_lead_table[128] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0xA0, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80,
+    0x80, 0x80, 0x80, 0x80, 0x80, 0x9F, 0x80, 0x80,
+    0x90, 0x80, 0x80, 0x80, 0x8F, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0
+};
+
+#ifdef UTF_BLOCK
+// True if the block starting at `s` is all ascii
+static inline bool utf8_ascii_block(const uint8_t* s) {
+#if UTF_BLOCK == 32
+    __m256i v = _mm256_loadu_si256((const __m256i*)s);
+    return _mm256_movemask_epi8(v) == 0;
+#else
+    __m128i v = _mm_loadu_si128((const __m128i*)s);
+    return _mm_movemask_epi8(v) == 0;
+#endif
+}
+
+// True if the block starting at `s` is all below 0x80
+static inline bool utf16_ascii_block(const wchar_t* s) {
+#if UTF_BLOCK == 32
+    __m256i a = _mm256_loadu_si256((const __m256i*)s);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(s + 16));
+    return _mm256_testz_si256(_mm256_or_si256(a, b),
+                              _mm256_set1_epi16((short)0xff80));
+#else
+    __m128i a = _mm_loadu_si128((const __m128i*)s);
+    __m128i b = _mm_loadu_si128((const __m128i*)(s + 8));
+    __m128i high = _mm_and_si128(_mm_or_si128(a, b), _mm_set1_epi16((short)0xff80));
+    return _mm_movemask_epi8(_mm_cmpeq_epi16(high, _mm_setzero_si128())) == 0xffff;
+#endif
+}
+#endif
+
+// Length of the utf8 sequence starting with non-ascii `s[0]`, 0 if it
+// is invalid or cut off by `avail`
+static inline size_t utf8_sequence_length(const uint8_t* s, size_t avail) {
+    uint8_t bound = utf8_lead_table[s[0] - 0x80];
+    if (bound == 0) {
+        return 0;
     }
-    UINT code_point = 65001;
-    DWORD size = WideCharToMultiByte(code_point, 0, str, count, NULL, 0, NULL, NULL);
-    if (!String_reserve(s, s->length + size)) {
-        return false;
+    size_t n = s[0] >= 0xF0 ? 4 : s[0] >= 0xE0 ? 3 : 2;
+    if (n > avail) {
+        return 0;
     }
-    size = WideCharToMultiByte(code_point, 0, str, count, s->buffer + s->length, size, NULL, NULL);
-    if (size == 0) {
-        return false;
+    if (bound & 1) {
+        if (s[1] < 0x80 || s[1] > bound) {
+            return 0;
+        }
+    } else if (s[1] < bound || s[1] > 0xBF) {
+        return 0;
     }
-    s->length += size;
-    s->buffer[s->length] = L'\0';
+    for (size_t j = 2; j < n; ++j) {
+        if ((s[j] & 0xC0) != 0x80) {
+            return 0;
+        }
+    }
+    return n;
+}
+
+size_t utf8_valid_prefix(const char* str, size_t count) {
+    const uint8_t* s = (const uint8_t*)str;
+    size_t ix = 0;
+    while (ix < count) {
+#ifdef UTF_BLOCK
+        if (ix + UTF_BLOCK <= count && utf8_ascii_block(s + ix)) {
+            ix += UTF_BLOCK;
+            continue;
+        }
+#endif
+        if (s[ix] < 0x80) {
+            ++ix;
+            continue;
+        }
+        size_t n = utf8_sequence_length(s + ix, count - ix);
+        if (n == 0) {
+            return ix;
+        }
+        ix += n;
+    }
+    return count;
+}
+
+// Number of utf16 units `s` converts to, -1 if it is not valid utf8
+static int64_t utf8_to_utf16_length(const uint8_t* s, size_t count) {
+    int64_t len = 0;
+    size_t ix = 0;
+    while (ix < count) {
+#ifdef UTF_BLOCK
+        if (ix + UTF_BLOCK <= count && utf8_ascii_block(s + ix)) {
+            ix += UTF_BLOCK;
+            len += UTF_BLOCK;
+            continue;
+        }
+#endif
+        if (s[ix] < 0x80) {
+            ++ix;
+            ++len;
+            continue;
+        }
+        size_t n = utf8_sequence_length(s + ix, count - ix);
+        if (n == 0) {
+            return -1;
+        }
+        ix += n;
+        len += n == 4 ? 2 : 1;
+    }
+    return len;
+}
+
+// Converts `s`, which must have passed utf8_to_utf16_length
+static void utf8_to_utf16(const uint8_t* s, size_t count, wchar_t* out) {
+    size_t ix = 0;
+    while (ix < count) {
+#ifdef UTF_BLOCK
+        if (ix + UTF_BLOCK <= count && utf8_ascii_block(s + ix)) {
+#if UTF_BLOCK == 32
+            __m256i lo = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s + ix)));
+            __m256i hi = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s + ix + 16)));
+            _mm256_storeu_si256((__m256i*)out, lo);
+            _mm256_storeu_si256((__m256i*)(out + 16), hi);
+#else
+            __m128i v = _mm_loadu_si128((const __m128i*)(s + ix));
+            __m128i zero = _mm_setzero_si128();
+            _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi8(v, zero));
+            _mm_storeu_si128((__m128i*)(out + 8), _mm_unpackhi_epi8(v, zero));
+#endif
+            ix += UTF_BLOCK;
+            out += UTF_BLOCK;
+            continue;
+        }
+#endif
+        uint32_t c = s[ix];
+        if (c < 0x80) {
+            *out++ = c;
+            ++ix;
+        } else if (c < 0xE0) {
+            *out++ = ((c & 0x1F) << 6) | (s[ix + 1] & 0x3F);
+            ix += 2;
+        } else if (c < 0xF0) {
+            *out++ = ((c & 0x0F) << 12) | ((s[ix + 1] & 0x3F) << 6) |
+                     (s[ix + 2] & 0x3F);
+            ix += 3;
+        } else {
+            uint32_t cp = ((c & 0x07) << 18) | ((s[ix + 1] & 0x3F) << 12) |
+                          ((s[ix + 2] & 0x3F) << 6) | (s[ix + 3] & 0x3F);
+            cp -= 0x10000;
+            *out++ = 0xD800 | (cp >> 10);
+            *out++ = 0xDC00 | (cp & 0x3FF);
+            ix += 4;
+        }
+    }
+}
+
+// Number of utf8 bytes `s` converts to, -1 if it has lone surrogates
+static int64_t utf16_to_utf8_length(const wchar_t* s, size_t count) {
+    int64_t len = 0;
+    size_t ix = 0;
+    while (ix < count) {
+#ifdef UTF_BLOCK
+        if (ix + UTF_BLOCK <= count && utf16_ascii_block(s + ix)) {
+            ix += UTF_BLOCK;
+            len += UTF_BLOCK;
+            continue;
+        }
+#endif
+        uint16_t c = s[ix];
+        if (c < 0x80) {
+            len += 1;
+        } else if (c < 0x800) {
+            len += 2;
+        } else if (c < 0xD800 || c > 0xDFFF) {
+            len += 3;
+        } else if (c < 0xDC00 && ix + 1 < count &&
+                   s[ix + 1] >= 0xDC00 && s[ix + 1] <= 0xDFFF) {
+            len += 4;
+            ++ix;
+        } else {
+            return -1;
+        }
+        ++ix;
+    }
+    return len;
+}
+
+// Converts `s`, which must have passed utf16_to_utf8_length
+static void utf16_to_utf8(const wchar_t* s, size_t count, uint8_t* out) {
+    size_t ix = 0;
+    while (ix < count) {
+#ifdef UTF_BLOCK
+        if (ix + UTF_BLOCK <= count && utf16_ascii_block(s + ix)) {
+#if UTF_BLOCK == 32
+            __m256i a = _mm256_loadu_si256((const __m256i*)(s + ix));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(s + ix + 16));
+            // packus works per 128 bit lane, put the qwords back in order
+            __m256i v = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+            _mm256_storeu_si256((__m256i*)out, v);
+#else
+            __m128i a = _mm_loadu_si128((const __m128i*)(s + ix));
+            __m128i b = _mm_loadu_si128((const __m128i*)(s + ix + 8));
+            _mm_storeu_si128((__m128i*)out, _mm_packus_epi16(a, b));
+#endif
+            ix += UTF_BLOCK;
+            out += UTF_BLOCK;
+            continue;
+        }
+#endif
+        uint32_t c = s[ix];
+        if (c < 0x80) {
+            *out++ = c;
+        } else if (c < 0x800) {
+            *out++ = 0xC0 | (c >> 6);
+            *out++ = 0x80 | (c & 0x3F);
+        } else if (c < 0xD800 || c > 0xDFFF) {
+            *out++ = 0xE0 | (c >> 12);
+            *out++ = 0x80 | ((c >> 6) & 0x3F);
+            *out++ = 0x80 | (c & 0x3F);
+        } else {
+            uint32_t cp = 0x10000 + (((c & 0x3FF) << 10) | (s[ix + 1] & 0x3FF));
+            *out++ = 0xF0 | (cp >> 18);
+            *out++ = 0x80 | ((cp >> 12) & 0x3F);
+            *out++ = 0x80 | ((cp >> 6) & 0x3F);
+            *out++ = 0x80 | (cp & 0x3F);
+            ++ix;
+        }
+        ++ix;
+    }
+}
 
+// Converts utf16 into s->buffer + offset, replacing anything after it
+static bool String_set_utf16_at(String* s, string_size_t offset,
+                                const wchar_t* str, size_t count) {
+    int64_t size = utf16_to_utf8_length(str, count);
+    if (size >= 0) {
+        if (!String_reserve(s, offset + size)) {
+            return false;
+        }
+        utf16_to_utf8(str, count, (uint8_t*)s->buffer + offset);
+    } else {
+        UINT code_point = 65001;
+        size = WideCharToMultiByte(code_point, 0, str, count, NULL, 0, NULL, NULL);
+        if (!String_reserve(s, offset + size)) {
+            return false;
+        }
+        size = WideCharToMultiByte(code_point, 0, str, count, s->buffer + offset,
+                                   size, NULL, NULL);
+        if (size == 0) {
+            return false;
+        }
+    }
+    s->length = offset + size;
+    s->buffer[s->length] = '\0';
     return true;
 }
 
+// Converts utf8 into s->buffer + offset, replacing anything after it
+static bool WString_set_utf8_at(WString* s, string_size_t offset,
+                                const char* str, size_t count) {
+    int64_t size = utf8_to_utf16_length((const uint8_t*)str, count);
+    if (size >= 0) {
+        if (!WString_reserve(s, offset + size)) {
+            return false;
+        }
+        utf8_to_utf16((const uint8_t*)str, count, s->buffer + offset);
+    } else {
+        UINT code_point = 65001;
+        size = MultiByteToWideChar(code_point, 0, str, count, NULL, 0);
+        if (!WString_reserve(s, offset + size)) {
+            return false;
+        }
+        size = MultiByteToWideChar(code_point, 0, str, count, s->buffer + offset, size);
+        if (size == 0) {
+            return false;
+        }
+    }
+    s->length = offset + size;
+    s->buffer[s->length] = L'\0';
+    return true;
+}
+
+bool String_append_utf16_bytes(String* s, const wchar_t* str, size_t count) {
+    if (count == 0) {
+        return true;
+    }
+    return String_set_utf16_at(s, s->length, str, count);
+}
+
 bool String_from_utf16_bytes(String *dest, const wchar_t *s, size_t count) {
     if (count == 0) {
         String_clear(dest);
         return true;
     }
-    UINT code_point = 65001;
-    DWORD size = WideCharToMultiByte(code_point, 0, s, count, NULL, 0, NULL, NULL);
-    if (!String_reserve(dest, size)) {
-        return false;
-    }
-    size = WideCharToMultiByte(code_point, 0, s, count, dest->buffer, size, NULL, NULL);
-    if (size == 0) {
-        return false;
-    }
-    dest->length = size;
-    dest->buffer[size] = L'\0';
-
-    return true;
+    return String_set_utf16_at(dest, 0, s, count);
 }
 
 bool String_from_utf16_str(String *dest, const wchar_t* s) {
@@ -332,8 +691,13 @@ void WString_clear(WString *s) {
 }
 
 bool WString_create(WString *s) {
+    return WString_create_with(s, NULL);
+}
+
+bool WString_create_with(WString_noinit* s, const Allocator* allocator) {
     s->length = 0;
-    s->buffer = Mem_alloc(MEM_ALIGNMENT);
+    s->allocator = allocator;
+    s->buffer = Allocator_alloc(allocator, MEM_ALIGNMENT);
     if (s->buffer == NULL) {
         s->capacity = 0;
         return false;
@@ -344,15 +708,21 @@ bool WString_create(WString *s) {
 }
 
 bool WString_create_capacity(WString_noinit* s, string_size_t cap) {
+    return WString_create_capacity_with(s, cap, NULL);
+}
+
+bool WString_create_capacity_with(WString_noinit* s, string_size_t cap,
+                                  const Allocator* allocator) {
     if (cap > 0x7fffffff) {
         return false;
     }
     s->length = 0;
+    s->allocator = allocator;
     s->capacity = MEM_ALIGNMENT / sizeof(wchar_t);
     while (s->capacity < cap) {
         s->capacity *= 2;
     }
-    s->buffer = Mem_alloc(s->capacity * sizeof(wchar_t));
+    s->buffer = Allocator_alloc(allocator, s->capacity * sizeof(wchar_t));
     if (s->buffer == NULL) {
         s->capacity = 0;
         return false;
@@ -409,8 +779,57 @@ bool WString_equals_str(const WString* s, const wchar_t* str) {
     return memcmp(s->buffer, str, s->length * sizeof(wchar_t)) == 0;
 }
 
+WStrView WStrView_from_str(const wchar_t* c_str) {
+    WStrView v;
+    v.data = c_str;
+    v.length = wcslen(c_str);
+    return v;
+}
+
+WStrView WString_view(const WString* s) {
+    WStrView v;
+    v.data = s->buffer;
+    v.length = s->length;
+    return v;
+}
+
+WStrView WString_slice(const WString* s, string_size_t ix, string_size_t count) {
+    WStrView v;
+    if (ix > s->length) {
+        ix = s->length;
+    }
+    if (count > s->length - ix) {
+        count = s->length - ix;
+    }
+    v.data = s->buffer + ix;
+    v.length = count;
+    return v;
+}
+
+bool WStrView_equals(WStrView a, WStrView b) {
+    if (a.length != b.length) {
+        return false;
+    }
+    return memcmp(a.data, b.data, a.length * sizeof(wchar_t)) == 0;
+}
+
+bool WStrView_startswith(WStrView v, WStrView prefix) {
+    if (v.length < prefix.length) {
+        return false;
+    }
+    return memcmp(v.data, prefix.data, prefix.length * sizeof(wchar_t)) == 0;
+}
+
+bool WString_equals_view(const WString* s, WStrView v) {
+    return WStrView_equals(WString_view(s), v);
+}
+
+bool WString_startswith_view(const WString* s, WStrView v) {
+    return WStrView_startswith(WString_view(s), v);
+}
+
 void WString_free(WString *s) {
-    Mem_free(s->buffer);
+    Allocator_free(s->allocator, s->buffer);
     s->capacity = 0;
     s->length = 0;
     s->buffer = NULL;
@@ -418,6 +837,7 @@ void WString_free(WString *s) {
 
 bool WString_copy(WString* dest, WString* source) {
     dest->length = source->length;
+    dest->allocator = NULL;
     dest->capacity = 4;
     while (dest->capacity <= source->length) {
         dest->capacity = dest->capacity * 2;
@@ -442,6 +862,20 @@ bool WString_append_count(WString* s, const wchar_t* buf, string_size_t count) {
     return TRUE;
 }
 
+bool WString_append_view(WString* s, WStrView v) {
+    return WString_append_count(s, v.data, v.length);
+}
+
+bool WString_from_view(WString* dest, WStrView v) {
+    if (!WString_create_capacity(dest, v.length + 1)) {
+        return false;
+    }
+    memcpy(dest->buffer, v.data, v.length * sizeof(wchar_t));
+    dest->length = v.length;
+    dest->buffer[v.length] = L'\0';
+    return true;
+}
+
 
 bool WString_reserve(WString* s, size_t count) {
     if (s->capacity <= count) {
@@ -455,7 +889,9 @@ bool WString_reserve(WString* s, size_t count) {
         while (new_cap <= count) {
             new_cap *= 2;
         }
-        wchar_t* buf = Mem_realloc(s->buffer, new_cap * sizeof(wchar_t));
+        wchar_t* buf = Allocator_realloc(s->allocator, s->buffer,
+                                         s->capacity * sizeof(wchar_t),
+                                         new_cap * sizeof(wchar_t));
         if (buf == NULL) {
             return false;
         }
@@ -466,6 +902,9 @@ bool WString_reserve(WString* s, size_t count) {
 }
 
 bool WString_from_con_bytes(WString* dest, const char* s, size_t count, UINT code_point) {
+    if (code_point == 65001) {
+        return WString_from_utf8_bytes(dest, s, count);
+    }
     if (count == 0) {
         WString_clear(dest);
         return true;
@@ -493,19 +932,7 @@ bool WString_append_utf8_bytes(WString* s, const char* str, size_t count) {
     if (count == 0) {
         return true;
     }
-    UINT code_point = 65001;
-    DWORD size = MultiByteToWideChar(code_point, 0, str, count, NULL, 0);
-    if (!WString_reserve(s, size + s->length)) {
-        return false;
-    }
-    size = MultiByteToWideChar(code_point, 0, str, count, s->buffer + s->length, size);
-    if (size == 0) {
-        return false;
-    }
-    s->length += size;
-    s->buffer[s->length] = L'\0';
-
-    return true;
+    return WString_set_utf8_at(s, s->length, str, count);
 }
 
 bool WString_from_utf8_bytes(WString* dest, const char* s, size_t count) {
@@ -513,19 +940,7 @@ bool WString_from_utf8_bytes(WString* dest, const char* s, size_t count) {
         WString_clear(dest);
         return true;
     }
-    UINT code_point = 65001;
-    DWORD size = MultiByteToWideChar(code_point, 0, s, count, NULL, 0);
-    if (!WString_reserve(dest, size)) {
-        return false;
-    }
-    size = MultiByteToWideChar(code_point, 0, s, count, dest->buffer, size);
-    if (size == 0) {
-        return false;
-    }
-    dest->length = size;
-    dest->buffer[size] = L'\0';
-
-    return true;
+    return WString_set_utf8_at(dest, 0, s, count);
 }
 
 bool WString_from_utf8_str(WString* dest, const char* s) {
@@ -2,6 +2,7 @@
 #define DYNAMIC_STRING_H_00
 #include <stdbool.h>
 #include "mem.h"
+#include "allocator.h"
 #include <stdint.h>
 
 typedef uint32_t string_size_t;
@@ -10,10 +11,34 @@ typedef struct String {
     char* buffer;
     string_size_t capacity;
     string_size_t length;
+    // NULL for the process heap
+    const Allocator* allocator;
 } String;
 
 typedef String String_noinit;
 
+// Non-owning slice of characters, not necessarily null-terminated
+typedef struct StrView {
+    const char* data;
+    string_size_t length;
+} StrView;
+
+// View of a string literal, without calling strlen
+#define STRVIEW(lit) ((StrView){(lit), sizeof(lit) - 1})
+
+// View of null-terminated string `c_str`
+StrView StrView_from_str(const char* c_str);
+
+// View of the whole content of `s`
+StrView String_view(const String* s);
+
+// View of `count` characters starting at `ix` in `s`, clamped to its length
+StrView String_slice(const String* s, string_size_t ix, string_size_t count);
+
+bool StrView_equals(StrView a, StrView b);
+
+bool StrView_startswith(StrView v, StrView prefix);
+
 // Append character `c` to string
 bool String_append(String* s, const char c);
 
@@ -23,6 +48,9 @@ bool String_extend(String*s, const char* c_str);
 // Append `count` characters from `buf` to string
 bool String_append_count(String* s, const char* buf, string_size_t count);
 
+// Append content of view `v` to string
+bool String_append_view(String* s, StrView v);
+
 // Insert `c` at offset `ix` into string
 bool String_insert(String* s, string_size_t ix, const char c);
 
@@ -44,6 +72,13 @@ bool String_create(String_noinit* s);
 // Create a new string with capacity >= `cap`
 bool String_create_capacity(String_noinit* s, string_size_t cap);
 
+// Create a new string allocating from `allocator`
+bool String_create_with(String_noinit* s, const Allocator* allocator);
+
+// Create a new string with capacity >= `cap` allocating from `allocator`
+bool String_create_capacity_with(String_noinit* s, string_size_t cap,
+                                 const Allocator* allocator);
+
 void String_replaceall(String* s, char from, char to);
 
 string_size_t String_count(const String* s, char c);
@@ -54,12 +89,20 @@ bool String_equals(const String* s, const String* str);
 
 bool String_equals_str(const String* s, const char* str);
 
+bool String_equals_view(const String* s, StrView v);
+
+bool String_startswith_view(const String* s, StrView v);
+
 // Free a string
 void String_free(String* s);
 
 // Copy `source` into `dest`. `dest` should be unitialized
+// and is allocated from the process heap
 bool String_copy(String_noinit* dest, String* source);
 
+// Create `dest` from view `v` with a single allocation
+bool String_from_view(String_noinit* dest, StrView v);
+
 // Increase capacity to allow `count` elements
 bool String_reserve(String* s, size_t count);
 
@@ -69,14 +112,41 @@ bool String_from_utf16_bytes(String* dest, const wchar_t* s, size_t count);
 
 bool String_from_utf16_str(String* dest, const wchar_t* s);
 
+// Length of the longest prefix of the `count` bytes at `s` that is valid utf8
+size_t utf8_valid_prefix(const char* s, size_t count);
+
 typedef struct WString {
     wchar_t* buffer;
     string_size_t capacity;
     string_size_t length;
+    // NULL for the process heap
+    const Allocator* allocator;
 } WString;
 
 typedef WString WString_noinit;
 
+// Non-owning slice of wide characters, not necessarily null-terminated
+typedef struct WStrView {
+    const wchar_t* data;
+    string_size_t length;
+} WStrView;
+
+// View of a wide string literal, without calling wcslen
+#define WSTRVIEW(lit) ((WStrView){(lit), (sizeof(lit) / sizeof(wchar_t)) - 1})
+
+// View of null-terminated string `c_str`
+WStrView WStrView_from_str(const wchar_t* c_str);
+
+// View of the whole content of `s`
+WStrView WString_view(const WString* s);
+
+// View of `count` characters starting at `ix` in `s`, clamped to its length
+WStrView WString_slice(const WString* s, string_size_t ix, string_size_t count);
+
+bool WStrView_equals(WStrView a, WStrView b);
+
+bool WStrView_startswith(WStrView v, WStrView prefix);
+
 // Append character `c` to string
 bool WString_append(WString* s, const wchar_t c);
 
@@ -86,6 +156,9 @@ bool WString_extend(WString*s, const wchar_t* c_str);
 // Append `count` characters from `buf` to string
 bool WString_append_count(WString* s, const wchar_t* buf, string_size_t count);
 
+// Append content of view `v` to string
+bool WString_append_view(WString* s, WStrView v);
+
 // Insert `c` at offset `ix` into string
 bool WString_insert(WString* s, string_size_t ix, const wchar_t c);
 
@@ -107,6 +180,13 @@ bool WString_create(WString_noinit* s);
 // Create a new string with capacity >= `cap`
 bool WString_create_capacity(WString_noinit* s, string_size_t cap);
 
+// Create a new string allocating from `allocator`
+bool WString_create_with(WString_noinit* s, const Allocator* allocator);
+
+// Create a new string with capacity >= `cap` allocating from `allocator`
+bool WString_create_capacity_with(WString_noinit* s, string_size_t cap,
+                                  const Allocator* allocator);
+
 void WString_replaceall(WString* s, wchar_t from, wchar_t to);
 
 string_size_t WString_count(const WString* s, wchar_t c);
@@ -117,12 +197,20 @@ bool WString_equals(const WString* s, const WString* str);
 
 bool WString_equals_str(const WString* s, const wchar_t* str);
 
+bool WString_equals_view(const WString* s, WStrView v);
+
+bool WString_startswith_view(const WString* s, WStrView v);
+
 // Free a string
 void WString_free(WString* s);
 
 // Copy `source` into `dest`. `dest` should be unitialized
+// and is allocated from the process heap
 bool WString_copy(WString_noinit* dest, WString* source);
 
+// Create `dest` from view `v` with a single allocation
+bool WString_from_view(WString_noinit* dest, WStrView v);
+
 // Increase capacity to allow `count` elements
 bool WString_reserve(WString* s, size_t count);
 
@@ -498,6 +498,7 @@ bool output_line(const char* line, uint32_t len, uint64_t lineno, uint32_t opts,
         s.buffer = (char*)utf16_buf->buffer;
         s.capacity = utf16_buf->capacity * sizeof(wchar_t);
         s.length = 0;
+        s.allocator = utf16_buf->allocator;
 
         if (list_name) {
             if (color) {
@@ -4,22 +4,27 @@
 #endif
 #include "hashmap.h"
 
+#define MAP_ALLOC(map, size) ((map)->allocator == NULL ? HASHMAP_ALLOC_FN(size) : \
+    (map)->allocator->alloc((map)->allocator->ctx, (size)))
+#define MAP_FREE(map, ptr) ((map)->allocator == NULL ? (void)HASHMAP_FREE_FN(ptr) : \
+    (map)->allocator->free((map)->allocator->ctx, (ptr)))
+
 #ifdef HASHMAP_ALLOC_ERROR
 #define CHECKED_CALL(c) if (!(c)) {return 0;}
-#define CHECKED_ALLOC(name, size) do {name = HASHMAP_ALLOC_FN(size); if (name == NULL) { return 0; } } while(0)
+#define CHECKED_ALLOC(map, name, size) do {name = MAP_ALLOC(map, size); if (name == NULL) { return 0; } } while(0)
 #else
 #define CHECKED_CALL(c) c
-#define CHECKED_ALLOC(name, size) name = HASHMAP_ALLOC_FN(size)
+#define CHECKED_ALLOC(map, name, size) name = MAP_ALLOC(map, size)
 #endif
 
 void HashMap_Free(HashMap* map) {
     for (uint32_t i = 0; i < map->bucket_count; ++i) {
 #ifdef HASHMAP_STRINGKEY
         for (uint32_t j = 0; j < map->buckets[i].size; ++j) {
-            HASHMAP_FREE_FN((ckey_t*)map->buckets[i].data[j].key);
+            MAP_FREE(map, (ckey_t*)map->buckets[i].data[j].key);
         } 
 #endif
-        HASHMAP_FREE_FN(map->buckets[i].data);
+        MAP_FREE(map, map->buckets[i].data);
     }
     map->element_count = 0;
     map->bucket_count = 0;
@@ -29,14 +34,15 @@ void HashMap_Free(HashMap* map) {
     map->last_bucket_ix = 0;
     map->last_elem_ix = 0;
 #endif
-    HASHMAP_FREE_FN(map->buckets);
+    MAP_FREE(map, map->buckets);
     map->buckets = NULL;
 }
 
-int HashMap_Allocate(HashMap* map, uint32_t bucket_count) {
+// Allocate buckets using the allocator already set in `map`
+static int HashMap_AllocateBuckets(HashMap* map, uint32_t bucket_count) {
     map->element_count = 0;
     map->bucket_count = bucket_count;
-    map->buckets = HASHMAP_ALLOC_FN(bucket_count * sizeof(HashBucket));
+    map->buckets = MAP_ALLOC(map, bucket_count * sizeof(HashBucket));
 #ifdef HASHMAP_LINKED
     map->first_bucket_ix = 0;
     map->first_elem_ix = 0;
@@ -52,7 +58,7 @@ int HashMap_Allocate(HashMap* map, uint32_t bucket_count) {
     for (uint32_t i = 0; i < bucket_count; ++i) {
         map->buckets[i].size = 0;
         map->buckets[i].capacity = HASHMAP_INIT_BUCKET_CAP;
-        map->buckets[i].data = HASHMAP_ALLOC_FN(HASHMAP_INIT_BUCKET_CAP * sizeof(HashElement));
+        map->buckets[i].data = MAP_ALLOC(map, HASHMAP_INIT_BUCKET_CAP * sizeof(HashElement));
 #ifdef HASHMAP_ALLOC_ERROR
         if (map->buckets[i].data == NULL) {
             map->bucket_count = i;
@@ -64,11 +70,16 @@ int HashMap_Allocate(HashMap* map, uint32_t bucket_count) {
     return 1;
 }
 
+int HashMap_Allocate(HashMap* map, uint32_t bucket_count) {
+    map->allocator = NULL;
+    return HashMap_AllocateBuckets(map, bucket_count);
+}
+
 void HashMap_Clear(HashMap* map) {
     for (uint32_t i = 0; i < map->bucket_count; ++i) {
 #ifdef HASHMAP_STRINGKEY
         for (uint32_t j = 0; j < map->buckets[i].size; ++j) {
-            HASHMAP_FREE_FN((ckey_t*)map->buckets[i].data[j].key);
+            MAP_FREE(map, (ckey_t*)map->buckets[i].data[j].key);
         }
 #endif
         map->buckets[i].size = 0;
@@ -86,6 +97,11 @@ int HashMap_Create(HashMap* map) {
     return HashMap_Allocate(map, HASHMAP_INIT_BUCKETS);
 }
 
+int HashMap_CreateWith(HashMap* map, const Allocator* allocator) {
+    map->allocator = allocator;
+    return HashMap_AllocateBuckets(map, HASHMAP_INIT_BUCKETS);
+}
+
 static uint64_t hash(const ckey_t str) {
 #ifdef HASHMAP_STRINGKEY
     uint64_t hash = 5381;
@@ -136,9 +152,9 @@ static HashElement* HashMap_GetElement(HashMap* map, const ckey_t key, HashBucke
 static int HashMap_AddElement(HashMap* map, HashBucket* bucket, HashElement element) {
     if (bucket->size == bucket->capacity) {
         HashElement* new_data;
-        CHECKED_ALLOC(new_data, bucket->size * 2 * sizeof(HashElement));
+        CHECKED_ALLOC(map, new_data, bucket->size * 2 * sizeof(HashElement));
         memcpy(new_data, bucket->data, bucket->size * sizeof(HashElement));
-        HASHMAP_FREE_FN(bucket->data);
+        MAP_FREE(map, bucket->data);
         bucket->data = new_data;
         bucket->capacity = bucket->size * 2;
     }
@@ -165,7 +181,8 @@ static int HashMap_AddElement(HashMap* map, HashBucket* bucket, HashElement elem
 
 static int HashMap_Rehash(HashMap* map) {
     HashMap tmp;
-    CHECKED_CALL(HashMap_Allocate(&tmp, map->bucket_count * 2));
+    tmp.allocator = map->allocator;
+    CHECKED_CALL(HashMap_AllocateBuckets(&tmp, map->bucket_count * 2));
 #ifdef HASHMAP_LINKED
     uint32_t b = map->first_bucket_ix;
     uint32_t ix = map->first_elem_ix;
@@ -201,9 +218,9 @@ static int HashMap_Rehash(HashMap* map) {
     }
 #endif
     for (uint32_t i = 0; i < map->bucket_count; ++i) {
-        HASHMAP_FREE_FN(map->buckets[i].data);
+        MAP_FREE(map, map->buckets[i].data);
     }
-    HASHMAP_FREE_FN(map->buckets);
+    MAP_FREE(map, map->buckets);
     *map = tmp;
     return 1;
 }
@@ -221,7 +238,7 @@ int HashMap_Insert(HashMap* map, const ckey_t key, void* value) {
 #ifdef HASHMAP_STRINGKEY
     uint32_t len = keylen(key);
     ckey_t buf;
-    CHECKED_ALLOC(buf, (len + 1) * sizeof(*key));
+    CHECKED_ALLOC(map, buf, (len + 1) * sizeof(*key));
     memcpy(buf, key, (len + 1) * sizeof(*key));
     HashElement he = {buf, value};
 #else
@@ -243,7 +260,7 @@ HashElement* HashMap_Get(HashMap* map, const ckey_t key) {
 #ifdef HASHMAP_STRINGKEY
     uint32_t len = keylen(key);
     ckey_t buf;
-    CHECKED_ALLOC(buf, (len + 1) * sizeof(*key));
+    CHECKED_ALLOC(map, buf, (len + 1) * sizeof(*key));
     memcpy(buf, key, (len + 1) * sizeof(*key));
     HashElement he = {buf, NULL};
 #else
@@ -302,7 +319,7 @@ static void HashMap_RemoveElement(HashMap* map, HashBucket* bucket, HashElement*
 
 #endif
 #ifdef HASHMAP_STRINGKEY
-    HASHMAP_FREE_FN((ckey_t)element->key);
+    MAP_FREE(map, (ckey_t)element->key);
 #endif
     memmove(&bucket->data[elem_ix], &bucket->data[bucket->size - 1],
             sizeof(HashElement));
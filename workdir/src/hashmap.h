@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include "mem.h"
+#include "allocator.h"
 
 #define HASHMAP_PROCESS_HEAP
 
@@ -62,6 +63,7 @@
         #define HashMap_Allocate LinkedU64HashMap_Allocate
         #define HashMap_Clear LinkedU64HashMap_Clear
         #define HashMap_Create LinkedU64HashMap_Create
+        #define HashMap_CreateWith LinkedU64HashMap_CreateWith
         #define HashMap_Insert LinkedU64HashMap_Insert
         #define HashMap_Find LinkedU64HashMap_Find
         #define HashMap_Get LinkedU64HashMap_Get
@@ -81,6 +83,7 @@
         #define HashMap_Allocate U64HashMap_Allocate
         #define HashMap_Clear U64HashMap_Clear
         #define HashMap_Create U64HashMap_Create
+        #define HashMap_CreateWith U64HashMap_CreateWith
         #define HashMap_Insert U64HashMap_Insert
         #define HashMap_Find U64HashMap_Find
         #define HashMap_Get U64HashMap_Get
@@ -116,6 +119,7 @@
         #define HashMap_Allocate LinkedWHashMap_Allocate
         #define HashMap_Clear LinkedWHashMap_Clear
         #define HashMap_Create LinkedWHashMap_Create
+        #define HashMap_CreateWith LinkedWHashMap_CreateWith
         #define HashMap_Insert LinkedWHashMap_Insert
         #define HashMap_Find LinkedWHashMap_Find
         #define HashMap_Get LinkedWHashMap_Get
@@ -135,6 +139,7 @@
         #define HashMap_Allocate WHashMap_Allocate
         #define HashMap_Clear WHashMap_Clear
         #define HashMap_Create WHashMap_Create
+        #define HashMap_CreateWith WHashMap_CreateWith
         #define HashMap_Insert WHashMap_Insert
         #define HashMap_Find WHashMap_Find
         #define HashMap_Get WHashMap_Get
@@ -162,6 +167,7 @@
         #define HashMap_Allocate LinkedHashMap_Allocate
         #define HashMap_Clear LinkedHashMap_Clear
         #define HashMap_Create LinkedHashMap_Create
+        #define HashMap_CreateWith LinkedHashMap_CreateWith
         #define HashMap_Insert LinkedHashMap_Insert
         #define HashMap_Find LinkedHashMap_Find
         #define HashMap_Get LinkedHashMap_Get
@@ -202,6 +208,8 @@ typedef struct HashMap {
     HashBucket* buckets;
     uint32_t bucket_count;
     uint32_t element_count;
+    // NULL for HASHMAP_ALLOC_FN
+    const Allocator* allocator;
 #ifdef HASHMAP_LINKED
     uint32_t first_bucket_ix;
     uint32_t first_elem_ix;
@@ -218,6 +226,9 @@ void HashMap_Clear(HashMap* map);
 
 int HashMap_Create(HashMap* map);
 
+// Create a map that allocates buckets and keys from `allocator`
+int HashMap_CreateWith(HashMap* map, const Allocator* allocator);
+
 int HashMap_Insert(HashMap* map, const ckey_t key, void* value);
 
 HashElement* HashMap_Find(HashMap* map, const ckey_t key);
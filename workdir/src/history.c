@@ -0,0 +1,617 @@
+#include "history.h"
+#include "mem.h"
+
+// Address space reserved for the text of entries
+#define HISTORY_ARENA_SIZE (64ull << 20)
+// Replaced entries allowed in the trigram lists before they are compacted
+#define HISTORY_DEAD_IDS 256
+
+static bool reserve(void** dst, uint32_t* cap, uint32_t size, size_t elem_size) {
+    if (size <= *cap) {
+        return true;
+    }
+    uint32_t new_cap = *cap == 0 ? 4 : *cap;
+    while (new_cap < size) {
+        new_cap *= 2;
+    }
+    void* ptr;
+    if (*dst == NULL) {
+        ptr = Mem_alloc(new_cap * elem_size);
+    } else {
+        ptr = Mem_realloc(*dst, new_cap * elem_size);
+    }
+    if (ptr == NULL) {
+        return false;
+    }
+    *dst = ptr;
+    *cap = new_cap;
+    return true;
+}
+
+static uint32_t history_hash(const wchar_t* s, uint32_t len) {
+    uint32_t hash = 2166136261u;
+    for (uint32_t ix = 0; ix < len; ++ix) {
+        hash = (hash ^ s[ix]) * 16777619u;
+    }
+    return hash;
+}
+
+// Lowercase trigram starting at `s`, only zero for three nulls
+static uint64_t history_gram(const wchar_t* s) {
+    return ((uint64_t)towlower(s[0]) << 32) | ((uint64_t)towlower(s[1]) << 16) |
+           (uint64_t)towlower(s[2]);
+}
+
+static bool history_contains(const wchar_t* text, const wchar_t* query) {
+    for (; *text != L'\0'; ++text) {
+        uint32_t j = 0;
+        while (query[j] != L'\0' && text[j] != L'\0' &&
+               towlower(text[j]) == towlower(query[j])) {
+            ++j;
+        }
+        if (query[j] == L'\0') {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool history_equals(const HistoryEntry* e, const wchar_t* s, uint32_t len, uint32_t hash) {
+    return e->hash == hash && e->length == len &&
+           memcmp(e->text, s, len * sizeof(wchar_t)) == 0;
+}
+
+static HANDLE history_open_append(History* h) {
+    // Other shells append to the same file
+    return CreateFileW(h->path.buffer, FILE_APPEND_DATA | FILE_READ_ATTRIBUTES,
+                       FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS,
+                       FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+static HANDLE history_open_read(History* h) {
+    return CreateFileW(h->path.buffer, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                       NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+}
+
+static uint32_t* history_set_slot(History* h, const wchar_t* s, uint32_t len, uint32_t hash) {
+    uint32_t mask = h->set_cap - 1;
+    uint32_t ix = hash & mask;
+    while (h->set[ix] != 0 && !history_equals(&h->entries[h->set[ix] - 1], s, len, hash)) {
+        ix = (ix + 1) & mask;
+    }
+    return &h->set[ix];
+}
+
+static bool history_grow_set(History* h) {
+    if ((h->live_count + 1) * 4 <= h->set_cap * 3) {
+        return true;
+    }
+    uint32_t cap = h->set_cap == 0 ? 1024 : h->set_cap * 2;
+    uint32_t* set = Mem_alloc(cap * sizeof(uint32_t));
+    if (set == NULL) {
+        return false;
+    }
+    memset(set, 0, cap * sizeof(uint32_t));
+    for (uint32_t id = 0; id < h->entry_count; ++id) {
+        if (h->entries[id].text == NULL) {
+            continue;
+        }
+        uint32_t ix = h->entries[id].hash & (cap - 1);
+        while (set[ix] != 0) {
+            ix = (ix + 1) & (cap - 1);
+        }
+        set[ix] = id + 1;
+    }
+    Mem_free(h->set);
+    h->set = set;
+    h->set_cap = cap;
+    return true;
+}
+
+static HistoryGram* history_gram_slot(HistoryGram* grams, uint32_t cap, uint64_t gram) {
+    uint32_t mask = cap - 1;
+    uint32_t ix = (uint32_t)((gram * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+    while (grams[ix].gram != 0 && grams[ix].gram != gram) {
+        ix = (ix + 1) & mask;
+    }
+    return &grams[ix];
+}
+
+static bool history_add_gram(History* h, uint64_t gram, uint32_t id) {
+    if ((h->gram_count + 1) * 4 > h->gram_cap * 3) {
+        uint32_t cap = h->gram_cap == 0 ? 1024 : h->gram_cap * 2;
+        HistoryGram* grams = Mem_alloc(cap * sizeof(HistoryGram));
+        if (grams == NULL) {
+            return false;
+        }
+        memset(grams, 0, cap * sizeof(HistoryGram));
+        for (uint32_t ix = 0; ix < h->gram_cap; ++ix) {
+            if (h->grams[ix].gram != 0) {
+                *history_gram_slot(grams, cap, h->grams[ix].gram) = h->grams[ix];
+            }
+        }
+        Mem_free(h->grams);
+        h->grams = grams;
+        h->gram_cap = cap;
+    }
+    HistoryGram* g = history_gram_slot(h->grams, h->gram_cap, gram);
+    if (g->gram == 0) {
+        g->gram = gram;
+        h->gram_count += 1;
+    }
+    // A trigram repeated within one entry is only listed once
+    if (g->count > 0 && g->ids[g->count - 1] == id) {
+        return true;
+    }
+    if (!reserve((void**)&g->ids, &g->capacity, g->count + 1, sizeof(uint32_t))) {
+        return false;
+    }
+    g->ids[g->count] = id;
+    g->count += 1;
+    return true;
+}
+
+// Drop the ids of replaced entries from all trigram lists
+static void history_compact_grams(History* h) {
+    for (uint32_t ix = 0; ix < h->gram_cap; ++ix) {
+        HistoryGram* g = &h->grams[ix];
+        uint32_t count = 0;
+        for (uint32_t p = 0; p < g->count; ++p) {
+            if (h->entries[g->ids[p]].text != NULL) {
+                g->ids[count++] = g->ids[p];
+            }
+        }
+        g->count = count;
+    }
+    h->dead_ids = 0;
+}
+
+static bool history_is_newest(History* h, const wchar_t* s, uint32_t len, uint32_t hash) {
+    return h->entry_count > 0 && history_equals(&h->entries[h->entry_count - 1], s, len, hash);
+}
+
+// Add `text` as the newest entry, unless it already is
+static bool history_insert(History* h, const wchar_t* text, uint32_t len) {
+    uint32_t hash = history_hash(text, len);
+    if (history_is_newest(h, text, len, hash)) {
+        return true;
+    }
+    if (!history_grow_set(h) ||
+        !reserve((void**)&h->entries, &h->entry_capacity, h->entry_count + 1, sizeof(HistoryEntry))) {
+        return false;
+    }
+    wchar_t* copy = Arena_alloc_count(&h->arena, wchar_t, len + 1);
+    if (copy == NULL) {
+        return false;
+    }
+    memcpy(copy, text, len * sizeof(wchar_t));
+    copy[len] = L'\0';
+
+    uint32_t id = h->entry_count;
+    uint32_t* slot = history_set_slot(h, text, len, hash);
+    if (*slot != 0) {
+        // The old id stays in the trigram lists until enough of them pile up
+        HistoryEntry* old = &h->entries[*slot - 1];
+        if (old->length >= 3) {
+            h->dead_ids += 1;
+        }
+        old->text = NULL;
+    } else {
+        h->live_count += 1;
+    }
+    *slot = id + 1;
+    h->entries[id].text = copy;
+    h->entries[id].length = len;
+    h->entries[id].hash = hash;
+    h->entry_count += 1;
+
+    for (uint32_t ix = 0; ix + 3 <= len; ++ix) {
+        uint64_t gram = history_gram(copy + ix);
+        if (gram != 0 && !history_add_gram(h, gram, id)) {
+            return false;
+        }
+    }
+    if (h->dead_ids > HISTORY_DEAD_IDS && h->dead_ids > h->live_count) {
+        history_compact_grams(h);
+    }
+    return true;
+}
+
+static void history_reset(History* h) {
+    for (uint32_t ix = 0; ix < h->gram_cap; ++ix) {
+        Mem_free(h->grams[ix].ids);
+    }
+    if (h->gram_cap > 0) {
+        memset(h->grams, 0, h->gram_cap * sizeof(HistoryGram));
+    }
+    if (h->set_cap > 0) {
+        memset(h->set, 0, h->set_cap * sizeof(uint32_t));
+    }
+    h->gram_count = 0;
+    h->dead_ids = 0;
+    h->live_count = 0;
+    h->entry_count = 0;
+    h->indexed_size = 0;
+    Arena_release(&h->arena);
+}
+
+// Index the complete lines of `buf`, returning the length of them
+static uint64_t history_parse(History* h, const wchar_t* buf, uint64_t len) {
+    uint64_t start = 0;
+    for (uint64_t ix = 0; ix < len; ++ix) {
+        if (buf[ix] != L'\r' && buf[ix] != L'\n') {
+            continue;
+        }
+        if (ix > start && ix - start < 0xffffffff) {
+            history_insert(h, buf + start, ix - start);
+        }
+        start = ix + 1;
+    }
+    return start;
+}
+
+// Index the lines added to `file` since the last read. Everything is read
+// again if the file has been rewritten.
+static bool history_read(History* h, HANDLE file) {
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        return false;
+    }
+    if ((uint64_t)size.QuadPart < h->indexed_size) {
+        history_reset(h);
+    }
+    // Include the line break ending the indexed part, to see that it has
+    // not moved
+    uint64_t from = h->indexed_size;
+    uint64_t start = from == 0 ? 0 : from - sizeof(wchar_t);
+    uint64_t count = (size.QuadPart - start) / sizeof(wchar_t);
+    if (count <= (from - start) / sizeof(wchar_t)) {
+        return true;
+    }
+    if (count > 0x7fffffff) {
+        return false;
+    }
+    wchar_t* buf = Mem_alloc(count * sizeof(wchar_t));
+    if (buf == NULL) {
+        return false;
+    }
+    LARGE_INTEGER pos;
+    pos.QuadPart = start;
+    if (!SetFilePointerEx(file, pos, NULL, FILE_BEGIN)) {
+        Mem_free(buf);
+        return false;
+    }
+    uint64_t read = 0;
+    while (read < count * sizeof(wchar_t)) {
+        DWORD r;
+        if (!ReadFile(file, (uint8_t*)buf + read, count * sizeof(wchar_t) - read, &r, NULL) ||
+            r == 0) {
+            break;
+        }
+        read += r;
+    }
+    count = read / sizeof(wchar_t);
+    uint64_t skip = (from - start) / sizeof(wchar_t);
+    if (skip > 0 && (count == 0 || (buf[0] != L'\r' && buf[0] != L'\n'))) {
+        Mem_free(buf);
+        history_reset(h);
+        return history_read(h, file);
+    }
+    if (count > skip) {
+        h->indexed_size = from + history_parse(h, buf + skip, count - skip) * sizeof(wchar_t);
+    }
+    Mem_free(buf);
+    return true;
+}
+
+static bool history_write(const wchar_t* path, const WString* text) {
+    // Without sharing, so concurrent compactions fail instead of mixing
+    HANDLE file = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    uint64_t size = text->length * sizeof(wchar_t);
+    uint64_t written = 0;
+    while (written < size) {
+        DWORD w;
+        if (!WriteFile(file, (uint8_t*)text->buffer + written, size - written, &w, NULL) ||
+            w == 0) {
+            break;
+        }
+        written += w;
+    }
+    CloseHandle(file);
+    return written == size;
+}
+
+// Replace the file with its newest distinct entries. Only possible while
+// no other shell has it open for appending. The entries are written to a
+// temporary file first, so a failure leaves the old file intact.
+static void history_compact(History* h) {
+    if (h->file != INVALID_HANDLE_VALUE) {
+        CloseHandle(h->file);
+        h->file = INVALID_HANDLE_VALUE;
+    }
+    // Held until the move to keep out appenders, which lets the move
+    // replace it
+    HANDLE file = CreateFileW(h->path.buffer, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        goto reopen;
+    }
+    if (!history_read(h, file)) {
+        goto close;
+    }
+
+    uint64_t size = 0;
+    uint32_t first = h->entry_count;
+    while (first > 0) {
+        HistoryEntry* e = &h->entries[first - 1];
+        if (e->text != NULL) {
+            uint64_t line = (e->length + 2) * sizeof(wchar_t);
+            if (size + line > HISTORY_KEEP_SIZE) {
+                break;
+            }
+            size += line;
+        }
+        --first;
+    }
+    WString out;
+    if (!WString_create_capacity(&out, size / sizeof(wchar_t) + 1)) {
+        goto close;
+    }
+    for (uint32_t id = first; id < h->entry_count; ++id) {
+        if (h->entries[id].text != NULL) {
+            WString_append_count(&out, h->entries[id].text, h->entries[id].length);
+            WString_append_count(&out, L"\r\n", 2);
+        }
+    }
+
+    WString tmp;
+    if (!WString_create(&tmp)) {
+        WString_free(&out);
+        goto close;
+    }
+    WString_extend(&tmp, h->path.buffer);
+    WString_extend(&tmp, L".tmp");
+    if (history_write(tmp.buffer, &out) &&
+        MoveFileExW(tmp.buffer, h->path.buffer, MOVEFILE_REPLACE_EXISTING)) {
+        history_reset(h);
+        h->indexed_size = history_parse(h, out.buffer, out.length) * sizeof(wchar_t);
+    } else {
+        DeleteFileW(tmp.buffer);
+    }
+    WString_free(&tmp);
+    WString_free(&out);
+close:
+    CloseHandle(file);
+reopen:
+    h->file = history_open_append(h);
+}
+
+bool History_open(History* h, const wchar_t* path) {
+    memset(h, 0, sizeof(History));
+    h->file = INVALID_HANDLE_VALUE;
+    if (!WString_create(&h->path) || !WString_extend(&h->path, path) ||
+        !WString_create(&h->pending) ||
+        !Arena_create(&h->arena, HISTORY_ARENA_SIZE, NULL, NULL)) {
+        goto fail;
+    }
+    // Creates the file if needed
+    h->file = history_open_append(h);
+    if (h->file == INVALID_HANDLE_VALUE) {
+        goto fail;
+    }
+    HANDLE file = history_open_read(h);
+    if (file != INVALID_HANDLE_VALUE) {
+        history_read(h, file);
+        CloseHandle(file);
+    }
+    if (h->indexed_size > HISTORY_MAX_SIZE) {
+        history_compact(h);
+    }
+    return true;
+fail:
+    History_close(h);
+    return false;
+}
+
+void History_close(History* h) {
+    History_flush(h, true);
+    if (h->file != INVALID_HANDLE_VALUE) {
+        CloseHandle(h->file);
+        h->file = INVALID_HANDLE_VALUE;
+    }
+    for (uint32_t ix = 0; ix < h->gram_cap; ++ix) {
+        Mem_free(h->grams[ix].ids);
+    }
+    Mem_free(h->grams);
+    Mem_free(h->set);
+    Mem_free(h->entries);
+    h->grams = NULL;
+    h->set = NULL;
+    h->entries = NULL;
+    h->gram_cap = 0;
+    h->set_cap = 0;
+    h->entry_capacity = 0;
+    h->entry_count = 0;
+    if (h->arena.base != NULL) {
+        Arena_free(&h->arena);
+    }
+    WString_free(&h->pending);
+    WString_free(&h->path);
+}
+
+bool History_add(History* h, const wchar_t* cmd, uint32_t len) {
+    if (len == 0 || history_is_newest(h, cmd, len, history_hash(cmd, len))) {
+        return true;
+    }
+    if (!history_insert(h, cmd, len)) {
+        return false;
+    }
+    if (h->pending.length == 0) {
+        h->pending_since = GetTickCount64();
+    }
+    if (!WString_append_count(&h->pending, cmd, len) ||
+        !WString_append_count(&h->pending, L"\r\n", 2)) {
+        return false;
+    }
+    History_flush(h, false);
+    return true;
+}
+
+void History_flush(History* h, bool force) {
+    if (h->pending.length == 0) {
+        return;
+    }
+    if (!force && h->pending.length * sizeof(wchar_t) < HISTORY_FLUSH_SIZE &&
+        GetTickCount64() - h->pending_since < HISTORY_FLUSH_MS) {
+        return;
+    }
+    if (h->file == INVALID_HANDLE_VALUE) {
+        // Another shell may be compacting the file
+        h->file = history_open_append(h);
+        if (h->file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+    }
+    uint64_t size = h->pending.length * sizeof(wchar_t) - h->pending_offset;
+    uint8_t* data = (uint8_t*)h->pending.buffer + h->pending_offset;
+    uint64_t written = 0;
+    while (written < size) {
+        DWORD w;
+        if (!WriteFile(h->file, data + written, size - written, &w, NULL) || w == 0) {
+            break;
+        }
+        written += w;
+    }
+    if (written == 0) {
+        return;
+    }
+    if (written < size) {
+        // Keep what was not written for the next flush
+        uint64_t done = h->pending_offset + written;
+        WString_remove(&h->pending, 0, done / sizeof(wchar_t));
+        h->pending_offset = done % sizeof(wchar_t);
+        return;
+    }
+    WString_clear(&h->pending);
+    h->pending_offset = 0;
+
+    // Unless another shell wrote in between, the index covers the file
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(h->file, &file_size)) {
+        return;
+    }
+    if ((uint64_t)file_size.QuadPart == h->indexed_size + size) {
+        h->indexed_size = file_size.QuadPart;
+    }
+    if (file_size.QuadPart > HISTORY_MAX_SIZE) {
+        history_compact(h);
+    }
+}
+
+void History_sync(History* h) {
+    if (h->path.buffer == NULL) {
+        return;
+    }
+    History_flush(h, true);
+    HANDLE file = history_open_read(h);
+    if (file == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    history_read(h, file);
+    CloseHandle(file);
+}
+
+static const wchar_t* history_check(History* h, int64_t id, const wchar_t* query, int64_t* ix) {
+    const wchar_t* text = h->entries[id].text;
+    if (text != NULL && history_contains(text, query)) {
+        *ix = id;
+        return text;
+    }
+    return NULL;
+}
+
+const wchar_t* History_find(History* h, const wchar_t* query, int64_t* ix, int step) {
+    int64_t count = h->entry_count;
+    int64_t cur = *ix;
+    if (step == 0 && cur >= 0 && cur < count && h->entries[cur].text != NULL &&
+        (query[0] == L'\0' || history_contains(h->entries[cur].text, query))) {
+        return h->entries[cur].text;
+    }
+    if (query[0] == L'\0') {
+        return NULL;
+    }
+
+    int64_t from;
+    int64_t dir = -1;
+    if (step == 0 || (step > 0 && cur < 0)) {
+        from = count - 1;
+    } else if (step > 0) {
+        from = cur > count ? count - 1 : cur - 1;
+    } else {
+        if (cur < 0) {
+            return NULL;
+        }
+        from = cur + 1;
+        dir = 1;
+    }
+    if (from < 0 || from >= count) {
+        return NULL;
+    }
+
+    uint32_t len = wcslen(query);
+    if (len < 3) {
+        for (int64_t id = from; id >= 0 && id < count; id += dir) {
+            const wchar_t* res = history_check(h, id, query, ix);
+            if (res != NULL) {
+                return res;
+            }
+        }
+        return NULL;
+    }
+
+    // Only entries containing the rarest trigram of the query are checked
+    if (h->gram_cap == 0) {
+        return NULL;
+    }
+    HistoryGram* best = NULL;
+    for (uint32_t i = 0; i + 3 <= len; ++i) {
+        HistoryGram* g = history_gram_slot(h->grams, h->gram_cap, history_gram(query + i));
+        if (g->gram == 0) {
+            return NULL;
+        }
+        if (best == NULL || g->count < best->count) {
+            best = g;
+        }
+    }
+    uint32_t lo = 0;
+    uint32_t hi = best->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (best->ids[mid] < from) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (dir > 0) {
+        for (uint32_t p = lo; p < best->count; ++p) {
+            const wchar_t* res = history_check(h, best->ids[p], query, ix);
+            if (res != NULL) {
+                return res;
+            }
+        }
+    } else {
+        int64_t p = lo < best->count && best->ids[lo] == from ? lo : (int64_t)lo - 1;
+        for (; p >= 0; --p) {
+            const wchar_t* res = history_check(h, best->ids[p], query, ix);
+            if (res != NULL) {
+                return res;
+            }
+        }
+    }
+    return NULL;
+}
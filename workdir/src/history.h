@@ -0,0 +1,90 @@
+#ifndef HISTORY_H_00
+#define HISTORY_H_00
+
+#include <windows.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "arena.h"
+#include "dynamic_string.h"
+
+// Added entries are written once this many bytes are pending, or on the
+// first flush HISTORY_FLUSH_MS after the oldest of them was added
+#define HISTORY_FLUSH_SIZE 4096
+#define HISTORY_FLUSH_MS 2000
+// Past HISTORY_MAX_SIZE bytes the file is rewritten with its newest
+// distinct entries, at most HISTORY_KEEP_SIZE bytes of them
+#define HISTORY_MAX_SIZE (4 << 20)
+#define HISTORY_KEEP_SIZE (2 << 20)
+
+typedef struct HistoryEntry {
+    wchar_t* text; // NULL once the same command is added again
+    uint32_t length;
+    uint32_t hash;
+} HistoryEntry;
+
+// Ids of the entries containing a lowercase trigram, in increasing order
+typedef struct HistoryGram {
+    uint64_t gram; // Zero for empty slots
+    uint32_t* ids;
+    uint32_t count;
+    uint32_t capacity;
+} HistoryGram;
+
+typedef struct History {
+    WString path;
+    // Opened for appending only, shared with other shells
+    HANDLE file;
+    // Bytes of the file contained in `entries`
+    uint64_t indexed_size;
+    // Entries not yet written, and the tick they started gathering at
+    WString pending;
+    uint64_t pending_since;
+    // Bytes of the first pending character already written
+    uint32_t pending_offset;
+
+    Arena arena; // Text of entries
+    // Oldest first, the id of an entry is its index
+    HistoryEntry* entries;
+    uint32_t entry_count;
+    uint32_t entry_capacity;
+
+    // Open addressing set of live entries, as id + 1. `set_cap` is zero
+    // or a power of two.
+    uint32_t* set;
+    uint32_t set_cap;
+    uint32_t live_count;
+
+    // Open addressing table of trigrams, `gram_cap` is zero or a power
+    // of two
+    HistoryGram* grams;
+    uint32_t gram_count;
+    uint32_t gram_cap;
+    // Replaced entries still listed in `grams`
+    uint32_t dead_ids;
+} History;
+
+// Read and index the history in `path`, creating it if needed
+bool History_open(History* h, const wchar_t* path);
+
+// Write pending entries and free `h`
+void History_close(History* h);
+
+// Add command `cmd` of `len` characters, without line break. Repeating
+// the newest entry is ignored, other repeats replace the older copy.
+bool History_add(History* h, const wchar_t* cmd, uint32_t len);
+
+// Write pending entries if there are enough of them or they are old
+// enough, or always with `force`
+void History_flush(History* h, bool force);
+
+// Index entries added by other shells since the last call
+void History_sync(History* h);
+
+// Find an entry containing `query`, ignoring case. With `step` 0 this
+// keeps `*ix` if it still matches and otherwise finds the newest match,
+// with 1 it finds the next older and with -1 the next newer match.
+// `*ix` is -1 when nothing has been found yet. Returns NULL if there is
+// no match, leaving `*ix` unchanged.
+const wchar_t* History_find(History* h, const wchar_t* query, int64_t* ix, int step);
+
+#endif
@@ -1,18 +1,29 @@
 #define UNICODE
 #include <windows.h>
 #include "json.h"
+#include "json_number.h"
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 
 bool JsonObject_create(JsonObject* obj) {
     return LinkedHashMap_Create(&obj->data);
 }
 
+bool JsonObject_create_with(JsonObject* obj, const Allocator* allocator) {
+    return LinkedHashMap_CreateWith(&obj->data, allocator);
+}
+
 void JsonObject_free(JsonObject* obj) {
     LinkedHashMap* map = &obj->data;
     for (uint32_t i = 0; i < map->bucket_count; ++i) {
         for (uint32_t j = 0; j < map->buckets[i].size; ++j) {
             JsonType* type = map->buckets[i].data[j].value;
+            if (type == NULL) {
+                continue;
+            }
             JsonType_free(type);
-            Mem_free(type);
+            Allocator_free(map->allocator, type);
         } 
     }
     LinkedHashMap_Free(&obj->data);
@@ -26,7 +37,7 @@ bool JsonObject_insert(JsonObject* obj, const char* str, JsonType type) {
     if (elem->value != NULL) {
         JsonType_free(elem->value);
     } else {
-        elem->value = Mem_alloc(sizeof(JsonType));
+        elem->value = Allocator_alloc(obj->data.allocator, sizeof(JsonType));
         if (elem->value == NULL) {
             return false;
         }
@@ -153,12 +164,17 @@ bool JsonObject_remove(JsonObject* obj, const char* key) {
         return false;
     }
     JsonType_free(val);
-    Mem_free(val);
+    Allocator_free(obj->data.allocator, val);
     return true;
 }
 
 bool JsonList_create(JsonList* list) {
-    list->data = Mem_alloc(4 * sizeof(JsonType));
+    return JsonList_create_with(list, NULL);
+}
+
+bool JsonList_create_with(JsonList* list, const Allocator* allocator) {
+    list->allocator = allocator;
+    list->data = Allocator_alloc(allocator, 4 * sizeof(JsonType));
     if (list->data == NULL) {
         list->capacity = 0;
         list->size = 0;
@@ -173,14 +189,16 @@ void JsonList_free(JsonList* list) {
     for (unsigned ix = 0; ix < list->size; ++ix) {
         JsonType_free(list->data + ix);
     }
-    Mem_free(list->data);
+    Allocator_free(list->allocator, list->data);
 }
 
 
 bool JsonList_append(JsonList* list, JsonType val) {
     if (list->size == list->capacity) {
         unsigned cap = list->capacity == 0 ? 4 : list->capacity * 2;
-        JsonType* data = Mem_realloc(list->data, sizeof(JsonType) * cap);
+        JsonType* data = Allocator_realloc(list->allocator, list->data,
+                                           sizeof(JsonType) * list->capacity,
+                                           sizeof(JsonType) * cap);
         if (data == NULL) {
             return false;
         }
@@ -246,7 +264,9 @@ bool JsonList_insert(JsonList* list, unsigned ix, JsonType val) {
     }
     if (list->size == list->capacity) {
         unsigned cap = list->capacity == 0 ? 4 : list->capacity * 2;
-        JsonType* data = Mem_realloc(list->data, sizeof(JsonType) * cap);
+        JsonType* data = Allocator_realloc(list->allocator, list->data,
+                                           sizeof(JsonType) * list->capacity,
+                                           sizeof(JsonType) * cap);
         if (data == NULL) {
             return false;
         }
@@ -464,61 +484,25 @@ void JsonType_free(JsonType* val) {
     val->type = JSON_NULL;
 }
 
-typedef struct ParseCtx {
-    const char* root;
-    unsigned row;
-    unsigned col;
-    String errormsg;
-} JsonParseCtx;
-
+// Advance root to `pos`, counting rows and columns on the way
 void find_position(JsonParseCtx* ctx, const char* pos) {
-    ctx->row = 1;
-    ctx->col = 1;
     const char* s = ctx->root;
-    char last = '\0';
     while (s < pos) {
-        if (*s == '\r' || (*s == '\n' && last != '\r')) {
+        if (*s == '\r' || (*s == '\n' && ctx->last != '\r')) {
             ctx->col = 1;
             ++ctx->row;
-        } else {
+        } else if (*s != '\n') {
             ++ctx->col;
         }
-        last = *s;
+        ctx->last = *s;
         ++s;
     }
+    ctx->root = pos;
 }
 
 bool format_int(String* dst, int64_t i) {
-    if (i == 0) {
-        return String_append(dst, '0');
-    }
-    uint64_t n;
-    if (i < 0) {
-        if (i == INT64_MIN) {
-            n = ((uint64_t)INT64_MAX) + 1;
-        } else {
-            n = -i;
-        }
-        if (!String_append(dst, '-')) {
-            return false;
-        }
-    }  else {
-        n = i;
-    }
-    unsigned ix = 0;
-    char buf[20];
-    while (n > 0) {
-        buf[ix] = (n % 10) + '0';
-        ++ix;
-        n /= 10;
-    }
-    while (ix > 0) {
-        if (!String_append(dst, buf[ix - 1])) {
-            return false;
-        }
-        --ix;
-    }
-    return true;
+    char buf[JSON_INT_MAX_LEN];
+    return String_append_count(dst, buf, json_format_int(i, buf));
 }
 
 bool unexpected_eof(const char* s, JsonParseCtx* ctx) {
@@ -579,282 +563,141 @@ bool invalid_literal(const char* s, JsonParseCtx* ctx, const char* type) {
     return false;
 }
 
-// Skip until next non-space character
-bool skip_spaces(const char** str, JsonParseCtx* ctx) {
-    const char* s = *str;
-    if (*s == '\0') {
-        return unexpected_eof(s, ctx);
-    }
-    while (1) {
-        ++s;
-        if (*s == '\t' || *s == '\n' || *s == '\r' || *s == ' ') {
-            continue;
-        }
-        *str = s;
-        if (*s == '\0') {
-            return unexpected_eof(s, ctx);
-        }
-        return true;
-    }
-}
-
-bool JsonType_parse(const char** str, JsonType* res, JsonParseCtx* ctx);
-bool JsonString_parse(const char** str, String* res, JsonParseCtx* ctx);
-bool JsonObject_parse(const char** str, JsonObject* res, JsonParseCtx* ctx);
-bool JsonList_parse(const char** str, JsonList* res, JsonParseCtx* ctx);
-bool JsonBool_parse(const char** str, bool* res, JsonParseCtx* ctx);
 bool JsonNumber_parse(const char** str, int64_t* i, double* d, bool* is_int, JsonParseCtx* ctx);
-bool JsonDouble_parse(const char** str, double* d, JsonParseCtx* ctx);
-bool JsonNull_parse(const char** str, JsonParseCtx* ctx);
-
 
-bool JsonType_parse(const char** str, JsonType* res, JsonParseCtx* ctx) {
-    const char* s = *str;
-    switch (*s) {
-        case '{': {
-            JsonObject obj;
-            if (!JsonObject_parse(&s, &obj, ctx)) {
-                return false;
-            }
-            res->type = JSON_OBJECT;
-            res->object = obj;
-            break;
-        }
-        case '[': {
-            JsonList list;
-            if (!JsonList_parse(&s, &list, ctx)) {
-                return false;
-            }
-            res->type = JSON_LIST;
-            res->list = list;
-            break;
-        }
-        case '"': {
-            String string;
-            if (!JsonString_parse(&s, &string, ctx)) {
-                return false;
-            }
-            res->type = JSON_STRING;
-            res->string = string;
-            break;
-        }
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9':
-        case '-': {
-            int64_t i;
-            double d;
-            bool is_int;
-            if (!JsonNumber_parse(&s, &i, &d, &is_int, ctx)) {
-                return false;
-            }
-            if (is_int) {
-                res->type = JSON_INTEGER;
-                res->integer = i;
-            } else {
-                res->type = JSON_DOUBLE;
-                res->dbl = d;
-            }
-            break;
-        }
+// Character for escape sequence \`c`, '\0' if it is not supported
+char json_unescape(char c) {
+    switch (c) {
         case 't':
-        case 'f': {
-            bool b;
-            if (!JsonBool_parse(&s, &b, ctx)) {
-                return false;
-            }
-            res->type = JSON_BOOL;
-            res->b = b;
-            break;
-        }
-        case 'n': {
-            if (!JsonNull_parse(&s, ctx)) {
-                return false;
-            }
-            res->type = JSON_NULL;
-            break;
-        }
-        case '\0':
-            return unexpected_eof(s, ctx);
+            return '\t';
+        case 'n':
+            return '\n';
+        case 'r':
+            return '\r';
+        case 'b':
+            return '\b';
+        case 'f':
+            return '\f';
+        case '\\':
+        case '/':
+        case '"':
+            return c;
         default:
-            return unexpected_char(s, ctx, *s);
+            return '\0';
+    }
+}
+
+static bool json_hex4(const char* s, uint32_t* out) {
+    uint32_t v = 0;
+    for (uint32_t i = 0; i < 4; ++i) {
+        char c = s[i];
+        if (c >= '0' && c <= '9') {
+            v = v * 16 + (c - '0');
+        } else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+            v = v * 16 + ((c | 0x20) - 'a' + 10);
+        } else {
+            return false;
+        }
     }
-    *str = s;
+    *out = v;
     return true;
 }
 
-bool JsonString_parse(const char** str, String* string, JsonParseCtx* ctx) {
+// Decode the \u escape at `s`, which points at the 'u', combining a
+// surrogate pair into one code point. Writes the utf-8 encoding to `out`
+// and returns its length, 0 if the escape is invalid. `*used` is set to
+// the number of characters read starting at `s`.
+static uint32_t json_unescape_unicode(const char* s, char* out, uint32_t* used) {
+    uint32_t cp;
+    if (!json_hex4(s + 1, &cp)) {
+        return 0;
+    }
+    *used = 5;
+    if (cp >= 0xD800 && cp < 0xDC00) {
+        uint32_t low;
+        if (s[5] != '\\' || s[6] != 'u' || !json_hex4(s + 7, &low) ||
+            low < 0xDC00 || low >= 0xE000) {
+            return 0;
+        }
+        cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        *used = 11;
+    } else if (cp >= 0xDC00 && cp < 0xE000) {
+        return 0;
+    }
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    } else if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    } else if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+// Append content of string starting at `*str` to `string`,
+// copying runs without escapes in one go
+bool JsonString_parse_append(const char** str, String* string, JsonParseCtx* ctx) {
     const char* s = *str;
     if (*s != '"') {
         return false;
     }
-    if (!String_create(string)) {
-        return false;
-    }
     ++s;
     while (1) {
+        const char* run = s;
+        while (*s != '"' && *s != '\\' && *s != '\0') {
+            ++s;
+        }
+        if (s != run && !String_append_count(string, run, s - run)) {
+            return false;
+        }
         char c = *s;
         switch (c) {
             case '\0':
-                String_free(string);
                 return unexpected_eof(s, ctx);
             case '"':
                 *str = s;
                 return true;
             case '\\':
                 ++s;
-                switch (*s) {
-                    case 't':
-                        String_append(string, '\t');
-                        break;
-                    case 'n':
-                        String_append(string, '\n');
-                        break;
-                    case 'r':
-                        String_append(string, '\r');
-                        break;
-                    case 'b':
-                        String_append(string, '\b');
-                        break;
-                    case 'f':
-                        String_append(string, '\f');
-                        break;
-                    case '\\':
-                    case '/':
-                    case '"':
-                        String_append(string, *s);
-                        break;
-                    default:
-                        String_free(string);
-                        return unexpected_char(s, ctx, *s);
+                if (*s == 'u') {
+                    char buf[4];
+                    uint32_t used;
+                    uint32_t len = json_unescape_unicode(s, buf, &used);
+                    if (len == 0) {
+                        return invalid_literal(s - 1, ctx, "escape");
+                    }
+                    if (!String_append_count(string, buf, len)) {
+                        return false;
+                    }
+                    s += used;
+                    continue;
+                }
+                c = json_unescape(*s);
+                if (c == '\0') {
+                    return unexpected_char(s, ctx, *s);
+                }
+                if (!String_append(string, c)) {
+                    return false;
                 }
-                break;
-            default:
-                String_append(string, c);
                 break;
         }
         ++s;
     }
 }
 
-bool JsonObject_parse(const char** str, JsonObject* obj, JsonParseCtx* ctx) {
-    const char* s = *str;
-    if (*s != '{') {
-        return expected_char(s, ctx, '{', *s);
-    }
-    if (!JsonObject_create(obj)) {
-        return false;
-    }
-    if (!skip_spaces(&s, ctx)) {
-        goto end;
-    }
-    if (*s == '}') {
-        *str = s;
-        return true;
-    }
-
-    while (1) {
-        String label;
-        if (!JsonString_parse(&s, &label, ctx)) {
-            goto end;
-        }
-        if (!skip_spaces(&s, ctx)) {
-            String_free(&label);
-            goto end;
-        }
-        if (*s != ':') {
-            String_free(&label);
-            expected_char(s, ctx, ':', *s);
-            goto end;
-        }
-        JsonType type;
-        if (!skip_spaces(&s, ctx) || !JsonType_parse(&s, &type, ctx)) {
-            String_free(&label);
-            goto end;
-        }
-        bool res = JsonObject_insert(obj, label.buffer, type);
-        String_free(&label);
-        if (!res) {
-            JsonType_free(&type);
-            goto end;
-        }
-        if (!skip_spaces(&s, ctx)) {
-            goto end;
-        }
-        if (*s == '}') {
-            *str = s;
-            return true;
-        }
-        if (*s != ',') {
-            expected_char(s, ctx, ',', *s);
-            goto end;
-        }
-        if (!skip_spaces(&s, ctx)) {
-            goto end;
-        }
-    }
-end:
-    JsonObject_free(obj);
-    return false;
-}
-
-bool JsonList_parse(const char** str, JsonList* list, JsonParseCtx* ctx) {
-    const char* s = *str;
-    if (*s != '[') {
-        return expected_char(s, ctx, '[', *s);
-    }
-    if (!JsonList_create(list)) {
-        return false;
-    }
-    if (!skip_spaces(&s, ctx)) {
-        goto end;
-    }
-    if (*s == ']') {
-        *str = s;
-        return true;
-    }
-    while (1) {
-        JsonType type;
-        if (!JsonType_parse(&s, &type, ctx)) {
-            goto end;
-        }
-        if (!JsonList_append(list, type)) {
-            JsonType_free(&type);
-            goto end;
-        }
-        if (!skip_spaces(&s, ctx)) {
-            goto end;
-        }
-        if (*s == ']') {
-            *str = s;
-            return true;
-        }
-        if (*s != ',') {
-            expected_char(s, ctx, ',', *s);
-            goto end;
-        }
-        if (!skip_spaces(&s, ctx)) {
-            goto end;
-        }
-    }
-end:
-    JsonList_free(list);
-    return false;
-}
-
-
 bool JsonNumber_parse(const char** str, int64_t* i, double* d, bool* is_int, JsonParseCtx* ctx) {
     const char* s = *str;
-    uint64_t n;
     bool negative = false;
-    *is_int = true;
     if (*s == '-')  {
         ++s;
         negative = true;
@@ -862,39 +705,41 @@ bool JsonNumber_parse(const char** str, int64_t* i, double* d, bool* is_int, Jso
     if (*s < '0' || *s > '9') {
         return invalid_literal(*str, ctx, "number");
     }
-    n = (*s - '0');
-    *d = (*s - '0');
-    ++s;
-    if (*(s - 1) != '0') {
+    // All digits are accumulated into w, which is only exact for up to 19
+    // significant digits. Longer numbers are rescanned below.
+    const char* digits = s;
+    uint64_t w = 0;
+    if (*s == '0') {
+        ++s;
+        if (*s >= '0' && *s <= '9') {
+            return invalid_literal(*str, ctx, "number");
+        }
+    } else {
         while (*s >= '0' && *s <= '9') {
-            n *= 10;
-            *d *= 10;
-            n += *s - '0';
-            *d += *s - '0';
+            w = w * 10 + (*s - '0');
             ++s;
         }
-    } else if (*s >= '0' && *s <= '9') {
-        return invalid_literal(*str, ctx, "number");
     }
+    const char* int_end = s;
+    int64_t exp = 0;
+    *is_int = true;
     if (*s == '.') {
         *is_int = false;
         ++s;
-        if (*s < '0' || *s > '9') {
-            return invalid_literal(*str, ctx, "number");
-        }
-        double factor = 0.1;
+        const char* frac = s;
         while (*s >= '0' && *s <= '9') {
-            *d += (*s - '0') * factor;
-            factor *= 0.1;
+            w = w * 10 + (*s - '0');
             ++s;
         }
+        if (s == frac) {
+            return invalid_literal(*str, ctx, "number");
+        }
+        exp = frac - s;
     }
+    const char* digits_end = s;
     if (*s == 'e' || *s == 'E') {
-        if (*is_int) {
-            *is_int = false;
-        }
+        *is_int = false;
         ++s;
-        int64_t exp = 0;
         bool neg_exp = false;
         if (*s == '-') {
             neg_exp = true;
@@ -905,280 +750,1986 @@ bool JsonNumber_parse(const char** str, int64_t* i, double* d, bool* is_int, Jso
         if (*s < '0' || *s > '9') {
             return invalid_literal(*str, ctx, "number");
         }
+        int64_t e = 0;
         while (*s >= '0' && *s <= '9') {
-            exp = exp * 10;
-            exp += *s - '0';
+            // Anything this large is zero or infinity anyway
+            if (e < 100000) {
+                e = e * 10 + (*s - '0');
+            }
             ++s;
         }
-        double factor = 1.0;
-        while (exp > 15) {
-            exp -= 15;
-            // 10^15 is the largest power of 10 that can be fully represented by a double
-            factor *= 1000000000000000;
-        }
-        int64_t exps[15] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 
-                            1000000000, 10000000000, 100000000000, 1000000000000, 10000000000000,
-                            100000000000000};
-        factor *= exps[exp];
-        if (neg_exp) {
-            *d /= factor;
-        } else {
-            *d *= factor;
-        }
+        exp += neg_exp ? -e : e;
     }
     *str = s - 1;
-    if (negative) {
-        if (*is_int) {
-            *i = - *i;
-        } else {
-            *d = - *d;
+
+    bool truncated = false;
+    if (digits_end - digits - (digits_end != int_end) > 19) {
+        const char* p = digits;
+        while (*p == '0' || *p == '.') {
+            ++p;
+        }
+        if (digits_end - p - (p < int_end && digits_end != int_end) > 19) {
+            // Keep the first 19 significant digits, the rest only decide
+            // whether the value is exact
+            w = 0;
+            for (uint32_t count = 0; count < 19; ++p) {
+                if (*p != '.') {
+                    w = w * 10 + (*p - '0');
+                    ++count;
+                }
+            }
+            exp += p <= int_end ? int_end - p : int_end + 1 - p;
+            exp -= digits_end != int_end ? int_end + 1 - digits_end : 0;
+            for (; p < digits_end; ++p) {
+                truncated |= *p != '0' && *p != '.';
+            }
         }
     }
+    // Integers that do not fit in 64 bits are read as doubles.
+    // `i` and `d` may alias, only one of them is written.
+    if (*is_int && exp == 0 && w <= (negative ? (uint64_t)INT64_MAX + 1 : (uint64_t)INT64_MAX)) {
+        *i = negative ? (int64_t)(0 - w) : (int64_t)w;
+        return true;
+    }
+    *is_int = false;
+    *d = json_decimal_to_double(w, exp, truncated, negative, digits);
     return true;
 }
 
-bool JsonBool_parse(const char** str, bool* b, JsonParseCtx* ctx) {
-    const char* s = *str;
-    if (strncmp(s, "true", 4) == 0) {
-        *b = true;
-        *str = s + 3;
-        return true;
-    }
-    if (strncmp(s, "false", 5) == 0) {
-        *b = false;
-        *str = s + 4;
-        return true;
-    }
-    return invalid_literal(*str, ctx, "keyword");
+enum ReaderState {
+    READ_VALUE,
+    // After '[', a value or ']'
+    READ_VALUE_OR_END,
+    READ_KEY,
+    // After '{', a key or '}'
+    READ_KEY_OR_END,
+    READ_COLON,
+    // After a value in a container, ',' or the end of the container
+    READ_NEXT,
+    READ_DONE,
+    READ_ERROR
+};
+
+static void JsonReader_init(JsonReader* r, const Allocator* allocator) {
+    r->data = "";
+    r->size = 0;
+    r->pos = 0;
+    r->scan = 0;
+    r->scan_escaped = false;
+    r->finished = false;
+    r->input.buffer = NULL;
+    r->input.allocator = NULL;
+    r->stack = NULL;
+    r->depth = 0;
+    r->stack_cap = 0;
+    r->state = READ_VALUE;
+    r->string.buffer = NULL;
+    r->string.length = 0;
+    r->string.capacity = 0;
+    r->string.allocator = allocator;
+    r->borrow = false;
+    r->borrowed_escaped = false;
+    r->borrowed.data = NULL;
+    r->borrowed.length = 0;
+    r->frames = NULL;
+    r->frame_count = 0;
+    r->frame_cap = 0;
+    r->ctx.root = r->data;
+    r->ctx.row = 1;
+    r->ctx.col = 1;
+    r->ctx.last = '\0';
+    r->ctx.errormsg.buffer = NULL;
+    r->ctx.errormsg.allocator = NULL;
+    r->ctx.allocator = allocator;
+}
+
+bool JsonReader_create(JsonReader* r, const Allocator* allocator) {
+    JsonReader_init(r, allocator);
+    return true;
 }
 
-bool JsonNull_parse(const char** str, JsonParseCtx* ctx) {
-    if (strncmp(*str, "null", 4) == 0) {
-        *str = *str + 3;
-        return true;
-    }
-    return invalid_literal(*str, ctx, "keyword");
+bool JsonReader_create_str(JsonReader* r, const char* str, const Allocator* allocator) {
+    JsonReader_init(r, allocator);
+    r->data = str;
+    r->size = strlen(str);
+    r->finished = true;
+    r->ctx.root = str;
+    return true;
 }
 
-bool json_parse_object(const char* str, JsonObject* obj, String_noinit* errormsg) {
-    JsonParseCtx ctx;
-    ctx.errormsg.buffer = NULL;
-    ctx.root = str;
-    if ((*str != '{' && !skip_spaces(&str, &ctx)) || !JsonObject_parse(&str, obj, &ctx)) {
-        if (errormsg == NULL) {
-            String_free(&ctx.errormsg);
-        } else {
-            *errormsg = ctx.errormsg;
+bool JsonReader_feed(JsonReader* r, const char* data, size_t len) {
+    if (r->input.buffer == NULL) {
+        if (!String_create_capacity(&r->input, len)) {
+            return false;
         }
+    } else if (r->pos > 0) {
+        // Drop what has been read, counting its rows for error messages
+        find_position(&r->ctx, r->data + r->pos);
+        memmove(r->input.buffer, r->input.buffer + r->pos, r->size - r->pos);
+        r->input.length = r->size - r->pos;
+        r->input.buffer[r->input.length] = '\0';
+        r->pos = 0;
+    }
+    if (!String_append_count(&r->input, data, len)) {
         return false;
     }
+    // The buffer is always null-terminated, which the number and string
+    // parsing below rely on
+    r->data = r->input.buffer;
+    r->size = r->input.length;
+    r->ctx.root = r->data;
     return true;
 }
 
-bool json_parse_type(const char* str, JsonType* type, String_noinit* errormsg) {
-    JsonParseCtx ctx;
-    ctx.errormsg.buffer = NULL;
-    ctx.root = str;
-    while (*str == ' ' || *str == '\t' || *str == '\n' || *str == '\r') {
-        ++str;
+void JsonReader_finish(JsonReader* r) {
+    r->finished = true;
+}
+
+const char* JsonReader_error(const JsonReader* r) {
+    return r->ctx.errormsg.buffer;
+}
+
+void JsonReader_take_string(JsonReader* r, String_noinit* out) {
+    *out = r->string;
+    r->string.buffer = NULL;
+    r->string.length = 0;
+    r->string.capacity = 0;
+}
+
+void JsonReader_free(JsonReader* r) {
+    if (r->input.buffer != NULL) {
+        String_free(&r->input);
     }
-    if (!JsonType_parse(&str, type, &ctx)) {
-        if (errormsg == NULL) {
-            String_free(&ctx.errormsg);
-        } else {
-            *errormsg = ctx.errormsg;
+    if (r->stack != NULL) {
+        Mem_free(r->stack);
+    }
+    if (r->string.buffer != NULL) {
+        String_free(&r->string);
+    }
+    for (unsigned ix = 0; ix < r->frame_cap; ++ix) {
+        if (ix < r->frame_count) {
+            JsonType_free(&r->frames[ix].value);
+        }
+        if (r->frames[ix].key.buffer != NULL) {
+            String_free(&r->frames[ix].key);
         }
-        return false;
     }
-    return true;
+    if (r->frames != NULL) {
+        Mem_free(r->frames);
+    }
+    if (r->ctx.errormsg.buffer != NULL) {
+        String_free(&r->ctx.errormsg);
+    }
 }
 
+static JsonEvent JsonReader_fail(JsonReader* r) {
+    r->state = READ_ERROR;
+    return JSON_EVENT_ERROR;
+}
 
-bool double_to_string(double d, String* dest) {
-    if (d == 0.0) {
-        return String_append_count(dest, "0.0", 3);
-    }
-    bool negative = d < 0;
-    if (d < 0) {
-        d = -d;
-    }
-    int64_t exponent = 0;
-    if (d < 0.000001) {
-        while (d < 1.0) {
-            d *= 10.0;
-            --exponent;
+static void JsonReader_value_done(JsonReader* r) {
+    r->state = r->depth == 0 ? READ_DONE : READ_NEXT;
+}
+
+// Whitespace is skipped, returns false if the input ran out
+static bool JsonReader_skip_spaces(JsonReader* r) {
+    while (r->pos < r->size) {
+        char c = r->data[r->pos];
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+            return true;
         }
-    } else if (d > 1000000) {
-        while (d > 10.0) {
-            d /= 10.0;
-            ++exponent;
+        ++r->pos;
+    }
+    return false;
+}
+
+static JsonEvent JsonReader_open(JsonReader* r, char c) {
+    if (r->depth == r->stack_cap) {
+        unsigned cap = r->stack_cap == 0 ? 16 : r->stack_cap * 2;
+        char* stack = r->stack == NULL ? Mem_alloc(cap) : Mem_realloc(r->stack, cap);
+        if (stack == NULL) {
+            return JsonReader_fail(r);
         }
+        r->stack = stack;
+        r->stack_cap = cap;
     }
-    uint64_t whole_part = (uint64_t)d;
-    d = d - whole_part;
-    uint64_t leading_zeroes = 0;
-    uint64_t frac_part = 0;
-    while (d > 0.000000000001 && d < 0.1) {
-        ++leading_zeroes;
-        d *= 10;
+    r->stack[r->depth] = c;
+    ++r->depth;
+    ++r->pos;
+    if (c == '{') {
+        r->state = READ_KEY_OR_END;
+        return JSON_EVENT_OBJECT_START;
     }
-    if (d >= 0.1) {
-        for (uint64_t j = 0; j < 12; ++j) {
-            d = d * 10;
-            uint64_t i = (uint64_t) d;
-            frac_part = frac_part * 10 + i;
-            d = d - i;
+    r->state = READ_VALUE_OR_END;
+    return JSON_EVENT_LIST_START;
+}
+
+static JsonEvent JsonReader_close(JsonReader* r) {
+    --r->depth;
+    ++r->pos;
+    JsonReader_value_done(r);
+    return r->stack[r->depth] == '{' ? JSON_EVENT_OBJECT_END : JSON_EVENT_LIST_END;
+}
+
+// Longest borrowed string, the tape keeps two flags in its length
+#define JSON_BORROW_MAX 0x3FFFFFFF
+
+// Check the escapes of the `len` bytes of string content at `s` without
+// unescaping it
+static bool json_check_escapes(const char* s, size_t len, JsonParseCtx* ctx) {
+    const char* end = s + len;
+    while (s < end) {
+        if (*s != '\\') {
+            ++s;
+            continue;
         }
-        if (d > 0.5) {
-            frac_part += 1;
+        ++s;
+        if (*s == 'u') {
+            char buf[4];
+            uint32_t used;
+            if (json_unescape_unicode(s, buf, &used) == 0) {
+                return invalid_literal(s - 1, ctx, "escape");
+            }
+            s += used;
+            continue;
         }
-        while (frac_part % 10 == 0) {
-            frac_part = frac_part / 10;
+        if (json_unescape(*s) == '\0') {
+            return unexpected_char(s, ctx, *s);
         }
+        ++s;
     }
-    if (negative) {
-        if (!String_append(dest, '-')) {
-            return false;
+    return true;
+}
+
+static JsonEvent JsonReader_string(JsonReader* r, bool key) {
+    // Find the closing quote first, so the string can be created with
+    // enough capacity and a string split between chunks is scanned once
+    size_t end = r->pos + (r->scan > 0 ? r->scan : 1);
+    bool escaped = r->scan > 0 && r->scan_escaped;
+    while (end < r->size && r->data[end] != '"') {
+        if (r->data[end] == '\\') {
+            escaped = true;
+            ++end;
         }
+        ++end;
     }
-    if (!String_format_append(dest, "%llu.", whole_part)) {
-        return false;
-    }
-    for (uint64_t i = 0; i < leading_zeroes; ++i) {
-        if (!String_append(dest, '0')) {
-            return false;
+    if (end >= r->size) {
+        if (r->finished) {
+            unexpected_eof(r->data + r->size, &r->ctx);
+            return JsonReader_fail(r);
         }
+        // Resume at a trailing backslash, its escape is not complete
+        r->scan = (end > r->size ? r->size - 1 : end) - r->pos;
+        r->scan_escaped = escaped;
+        return JSON_EVENT_NONE;
+    }
+    r->scan = 0;
+    r->scan_escaped = false;
+    // Bytes outside strings are ascii or rejected, so this is all the
+    // validation the input needs
+    size_t len = end - r->pos - 1;
+    size_t valid = utf8_valid_prefix(r->data + r->pos + 1, len);
+    if (valid != len) {
+        invalid_literal(r->data + r->pos + 1 + valid, &r->ctx, "utf-8");
+        return JsonReader_fail(r);
+    }
+    if (r->borrow && len >= JSON_BORROW_MIN && len <= JSON_BORROW_MAX &&
+        !(escaped && key)) {
+        if (escaped && !json_check_escapes(r->data + r->pos + 1, len, &r->ctx)) {
+            return JsonReader_fail(r);
+        }
+        r->borrowed_escaped = escaped;
+        r->borrowed.data = r->data + r->pos + 1;
+        r->borrowed.length = (string_size_t)len;
+        r->pos = end + 1;
+        return JSON_EVENT_STRING;
+    }
+    r->borrowed.data = NULL;
+    if (r->string.buffer == NULL) {
+        if (!String_create_capacity_with(&r->string, end - r->pos, r->ctx.allocator)) {
+            return JsonReader_fail(r);
+        }
+    } else {
+        String_clear(&r->string);
     }
-    if (!String_format_append(dest, "%llu", frac_part)) {
-        return false;
-    }
-    if (exponent != 0) {
-        return String_format_append(dest, "e%lld", exponent);
+    const char* s = r->data + r->pos;
+    if (!JsonString_parse_append(&s, &r->string, &r->ctx)) {
+        return JsonReader_fail(r);
     }
-    return true;
+    r->pos = s - r->data + 1;
+    return JSON_EVENT_STRING;
 }
 
-bool write_json_string(const char* in, uint64_t len, String* out) {
-    if (!String_append(out, '"')) {
-        return false;
+static JsonEvent JsonReader_number(JsonReader* r) {
+    size_t end = r->pos;
+    while (end < r->size) {
+        char c = r->data[end];
+        if ((c < '0' || c > '9') && c != '-' && c != '+' && c != '.' &&
+            c != 'e' && c != 'E') {
+            break;
+        }
+        ++end;
+    }
+    if (end == r->size && !r->finished) {
+        return JSON_EVENT_NONE;
     }
+    const char* s = r->data + r->pos;
+    bool is_int;
+    if (!JsonNumber_parse(&s, &r->integer, &r->dbl, &is_int, &r->ctx)) {
+        return JsonReader_fail(r);
+    }
+    r->pos = s - r->data + 1;
+    JsonReader_value_done(r);
+    return is_int ? JSON_EVENT_INTEGER : JSON_EVENT_DOUBLE;
+}
 
-    for (uint32_t i = 0; i < len;) {
-        uint8_t c = (uint8_t)in[i];
-        if (c >= 0x20 && c < 0x7F) {
-            if (c == '\\' || c == '"') {
-                if (!String_append(out, '\\')) {
-                    return false;
-                }
-            }
-            if (!String_append(out, (char)c)) {
-                return false;
-            }
-        } else if (c == '\r') {
-            if (!String_append_count(out, "\\r", 2)) {
-                return false;
-            }
-        } else if (c == '\n') {
-            if (!String_append_count(out, "\\n", 2)) {
-                return false;
-            }
-        } else if (c == '\t') {
-            if (!String_append_count(out, "\\t", 2)) {
-                return false;
-            }
-        } else if (c == '\b') {
-            if (!String_append_count(out, "\\b", 2)) {
-                return false;
-            }
-        } else if (c == '\f') {
-            if (!String_append_count(out, "\\f", 2)) {
-                return false;
-            }
-        } else {
-            if (!String_append(out, (char)c)) {
-                return false;
-            }
+static JsonEvent JsonReader_keyword(JsonReader* r) {
+    const char* s = r->data + r->pos;
+    const char* word = *s == 't' ? "true" : *s == 'f' ? "false" : "null";
+    size_t len = *s == 'f' ? 5 : 4;
+    size_t avail = r->size - r->pos;
+    if (avail < len) {
+        if (!r->finished && memcmp(s, word, avail) == 0) {
+            return JSON_EVENT_NONE;
         }
-        ++i;
+        invalid_literal(s, &r->ctx, "keyword");
+        return JsonReader_fail(r);
     }
-
-    return String_append(out, '"');
+    if (memcmp(s, word, len) != 0) {
+        invalid_literal(s, &r->ctx, "keyword");
+        return JsonReader_fail(r);
+    }
+    r->pos += len;
+    r->b = *s == 't';
+    JsonReader_value_done(r);
+    return *s == 'n' ? JSON_EVENT_NULL : JSON_EVENT_BOOL;
 }
 
-bool json_object_to_string(const JsonObject* obj, String* res) {
-    JsonType t;
-    t.type = JSON_OBJECT;
-    t.object = *obj;
-    return json_type_to_string(&t, res);
+static JsonEvent JsonReader_value(JsonReader* r) {
+    const char* s = r->data + r->pos;
+    switch (*s) {
+        case '{':
+        case '[':
+            return JsonReader_open(r, *s);
+        case '"': {
+            JsonEvent e = JsonReader_string(r, false);
+            if (e == JSON_EVENT_STRING) {
+                JsonReader_value_done(r);
+            }
+            return e;
+        }
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+        case '8':
+        case '9':
+        case '-':
+            return JsonReader_number(r);
+        case 't':
+        case 'f':
+        case 'n':
+            return JsonReader_keyword(r);
+        default:
+            unexpected_char(s, &r->ctx, *s);
+            return JsonReader_fail(r);
+    }
 }
 
-bool json_type_to_string(const JsonType* v, String* res) {
-    char fmtbuf[64];
-    switch (v->type) {
-    case JSON_OBJECT:
-        if (!String_append(res, '{')) {
-            return false;
+JsonEvent JsonReader_next(JsonReader* r) {
+    while (1) {
+        if (r->state == READ_ERROR) {
+            return JSON_EVENT_ERROR;
         }
-        {
-            LinkedHashMapIterator it;
-            LinkedHashMapIter_Begin(&it, (LinkedHashMap*)&v->object.data);
-            LinkedHashElement* el;
-            uint32_t count = 0;
-            while ((el = LinkedHashMapIter_Next(&it)) != NULL) {
-                if (count > 0) {
-                    if (!String_append(res, ',')) {
-                        return false;
-                    }
+        if (r->state == READ_DONE) {
+            return JSON_EVENT_DONE;
+        }
+        if (!JsonReader_skip_spaces(r)) {
+            if (r->finished) {
+                unexpected_eof(r->data + r->pos, &r->ctx);
+                return JsonReader_fail(r);
+            }
+            return JSON_EVENT_NONE;
+        }
+        const char* s = r->data + r->pos;
+        switch (r->state) {
+            case READ_VALUE_OR_END:
+                if (*s == ']') {
+                    return JsonReader_close(r);
                 }
-                ++count;
-                if (!write_json_string(el->key, strlen(el->key), res)) {
-                    return false;
+                return JsonReader_value(r);
+            case READ_VALUE:
+                return JsonReader_value(r);
+            case READ_KEY_OR_END:
+                if (*s == '}') {
+                    return JsonReader_close(r);
                 }
-                if (!String_append(res, ':')) {
-                    return false;
+                // fallthrough
+            case READ_KEY: {
+                if (*s != '"') {
+                    expected_char(s, &r->ctx, '"', *s);
+                    return JsonReader_fail(r);
                 }
-                if (!json_type_to_string(el->value, res)) {
-                    return false;
+                JsonEvent e = JsonReader_string(r, true);
+                if (e != JSON_EVENT_STRING) {
+                    return e;
+                }
+                r->state = READ_COLON;
+                return JSON_EVENT_KEY;
+            }
+            case READ_COLON:
+                if (*s != ':') {
+                    expected_char(s, &r->ctx, ':', *s);
+                    return JsonReader_fail(r);
+                }
+                ++r->pos;
+                r->state = READ_VALUE;
+                break;
+            case READ_NEXT: {
+                char open = r->stack[r->depth - 1];
+                if (*s == ',') {
+                    ++r->pos;
+                    r->state = open == '{' ? READ_KEY : READ_VALUE;
+                    break;
+                }
+                if (*s == (open == '{' ? '}' : ']')) {
+                    return JsonReader_close(r);
                 }
+                expected_char(s, &r->ctx, ',', *s);
+                return JsonReader_fail(r);
             }
         }
-        if (!String_append(res, '}')) {
+    }
+}
+
+static bool JsonReader_push_frame(JsonReader* r, JsonEvent e) {
+    if (r->frame_count == r->frame_cap) {
+        unsigned cap = r->frame_cap == 0 ? 8 : r->frame_cap * 2;
+        size_t size = cap * sizeof(JsonBuildFrame);
+        JsonBuildFrame* frames = r->frames == NULL ? Mem_alloc(size) :
+                                 Mem_realloc(r->frames, size);
+        if (frames == NULL) {
             return false;
         }
-        return true;
-    case JSON_LIST:
-        if (!String_append(res, '[')) {
+        for (unsigned ix = r->frame_cap; ix < cap; ++ix) {
+            frames[ix].key.buffer = NULL;
+            frames[ix].key.length = 0;
+            frames[ix].key.capacity = 0;
+            frames[ix].key.allocator = r->ctx.allocator;
+        }
+        r->frames = frames;
+        r->frame_cap = cap;
+    }
+    JsonType* val = &r->frames[r->frame_count].value;
+    if (e == JSON_EVENT_OBJECT_START) {
+        val->type = JSON_OBJECT;
+        if (!JsonObject_create_with(&val->object, r->ctx.allocator)) {
             return false;
         }
-        for (uint32_t i = 0; i< v->list.size; ++i) {
-            if (i > 0) {
-                if (!String_append(res, ',')) {
-                    return false;
+    } else {
+        val->type = JSON_LIST;
+        if (!JsonList_create_with(&val->list, r->ctx.allocator)) {
+            return false;
+        }
+    }
+    ++r->frame_count;
+    return true;
+}
+
+JsonEvent JsonReader_read(JsonReader* r, JsonType* val) {
+    while (1) {
+        JsonEvent e = JsonReader_next(r);
+        JsonType v;
+        switch (e) {
+            case JSON_EVENT_NONE:
+                return JSON_EVENT_NONE;
+            case JSON_EVENT_ERROR:
+                goto fail;
+            case JSON_EVENT_DONE:
+                // No value left to read
+                unexpected_eof(r->data + r->pos, &r->ctx);
+                goto fail;
+            case JSON_EVENT_OBJECT_START:
+            case JSON_EVENT_LIST_START:
+                if (!JsonReader_push_frame(r, e)) {
+                    goto fail;
+                }
+                continue;
+            case JSON_EVENT_KEY: {
+                if (r->frame_count == 0) {
+                    // Called at a key, read the member value
+                    continue;
                 }
+                // Swap buffers with the frame, the key is copied on insert
+                String* key = &r->frames[r->frame_count - 1].key;
+                String tmp = *key;
+                *key = r->string;
+                r->string = tmp;
+                continue;
+            }
+            case JSON_EVENT_OBJECT_END:
+            case JSON_EVENT_LIST_END:
+                --r->frame_count;
+                v = r->frames[r->frame_count].value;
+                break;
+            case JSON_EVENT_STRING:
+                v.type = JSON_STRING;
+                JsonReader_take_string(r, &v.string);
+                break;
+            case JSON_EVENT_INTEGER:
+                v.type = JSON_INTEGER;
+                v.integer = r->integer;
+                break;
+            case JSON_EVENT_DOUBLE:
+                v.type = JSON_DOUBLE;
+                v.dbl = r->dbl;
+                break;
+            case JSON_EVENT_BOOL:
+                v.type = JSON_BOOL;
+                v.b = r->b;
+                break;
+            case JSON_EVENT_NULL:
+                v.type = JSON_NULL;
+                break;
+        }
+        if (r->frame_count == 0) {
+            *val = v;
+            return JSON_EVENT_DONE;
+        }
+        JsonBuildFrame* top = &r->frames[r->frame_count - 1];
+        bool inserted;
+        if (top->value.type == JSON_OBJECT) {
+            inserted = JsonObject_insert(&top->value.object, top->key.buffer, v);
+        } else {
+            inserted = JsonList_append(&top->value.list, v);
+        }
+        if (!inserted) {
+            JsonType_free(&v);
+            goto fail;
+        }
+    }
+fail:
+    r->state = READ_ERROR;
+    while (r->frame_count > 0) {
+        --r->frame_count;
+        JsonType_free(&r->frames[r->frame_count].value);
+    }
+    return JSON_EVENT_ERROR;
+}
+
+// Structural index parsing of complete documents.
+// Stage one classifies the input 64 bytes at a time into bitmasks,
+// works out which quotes are escaped and which bytes are inside strings,
+// and records the offset of every structural character, string quote
+// and first byte of a number or keyword. Stage two builds the tree by
+// walking those offsets instead of the characters.
+
+// Nesting deeper than this is left to the reader, which does not recurse
+#define JSON_INDEX_MAX_DEPTH 1024
+
+typedef struct JsonBlockMasks {
+    uint64_t quote;
+    uint64_t backslash;
+    // {}[]:,
+    uint64_t op;
+    uint64_t space;
+} JsonBlockMasks;
+
+static void json_classify_block(const uint8_t* b, JsonBlockMasks* m) {
+#if defined(__AVX2__)
+    m->quote = 0;
+    m->backslash = 0;
+    m->op = 0;
+    m->space = 0;
+    for (unsigned half = 0; half < 2; ++half) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(b + 32 * half));
+        // Setting bit 5 maps '[' to '{' and ']' to '}'
+        __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i op = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(lower, _mm256_set1_epi8('{')),
+                            _mm256_cmpeq_epi8(lower, _mm256_set1_epi8('}'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))));
+        __m256i space = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r'))));
+        unsigned shift = 32 * half;
+        m->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))) << shift;
+        m->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))) << shift;
+        m->op |= (uint64_t)(uint32_t)_mm256_movemask_epi8(op) << shift;
+        m->space |= (uint64_t)(uint32_t)_mm256_movemask_epi8(space) << shift;
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    m->quote = 0;
+    m->backslash = 0;
+    m->op = 0;
+    m->space = 0;
+    for (unsigned part = 0; part < 4; ++part) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(b + 16 * part));
+        __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i op = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')),
+                         _mm_cmpeq_epi8(lower, _mm_set1_epi8('}'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+        __m128i space = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')),
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('\r'))));
+        unsigned shift = 16 * part;
+        m->quote |= (uint64_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << shift;
+        m->backslash |= (uint64_t)_mm_movemask_epi8(
+            _mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << shift;
+        m->op |= (uint64_t)_mm_movemask_epi8(op) << shift;
+        m->space |= (uint64_t)_mm_movemask_epi8(space) << shift;
+    }
+#else
+    m->quote = 0;
+    m->backslash = 0;
+    m->op = 0;
+    m->space = 0;
+    for (unsigned ix = 0; ix < 64; ++ix) {
+        uint64_t bit = 1ULL << ix;
+        switch (b[ix]) {
+            case '"':
+                m->quote |= bit;
+                break;
+            case '\\':
+                m->backslash |= bit;
+                break;
+            case '{':
+            case '}':
+            case '[':
+            case ']':
+            case ':':
+            case ',':
+                m->op |= bit;
+                break;
+            case ' ':
+            case '\t':
+            case '\n':
+            case '\r':
+                m->space |= bit;
+                break;
+        }
+    }
+#endif
+}
+
+// Bit n of the result is the xor of bits 0..n of `x`
+static inline uint64_t json_prefix_xor(uint64_t x) {
+#if defined(__PCLMUL__) || (defined(_MSC_VER) && defined(__AVX2__))
+    // Carry-less multiplication by all ones
+    __m128i r = _mm_clmulepi64_si128(_mm_set_epi64x(0, (int64_t)x),
+                                     _mm_set1_epi8((char)0xFF), 0);
+    return (uint64_t)_mm_cvtsi128_si64(r);
+#else
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+#endif
+}
+
+// Characters preceded by an odd number of backslashes. `prev_odd` is
+// 1 if the previous block ended in an odd run of backslashes.
+static inline uint64_t json_escaped(uint64_t backslash, uint64_t* prev_odd) {
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    uint64_t starts = backslash & ~(backslash << 1);
+    uint64_t even_start_mask = even_bits ^ *prev_odd;
+    uint64_t even_starts = starts & even_start_mask;
+    uint64_t odd_starts = starts & ~even_start_mask;
+    // Adding a run's first bit to the run carries to the byte after it
+    uint64_t even_carries = backslash + even_starts;
+    uint64_t odd_carries = backslash + odd_starts;
+    bool overflow = odd_carries < backslash;
+    odd_carries |= *prev_odd;
+    *prev_odd = overflow ? 1 : 0;
+    uint64_t even_carry_ends = even_carries & ~backslash;
+    uint64_t odd_carry_ends = odd_carries & ~backslash;
+    return (even_carry_ends & ~even_bits) | (odd_carry_ends & even_bits);
+}
+
+static inline unsigned json_ctz(uint64_t x) {
+#ifdef _MSC_VER
+    unsigned long ix;
+    _BitScanForward64(&ix, x);
+    return ix;
+#else
+    return __builtin_ctzll(x);
+#endif
+}
+
+typedef struct JsonIndex {
+    const char* data;
+    uint32_t* offsets;
+    // Next entry of `offsets` to parse
+    uint32_t pos;
+    unsigned depth;
+    String label;
+    // Only used by JsonNumber_parse, errors are reported by the reader
+    JsonParseCtx ctx;
+} JsonIndex;
+
+// Stage one. Returns false if out of memory, or if the document ends
+// inside a string.
+static bool JsonIndex_build(JsonIndex* p, size_t size) {
+    p->offsets = Mem_alloc((size + 1) * sizeof(uint32_t));
+    if (p->offsets == NULL) {
+        return false;
+    }
+    uint32_t count = 0;
+    uint64_t prev_odd = 0;
+    uint64_t prev_in_string = 0;
+    // The document start counts as a separator before the first token
+    uint64_t prev_sep = 1;
+    uint8_t tail[64];
+    for (size_t base = 0; base < size; base += 64) {
+        const uint8_t* block = (const uint8_t*)p->data + base;
+        if (size - base < 64) {
+            memset(tail, ' ', 64);
+            memcpy(tail, block, size - base);
+            block = tail;
+        }
+        JsonBlockMasks m;
+        json_classify_block(block, &m);
+        uint64_t quotes = m.quote & ~json_escaped(m.backslash, &prev_odd);
+        // Set from an opening quote up to, not including, its closing quote
+        uint64_t in_string = json_prefix_xor(quotes) ^ prev_in_string;
+        prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+        uint64_t sep = m.op | m.space | quotes;
+        uint64_t starts = ~sep & ~in_string & ((sep << 1) | prev_sep);
+        prev_sep = sep >> 63;
+
+        uint64_t bits = (m.op & ~in_string) | quotes | starts;
+        while (bits != 0) {
+            p->offsets[count++] = base + json_ctz(bits);
+            bits &= bits - 1;
+        }
+    }
+    // Points at the null terminator, which matches nothing below
+    p->offsets[count] = size;
+    return prev_in_string == 0;
+}
+
+static inline char JsonIndex_peek(JsonIndex* p) {
+    return p->data[p->offsets[p->pos]];
+}
+
+// Whether `c` can follow a number or keyword
+static inline bool json_ends_token(char c) {
+    return c == ',' || c == ']' || c == '}' || c == ' ' || c == '\t' ||
+           c == '\n' || c == '\r' || c == '\0';
+}
+
+// String at the current quote, whose closing quote is the next entry
+static bool JsonIndex_string(JsonIndex* p, String* s) {
+    const char* start = p->data + p->offsets[p->pos] + 1;
+    const char* end = p->data + p->offsets[p->pos + 1];
+    p->pos += 2;
+    while (start < end) {
+        const char* bs = memchr(start, '\\', end - start);
+        if (bs == NULL) {
+            return String_append_count(s, start, end - start);
+        }
+        if (!String_append_count(s, start, bs - start)) {
+            return false;
+        }
+        if (bs[1] == 'u') {
+            char buf[4];
+            uint32_t used;
+            uint32_t len = json_unescape_unicode(bs + 1, buf, &used);
+            if (len == 0 || bs + 1 + used > end || !String_append_count(s, buf, len)) {
+                return false;
+            }
+            start = bs + 1 + used;
+            continue;
+        }
+        char c = json_unescape(bs[1]);
+        if (c == '\0' || !String_append(s, c)) {
+            return false;
+        }
+        start = bs + 2;
+    }
+    return true;
+}
+
+static bool JsonIndex_value(JsonIndex* p, JsonType* out);
+
+static bool JsonIndex_object(JsonIndex* p, JsonObject* obj) {
+    if (!JsonObject_create_with(obj, p->ctx.allocator)) {
+        return false;
+    }
+    ++p->pos;
+    if (JsonIndex_peek(p) == '}') {
+        ++p->pos;
+        return true;
+    }
+    while (1) {
+        if (JsonIndex_peek(p) != '"') {
+            goto fail;
+        }
+        String_clear(&p->label);
+        if (!JsonIndex_string(p, &p->label) || JsonIndex_peek(p) != ':') {
+            goto fail;
+        }
+        ++p->pos;
+        // Insert the key first, nested objects reuse the label buffer
+        LinkedHashElement* elem = LinkedHashMap_Get(&obj->data, p->label.buffer);
+        if (elem == NULL) {
+            goto fail;
+        }
+        JsonType* val = elem->value;
+        if (val == NULL) {
+            val = Allocator_alloc(obj->data.allocator, sizeof(JsonType));
+            if (val == NULL) {
+                goto fail;
+            }
+            elem->value = val;
+        } else {
+            JsonType_free(val);
+        }
+        if (!JsonIndex_value(p, val)) {
+            val->type = JSON_NULL;
+            goto fail;
+        }
+        char c = JsonIndex_peek(p);
+        if (c == '}') {
+            ++p->pos;
+            return true;
+        }
+        if (c != ',') {
+            goto fail;
+        }
+        ++p->pos;
+    }
+fail:
+    JsonObject_free(obj);
+    return false;
+}
+
+static bool JsonIndex_list(JsonIndex* p, JsonList* list) {
+    if (!JsonList_create_with(list, p->ctx.allocator)) {
+        return false;
+    }
+    ++p->pos;
+    if (JsonIndex_peek(p) == ']') {
+        ++p->pos;
+        return true;
+    }
+    while (1) {
+        JsonType val;
+        if (!JsonIndex_value(p, &val)) {
+            goto fail;
+        }
+        if (!JsonList_append(list, val)) {
+            JsonType_free(&val);
+            goto fail;
+        }
+        char c = JsonIndex_peek(p);
+        if (c == ']') {
+            ++p->pos;
+            return true;
+        }
+        if (c != ',') {
+            goto fail;
+        }
+        ++p->pos;
+    }
+fail:
+    JsonList_free(list);
+    return false;
+}
+
+static bool JsonIndex_value(JsonIndex* p, JsonType* out) {
+    const char* s = p->data + p->offsets[p->pos];
+    switch (*s) {
+        case '{':
+        case '[': {
+            if (p->depth == JSON_INDEX_MAX_DEPTH) {
+                return false;
+            }
+            ++p->depth;
+            bool res;
+            if (*s == '{') {
+                out->type = JSON_OBJECT;
+                res = JsonIndex_object(p, &out->object);
+            } else {
+                out->type = JSON_LIST;
+                res = JsonIndex_list(p, &out->list);
+            }
+            --p->depth;
+            return res;
+        }
+        case '"': {
+            const char* end = p->data + p->offsets[p->pos + 1];
+            out->type = JSON_STRING;
+            if (!String_create_capacity_with(&out->string, end - s, p->ctx.allocator)) {
+                return false;
             }
-            if (!json_type_to_string(&v->list.data[i], res)) {
+            if (!JsonIndex_string(p, &out->string)) {
+                String_free(&out->string);
                 return false;
             }
+            return true;
+        }
+        case '\0':
+            return false;
+    }
+    if (*s == '-' || (*s >= '0' && *s <= '9')) {
+        bool is_int;
+        if (!JsonNumber_parse(&s, &out->integer, &out->dbl, &is_int, &p->ctx) ||
+            !json_ends_token(s[1])) {
+            return false;
+        }
+        out->type = is_int ? JSON_INTEGER : JSON_DOUBLE;
+    } else if (strncmp(s, "true", 4) == 0 && json_ends_token(s[4])) {
+        out->type = JSON_BOOL;
+        out->b = true;
+    } else if (strncmp(s, "false", 5) == 0 && json_ends_token(s[5])) {
+        out->type = JSON_BOOL;
+        out->b = false;
+    } else if (strncmp(s, "null", 4) == 0 && json_ends_token(s[4])) {
+        out->type = JSON_NULL;
+    } else {
+        return false;
+    }
+    ++p->pos;
+    return true;
+}
+
+// Parse `size` bytes of valid utf8 at `str`. On failure nothing is
+// reported, the caller parses again with the reader to get an error.
+static bool json_parse_indexed(const char* str, size_t size, JsonType* val,
+                               const Allocator* allocator) {
+    if (size >= UINT32_MAX) {
+        return false;
+    }
+    JsonIndex p;
+    p.data = str;
+    p.offsets = NULL;
+    p.pos = 0;
+    p.depth = 0;
+    p.ctx.root = str;
+    p.ctx.row = 1;
+    p.ctx.col = 1;
+    p.ctx.last = '\0';
+    p.ctx.errormsg.buffer = NULL;
+    p.ctx.errormsg.allocator = NULL;
+    p.ctx.allocator = allocator;
+    bool res = false;
+    if (String_create(&p.label)) {
+        res = JsonIndex_build(&p, size) && JsonIndex_value(&p, val);
+        String_free(&p.label);
+    }
+    if (p.offsets != NULL) {
+        Mem_free(p.offsets);
+    }
+    if (p.ctx.errormsg.buffer != NULL) {
+        String_free(&p.ctx.errormsg);
+    }
+    return res;
+}
+
+// Hand the error message to the caller and free the reader
+static bool json_parse_finish(JsonReader* r, bool res, String_noinit* errormsg) {
+    if (!res && errormsg != NULL) {
+        *errormsg = r->ctx.errormsg;
+        r->ctx.errormsg.buffer = NULL;
+    }
+    JsonReader_free(r);
+    return res;
+}
+
+// Parse all of `str` with the structural index, falling back to the
+// reader for anything it rejects so errors are reported the same way
+static bool json_parse_str(const char* str, JsonType* val, bool object,
+                           String_noinit* errormsg, const Allocator* allocator) {
+    size_t size = strlen(str);
+    size_t valid = utf8_valid_prefix(str, size);
+    if (valid == size && json_parse_indexed(str, size, val, allocator)) {
+        if (!object || val->type == JSON_OBJECT) {
+            return true;
+        }
+        JsonType_free(val);
+    }
+    JsonReader r;
+    JsonReader_create_str(&r, str, allocator);
+    bool res = false;
+    if (valid != size) {
+        invalid_literal(str + valid, &r.ctx, "utf-8");
+    } else if (object && JsonReader_skip_spaces(&r) && r.data[r.pos] != '{') {
+        expected_char(r.data + r.pos, &r.ctx, '{', r.data[r.pos]);
+    } else {
+        res = JsonReader_read(&r, val) == JSON_EVENT_DONE;
+    }
+    return json_parse_finish(&r, res, errormsg);
+}
+
+bool json_parse_object(const char* str, JsonObject* obj, String_noinit* errormsg) {
+    return json_parse_object_with(str, obj, errormsg, NULL);
+}
+
+bool json_parse_object_with(const char* str, JsonObject* obj, String_noinit* errormsg,
+                            const Allocator* allocator) {
+    JsonType type;
+    if (!json_parse_str(str, &type, true, errormsg, allocator)) {
+        return false;
+    }
+    *obj = type.object;
+    return true;
+}
+
+bool json_parse_type(const char* str, JsonType* type, String_noinit* errormsg) {
+    return json_parse_type_with(str, type, errormsg, NULL);
+}
+
+bool json_parse_type_with(const char* str, JsonType* type, String_noinit* errormsg,
+                          const Allocator* allocator) {
+    return json_parse_str(str, type, false, errormsg, allocator);
+}
+
+#define TAPE_KIND(e) ((JsonKind)((e) >> 56))
+#define TAPE_ENTRY(kind, payload) (((uint64_t)(kind) << 56) | (payload))
+// Info entry of a container without a key index
+#define TAPE_NO_KEYS (0xFFFFFFFFull << 32)
+// Length flag of strings stored as an offset into `source`
+#define TAPE_BORROWED 0x80000000u
+// Length flag of borrowed strings that still have their escapes
+#define TAPE_ESCAPED 0x40000000u
+// Member count flag of objects with repeated keys
+#define TAPE_REPEATED 0x80000000u
+
+void JsonTape_create(JsonTape* tape, const Allocator* allocator) {
+    tape->entries = NULL;
+    tape->count = 0;
+    tape->capacity = 0;
+    tape->strings = NULL;
+    tape->strings_size = 0;
+    tape->strings_cap = 0;
+    tape->keys = NULL;
+    tape->key_count = 0;
+    tape->key_cap = 0;
+    tape->open = NULL;
+    tape->depth = 0;
+    tape->open_cap = 0;
+    tape->source = NULL;
+    tape->allocator = allocator;
+}
+
+void JsonTape_free(JsonTape* tape) {
+    if (tape->entries != NULL) {
+        Allocator_free(tape->allocator, tape->entries);
+    }
+    if (tape->strings != NULL) {
+        Allocator_free(tape->allocator, tape->strings);
+    }
+    if (tape->keys != NULL) {
+        Allocator_free(tape->allocator, tape->keys);
+    }
+    if (tape->open != NULL) {
+        Allocator_free(tape->allocator, tape->open);
+    }
+    JsonTape_create(tape, tape->allocator);
+}
+
+// Make room for `extra` more elements of `size` bytes in `*buf`
+static bool JsonTape_grow(const Allocator* allocator, void** buf, uint32_t* cap,
+                          uint32_t used, uint32_t extra, size_t size) {
+    if (used + extra <= *cap) {
+        return true;
+    }
+    uint64_t new_cap = *cap == 0 ? 64 : *cap;
+    while (new_cap < (uint64_t)used + extra) {
+        new_cap *= 2;
+    }
+    if (new_cap > 0xFFFFFFFF) {
+        return false;
+    }
+    void* b;
+    if (*buf == NULL) {
+        b = Allocator_alloc(allocator, new_cap * size);
+    } else {
+        b = Allocator_realloc(allocator, *buf, *cap * size, new_cap * size);
+    }
+    if (b == NULL) {
+        return false;
+    }
+    *buf = b;
+    *cap = new_cap;
+    return true;
+}
+
+static bool JsonTape_append(JsonTape* tape, uint64_t entry) {
+    if (tape->count == tape->capacity &&
+        !JsonTape_grow(tape->allocator, (void**)&tape->entries, &tape->capacity,
+                       tape->count, 1, sizeof(uint64_t))) {
+        return false;
+    }
+    tape->entries[tape->count++] = entry;
+    return true;
+}
+
+static bool JsonTape_append_string(JsonTape* tape, JsonKind kind, const String* s) {
+    uint32_t size = s->length + sizeof(uint32_t) + 1;
+    if (!JsonTape_grow(tape->allocator, (void**)&tape->strings, &tape->strings_cap,
+                       tape->strings_size, size, 1)) {
+        return false;
+    }
+    char* dst = tape->strings + tape->strings_size;
+    memcpy(dst, &s->length, sizeof(uint32_t));
+    memcpy(dst + sizeof(uint32_t), s->buffer, s->length);
+    dst[sizeof(uint32_t) + s->length] = '\0';
+    if (!JsonTape_append(tape, TAPE_ENTRY(kind, tape->strings_size))) {
+        return false;
+    }
+    tape->strings_size += size;
+    return true;
+}
+
+// Store the reader's borrowed string as its length and offset in the input
+static bool JsonTape_append_borrowed(JsonTape* tape, const JsonReader* r) {
+    if (tape->source == NULL) {
+        tape->source = r->data;
+    }
+    uint32_t record[2];
+    record[0] = r->borrowed.length | TAPE_BORROWED |
+                (r->borrowed_escaped ? TAPE_ESCAPED : 0);
+    record[1] = (uint32_t)(r->borrowed.data - tape->source);
+    if (!JsonTape_grow(tape->allocator, (void**)&tape->strings, &tape->strings_cap,
+                       tape->strings_size, sizeof(record), 1)) {
+        return false;
+    }
+    memcpy(tape->strings + tape->strings_size, record, sizeof(record));
+    if (!JsonTape_append(tape, TAPE_ENTRY(JSON_STRING, tape->strings_size))) {
+        return false;
+    }
+    tape->strings_size += sizeof(record);
+    return true;
+}
+
+static bool JsonTape_open(JsonTape* tape, JsonKind kind) {
+    if (tape->depth == tape->open_cap &&
+        !JsonTape_grow(tape->allocator, (void**)&tape->open, &tape->open_cap,
+                       tape->depth, 1, sizeof(uint32_t))) {
+        return false;
+    }
+    tape->open[tape->depth++] = tape->count;
+    return JsonTape_append(tape, TAPE_ENTRY(kind, 0)) && JsonTape_append(tape, TAPE_NO_KEYS);
+}
+
+static inline JsonTapeRef JsonTape_skip(const JsonTape* tape, JsonTapeRef v) {
+    uint64_t e = tape->entries[v];
+    switch (TAPE_KIND(e)) {
+        case JSON_OBJECT:
+        case JSON_LIST:
+            return (uint32_t)e;
+        case JSON_INTEGER:
+        case JSON_DOUBLE:
+            return v + 2;
+        default:
+            return v + 1;
+    }
+}
+
+StrView JsonTape_string(const JsonTape* tape, JsonTapeRef v) {
+    const char* s = tape->strings + (uint32_t)tape->entries[v];
+    StrView view;
+    memcpy(&view.length, s, sizeof(uint32_t));
+    view.data = s + sizeof(uint32_t);
+    if (view.length & TAPE_BORROWED) {
+        uint32_t offset;
+        memcpy(&offset, view.data, sizeof(uint32_t));
+        view.length &= ~(TAPE_BORROWED | TAPE_ESCAPED);
+        view.data = tape->source + offset;
+    }
+    return view;
+}
+
+bool JsonTape_string_escaped(const JsonTape* tape, JsonTapeRef v) {
+    uint32_t length;
+    memcpy(&length, tape->strings + (uint32_t)tape->entries[v], sizeof(uint32_t));
+    return (length & (TAPE_BORROWED | TAPE_ESCAPED)) == (TAPE_BORROWED | TAPE_ESCAPED);
+}
+
+bool JsonTape_string_unescape(const JsonTape* tape, JsonTapeRef v, String* out) {
+    StrView view = JsonTape_string(tape, v);
+    if (!JsonTape_string_escaped(tape, v)) {
+        return String_append_count(out, view.data, view.length);
+    }
+    if (!String_reserve(out, out->length + view.length)) {
+        return false;
+    }
+    // Checked while parsing, so this only fails on out of memory. The
+    // closing quote ends the string.
+    const char* s = view.data - 1;
+    JsonParseCtx ctx;
+    ctx.root = s;
+    ctx.row = 1;
+    ctx.col = 1;
+    ctx.last = '\0';
+    ctx.errormsg.buffer = NULL;
+    ctx.errormsg.allocator = NULL;
+    ctx.allocator = NULL;
+    bool res = JsonString_parse_append(&s, out, &ctx);
+    if (ctx.errormsg.buffer != NULL) {
+        String_free(&ctx.errormsg);
+    }
+    return res;
+}
+
+static int JsonTape_compare(StrView a, StrView b) {
+    int c = memcmp(a.data, b.data, a.length < b.length ? a.length : b.length);
+    if (c != 0) {
+        return c;
+    }
+    return (a.length > b.length) - (a.length < b.length);
+}
+
+// Stable merge sort of key entries, so repeated keys stay in document order
+static void JsonTape_sort_keys(const JsonTape* tape, uint32_t* keys, uint32_t* tmp, uint32_t n) {
+    if (n < 2) {
+        return;
+    }
+    uint32_t half = n / 2;
+    JsonTape_sort_keys(tape, keys, tmp, half);
+    JsonTape_sort_keys(tape, keys + half, tmp, n - half);
+    memcpy(tmp, keys, half * sizeof(uint32_t));
+    uint32_t a = 0, b = half, out = 0;
+    while (a < half && b < n) {
+        if (JsonTape_compare(JsonTape_string(tape, keys[b]), JsonTape_string(tape, tmp[a])) < 0) {
+            keys[out++] = keys[b++];
+        } else {
+            keys[out++] = tmp[a++];
+        }
+    }
+    while (a < half) {
+        keys[out++] = tmp[a++];
+    }
+}
+
+static bool JsonTape_close(JsonTape* tape) {
+    JsonTapeRef start = tape->open[--tape->depth];
+    tape->entries[start] |= tape->count;
+    uint32_t count = (uint32_t)tape->entries[start + 1];
+    if (TAPE_KIND(tape->entries[start]) != JSON_OBJECT) {
+        return true;
+    }
+    if (count <= JSON_TAPE_LINEAR_MAX) {
+        // Few enough to compare every pair of keys
+        StrView names[JSON_TAPE_LINEAR_MAX];
+        JsonTapeRef v = start + 2;
+        for (uint32_t i = 0; i < count; ++i) {
+            names[i] = JsonTape_string(tape, v);
+            for (uint32_t j = 0; j < i; ++j) {
+                if (StrView_equals(names[i], names[j])) {
+                    tape->entries[start + 1] |= TAPE_REPEATED;
+                    return true;
+                }
+            }
+            v = JsonTape_skip(tape, v + 1);
+        }
+        return true;
+    }
+    // Second half of the reserved space is scratch for the sort
+    if (!JsonTape_grow(tape->allocator, (void**)&tape->keys, &tape->key_cap,
+                       tape->key_count, 2 * count, sizeof(uint32_t))) {
+        return false;
+    }
+    uint32_t* keys = tape->keys + tape->key_count;
+    JsonTapeRef v = start + 2;
+    for (uint32_t i = 0; i < count; ++i) {
+        keys[i] = v;
+        v = JsonTape_skip(tape, v + 1);
+    }
+    JsonTape_sort_keys(tape, keys, keys + count, count);
+    uint32_t repeated = 0;
+    for (uint32_t i = 1; i < count; ++i) {
+        if (JsonTape_compare(JsonTape_string(tape, keys[i - 1]),
+                             JsonTape_string(tape, keys[i])) == 0) {
+            repeated = TAPE_REPEATED;
+            break;
+        }
+    }
+    tape->entries[start + 1] = count | repeated | ((uint64_t)tape->key_count << 32);
+    tape->key_count += count;
+    return true;
+}
+
+JsonEvent JsonReader_read_tape(JsonReader* r, JsonTape* tape) {
+    while (1) {
+        JsonEvent e = JsonReader_next(r);
+        bool res = true;
+        switch (e) {
+            case JSON_EVENT_NONE:
+                return JSON_EVENT_NONE;
+            case JSON_EVENT_ERROR:
+                goto fail;
+            case JSON_EVENT_DONE:
+                unexpected_eof(r->data + r->pos, &r->ctx);
+                goto fail;
+            case JSON_EVENT_OBJECT_START:
+            case JSON_EVENT_LIST_START:
+                if (!JsonTape_open(tape, e == JSON_EVENT_OBJECT_START ? JSON_OBJECT : JSON_LIST)) {
+                    goto fail;
+                }
+                continue;
+            case JSON_EVENT_KEY:
+                if (tape->depth == 0) {
+                    // Called at a key, read the member value
+                    continue;
+                }
+                if (r->borrowed.data != NULL ? !JsonTape_append_borrowed(tape, r)
+                                             : !JsonTape_append_string(tape, JSON_STRING, &r->string)) {
+                    goto fail;
+                }
+                continue;
+            case JSON_EVENT_OBJECT_END:
+            case JSON_EVENT_LIST_END:
+                res = JsonTape_close(tape);
+                break;
+            case JSON_EVENT_STRING:
+                res = r->borrowed.data != NULL ? JsonTape_append_borrowed(tape, r)
+                                               : JsonTape_append_string(tape, JSON_STRING, &r->string);
+                break;
+            case JSON_EVENT_INTEGER:
+                res = JsonTape_append(tape, TAPE_ENTRY(JSON_INTEGER, 0)) &&
+                      JsonTape_append(tape, (uint64_t)r->integer);
+                break;
+            case JSON_EVENT_DOUBLE: {
+                uint64_t bits;
+                memcpy(&bits, &r->dbl, sizeof(bits));
+                res = JsonTape_append(tape, TAPE_ENTRY(JSON_DOUBLE, 0)) &&
+                      JsonTape_append(tape, bits);
+                break;
+            }
+            case JSON_EVENT_BOOL:
+                res = JsonTape_append(tape, TAPE_ENTRY(JSON_BOOL, r->b));
+                break;
+            case JSON_EVENT_NULL:
+                res = JsonTape_append(tape, TAPE_ENTRY(JSON_NULL, 0));
+                break;
+        }
+        if (!res) {
+            goto fail;
+        }
+        if (tape->depth == 0) {
+            return JSON_EVENT_DONE;
+        }
+        // Member count of the enclosing container
+        ++tape->entries[tape->open[tape->depth - 1] + 1];
+    }
+fail:
+    r->state = READ_ERROR;
+    return JSON_EVENT_ERROR;
+}
+
+bool json_parse_tape(const char* str, JsonTape* tape, String_noinit* errormsg) {
+    return json_parse_tape_with(str, tape, errormsg, NULL);
+}
+
+static bool json_parse_tape_str(const char* str, JsonTape* tape, String_noinit* errormsg,
+                                const Allocator* allocator, bool borrow) {
+    size_t size = strlen(str);
+    size_t valid = utf8_valid_prefix(str, size);
+    JsonTape_create(tape, allocator);
+    JsonReader r;
+    JsonReader_create_str(&r, str, allocator);
+    r.borrow = borrow;
+    bool res = false;
+    if (valid != size) {
+        invalid_literal(str + valid, &r.ctx, "utf-8");
+    } else if (size <= 0xFFFFFFFF) {
+        // Strings never take more than the input plus their length prefixes,
+        // entries rarely more than one per four bytes
+        res = JsonTape_grow(allocator, (void**)&tape->entries, &tape->capacity,
+                            0, size / 4 + 2, sizeof(uint64_t)) &&
+              JsonTape_grow(allocator, (void**)&tape->strings, &tape->strings_cap,
+                            0, size + 1, 1) &&
+              JsonReader_read_tape(&r, tape) == JSON_EVENT_DONE;
+    }
+    if (!res) {
+        JsonTape_free(tape);
+    }
+    return json_parse_finish(&r, res, errormsg);
+}
+
+bool json_parse_tape_with(const char* str, JsonTape* tape, String_noinit* errormsg,
+                          const Allocator* allocator) {
+    return json_parse_tape_str(str, tape, errormsg, allocator, false);
+}
+
+bool json_parse_tape_borrowed(const char* str, JsonTape* tape, String_noinit* errormsg,
+                              const Allocator* allocator) {
+    return json_parse_tape_str(str, tape, errormsg, allocator, true);
+}
+
+JsonKind JsonTape_type(const JsonTape* tape, JsonTapeRef v) {
+    return TAPE_KIND(tape->entries[v]);
+}
+
+// Members stored for a container, repeated keys included
+static inline uint32_t JsonTape_count(const JsonTape* tape, JsonTapeRef v) {
+    return (uint32_t)tape->entries[v + 1] & ~TAPE_REPEATED;
+}
+
+// Whether the key of member `key` appears earlier in object `obj`
+static bool JsonTape_repeated(const JsonTape* tape, JsonTapeRef obj, JsonTapeRef key) {
+    StrView name = JsonTape_string(tape, key);
+    for (JsonTapeRef v = obj + 2; v < key; v = JsonTape_skip(tape, v + 1)) {
+        if (StrView_equals(JsonTape_string(tape, v), name)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t JsonTape_size(const JsonTape* tape, JsonTapeRef v) {
+    JsonKind kind = TAPE_KIND(tape->entries[v]);
+    if (kind != JSON_OBJECT && kind != JSON_LIST) {
+        return 0;
+    }
+    uint32_t count = JsonTape_count(tape, v);
+    if (!(tape->entries[v + 1] & TAPE_REPEATED)) {
+        return count;
+    }
+    uint32_t size = 0;
+    JsonTapeRef key = v + 2;
+    for (uint32_t i = 0; i < count; ++i) {
+        size += !JsonTape_repeated(tape, v, key);
+        key = JsonTape_skip(tape, key + 1);
+    }
+    return size;
+}
+
+int64_t JsonTape_int(const JsonTape* tape, JsonTapeRef v) {
+    return (int64_t)tape->entries[v + 1];
+}
+
+double JsonTape_double(const JsonTape* tape, JsonTapeRef v) {
+    double d;
+    memcpy(&d, &tape->entries[v + 1], sizeof(d));
+    return d;
+}
+
+bool JsonTape_bool(const JsonTape* tape, JsonTapeRef v) {
+    return (uint32_t)tape->entries[v] != 0;
+}
+
+static JsonTapeRef JsonTape_find(const JsonTape* tape, JsonTapeRef obj, StrView k) {
+    uint64_t info = tape->entries[obj + 1];
+    uint32_t count = JsonTape_count(tape, obj);
+    JsonTapeRef found = JSON_TAPE_NONE;
+    if (count <= JSON_TAPE_LINEAR_MAX) {
+        JsonTapeRef v = obj + 2;
+        for (uint32_t i = 0; i < count; ++i) {
+            StrView name = JsonTape_string(tape, v);
+            if (name.length == k.length && memcmp(name.data, k.data, k.length) == 0) {
+                found = v + 1;
+            }
+            v = JsonTape_skip(tape, v + 1);
+        }
+        return found;
+    }
+    // Last key not greater than `key`
+    const uint32_t* keys = tape->keys + (info >> 32);
+    uint32_t low = 0, high = count;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (JsonTape_compare(JsonTape_string(tape, keys[mid]), k) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low > 0 && JsonTape_compare(JsonTape_string(tape, keys[low - 1]), k) == 0) {
+        found = keys[low - 1] + 1;
+    }
+    return found;
+}
+
+JsonTapeRef JsonTapeObject_get(const JsonTape* tape, JsonTapeRef obj, const char* key) {
+    if (TAPE_KIND(tape->entries[obj]) != JSON_OBJECT) {
+        return JSON_TAPE_NONE;
+    }
+    return JsonTape_find(tape, obj, StrView_from_str(key));
+}
+
+static JsonTapeRef JsonTape_of_type(const JsonTape* tape, JsonTapeRef v, JsonKind kind) {
+    if (v == JSON_TAPE_NONE || TAPE_KIND(tape->entries[v]) != kind) {
+        return JSON_TAPE_NONE;
+    }
+    return v;
+}
+
+JsonTapeRef JsonTapeObject_get_obj(const JsonTape* tape, JsonTapeRef obj, const char* key) {
+    return JsonTape_of_type(tape, JsonTapeObject_get(tape, obj, key), JSON_OBJECT);
+}
+
+JsonTapeRef JsonTapeObject_get_list(const JsonTape* tape, JsonTapeRef obj, const char* key) {
+    return JsonTape_of_type(tape, JsonTapeObject_get(tape, obj, key), JSON_LIST);
+}
+
+bool JsonTapeObject_get_int(const JsonTape* tape, JsonTapeRef obj, const char* key, int64_t* out) {
+    JsonTapeRef v = JsonTape_of_type(tape, JsonTapeObject_get(tape, obj, key), JSON_INTEGER);
+    if (v == JSON_TAPE_NONE) {
+        return false;
+    }
+    *out = JsonTape_int(tape, v);
+    return true;
+}
+
+bool JsonTapeObject_get_double(const JsonTape* tape, JsonTapeRef obj, const char* key, double* out) {
+    JsonTapeRef v = JsonTape_of_type(tape, JsonTapeObject_get(tape, obj, key), JSON_DOUBLE);
+    if (v == JSON_TAPE_NONE) {
+        return false;
+    }
+    *out = JsonTape_double(tape, v);
+    return true;
+}
+
+bool JsonTapeObject_get_bool(const JsonTape* tape, JsonTapeRef obj, const char* key, bool* out) {
+    JsonTapeRef v = JsonTape_of_type(tape, JsonTapeObject_get(tape, obj, key), JSON_BOOL);
+    if (v == JSON_TAPE_NONE) {
+        return false;
+    }
+    *out = JsonTape_bool(tape, v);
+    return true;
+}
+
+bool JsonTapeObject_get_string(const JsonTape* tape, JsonTapeRef obj, const char* key, StrView* out) {
+    JsonTapeRef v = JsonTape_of_type(tape, JsonTapeObject_get(tape, obj, key), JSON_STRING);
+    if (v == JSON_TAPE_NONE) {
+        return false;
+    }
+    *out = JsonTape_string(tape, v);
+    return true;
+}
+
+bool JsonTapeObject_get_null(const JsonTape* tape, JsonTapeRef obj, const char* key) {
+    return JsonTape_of_type(tape, JsonTapeObject_get(tape, obj, key), JSON_NULL) != JSON_TAPE_NONE;
+}
+
+JsonTapeRef JsonTapeList_get(const JsonTape* tape, JsonTapeRef list, unsigned ix) {
+    if (TAPE_KIND(tape->entries[list]) != JSON_LIST || ix >= JsonTape_count(tape, list)) {
+        return JSON_TAPE_NONE;
+    }
+    JsonTapeRef v = list + 2;
+    for (unsigned i = 0; i < ix; ++i) {
+        v = JsonTape_skip(tape, v);
+    }
+    return v;
+}
+
+JsonTapeRef JsonTapeList_get_obj(const JsonTape* tape, JsonTapeRef list, unsigned ix) {
+    return JsonTape_of_type(tape, JsonTapeList_get(tape, list, ix), JSON_OBJECT);
+}
+
+JsonTapeRef JsonTapeList_get_list(const JsonTape* tape, JsonTapeRef list, unsigned ix) {
+    return JsonTape_of_type(tape, JsonTapeList_get(tape, list, ix), JSON_LIST);
+}
+
+bool JsonTapeList_get_int(const JsonTape* tape, JsonTapeRef list, unsigned ix, int64_t* out) {
+    JsonTapeRef v = JsonTape_of_type(tape, JsonTapeList_get(tape, list, ix), JSON_INTEGER);
+    if (v == JSON_TAPE_NONE) {
+        return false;
+    }
+    *out = JsonTape_int(tape, v);
+    return true;
+}
+
+bool JsonTapeList_get_double(const JsonTape* tape, JsonTapeRef list, unsigned ix, double* out) {
+    JsonTapeRef v = JsonTape_of_type(tape, JsonTapeList_get(tape, list, ix), JSON_DOUBLE);
+    if (v == JSON_TAPE_NONE) {
+        return false;
+    }
+    *out = JsonTape_double(tape, v);
+    return true;
+}
+
+bool JsonTapeList_get_bool(const JsonTape* tape, JsonTapeRef list, unsigned ix, bool* out) {
+    JsonTapeRef v = JsonTape_of_type(tape, JsonTapeList_get(tape, list, ix), JSON_BOOL);
+    if (v == JSON_TAPE_NONE) {
+        return false;
+    }
+    *out = JsonTape_bool(tape, v);
+    return true;
+}
+
+bool JsonTapeList_get_string(const JsonTape* tape, JsonTapeRef list, unsigned ix, StrView* out) {
+    JsonTapeRef v = JsonTape_of_type(tape, JsonTapeList_get(tape, list, ix), JSON_STRING);
+    if (v == JSON_TAPE_NONE) {
+        return false;
+    }
+    *out = JsonTape_string(tape, v);
+    return true;
+}
+
+bool JsonTapeList_get_null(const JsonTape* tape, JsonTapeRef list, unsigned ix) {
+    return JsonTape_of_type(tape, JsonTapeList_get(tape, list, ix), JSON_NULL) != JSON_TAPE_NONE;
+}
+
+void JsonTapeIter_begin(JsonTapeIter* it, const JsonTape* tape, JsonTapeRef container) {
+    JsonKind kind = TAPE_KIND(tape->entries[container]);
+    it->tape = tape;
+    it->container = container;
+    it->next = container + 2;
+    it->left = kind == JSON_OBJECT || kind == JSON_LIST ? JsonTape_count(tape, container) : 0;
+    it->object = kind == JSON_OBJECT;
+    it->repeated = it->object && (tape->entries[container + 1] & TAPE_REPEATED);
+}
+
+bool JsonTapeIter_next(JsonTapeIter* it, StrView* key, JsonTapeRef* value) {
+    while (it->left > 0) {
+        --it->left;
+        if (!it->object) {
+            *value = it->next;
+            it->next = JsonTape_skip(it->tape, it->next);
+            return true;
+        }
+        JsonTapeRef name = it->next;
+        *value = name + 1;
+        it->next = JsonTape_skip(it->tape, name + 1);
+        if (it->repeated) {
+            // Like the hash map, a repeated key keeps its first position
+            // and takes the last value
+            if (JsonTape_repeated(it->tape, it->container, name)) {
+                continue;
+            }
+            *value = JsonTape_find(it->tape, it->container, JsonTape_string(it->tape, name));
+        }
+        if (key != NULL) {
+            *key = JsonTape_string(it->tape, name);
+        }
+        return true;
+    }
+    return false;
+}
+
+bool double_to_string(double d, String* dest) {
+    char buf[JSON_DOUBLE_MAX_LEN];
+    return String_append_count(dest, buf, json_format_double(d, buf));
+}
+
+// Bytes added by escaping each byte in a string, \u00XX for control
+// characters without a short escape
+static const uint8_t json_escape_extra[256] = {
+    5, 5, 5, 5, 5, 5, 5, 5, 1, 1, 1, 5, 1, 1, 5, 5,
+    5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5, 5,
+    0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0,
+};
+
+// Character after the backslash for control characters, 'u' for \u00XX
+static const char json_control_escape[0x20] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+};
+
+#if defined(__AVX2__)
+#define JSON_ESCAPE_BLOCK 32
+// Bit i is set if byte i of `p` has to be escaped
+static inline uint32_t json_escape_mask(const char* p) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+    __m256i ctrl = _mm256_set1_epi8(0x1F);
+    m = _mm256_or_si256(m, _mm256_cmpeq_epi8(_mm256_max_epu8(v, ctrl), ctrl));
+    return (uint32_t)_mm256_movemask_epi8(m);
+}
+#elif defined(__SSE2__) || defined(_M_X64)
+#define JSON_ESCAPE_BLOCK 16
+static inline uint32_t json_escape_mask(const char* p) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+    __m128i ctrl = _mm_set1_epi8(0x1F);
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_max_epu8(v, ctrl), ctrl));
+    return (uint32_t)_mm_movemask_epi8(m);
+}
+#endif
+
+// Length of `s` written as a quoted JSON string
+static uint64_t json_string_size(const char* s, uint64_t len) {
+    uint64_t size = len + 2;
+    uint64_t i = 0;
+#ifdef JSON_ESCAPE_BLOCK
+    for (; i + JSON_ESCAPE_BLOCK <= len; i += JSON_ESCAPE_BLOCK) {
+        uint32_t m = json_escape_mask(s + i);
+        while (m != 0) {
+            size += json_escape_extra[(uint8_t)s[i + json_ctz(m)]];
+            m &= m - 1;
+        }
+    }
+#endif
+    for (; i < len; ++i) {
+        size += json_escape_extra[(uint8_t)s[i]];
+    }
+    return size;
+}
+
+static inline char* json_write_escape(char* out, uint8_t c) {
+    *out++ = '\\';
+    if (c >= 0x20) {
+        *out++ = (char)c;
+    } else if (json_control_escape[c] != 'u') {
+        *out++ = json_control_escape[c];
+    } else {
+        out[0] = 'u';
+        out[1] = '0';
+        out[2] = '0';
+        out[3] = '0' + (c >> 4);
+        out[4] = "0123456789abcdef"[c & 0xF];
+        out += 5;
+    }
+    return out;
+}
+
+// Write `s` quoted and escaped to `out`, which has room for
+// json_string_size bytes. Returns the end of the output
+static char* json_write_string(char* out, const char* s, uint64_t len) {
+    *out++ = '"';
+    uint64_t i = 0;
+#ifdef JSON_ESCAPE_BLOCK
+    while (i + JSON_ESCAPE_BLOCK <= len) {
+        uint32_t m = json_escape_mask(s + i);
+        if (m == 0) {
+            memcpy(out, s + i, JSON_ESCAPE_BLOCK);
+            out += JSON_ESCAPE_BLOCK;
+            i += JSON_ESCAPE_BLOCK;
+            continue;
+        }
+        unsigned n = json_ctz(m);
+        memcpy(out, s + i, n);
+        out = json_write_escape(out + n, (uint8_t)s[i + n]);
+        i += n + 1;
+    }
+#endif
+    for (; i < len; ++i) {
+        uint8_t c = (uint8_t)s[i];
+        if (json_escape_extra[c] == 0) {
+            *out++ = (char)c;
+        } else {
+            out = json_write_escape(out, c);
         }
-        if (!String_append(res, ']')) {
+    }
+    *out++ = '"';
+    return out;
+}
+
+static inline char* json_write_literal(char* out, const char* lit) {
+    while (*lit != '\0') {
+        *out++ = *lit++;
+    }
+    return out;
+}
+
+static inline char* json_write_indent(char* out, uint32_t depth) {
+    *out++ = '\n';
+    memset(out, ' ', 2 * (size_t)depth);
+    return out + 2 * (size_t)depth;
+}
+
+// Output position of the writers in a String, which only grows when
+// the next token does not fit
+typedef struct JsonSink {
+    char* out;
+    char* end;
+    String* s;
+} JsonSink;
+
+static void JsonSink_begin(JsonSink* sink, String* s) {
+    sink->s = s;
+    sink->out = s->buffer + s->length;
+    // Keep room for the terminator
+    sink->end = s->buffer + s->capacity - 1;
+}
+
+static bool JsonSink_grow(JsonSink* sink, uint64_t size) {
+    String* s = sink->s;
+    s->length = (string_size_t)(sink->out - s->buffer);
+    if (size > 0x7fffffff || !String_reserve(s, s->length + size)) {
+        return false;
+    }
+    JsonSink_begin(sink, s);
+    return true;
+}
+
+static inline bool JsonSink_reserve(JsonSink* sink, uint64_t size) {
+    return (uint64_t)(sink->end - sink->out) >= size || JsonSink_grow(sink, size);
+}
+
+// Terminate the output, or drop it if writing failed
+static bool JsonSink_end(JsonSink* sink, string_size_t start, bool ok) {
+    String* s = sink->s;
+    s->length = ok ? (string_size_t)(sink->out - s->buffer) : start;
+    s->buffer[s->length] = '\0';
+    return ok;
+}
+
+static bool JsonSink_string(JsonSink* sink, const char* s, uint64_t len) {
+    // Escaping makes a byte at most 6 long, only scan for the exact
+    // size when that might not fit
+    if ((uint64_t)(sink->end - sink->out) < 6 * len + 2 &&
+        !JsonSink_grow(sink, json_string_size(s, len))) {
+        return false;
+    }
+    sink->out = json_write_string(sink->out, s, len);
+    return true;
+}
+
+static bool JsonSink_scalar(JsonSink* sink, const JsonType* v) {
+    if (!JsonSink_reserve(sink, JSON_DOUBLE_MAX_LEN)) {
+        return false;
+    }
+    switch (v->type) {
+    case JSON_INTEGER:
+        sink->out += json_format_int(v->integer, sink->out);
+        break;
+    case JSON_DOUBLE:
+        sink->out += json_format_double(v->dbl, sink->out);
+        break;
+    case JSON_BOOL:
+        sink->out = json_write_literal(sink->out, v->b ? "true" : "false");
+        break;
+    default:
+        sink->out = json_write_literal(sink->out, "null");
+        break;
+    }
+    return true;
+}
+
+static bool JsonSink_tape_scalar(JsonSink* sink, const JsonTape* tape, JsonTapeRef v) {
+    JsonKind kind = JsonTape_type(tape, v);
+    if (kind == JSON_STRING) {
+        StrView str = JsonTape_string(tape, v);
+        if (!JsonTape_string_escaped(tape, v)) {
+            return JsonSink_string(sink, str.data, str.length);
+        }
+        // Already escaped as it was in the input
+        if (!JsonSink_reserve(sink, (uint64_t)str.length + 2)) {
             return false;
         }
+        *sink->out++ = '"';
+        memcpy(sink->out, str.data, str.length);
+        sink->out += str.length;
+        *sink->out++ = '"';
         return true;
+    }
+    if (!JsonSink_reserve(sink, JSON_DOUBLE_MAX_LEN)) {
+        return false;
+    }
+    switch (kind) {
     case JSON_INTEGER:
-        return String_format_append(res, "%llu", v->integer);
+        sink->out += json_format_int(JsonTape_int(tape, v), sink->out);
+        break;
     case JSON_DOUBLE:
-        return double_to_string(v->dbl, res);
+        sink->out += json_format_double(JsonTape_double(tape, v), sink->out);
+        break;
     case JSON_BOOL:
-        if (v->b) {
-            return String_append_count(res, "true", 4);
-        } else {
-            return String_append_count(res, "false", 5);
+        sink->out = json_write_literal(sink->out, JsonTape_bool(tape, v) ? "true" : "false");
+        break;
+    default:
+        sink->out = json_write_literal(sink->out, "null");
+        break;
+    }
+    return true;
+}
+
+#include "json_writer.h"
+#define JSON_WRITER_PRETTY
+#include "json_writer.h"
+#undef JSON_WRITER_PRETTY
+
+// Upper bound of the compact output size of `v`, exact except for
+// numbers which are counted at their longest
+static uint64_t json_type_size(const JsonType* v) {
+    switch (v->type) {
+    case JSON_OBJECT: {
+        LinkedHashMapIterator it;
+        LinkedHashMapIter_Begin(&it, (LinkedHashMap*)&v->object.data);
+        LinkedHashElement* el;
+        uint64_t size = 2;
+        while ((el = LinkedHashMapIter_Next(&it)) != NULL) {
+            size += json_string_size(el->key, strlen(el->key)) + 2 + json_type_size(el->value);
+        }
+        return size;
+    }
+    case JSON_LIST: {
+        uint64_t size = 2;
+        for (uint32_t i = 0; i < v->list.size; ++i) {
+            size += json_type_size(&v->list.data[i]) + 1;
         }
+        return size;
+    }
     case JSON_STRING:
-        return write_json_string(v->string.buffer, v->string.length, res);
-    case JSON_NULL:
-        return String_append_count(res, "null", 4);
+        return json_string_size(v->string.buffer, v->string.length);
+    default:
+        return JSON_DOUBLE_MAX_LEN;
+    }
+}
+
+bool json_object_to_string(const JsonObject* obj, String* res) {
+    JsonType t;
+    t.type = JSON_OBJECT;
+    t.object = *obj;
+    return json_type_to_string(&t, res);
+}
+
+bool json_type_to_string(const JsonType* v, String* res) {
+    string_size_t start = res->length;
+    JsonSink sink;
+    JsonSink_begin(&sink, res);
+    return JsonSink_end(&sink, start, JsonWriter_type(&sink, v, 0));
+}
+
+bool json_type_to_string_pretty(const JsonType* v, String* res) {
+    string_size_t start = res->length;
+    JsonSink sink;
+    JsonSink_begin(&sink, res);
+    return JsonSink_end(&sink, start, JsonWriter_type_pretty(&sink, v, 0));
+}
+
+bool json_type_to_new_string(const JsonType* v, String_noinit* dest) {
+    uint64_t size = json_type_size(v);
+    if (size >= 0x7fffffff || !String_create_capacity(dest, (string_size_t)size + 1)) {
+        return false;
+    }
+    if (!json_type_to_string(v, dest)) {
+        String_free(dest);
+        return false;
     }
+    return true;
+}
+
+bool json_tape_to_string(const JsonTape* tape, JsonTapeRef v, String* res) {
+    string_size_t start = res->length;
+    JsonSink sink;
+    JsonSink_begin(&sink, res);
+    return JsonSink_end(&sink, start, JsonWriter_tape(&sink, tape, v, 0));
+}
+
+bool json_tape_to_string_pretty(const JsonTape* tape, JsonTapeRef v, String* res) {
+    string_size_t start = res->length;
+    JsonSink sink;
+    JsonSink_begin(&sink, res);
+    return JsonSink_end(&sink, start, JsonWriter_tape_pretty(&sink, tape, v, 0));
 }
 
 #ifdef JSON_TESTS
@@ -1221,10 +2772,16 @@ double rel_diff(double a, double b) {
     bool is_int;                \
     assert(JsonNumber_parse(&s, &i, &d, &is_int, &ctx)); \
     assert(!is_int);             \
-    printf("%g, %g, %g\n", d, res, rel_diff(d, res)); \
-    if (rel_diff(d, res) > 1e-10) {              \
-        assert(d == res);        \
-    }                            \
+    printf("%g, %g\n", d, res); \
+    assert(d == res);            \
+} while (0)
+
+#define TEST_ROUNDTRIP(v) do {  \
+    String out;                 \
+    String_create(&out);        \
+    assert(double_to_string(v, &out)); \
+    TEST_DOUBLE(out.buffer, v); \
+    String_free(&out);          \
 } while (0)
 
 int main() {
@@ -1236,7 +2793,16 @@ int main() {
     TEST_DOUBLE("0.00214125E70", 0.00214125E70);
     TEST_DOUBLE("-0.00214125E+70", -0.00214125E70);
     TEST_DOUBLE("123456789101112131415.0", 123456789101112131415.0);
-    TEST_INT("-9223372036854775807", )
+    TEST_DOUBLE("1.00000000000000011102230246251565404236316680908203125", 1.0);
+    TEST_DOUBLE("1.00000000000000011102230246251565404236316680908203126", 1.0000000000000002);
+    TEST_DOUBLE("2.4703282292062328e-324", 5e-324);
+    TEST_INT("-9223372036854775808", INT64_MIN);
+    TEST_INT("9223372036854775807", INT64_MAX);
+    TEST_DOUBLE("9223372036854775808", 9223372036854775808.0);
+    TEST_ROUNDTRIP(0.1);
+    TEST_ROUNDTRIP(-1.7976931348623157e308);
+    TEST_ROUNDTRIP(5e-324);
+    TEST_ROUNDTRIP(123456.789e-12);
 
     const char* str = "{\"Hello\": [0, -0.0, -1123, true, null, {\"This\": \"Is the fin\\\"al countdown\", \"Is a test\": -2.345e24}]}";
     JsonObject obj;
@@ -1258,6 +2824,31 @@ int main() {
     assert(JsonObject_get_string(o, "This") != NULL && strcmp(JsonObject_get_string(o, "This")->buffer, "Is the fin\"al countdown") == 0);
     assert(JsonObject_get_double(o, "Is a test") != NULL && rel_diff(*JsonObject_get_double(o, "Is a test"), -2.345e24) < 1e-10);
 
+    // Feeding the same document a byte at a time gives the same tree
+    String whole;
+    String_create(&whole);
+    assert(json_object_to_string(&obj, &whole));
+    JsonReader reader;
+    JsonReader_create(&reader, NULL);
+    JsonType streamed;
+    JsonEvent e;
+    const char* next = str;
+    while ((e = JsonReader_read(&reader, &streamed)) == JSON_EVENT_NONE) {
+        if (*next == '\0') {
+            JsonReader_finish(&reader);
+        } else {
+            assert(JsonReader_feed(&reader, next, 1));
+            ++next;
+        }
+    }
+    assert(e == JSON_EVENT_DONE);
+    String part;
+    String_create(&part);
+    assert(json_type_to_string(&streamed, &part));
+    assert(strcmp(whole.buffer, part.buffer) == 0);
+    JsonType_free(&streamed);
+    JsonReader_free(&reader);
+
     printf("Success!\n");
 }
 #endif
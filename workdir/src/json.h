@@ -20,10 +20,16 @@ struct JsonList {
     JsonType* data;
     unsigned size;
     unsigned capacity;
+    // NULL for the process heap
+    const Allocator* allocator;
 };
 
+typedef enum JsonKind {
+    JSON_OBJECT, JSON_LIST, JSON_INTEGER, JSON_DOUBLE, JSON_BOOL, JSON_STRING, JSON_NULL
+} JsonKind;
+
 struct JsonType {
-    enum { JSON_OBJECT, JSON_LIST, JSON_INTEGER, JSON_DOUBLE, JSON_BOOL, JSON_STRING, JSON_NULL } type;
+    JsonKind type;
     union {
         JsonObject object;
         JsonList list;
@@ -37,6 +43,9 @@ struct JsonType {
 
 bool JsonObject_create(JsonObject* obj);
 
+// Create an object allocating members and keys from `allocator`
+bool JsonObject_create_with(JsonObject* obj, const Allocator* allocator);
+
 void JsonObject_free(JsonObject* obj);
 
 bool JsonObject_insert(JsonObject* obj, const char* key, JsonType val);
@@ -65,6 +74,9 @@ bool JsonObject_remove(JsonObject* obj, const char* key);
 
 bool JsonList_create(JsonList* list);
 
+// Create a list allocating elements from `allocator`
+bool JsonList_create_with(JsonList* list, const Allocator* allocator);
+
 bool JsonList_append(JsonList* list, JsonType val);
 
 bool JsonList_append_obj(JsonList* list, JsonObject val);
@@ -112,12 +124,266 @@ void JsonList_free(JsonList* list);
 
 void JsonType_free(JsonType* val);
 
+// Position and error state shared by the parsing functions
+typedef struct JsonParseCtx {
+    // Errors are reported relative to `root`, which is at `row`, `col`
+    const char* root;
+    unsigned row;
+    unsigned col;
+    // Character before `root`, to count \r\n as one line break
+    char last;
+    String errormsg;
+    const Allocator* allocator;
+} JsonParseCtx;
+
+typedef enum JsonEvent {
+    // More input is needed, feed it and call again
+    JSON_EVENT_NONE,
+    JSON_EVENT_ERROR,
+    JSON_EVENT_OBJECT_START,
+    JSON_EVENT_OBJECT_END,
+    JSON_EVENT_LIST_START,
+    JSON_EVENT_LIST_END,
+    // Object key, content in `string` of the reader
+    JSON_EVENT_KEY,
+    JSON_EVENT_STRING,
+    JSON_EVENT_INTEGER,
+    JSON_EVENT_DOUBLE,
+    JSON_EVENT_BOOL,
+    JSON_EVENT_NULL,
+    // The top level value has been read
+    JSON_EVENT_DONE
+} JsonEvent;
+
+// Strings shorter than this are always copied
+#define JSON_BORROW_MIN 64
+
+typedef struct JsonBuildFrame {
+    JsonType value;
+    // Key the next member of an object is stored under
+    String key;
+} JsonBuildFrame;
+
+// Pull parser. Input can be fed in chunks of any size, only the unread
+// part of the input and the current token are kept.
+typedef struct JsonReader {
+    const char* data;
+    size_t size;
+    size_t pos;
+    // Where the scan for the end of a split string resumes, relative to pos
+    size_t scan;
+    // The part of a split string scanned so far has an escape
+    bool scan_escaped;
+    bool finished;
+    // Owns `data` when fed in chunks
+    String input;
+    // One byte per open container, '{' or '['
+    char* stack;
+    unsigned depth;
+    unsigned stack_cap;
+    int state;
+    // Value of the last event
+    String string;
+    // Set to leave strings of at least JSON_BORROW_MIN bytes in the input,
+    // only valid for readers from JsonReader_create_str. Such strings are
+    // in `borrowed` instead of `string`. Values with escapes are borrowed
+    // as the raw text between the quotes with `borrowed_escaped` set, keys
+    // only without escapes.
+    bool borrow;
+    bool borrowed_escaped;
+    StrView borrowed;
+    int64_t integer;
+    double dbl;
+    bool b;
+    // Containers under construction by JsonReader_read
+    JsonBuildFrame* frames;
+    unsigned frame_count;
+    unsigned frame_cap;
+    JsonParseCtx ctx;
+} JsonReader;
+
+// Create a reader fed with JsonReader_feed. Strings and values built by
+// JsonReader_read are allocated from `allocator`.
+bool JsonReader_create(JsonReader* r, const Allocator* allocator);
+
+// Create a reader over all of null-terminated `str`, without copying it
+bool JsonReader_create_str(JsonReader* r, const char* str, const Allocator* allocator);
+
+// Append `len` bytes of input
+bool JsonReader_feed(JsonReader* r, const char* data, size_t len);
+
+// Signal that no more input will be fed
+void JsonReader_finish(JsonReader* r);
+
+JsonEvent JsonReader_next(JsonReader* r);
+
+// Move the string of the last JSON_EVENT_STRING or JSON_EVENT_KEY into `out`
+void JsonReader_take_string(JsonReader* r, String_noinit* out);
+
+// Build the next complete value into `val`. Returns JSON_EVENT_DONE once
+// `val` is set, JSON_EVENT_NONE if more input is needed, after which it
+// can be called again to continue.
+JsonEvent JsonReader_read(JsonReader* r, JsonType* val);
+
+// Error message after JSON_EVENT_ERROR, NULL if out of memory
+const char* JsonReader_error(const JsonReader* r);
+
+void JsonReader_free(JsonReader* r);
+
 bool json_parse_object(const char* str, JsonObject* obj, String_noinit* errormsg);
 
 bool json_parse_type(const char* str, JsonType* val, String_noinit* errormsg);
 
+// Parse with all objects, lists and strings allocated from `allocator`.
+// `errormsg` is always allocated from the process heap.
+// A document parsed into an Arena can be dropped with Arena_release
+// instead of walking it with JsonType_free.
+bool json_parse_object_with(const char* str, JsonObject* obj, String_noinit* errormsg,
+                            const Allocator* allocator);
+
+bool json_parse_type_with(const char* str, JsonType* val, String_noinit* errormsg,
+                          const Allocator* allocator);
+
 bool json_object_to_string(const JsonObject* obj, String* res);
 
+// Append `v` to `res`
 bool json_type_to_string(const JsonType* v, String* res);
 
+// Like json_type_to_string, with one member per line and two space indentation
+bool json_type_to_string_pretty(const JsonType* v, String* res);
+
+// Create `dest` holding `v` with a single allocation, sized by a pass
+// over `v` before writing
+bool json_type_to_new_string(const JsonType* v, String_noinit* dest);
+
+// Index of a value in a JsonTape
+typedef uint32_t JsonTapeRef;
+
+#define JSON_TAPE_NONE ((JsonTapeRef)-1)
+// The top level value
+#define JSON_TAPE_ROOT ((JsonTapeRef)0)
+
+// Objects with more members than this get a sorted key index
+#define JSON_TAPE_LINEAR_MAX 8
+
+// Read-only document stored in document order as 64-bit entries. The top
+// byte of an entry is its JsonKind, the low 32 bits its payload:
+//   object, list: index past the container. The next entry holds the
+//                 member count and the offset of the sorted key index.
+//   integer, double: the value is the next entry
+//   string: offset in `strings` of the length, bytes and null terminator,
+//           or for borrowed strings the length, whether it has escapes and
+//           the offset in `source`
+//   bool: the value
+// Object members are a string entry for the key followed by the value.
+typedef struct JsonTape {
+    uint64_t* entries;
+    uint32_t count;
+    uint32_t capacity;
+    char* strings;
+    uint32_t strings_size;
+    uint32_t strings_cap;
+    // Key entries of large objects, sorted by key within each object
+    uint32_t* keys;
+    uint32_t key_count;
+    uint32_t key_cap;
+    // Containers still open while building
+    uint32_t* open;
+    uint32_t depth;
+    uint32_t open_cap;
+    // Input of json_parse_tape_borrowed
+    const char* source;
+    const Allocator* allocator;
+} JsonTape;
+
+typedef struct JsonTapeIter {
+    const JsonTape* tape;
+    JsonTapeRef container;
+    JsonTapeRef next;
+    uint32_t left;
+    bool object;
+    // The object has repeated keys, which are visited once
+    bool repeated;
+} JsonTapeIter;
+
+// Create an empty tape allocating from `allocator`
+void JsonTape_create(JsonTape* tape, const Allocator* allocator);
+
+void JsonTape_free(JsonTape* tape);
+
+// Parse all of `str` into `tape`, with the same errors as json_parse_type.
+// A tape is a handful of allocations regardless of the document size.
+bool json_parse_tape(const char* str, JsonTape* tape, String_noinit* errormsg);
+
+bool json_parse_tape_with(const char* str, JsonTape* tape, String_noinit* errormsg,
+                          const Allocator* allocator);
+
+// Like json_parse_tape_with, but strings of at least JSON_BORROW_MIN bytes
+// are not copied and point into `str`, which has to outlive the tape.
+// String values with escapes are kept escaped, see JsonTape_string_escaped.
+bool json_parse_tape_borrowed(const char* str, JsonTape* tape, String_noinit* errormsg,
+                              const Allocator* allocator);
+
+// Like JsonReader_read, but append the value to an empty `tape`
+JsonEvent JsonReader_read_tape(JsonReader* r, JsonTape* tape);
+
+JsonKind JsonTape_type(const JsonTape* tape, JsonTapeRef v);
+
+// Number of members or elements of a container, 0 for other values.
+// Repeated keys count once, like in JsonObject.
+uint32_t JsonTape_size(const JsonTape* tape, JsonTapeRef v);
+
+// Value accessors, `v` must have the matching type
+int64_t JsonTape_int(const JsonTape* tape, JsonTapeRef v);
+double JsonTape_double(const JsonTape* tape, JsonTapeRef v);
+bool JsonTape_bool(const JsonTape* tape, JsonTapeRef v);
+// The view lives as long as the tape. It is null-terminated unless the
+// string was borrowed from the input. For strings where
+// JsonTape_string_escaped is true it is the raw text between the quotes.
+StrView JsonTape_string(const JsonTape* tape, JsonTapeRef v);
+
+// Whether JsonTape_string of `v` still has its escapes, which is only the
+// case for long values of json_parse_tape_borrowed
+bool JsonTape_string_escaped(const JsonTape* tape, JsonTapeRef v);
+
+// Append the unescaped value of string `v` to `out`
+bool JsonTape_string_unescape(const JsonTape* tape, JsonTapeRef v, String* out);
+
+// Value of `key` in object `obj`, the last one if the key is repeated.
+// JSON_TAPE_NONE if missing.
+JsonTapeRef JsonTapeObject_get(const JsonTape* tape, JsonTapeRef obj, const char* key);
+
+// JSON_TAPE_NONE if missing or of another type
+JsonTapeRef JsonTapeObject_get_obj(const JsonTape* tape, JsonTapeRef obj, const char* key);
+JsonTapeRef JsonTapeObject_get_list(const JsonTape* tape, JsonTapeRef obj, const char* key);
+// False if missing or of another type
+bool JsonTapeObject_get_int(const JsonTape* tape, JsonTapeRef obj, const char* key, int64_t* out);
+bool JsonTapeObject_get_double(const JsonTape* tape, JsonTapeRef obj, const char* key, double* out);
+bool JsonTapeObject_get_bool(const JsonTape* tape, JsonTapeRef obj, const char* key, bool* out);
+bool JsonTapeObject_get_string(const JsonTape* tape, JsonTapeRef obj, const char* key, StrView* out);
+bool JsonTapeObject_get_null(const JsonTape* tape, JsonTapeRef obj, const char* key);
+
+// Element `ix` of `list`, walking the elements before it
+JsonTapeRef JsonTapeList_get(const JsonTape* tape, JsonTapeRef list, unsigned ix);
+
+JsonTapeRef JsonTapeList_get_obj(const JsonTape* tape, JsonTapeRef list, unsigned ix);
+JsonTapeRef JsonTapeList_get_list(const JsonTape* tape, JsonTapeRef list, unsigned ix);
+bool JsonTapeList_get_int(const JsonTape* tape, JsonTapeRef list, unsigned ix, int64_t* out);
+bool JsonTapeList_get_double(const JsonTape* tape, JsonTapeRef list, unsigned ix, double* out);
+bool JsonTapeList_get_bool(const JsonTape* tape, JsonTapeRef list, unsigned ix, bool* out);
+bool JsonTapeList_get_string(const JsonTape* tape, JsonTapeRef list, unsigned ix, StrView* out);
+bool JsonTapeList_get_null(const JsonTape* tape, JsonTapeRef list, unsigned ix);
+
+// Iterate members of an object or elements of a list in document order.
+// Like JsonObject, a repeated key is visited once, at its first position
+// with its last value.
+void JsonTapeIter_begin(JsonTapeIter* it, const JsonTape* tape, JsonTapeRef container);
+
+// `key` is only set for objects and may be NULL
+bool JsonTapeIter_next(JsonTapeIter* it, StrView* key, JsonTapeRef* value);
+
+bool json_tape_to_string(const JsonTape* tape, JsonTapeRef v, String* res);
+
+bool json_tape_to_string_pretty(const JsonTape* tape, JsonTapeRef v, String* res);
+
 #endif
@@ -0,0 +1,26 @@
+#ifndef JSON_NUMBER_H_00
+#define JSON_NUMBER_H_00
+#include <stdint.h>
+#include <stdbool.h>
+
+// Longest output of json_format_double, "-2.2250738585072014e-308"
+#define JSON_DOUBLE_MAX_LEN 25
+// Longest output of json_format_int, "-9223372036854775808"
+#define JSON_INT_MAX_LEN 20
+
+// Write the decimal representation of `v` to `buf`, returns the length
+uint32_t json_format_int(int64_t v, char* buf);
+
+// Write the shortest representation of `d` that parses back to the same
+// double to `buf`, returns the length. The output always has a '.' or
+// an exponent, so it is read back as a double. Infinity and NaN have no
+// JSON representation and are written as null.
+uint32_t json_format_double(double d, char* buf);
+
+// Correctly rounded value of `w` * 10^`exp10`. `truncated` is set if
+// nonzero digits were dropped from `w`, in which case the exact value is
+// recomputed from `digits`, the number text after any sign.
+double json_decimal_to_double(uint64_t w, int64_t exp10, bool truncated,
+                              bool negative, const char* digits);
+
+#endif
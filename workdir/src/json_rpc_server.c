@@ -1,16 +1,8 @@
 #include "json_rpc_server.h"
-#include "json.h"
+#include "json_number.h"
+#include "mutex.h"
 
-
-typedef void(*ResponseFn)(const String* response, void* ctx);
-
-struct RpcServer {
-    ResponseFn response_fn;
-
-    String internal_error;
-
-    void* ctx;
-};
+#define RPC_ARENA_SIZE 0x10000000
 
 
 bool RcpServer_init(struct RpcServer* server, ResponseFn callback, void* ctx) {
@@ -24,19 +16,104 @@ bool RcpServer_init(struct RpcServer* server, ResponseFn callback, void* ctx) {
         String_free(&server->internal_error);
         return false;
     }
+    if (!Arena_create(&server->arena, RPC_ARENA_SIZE, NULL, NULL)) {
+        String_free(&server->internal_error);
+        return false;
+    }
+    Arena_allocator(&server->arena, &server->allocator);
+    server->methods = NULL;
+    server->method_count = 0;
+    server->method_cap = 0;
+
+    return true;
+}
+
+void RpcServer_free(struct RpcServer* server) {
+    String_free(&server->internal_error);
+    Arena_free(&server->arena);
+    if (server->methods != NULL) {
+        Mem_free(server->methods);
+    }
+}
+
+static uint32_t rpc_hash(StrView name) {
+    uint32_t hash = 5381;
+    for (string_size_t i = 0; i < name.length; ++i) {
+        hash = ((hash << 5) + hash) + (uint8_t)name.data[i];
+    }
+    return hash;
+}
+
+// Slot of `name` in `methods`, or the empty slot it would go in
+static RpcMethod* rpc_method_slot(RpcMethod* methods, uint32_t cap, StrView name, uint32_t hash) {
+    uint32_t i = hash & (cap - 1);
+    while (methods[i].fn != NULL) {
+        if (methods[i].hash == hash && StrView_equals(methods[i].name, name)) {
+            break;
+        }
+        i = (i + 1) & (cap - 1);
+    }
+    return &methods[i];
+}
+
+bool RpcServer_register(struct RpcServer* server, const char* name, RpcMethodFn fn,
+                        const RpcParam* params, uint32_t param_count, void* ctx) {
+    if (param_count > RPC_MAX_PARAMS || fn == NULL) {
+        return false;
+    }
+    // Keep the table at most 3/4 full, so probe sequences stay short
+    if ((server->method_count + 1) * 4 > server->method_cap * 3) {
+        uint32_t cap = server->method_cap == 0 ? 16 : server->method_cap * 2;
+        RpcMethod* methods = Mem_alloc(cap * sizeof(RpcMethod));
+        if (methods == NULL) {
+            return false;
+        }
+        for (uint32_t i = 0; i < cap; ++i) {
+            methods[i].fn = NULL;
+        }
+        for (uint32_t i = 0; i < server->method_cap; ++i) {
+            RpcMethod* m = &server->methods[i];
+            if (m->fn != NULL) {
+                *rpc_method_slot(methods, cap, m->name, m->hash) = *m;
+            }
+        }
+        if (server->methods != NULL) {
+            Mem_free(server->methods);
+        }
+        server->methods = methods;
+        server->method_cap = cap;
+    }
 
+    RpcMethod method;
+    method.name = StrView_from_str(name);
+    method.hash = rpc_hash(method.name);
+    method.fn = fn;
+    method.params = params;
+    method.param_count = param_count;
+    method.ctx = ctx;
+    RpcMethod* slot = rpc_method_slot(server->methods, server->method_cap, method.name, method.hash);
+    if (slot->fn == NULL) {
+        ++server->method_count;
+    }
+    *slot = method;
     return true;
 }
 
 
+// Takes ownership of `id`
 bool get_error_obj(struct RpcServer* server, int64_t code, const char* message,
                    JsonType* id, JsonObject* dest) {
     if (!JsonObject_create(dest)) {
+        JsonType_free(id);
         return false;
     }
 
     String s;
-    if (!JsonObject_insert(dest, "id", *id) || !String_create(&s)) {
+    if (!JsonObject_insert(dest, "id", *id)) {
+        JsonType_free(id);
+        goto fail;
+    }
+    if (!String_create(&s)) {
         goto fail;
     }
     if (!String_extend(&s, "2.0") || !JsonObject_insert_string(dest, "jsonrpc", s)) {
@@ -72,38 +149,31 @@ fail:
     return false;
 }
 
-void send_response(struct RpcServer* server, JsonObject* response) {
+// Responses are sized before writing, so each is a single allocation
+static void send_json(struct RpcServer* server, const JsonType* response) {
     String s;
-    if (String_create(&s)) {
-        if (json_object_to_string(response, &s)) {
-            server->response_fn(&s, server->ctx);
-        } else {
-            server->response_fn(&server->internal_error, server->ctx);
-        }
+    if (json_type_to_new_string(response, &s)) {
+        server->response_fn(&s, server->ctx);
         String_free(&s);
     } else {
         server->response_fn(&server->internal_error, server->ctx);
     }
+}
+
+void send_response(struct RpcServer* server, JsonObject* response) {
+    JsonType t;
+    t.type = JSON_OBJECT;
+    t.object = *response;
+    send_json(server, &t);
     JsonObject_free(response);
 }
 
 void send_responses(struct RpcServer* server, JsonList* responses) {
-    String s;
-    if (String_create(&s)) {
-        JsonType t;
-        t.type = JSON_LIST;
-        t.list = *responses;
-        if (json_type_to_string(&t, &s)) {
-            server->response_fn(&s, server->ctx);
-        } else {
-            server->response_fn(&server->internal_error, server->ctx);
-        }
-        String_free(&s);
-    } else {
-        server->response_fn(&server->internal_error, server->ctx);
-    }
+    JsonType t;
+    t.type = JSON_LIST;
+    t.list = *responses;
+    send_json(server, &t);
     JsonList_free(responses);
-
 }
 
 void send_error(struct RpcServer* server, int64_t code, const char* msg, JsonType* id) {
@@ -116,74 +186,262 @@ void send_error(struct RpcServer* server, int64_t code, const char* msg, JsonTyp
 }
 
 
-bool RpcServer_call_method(struct RpcServer* server, String* method, JsonType* params, JsonObject* res) {
-
+// Takes ownership of `id` and `result`
+static bool get_result_obj(JsonType* id, JsonType* result, JsonObject* dest) {
+    if (!JsonObject_create(dest)) {
+        JsonType_free(id);
+        JsonType_free(result);
+        return false;
+    }
+    if (!JsonObject_insert(dest, "id", *id)) {
+        JsonType_free(id);
+        JsonType_free(result);
+        goto fail;
+    }
+    if (!JsonObject_insert(dest, "result", *result)) {
+        JsonType_free(result);
+        goto fail;
+    }
+    String s;
+    if (!String_create(&s)) {
+        goto fail;
+    }
+    if (!String_extend(&s, "2.0") || !JsonObject_insert_string(dest, "jsonrpc", s)) {
+        String_free(&s);
+        goto fail;
+    }
+    return true;
+fail:
+    JsonObject_free(dest);
     return false;
 }
 
-bool handle_single_request(struct RpcServer* server, JsonType* req, JsonObject* res) {
+static const RpcMethod* RpcServer_find(const struct RpcServer* server, StrView name) {
+    if (server->method_cap == 0) {
+        return NULL;
+    }
+    RpcMethod* m = rpc_method_slot(server->methods, server->method_cap, name, rpc_hash(name));
+    return m->fn == NULL ? NULL : m;
+}
+
+// Look up the parameters declared by `m` in `params`. Only these are
+// looked at, the rest of `params` is never visited.
+static bool rpc_bind_params(const RpcMethod* m, const JsonTape* tape, JsonTapeRef params,
+                            JsonTapeRef* args) {
+    JsonKind kind = params == JSON_TAPE_NONE ? JSON_NULL : JsonTape_type(tape, params);
+    for (uint32_t i = 0; i < m->param_count; ++i) {
+        const RpcParam* p = &m->params[i];
+        JsonTapeRef v = JSON_TAPE_NONE;
+        if (kind == JSON_OBJECT) {
+            v = JsonTapeObject_get(tape, params, p->name);
+        } else if (kind == JSON_LIST) {
+            v = JsonTapeList_get(tape, params, i);
+        }
+        if (v == JSON_TAPE_NONE) {
+            if (!p->optional) {
+                return false;
+            }
+        } else if (p->type != RPC_PARAM_ANY) {
+            JsonKind type = JsonTape_type(tape, v);
+            if (type != p->type && !(p->type == JSON_DOUBLE && type == JSON_INTEGER)) {
+                return false;
+            }
+        }
+        args[i] = v;
+    }
+    return true;
+}
+
+// Unescaped copy of string `v`
+static bool rpc_copy_string(const JsonTape* tape, JsonTapeRef v, String_noinit* out) {
+    if (!JsonTape_string_escaped(tape, v)) {
+        return String_from_view(out, JsonTape_string(tape, v));
+    }
+    if (!String_create(out)) {
+        return false;
+    }
+    if (!JsonTape_string_unescape(tape, v, out)) {
+        String_free(out);
+        return false;
+    }
+    return true;
+}
+
+bool RpcCall_string(const RpcCall* call, uint32_t ix, String_noinit* out) {
+    return rpc_copy_string(call->tape, call->args[ix], out);
+}
+
+double RpcCall_double(const RpcCall* call, uint32_t ix) {
+    JsonTapeRef v = call->args[ix];
+    if (JsonTape_type(call->tape, v) == JSON_INTEGER) {
+        return (double)JsonTape_int(call->tape, v);
+    }
+    return JsonTape_double(call->tape, v);
+}
+
+// Takes ownership of `id`. Long running methods should stop early once
+// `*cancelled` is set, `cancelled` is NULL outside of RpcServer_serve
+bool RpcServer_call_method(struct RpcServer* server, StrView method, const JsonTape* tape,
+                           JsonTapeRef params, JsonType* id, const volatile LONG* cancelled,
+                           JsonObject* res) {
+    const RpcMethod* m = RpcServer_find(server, method);
+    if (m == NULL) {
+        return get_error_obj(server, -32601, "Method not found", id, res);
+    }
+    JsonTapeRef args[RPC_MAX_PARAMS];
+    if (!rpc_bind_params(m, tape, params, args)) {
+        return get_error_obj(server, -32602, "Invalid params", id, res);
+    }
+
+    RpcCall call;
+    call.server = server;
+    call.tape = tape;
+    call.args = args;
+    call.cancelled = cancelled;
+    call.ctx = m->ctx;
+    call.error_code = 0;
+    call.error_message = NULL;
+    JsonType result;
+    if (!m->fn(&call, &result)) {
+        JsonType_free(id);
+        return false;
+    }
+    if (call.error_message != NULL) {
+        return get_error_obj(server, call.error_code, call.error_message, id, res);
+    }
+    return get_result_obj(id, &result, res);
+}
+
+// Copy the id of a request, which outlives the request tape
+static bool copy_id(const JsonTape* tape, JsonTapeRef v, JsonType* id) {
+    id->type = JsonTape_type(tape, v);
+    switch (id->type) {
+        case JSON_INTEGER:
+            id->integer = JsonTape_int(tape, v);
+            return true;
+        case JSON_DOUBLE:
+            id->dbl = JsonTape_double(tape, v);
+            return true;
+        case JSON_STRING:
+            return rpc_copy_string(tape, v, &id->string);
+        default:
+            id->type = JSON_NULL;
+            return true;
+    }
+}
+
+// Handle request `req` of `tape`. A request without an id is a
+// notification, which runs the method without a response: `*respond` is
+// then false and `res` unset. Invalid requests are always answered.
+bool handle_single_request(struct RpcServer* server, const JsonTape* tape, JsonTapeRef req,
+                           const volatile LONG* cancelled, JsonObject* res, bool* respond) {
     JsonType nullId;
     nullId.type = JSON_NULL;
+    *respond = true;
 
-    if (req->type != JSON_OBJECT) {
+    if (JsonTape_type(tape, req) != JSON_OBJECT) {
         return get_error_obj(server, -32600, "Invalid Request", &nullId, res);
     }
-    JsonObject* obj = &req->object;
 
-    JsonType* id = JsonObject_get(obj, "id");
-    if (id == NULL || id->type == JSON_BOOL || id->type == JSON_OBJECT || id->type == JSON_LIST) {
-        return get_error_obj(server, -32600, "Invalid Request", &nullId, res);
-    }
+    JsonTapeRef id_val = JsonTapeObject_get(tape, req, "id");
+    JsonType id;
+    if (id_val == JSON_TAPE_NONE) {
+        id.type = JSON_NULL;
+    } else {
+        JsonKind id_type = JsonTape_type(tape, id_val);
+        if (id_type == JSON_BOOL || id_type == JSON_OBJECT || id_type == JSON_LIST) {
+            return get_error_obj(server, -32600, "Invalid Request", &nullId, res);
+        }
 
-    if (id->type == JSON_DOUBLE && ((double)(int64_t)id->dbl) != id->dbl) {
-        return get_error_obj(server, -32600, "Invalid Request", &nullId, res);
+        if (id_type == JSON_DOUBLE) {
+            double d = JsonTape_double(tape, id_val);
+            if (((double)(int64_t)d) != d) {
+                return get_error_obj(server, -32600, "Invalid Request", &nullId, res);
+            }
+        }
+
+        if (!copy_id(tape, id_val, &id)) {
+            return false;
+        }
     }
 
-    String* s = JsonObject_get_string(obj, "method");
-    if (s == NULL) {
-        return get_error_obj(server, -32600, "Invalid Request", id, res);
+    JsonTapeRef method_val = JsonTapeObject_get(tape, req, "method");
+    if (method_val == JSON_TAPE_NONE || JsonTape_type(tape, method_val) != JSON_STRING) {
+        return get_error_obj(server, -32600, "Invalid Request", &id, res);
     }
 
-    JsonType* params = JsonObject_get(obj, "params");
-    if (params != NULL && params->type != JSON_OBJECT && params->type != JSON_LIST) {
-        return get_error_obj(server, -32600, "Invalid Request", id, res);
+    JsonTapeRef params = JsonTapeObject_get(tape, req, "params");
+    if (params != JSON_TAPE_NONE && JsonTape_type(tape, params) != JSON_OBJECT &&
+        JsonTape_type(tape, params) != JSON_LIST) {
+        return get_error_obj(server, -32600, "Invalid Request", &id, res);
     }
 
-    return RpcServer_call_method(server, s, params, res);
+    bool ok;
+    if (!JsonTape_string_escaped(tape, method_val)) {
+        ok = RpcServer_call_method(server, JsonTape_string(tape, method_val), tape, params,
+                                   &id, cancelled, res);
+    } else {
+        String method;
+        if (!rpc_copy_string(tape, method_val, &method)) {
+            JsonType_free(&id);
+            return false;
+        }
+        ok = RpcServer_call_method(server, String_view(&method), tape, params, &id,
+                                   cancelled, res);
+        String_free(&method);
+    }
+    if (ok && id_val == JSON_TAPE_NONE) {
+        // Not even errors of the method are sent for notifications
+        JsonObject_free(res);
+        *respond = false;
+    }
+    return ok;
 }
 
 void RpcServer_handle_request(struct RpcServer* server, String* data) {
-    JsonObject obj;
     JsonType nullId;
     nullId.type = JSON_NULL;
 
-
-    JsonType root;
+    // The tape is allocated from the arena, so it is dropped by releasing it
+    JsonTape tape;
     // TODO: tell appart out of memory and parse error
-    if (!json_parse_type(data->buffer, &root, NULL)) {
+    // `data` outlives the tape, so long strings can point into it
+    if (!json_parse_tape_borrowed(data->buffer, &tape, NULL, &server->allocator)) {
+        Arena_release(&server->arena);
         send_error(server, -32700, "Parse error", &nullId);
         return;
     }
 
-    if (root.type == JSON_LIST) {
+    if (JsonTape_type(&tape, JSON_TAPE_ROOT) == JSON_LIST &&
+        JsonTape_size(&tape, JSON_TAPE_ROOT) == 0) {
+        send_error(server, -32600, "Invalid Request", &nullId);
+    } else if (JsonTape_type(&tape, JSON_TAPE_ROOT) == JSON_LIST) {
         JsonList responses;
         if (JsonList_create(&responses)) {
-            uint32_t i = 0;
-            for (; i < root.list.size; ++i) {
+            JsonTapeIter it;
+            JsonTapeIter_begin(&it, &tape, JSON_TAPE_ROOT);
+            JsonTapeRef req;
+            bool failed = false;
+            while (JsonTapeIter_next(&it, NULL, &req)) {
                 JsonObject response;
-                if (handle_single_request(server, &root.list.data[i], &response)) {
-                    if (!JsonList_append_obj(&responses, response)) {
-                        JsonObject_free(&response);
-                        break;
-                    }
-                } else {
+                bool respond;
+                if (!handle_single_request(server, &tape, req, NULL, &response, &respond)) {
+                    failed = true;
+                    break;
+                }
+                if (respond && !JsonList_append_obj(&responses, response)) {
+                    JsonObject_free(&response);
+                    failed = true;
                     break;
                 }
             }
-            if (i < root.list.size) {
+            if (failed) {
                 // This should only occur on out of memory
                 JsonList_free(&responses);
                 server->response_fn(&server->internal_error, server->ctx);
+            } else if (responses.size == 0) {
+                // A batch of only notifications has no response
+                JsonList_free(&responses);
             } else {
                 send_responses(server, &responses);
             }
@@ -192,13 +450,595 @@ void RpcServer_handle_request(struct RpcServer* server, String* data) {
         }
     } else {
         JsonObject response;
-        if (!handle_single_request(server, &root, &response)) {
+        bool respond;
+        if (!handle_single_request(server, &tape, JSON_TAPE_ROOT, NULL, &response, &respond)) {
             server->response_fn(&server->internal_error, server->ctx);
-        } else {
+        } else if (respond) {
             send_response(server, &response);
         }
     }
-    JsonType_free(&root);
+    Arena_release(&server->arena);
+}
+
+
+// Headers longer than this are rejected
+#define RPC_MAX_HEADER 0x1000
+#define RPC_READ_SIZE 0x10000
+
+typedef struct RpcFrame RpcFrame;
+
+// Read buffer handed to the frames parsed from it, freed with the last one
+typedef struct RpcChunk {
+    volatile LONG refs;
+    String text;
+} RpcChunk;
+
+// One request of a frame, queued for the workers
+typedef struct RpcJob {
+    struct RpcJob* next;
+    RpcFrame* frame;
+    JsonTapeRef request;
+    // Set by $/cancelRequest
+    volatile LONG cancelled;
+    bool ok;
+    // False for notifications, which leave `response` unset
+    bool respond;
+    JsonObject response;
+} RpcJob;
+
+// A parsed message, a single request or a batch. Freed by the worker
+// finishing its last request
+struct RpcFrame {
+    RpcFrame* prev;
+    RpcFrame* next;
+    // Holds the message, long strings of `tape` point into it
+    RpcChunk* chunk;
+    JsonTape tape;
+    bool batch;
+    volatile LONG pending;
+    uint32_t count;
+    RpcJob jobs[];
+};
+
+typedef struct RpcTransport {
+    struct RpcServer* server;
+    HANDLE out;
+    // Event for overlapped handles, NULL for synchronous ones
+    HANDLE read_event;
+    HANDLE write_event;
+    // Responses are written whole under `out_lock`
+    SRWLOCK out_lock;
+
+    // Guards the members below
+    Condition* cond;
+    RpcJob* head;
+    RpcJob* tail;
+    // Frames with requests in flight, searched by $/cancelRequest
+    RpcFrame* active;
+    bool closing;
+} RpcTransport;
+
+// Read or write on `h`, waiting for completion if `event` is set
+static bool rpc_io(HANDLE h, HANDLE event, bool write, void* buf, DWORD len, DWORD* done) {
+    if (event == NULL) {
+        return write ? WriteFile(h, buf, len, done, NULL) : ReadFile(h, buf, len, done, NULL);
+    }
+    OVERLAPPED o;
+    memset(&o, 0, sizeof(o));
+    o.hEvent = event;
+    BOOL ok = write ? WriteFile(h, buf, len, NULL, &o) : ReadFile(h, buf, len, NULL, &o);
+    if (!ok && GetLastError() != ERROR_IO_PENDING) {
+        return false;
+    }
+    return GetOverlappedResult(h, &o, done, TRUE);
+}
+
+static bool rpc_write_all(RpcTransport* t, const char* buf, uint32_t len) {
+    while (len > 0) {
+        DWORD written;
+        if (!rpc_io(t->out, t->write_event, true, (void*)buf, len, &written) || written == 0) {
+            return false;
+        }
+        buf += written;
+        len -= written;
+    }
+    return true;
+}
+
+// ResponseFn of the transport
+static void RpcTransport_write(const String* response, void* ctx) {
+    RpcTransport* t = ctx;
+    char header[16 + JSON_INT_MAX_LEN + 4];
+    memcpy(header, "Content-Length: ", 16);
+    uint32_t len = 16 + json_format_int(response->length, header + 16);
+    memcpy(header + len, "\r\n\r\n", 4);
+    len += 4;
+    // A failed write means the client is gone, which the reader notices
+    AcquireSRWLockExclusive(&t->out_lock);
+    if (rpc_write_all(t, header, len)) {
+        rpc_write_all(t, response->buffer, response->length);
+    }
+    ReleaseSRWLockExclusive(&t->out_lock);
+}
+
+// Parse the headers at the start of `buf`. Returns their length including
+// the empty line, 0 if they are incomplete and -1 if they are invalid
+static int64_t rpc_parse_headers(const char* buf, uint32_t len, uint32_t* content_length) {
+    static const char name[] = "content-length:";
+    bool found = false;
+    uint32_t pos = 0;
+    while (1) {
+        uint32_t eol = pos;
+        while (eol + 1 < len && (buf[eol] != '\r' || buf[eol + 1] != '\n')) {
+            ++eol;
+        }
+        if (eol + 1 >= len) {
+            return len > RPC_MAX_HEADER ? -1 : 0;
+        }
+        if (eol == pos) {
+            return found ? eol + 2 : -1;
+        }
+        uint32_t i = 0;
+        // All characters of `name` have bit 0x20 set
+        while (i < sizeof(name) - 1 && pos + i < eol && (buf[pos + i] | 0x20) == name[i]) {
+            ++i;
+        }
+        if (i == sizeof(name) - 1) {
+            pos += i;
+            while (pos < eol && buf[pos] == ' ') {
+                ++pos;
+            }
+            uint64_t n = 0;
+            if (pos == eol) {
+                return -1;
+            }
+            for (; pos < eol; ++pos) {
+                if (buf[pos] < '0' || buf[pos] > '9' || n > 0x7fffffff) {
+                    return -1;
+                }
+                n = n * 10 + (buf[pos] - '0');
+            }
+            if (n > 0x7fffffff) {
+                return -1;
+            }
+            *content_length = (uint32_t)n;
+            found = true;
+        }
+        pos = eol + 2;
+    }
+}
+
+static bool rpc_same_id(const JsonTape* a, JsonTapeRef x, const JsonTape* b, JsonTapeRef y) {
+    JsonKind kind = JsonTape_type(a, x);
+    if (kind != JsonTape_type(b, y)) {
+        return false;
+    }
+    switch (kind) {
+        case JSON_INTEGER:
+            return JsonTape_int(a, x) == JsonTape_int(b, y);
+        case JSON_DOUBLE:
+            return JsonTape_double(a, x) == JsonTape_double(b, y);
+        case JSON_STRING:
+            break;
+        default:
+            return false;
+    }
+    if (!JsonTape_string_escaped(a, x) && !JsonTape_string_escaped(b, y)) {
+        return StrView_equals(JsonTape_string(a, x), JsonTape_string(b, y));
+    }
+    String s, t;
+    if (!rpc_copy_string(a, x, &s)) {
+        return false;
+    }
+    bool same = false;
+    if (rpc_copy_string(b, y, &t)) {
+        same = String_equals(&s, &t);
+        String_free(&t);
+    }
+    String_free(&s);
+    return same;
+}
+
+// Handle request `req` of `tape` if it is a $/cancelRequest notification.
+// Requests that are still queued are answered with RPC_REQUEST_CANCELLED,
+// running ones see their `cancelled` flag set.
+static bool RpcTransport_cancel(RpcTransport* t, const JsonTape* tape, JsonTapeRef req) {
+    StrView method;
+    if (JsonTape_type(tape, req) != JSON_OBJECT ||
+        JsonTapeObject_get(tape, req, "id") != JSON_TAPE_NONE ||
+        !JsonTapeObject_get_string(tape, req, "method", &method) ||
+        !StrView_equals(method, STRVIEW("$/cancelRequest"))) {
+        return false;
+    }
+    JsonTapeRef params = JsonTapeObject_get_obj(tape, req, "params");
+    JsonTapeRef id = JSON_TAPE_NONE;
+    if (params != JSON_TAPE_NONE) {
+        id = JsonTapeObject_get(tape, params, "id");
+    }
+    if (id == JSON_TAPE_NONE) {
+        return true;
+    }
+
+    Condition_aquire(t->cond);
+    for (RpcFrame* f = t->active; f != NULL; f = f->next) {
+        for (uint32_t i = 0; i < f->count; ++i) {
+            JsonTapeRef queued = f->jobs[i].request;
+            if (JsonTape_type(&f->tape, queued) != JSON_OBJECT) {
+                continue;
+            }
+            JsonTapeRef other = JsonTapeObject_get(&f->tape, queued, "id");
+            if (other != JSON_TAPE_NONE && rpc_same_id(tape, id, &f->tape, other)) {
+                InterlockedExchange(&f->jobs[i].cancelled, 1);
+            }
+        }
+    }
+    Condition_release(t->cond);
+    return true;
+}
+
+static void RpcChunk_release(RpcChunk* chunk) {
+    if (InterlockedDecrement(&chunk->refs) == 0) {
+        String_free(&chunk->text);
+        Mem_free(chunk);
+    }
+}
+
+// Queue the requests of message `body`, which is `len` bytes long and
+// lies in `chunk`
+static void RpcTransport_dispatch(RpcTransport* t, RpcChunk* chunk, char* body, uint32_t len) {
+    struct RpcServer* server = t->server;
+    // Parsed where it was read, so long strings of the tape point into the
+    // read buffer. The byte after the message belongs to the next one, and
+    // is only needed as terminator while parsing.
+    char next = body[len];
+    body[len] = '\0';
+    JsonTape tape;
+    bool parsed = json_parse_tape_borrowed(body, &tape, NULL, NULL);
+    body[len] = next;
+    if (!parsed) {
+        JsonType nullId;
+        nullId.type = JSON_NULL;
+        send_error(server, -32700, "Parse error", &nullId);
+        return;
+    }
+    if (RpcTransport_cancel(t, &tape, JSON_TAPE_ROOT)) {
+        JsonTape_free(&tape);
+        return;
+    }
+
+    bool batch = JsonTape_type(&tape, JSON_TAPE_ROOT) == JSON_LIST;
+    uint32_t count = batch ? JsonTape_size(&tape, JSON_TAPE_ROOT) : 1;
+    if (count == 0) {
+        JsonTape_free(&tape);
+        JsonType nullId;
+        nullId.type = JSON_NULL;
+        send_error(server, -32600, "Invalid Request", &nullId);
+        return;
+    }
+
+    RpcFrame* f = Mem_alloc(sizeof(RpcFrame) + count * sizeof(RpcJob));
+    if (f == NULL) {
+        JsonTape_free(&tape);
+        server->response_fn(&server->internal_error, server->ctx);
+        return;
+    }
+    InterlockedIncrement(&chunk->refs);
+    f->chunk = chunk;
+    f->tape = tape;
+    f->batch = batch;
+    f->pending = count;
+    f->count = count;
+    if (batch) {
+        // Cancels in a batch take effect right away, and then run as
+        // notifications without a method
+        JsonTapeIter it;
+        JsonTapeIter_begin(&it, &f->tape, JSON_TAPE_ROOT);
+        for (uint32_t i = 0; i < count; ++i) {
+            JsonTapeIter_next(&it, NULL, &f->jobs[i].request);
+            RpcTransport_cancel(t, &f->tape, f->jobs[i].request);
+        }
+    } else {
+        f->jobs[0].request = JSON_TAPE_ROOT;
+    }
+    for (uint32_t i = 0; i < count; ++i) {
+        f->jobs[i].next = i + 1 < count ? &f->jobs[i + 1] : NULL;
+        f->jobs[i].frame = f;
+        f->jobs[i].cancelled = 0;
+    }
+
+    Condition_aquire(t->cond);
+    f->prev = NULL;
+    f->next = t->active;
+    if (t->active != NULL) {
+        t->active->prev = f;
+    }
+    t->active = f;
+    if (t->tail == NULL) {
+        t->head = &f->jobs[0];
+    } else {
+        t->tail->next = &f->jobs[0];
+    }
+    t->tail = &f->jobs[count - 1];
+    Condition_notify_all(t->cond);
+    Condition_release(t->cond);
+}
+
+static void RpcTransport_finish_batch(RpcTransport* t, RpcFrame* f) {
+    struct RpcServer* server = t->server;
+    JsonList responses;
+    bool created = JsonList_create(&responses);
+    bool ok = created;
+    for (uint32_t i = 0; i < f->count; ++i) {
+        RpcJob* job = &f->jobs[i];
+        if (!job->ok) {
+            ok = false;
+        } else if (!job->respond) {
+            continue;
+        } else if (!ok || !JsonList_append_obj(&responses, job->response)) {
+            JsonObject_free(&job->response);
+            ok = false;
+        }
+    }
+    if (ok && responses.size == 0) {
+        // A batch of only notifications has no response
+        JsonList_free(&responses);
+        return;
+    }
+    if (ok) {
+        send_responses(server, &responses);
+        return;
+    }
+    if (created) {
+        JsonList_free(&responses);
+    }
+    server->response_fn(&server->internal_error, server->ctx);
+}
+
+static void RpcTransport_run(RpcTransport* t, RpcJob* job) {
+    struct RpcServer* server = t->server;
+    RpcFrame* f = job->frame;
+    if (job->cancelled) {
+        JsonType id;
+        JsonTapeRef id_val = JsonTapeObject_get(&f->tape, job->request, "id");
+        job->respond = true;
+        job->ok = copy_id(&f->tape, id_val, &id) &&
+                  get_error_obj(server, RPC_REQUEST_CANCELLED, "Request cancelled", &id,
+                                &job->response);
+    } else {
+        job->ok = handle_single_request(server, &f->tape, job->request, &job->cancelled,
+                                        &job->response, &job->respond);
+    }
+
+    // Single requests are answered right away, out of order
+    if (!f->batch) {
+        if (!job->ok) {
+            server->response_fn(&server->internal_error, server->ctx);
+        } else if (job->respond) {
+            send_response(server, &job->response);
+        }
+    }
+    if (InterlockedDecrement(&f->pending) != 0) {
+        return;
+    }
+    if (f->batch) {
+        RpcTransport_finish_batch(t, f);
+    }
+
+    Condition_aquire(t->cond);
+    if (f->prev != NULL) {
+        f->prev->next = f->next;
+    } else {
+        t->active = f->next;
+    }
+    if (f->next != NULL) {
+        f->next->prev = f->prev;
+    }
+    Condition_release(t->cond);
+    JsonTape_free(&f->tape);
+    RpcChunk_release(f->chunk);
+    Mem_free(f);
+}
+
+DWORD RpcTransport_worker(void* param) {
+    RpcTransport* t = param;
+    while (1) {
+        Condition_aquire(t->cond);
+        while (t->head == NULL && !t->closing) {
+            Condition_wait(t->cond, INFINITE);
+        }
+        RpcJob* job = t->head;
+        if (job == NULL) {
+            Condition_release(t->cond);
+            return 0;
+        }
+        t->head = job->next;
+        if (t->head == NULL) {
+            t->tail = NULL;
+        }
+        Condition_release(t->cond);
+
+        RpcTransport_run(t, job);
+    }
+}
+
+// Read and dispatch messages until `in` is closed. Returns false on
+// invalid headers or out of memory
+static bool RpcTransport_read(RpcTransport* t, HANDLE in) {
+    String buf;
+    if (!String_create_capacity(&buf, RPC_READ_SIZE)) {
+        return false;
+    }
+    bool res = true;
+    while (1) {
+        uint32_t consumed = 0;
+        RpcChunk* chunk = NULL;
+        while (1) {
+            uint32_t content_length;
+            int64_t header = rpc_parse_headers(buf.buffer + consumed, buf.length - consumed,
+                                               &content_length);
+            if (header < 0) {
+                res = false;
+            }
+            if (header <= 0 || buf.length - consumed - header < content_length) {
+                break;
+            }
+            if (chunk == NULL) {
+                chunk = Mem_alloc(sizeof(RpcChunk));
+                if (chunk == NULL) {
+                    res = false;
+                    break;
+                }
+                chunk->refs = 1;
+                chunk->text = buf;
+            }
+            RpcTransport_dispatch(t, chunk, buf.buffer + consumed + header, content_length);
+            consumed += (uint32_t)header + content_length;
+        }
+        if (chunk != NULL) {
+            // The frames keep the buffer, the start of the next message
+            // moves to a new one
+            String rest;
+            if (!String_create_capacity(&rest, RPC_READ_SIZE)) {
+                RpcChunk_release(chunk);
+                return false;
+            }
+            if (!String_append_count(&rest, buf.buffer + consumed, buf.length - consumed)) {
+                String_free(&rest);
+                RpcChunk_release(chunk);
+                return false;
+            }
+            RpcChunk_release(chunk);
+            buf = rest;
+        }
+        if (!res) {
+            goto end;
+        }
+        if (buf.capacity - buf.length < RPC_READ_SIZE / 4 &&
+            !String_reserve(&buf, buf.length + RPC_READ_SIZE)) {
+            res = false;
+            goto end;
+        }
+        DWORD read;
+        if (!rpc_io(in, t->read_event, false, buf.buffer + buf.length,
+                    buf.capacity - buf.length - 1, &read) || read == 0) {
+            break;
+        }
+        buf.length += read;
+        buf.buffer[buf.length] = '\0';
+    }
+end:
+    String_free(&buf);
+    return res;
+}
+
+static bool RpcTransport_serve(struct RpcServer* server, HANDLE in, HANDLE out, uint32_t workers,
+                               bool overlapped) {
+    RpcTransport t;
+    t.server = server;
+    t.out = out;
+    t.read_event = NULL;
+    t.write_event = NULL;
+    t.head = NULL;
+    t.tail = NULL;
+    t.active = NULL;
+    t.closing = false;
+    InitializeSRWLock(&t.out_lock);
+    t.cond = Condition_create();
+    if (t.cond == NULL) {
+        return false;
+    }
+    bool res = false;
+    if (overlapped) {
+        t.read_event = CreateEventW(NULL, TRUE, FALSE, NULL);
+        t.write_event = CreateEventW(NULL, TRUE, FALSE, NULL);
+        if (t.read_event == NULL || t.write_event == NULL) {
+            goto end;
+        }
+    }
+
+    if (workers == 0) {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        workers = info.dwNumberOfProcessors;
+    }
+    if (workers > RPC_MAX_WORKERS) {
+        workers = RPC_MAX_WORKERS;
+    }
+
+    ResponseFn response_fn = server->response_fn;
+    void* ctx = server->ctx;
+    server->response_fn = RpcTransport_write;
+    server->ctx = &t;
+
+    HANDLE threads[RPC_MAX_WORKERS];
+    uint32_t started = 0;
+    for (; started < workers; ++started) {
+        threads[started] = CreateThread(NULL, 0, RpcTransport_worker, &t, 0, NULL);
+        if (threads[started] == NULL) {
+            break;
+        }
+    }
+    res = started > 0 && RpcTransport_read(&t, in);
+
+    // Workers finish the queued requests before exiting
+    Condition_aquire(t.cond);
+    t.closing = true;
+    Condition_notify_all(t.cond);
+    Condition_release(t.cond);
+    for (uint32_t i = 0; i < started; ++i) {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+    }
+
+    server->response_fn = response_fn;
+    server->ctx = ctx;
+end:
+    if (t.read_event != NULL) {
+        CloseHandle(t.read_event);
+    }
+    if (t.write_event != NULL) {
+        CloseHandle(t.write_event);
+    }
+    Condition_free(t.cond);
+    return res;
+}
+
+bool RpcServer_serve(struct RpcServer* server, HANDLE in, HANDLE out, uint32_t workers) {
+    return RpcTransport_serve(server, in, out, workers, false);
+}
+
+void RpcServer_serve_pipe(struct RpcServer* server, const wchar_t* name, uint32_t workers) {
+    HANDLE event = CreateEventW(NULL, TRUE, FALSE, NULL);
+    if (event == NULL) {
+        return;
+    }
+    while (1) {
+        // Overlapped, since a blocking read would stall writes on the
+        // same handle
+        HANDLE pipe = CreateNamedPipeW(name, PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED,
+                                       PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT |
+                                       PIPE_REJECT_REMOTE_CLIENTS,
+                                       1, RPC_READ_SIZE, RPC_READ_SIZE, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE) {
+            break;
+        }
+        OVERLAPPED o;
+        memset(&o, 0, sizeof(o));
+        o.hEvent = event;
+        DWORD unused;
+        bool connected = ConnectNamedPipe(pipe, &o) || GetLastError() == ERROR_PIPE_CONNECTED ||
+                         (GetLastError() == ERROR_IO_PENDING &&
+                          GetOverlappedResult(pipe, &o, &unused, TRUE));
+        if (!connected) {
+            CloseHandle(pipe);
+            break;
+        }
+        // A client sending bad headers only loses its own connection
+        RpcTransport_serve(server, pipe, pipe, workers, true);
+        DisconnectNamedPipe(pipe);
+        CloseHandle(pipe);
+    }
+    CloseHandle(event);
 }
 
 
@@ -206,10 +1046,261 @@ void RpcServer_handle_request(struct RpcServer* server, String* data) {
 
 #include "printf.h"
 
+void print_response(const String* response, void* ctx) {
+#ifdef MEM_DEBUG
+    _printf("Live allocations: %llu\n", Mem_count());
+#endif
+    _printf("%s\n", response->buffer);
+}
+
+bool method_sum(RpcCall* call, JsonType* result) {
+    result->type = JSON_DOUBLE;
+    result->dbl = RpcCall_double(call, 0) + RpcCall_double(call, 1);
+    return true;
+}
+
+bool method_get(RpcCall* call, JsonType* result) {
+    result->type = JSON_STRING;
+    return RpcCall_string(call, 0, &result->string);
+}
+
+// Runs until cancelled, or for `ms` milliseconds
+bool method_wait(RpcCall* call, JsonType* result) {
+    int64_t ms = JsonTape_int(call->tape, call->args[0]);
+    for (int64_t i = 0; i < ms; ++i) {
+        if (call->cancelled != NULL && *call->cancelled) {
+            call->error_code = RPC_REQUEST_CANCELLED;
+            call->error_message = "Request cancelled";
+            return true;
+        }
+        Sleep(1);
+    }
+    result->type = JSON_NULL;
+    return true;
+}
+
+static const RpcParam sum_params[] = {{"a", JSON_DOUBLE, false}, {"b", JSON_DOUBLE, false}};
+static const RpcParam get_params[] = {{"key", JSON_STRING, false}};
+static const RpcParam wait_params[] = {{"ms", JSON_INTEGER, false}};
+
+typedef struct ServeParams {
+    struct RpcServer* server;
+    HANDLE in;
+    HANDLE out;
+} ServeParams;
+
+DWORD serve_entry(void* param) {
+    ServeParams* p = param;
+    return RpcServer_serve(p->server, p->in, p->out, 4) ? 0 : 1;
+}
+
+// Send `body` framed, one byte per write if `split` so the server sees
+// partial headers and bodies
+bool client_send(HANDLE h, const char* body, bool split) {
+    String frame;
+    if (!String_create(&frame)) {
+        return false;
+    }
+    String_format_append(&frame, "Content-Length: %u\r\nContent-Type: application/json\r\n\r\n%s",
+                         (uint32_t)strlen(body), body);
+    bool ok = true;
+    DWORD written;
+    if (split) {
+        for (uint32_t i = 0; ok && i < frame.length; ++i) {
+            ok = WriteFile(h, frame.buffer + i, 1, &written, NULL);
+        }
+    } else {
+        ok = WriteFile(h, frame.buffer, frame.length, &written, NULL) && written == frame.length;
+    }
+    String_free(&frame);
+    return ok;
+}
+
+// Stand-in client talking to RpcServer_serve over anonymous pipes
+bool test_transport(struct RpcServer* server) {
+    HANDLE req_read, req_write, res_read, res_write;
+    if (!CreatePipe(&req_read, &req_write, NULL, 0x10000)) {
+        return false;
+    }
+    if (!CreatePipe(&res_read, &res_write, NULL, 0x10000)) {
+        CloseHandle(req_read);
+        CloseHandle(req_write);
+        return false;
+    }
+    ServeParams params = {server, req_read, res_write};
+    HANDLE thread = CreateThread(NULL, 0, serve_entry, &params, 0, NULL);
+    if (thread == NULL) {
+        return false;
+    }
+
+    // Long enough to be left escaped in the read buffer
+    String escaped;
+    if (!String_create(&escaped)) {
+        return false;
+    }
+    String_extend(&escaped, "{\"jsonrpc\": \"2.0\", \"method\": \"get\", \"params\": {\"key\": \"");
+    for (uint32_t i = 0; i < 100; ++i) {
+        String_extend(&escaped, "a\\n");
+    }
+    String_extend(&escaped, "\"}, \"id\": 8}");
+
+    bool ok = client_send(req_write, "{\"jsonrpc\": \"2.0\", \"id\": \"a\"}", true) &&
+              client_send(req_write, "[{\"id\": 1}, {\"id\": 2}, {\"id\": 3}]", false) &&
+              client_send(req_write, "{", false) &&
+              client_send(req_write, "{\"jsonrpc\": \"2.0\", \"method\": \"$/cancelRequest\", "
+                                     "\"params\": {\"id\": 1}}", false) &&
+              client_send(req_write, "{\"jsonrpc\": \"2.0\", \"method\": \"sum\", "
+                                     "\"params\": [1, 2], \"id\": 4}", false) &&
+              client_send(req_write, "{\"jsonrpc\": \"2.0\", \"method\": \"nope\", \"id\": 5}", false) &&
+              client_send(req_write, "{\"jsonrpc\": \"2.0\", \"method\": \"sum\", "
+                                     "\"params\": {\"a\": 1}, \"id\": 6}", false) &&
+              client_send(req_write, "{\"jsonrpc\": \"2.0\", \"method\": \"wait\", "
+                                     "\"params\": [10000], \"id\": 7}", false) &&
+              client_send(req_write, "{\"jsonrpc\": \"2.0\", \"method\": \"$/cancelRequest\", "
+                                     "\"params\": {\"id\": 7}}", false) &&
+              client_send(req_write, escaped.buffer, false) &&
+              client_send(req_write, "{\"jsonrpc\": \"2.0\", \"method\": \"sum\", "
+                                     "\"params\": [1, 2]}", false) &&
+              client_send(req_write, "[{\"jsonrpc\": \"2.0\", \"method\": \"sum\", \"params\": [1, 2]}, "
+                                     "{\"jsonrpc\": \"2.0\", \"method\": \"sum\", "
+                                     "\"params\": [2, 3], \"id\": 9}]", false) &&
+              client_send(req_write, "[{\"jsonrpc\": \"2.0\", \"method\": \"sum\", \"params\": [1, 2]}, "
+                                     "{\"jsonrpc\": \"2.0\", \"method\": \"nope\"}]", false) &&
+              client_send(req_write, "{\"jsonrpc\": \"2.0\", \"method\": \"wait\", "
+                                     "\"params\": [10000], \"id\": 10}", false) &&
+              client_send(req_write, "[{\"jsonrpc\": \"2.0\", \"method\": \"$/cancelRequest\", "
+                                     "\"params\": {\"id\": 10}}, "
+                                     "{\"jsonrpc\": \"2.0\", \"method\": \"sum\", "
+                                     "\"params\": [5, 6], \"id\": 11}]", false) &&
+              client_send(req_write, "[]", false);
+    String_free(&escaped);
+    CloseHandle(req_write);
+    DWORD code = 1;
+    WaitForSingleObject(thread, INFINITE);
+    GetExitCodeThread(thread, &code);
+    CloseHandle(thread);
+    CloseHandle(req_read);
+    CloseHandle(res_write);
+    ok = ok && code == 0;
+
+    String out;
+    if (!String_create(&out)) {
+        CloseHandle(res_read);
+        return false;
+    }
+    char buf[4096];
+    DWORD read;
+    while (ReadFile(res_read, buf, sizeof(buf), &read, NULL) && read > 0) {
+        String_append_count(&out, buf, read);
+    }
+    CloseHandle(res_read);
+
+    // Responses may arrive in any order, the batch keeps its own order
+    uint32_t pos = 0;
+    uint32_t seen = 0;
+    uint32_t frames = 0;
+    while (ok && pos < out.length) {
+        uint32_t len;
+        int64_t header = rpc_parse_headers(out.buffer + pos, out.length - pos, &len);
+        if (header <= 0 || pos + header + len > out.length) {
+            ok = false;
+            break;
+        }
+        _printf("%.*s\n", len, out.buffer + pos + header);
+        char* body = out.buffer + pos + header;
+        char end = body[len];
+        body[len] = '\0';
+        JsonTape tape;
+        ok = json_parse_tape(body, &tape, NULL);
+        body[len] = end;
+        pos += (uint32_t)header + len;
+        ++frames;
+        if (!ok) {
+            break;
+        }
+        int64_t n;
+        StrView id;
+        StrView str;
+        JsonTapeRef err;
+        double d;
+        if (JsonTape_type(&tape, JSON_TAPE_ROOT) == JSON_LIST &&
+            JsonTape_size(&tape, JSON_TAPE_ROOT) == 1) {
+            // Notifications in a batch leave out their response
+            JsonTapeRef r = JsonTapeList_get_obj(&tape, JSON_TAPE_ROOT, 0);
+            ok = r != JSON_TAPE_NONE && JsonTapeObject_get_int(&tape, r, "id", &n) &&
+                 JsonTapeObject_get_double(&tape, r, "result", &d) &&
+                 ((n == 9 && d == 5.0) || (n == 11 && d == 11.0));
+            seen |= n == 9 ? 256 : 512;
+        } else if (JsonTape_type(&tape, JSON_TAPE_ROOT) == JSON_LIST) {
+            ok = JsonTape_size(&tape, JSON_TAPE_ROOT) == 3;
+            for (uint32_t i = 0; ok && i < 3; ++i) {
+                JsonTapeRef r = JsonTapeList_get_obj(&tape, JSON_TAPE_ROOT, i);
+                ok = r != JSON_TAPE_NONE && JsonTapeObject_get_int(&tape, r, "id", &n) && n == i + 1;
+            }
+            seen |= 1;
+        } else if (JsonTapeObject_get_string(&tape, JSON_TAPE_ROOT, "result", &str)) {
+            ok = str.length == 200 && str.data[0] == 'a' && str.data[1] == '\n' &&
+                 JsonTapeObject_get_int(&tape, JSON_TAPE_ROOT, "id", &n) && n == 8;
+            seen |= 128;
+        } else if (JsonTapeObject_get_double(&tape, JSON_TAPE_ROOT, "result", &d)) {
+            ok = d == 3.0 && JsonTapeObject_get_int(&tape, JSON_TAPE_ROOT, "id", &n) && n == 4;
+            seen |= 8;
+        } else if ((err = JsonTapeObject_get_obj(&tape, JSON_TAPE_ROOT, "error")) == JSON_TAPE_NONE ||
+                   !JsonTapeObject_get_int(&tape, err, "code", &n)) {
+            ok = false;
+        } else if (n == -32600 && JsonTapeObject_get_string(&tape, JSON_TAPE_ROOT, "id", &id)) {
+            ok = StrView_equals(id, STRVIEW("a"));
+            seen |= 2;
+        } else if (n == -32600) {
+            // The empty batch
+            ok = JsonTape_type(&tape, JsonTapeObject_get(&tape, JSON_TAPE_ROOT, "id")) == JSON_NULL;
+            seen |= 1024;
+        } else if (n == -32700) {
+            seen |= 4;
+        } else if (n == -32601) {
+            seen |= 16;
+        } else if (n == -32602) {
+            seen |= 32;
+        } else if (n == RPC_REQUEST_CANCELLED) {
+            ok = JsonTapeObject_get_int(&tape, JSON_TAPE_ROOT, "id", &n) && (n == 7 || n == 10);
+            seen |= n == 7 ? 64 : 2048;
+        } else {
+            ok = false;
+        }
+        JsonTape_free(&tape);
+    }
+    String_free(&out);
+    // Notifications, and batches of only notifications, have no response
+    return ok && seen == 4095 && frames == 12;
+}
+
 int main() {
     struct RpcServer server;
-    RcpServer_init(&server, NULL, NULL);
+    RcpServer_init(&server, print_response, NULL);
+    if (!RpcServer_register(&server, "sum", method_sum, sum_params, 2, NULL) ||
+        !RpcServer_register(&server, "get", method_get, get_params, 1, NULL) ||
+        !RpcServer_register(&server, "wait", method_wait, wait_params, 1, NULL)) {
+        RpcServer_free(&server);
+        return 1;
+    }
+
+    String req;
+    if (String_from_view(&req, STRVIEW("[{\"jsonrpc\": \"2.0\", \"method\": \"sum\", "
+                                       "\"params\": [1, 2], \"id\": \"a\"}, "
+                                       "{\"jsonrpc\": \"2.0\", \"method\": \"get\", "
+                                       "\"params\": {\"key\": \"value\"}, \"id\": 2}]"))) {
+        RpcServer_handle_request(&server, &req);
+        String_free(&req);
+    }
+
+    if (!test_transport(&server)) {
+        _printf("Transport test failed\n");
+        RpcServer_free(&server);
+        return 1;
+    }
+    _printf("Transport test passed\n");
 
+    RpcServer_free(&server);
 
     return 0;
 }
@@ -1,9 +1,111 @@
 #ifndef JSON_RCP_SERVER_H
 #define JSON_RCP_SERVER_H
 
+#include "json.h"
+#include "arena.h"
 
+// Upper limit of worker threads used by RpcServer_serve
+#define RPC_MAX_WORKERS 8
+// Upper limit of parameters a method can declare
+#define RPC_MAX_PARAMS 16
 
+// Error code of requests cancelled with $/cancelRequest
+#define RPC_REQUEST_CANCELLED -32800
 
+// Parameter type accepting any value
+#define RPC_PARAM_ANY ((JsonKind)0xFF)
 
+// Parameter read by a method. Named parameters are looked up by `name`,
+// positional ones by their index in the declaration. JSON_DOUBLE
+// parameters also accept integers.
+typedef struct RpcParam {
+    const char* name;
+    JsonKind type;
+    bool optional;
+} RpcParam;
+
+typedef struct RpcCall {
+    struct RpcServer* server;
+    // The request. Long strings point into the request text, so they are
+    // not null-terminated. Long values with escapes are left escaped, see
+    // JsonTape_string_escaped and RpcCall_string.
+    const JsonTape* tape;
+    // One per declared parameter, JSON_TAPE_NONE for missing optional ones
+    const JsonTapeRef* args;
+    // Set once the request is cancelled, NULL outside of RpcServer_serve
+    const volatile LONG* cancelled;
+    // As given to RpcServer_register
+    void* ctx;
+    // Set `error_message` to answer with an error instead of the result
+    int64_t error_code;
+    const char* error_message;
+} RpcCall;
+
+// Set `*result` or the error of `call`. Returns false on out of memory,
+// leaving `*result` unset.
+typedef bool (*RpcMethodFn)(RpcCall* call, JsonType* result);
+
+typedef struct RpcMethod {
+    StrView name;
+    uint32_t hash;
+    RpcMethodFn fn;
+    const RpcParam* params;
+    uint32_t param_count;
+    void* ctx;
+} RpcMethod;
+
+// Called with each complete response. May be called from several
+// threads at once when serving a transport
+typedef void(*ResponseFn)(const String* response, void* ctx);
+
+struct RpcServer {
+    ResponseFn response_fn;
+
+    String internal_error;
+
+    // Each request is parsed into `arena` and released once handled
+    Arena arena;
+    Allocator allocator;
+
+    void* ctx;
+
+    // Open addressing table of registered methods, `method_cap` is zero
+    // or a power of two
+    RpcMethod* methods;
+    uint32_t method_count;
+    uint32_t method_cap;
+};
+
+bool RcpServer_init(struct RpcServer* server, ResponseFn callback, void* ctx);
+
+void RpcServer_free(struct RpcServer* server);
+
+// Register `fn` as method `name`, reading the `param_count` parameters
+// described by `params`. `name` and `params` have to outlive the server.
+// Methods can only be registered before serving.
+bool RpcServer_register(struct RpcServer* server, const char* name, RpcMethodFn fn,
+                        const RpcParam* params, uint32_t param_count, void* ctx);
+
+// Value of JSON_DOUBLE parameter `ix`, which may have been given as an
+// integer
+double RpcCall_double(const RpcCall* call, uint32_t ix);
+
+// Unescaped copy of JSON_STRING parameter `ix`. Methods that can use the
+// raw text avoid the copy with JsonTape_string.
+bool RpcCall_string(const RpcCall* call, uint32_t ix, String_noinit* out);
+
+// Handle request or batch `data` on the calling thread
+void RpcServer_handle_request(struct RpcServer* server, String* data);
+
+// Serve requests framed with Content-Length headers read from `in` on
+// `workers` threads, 0 for one per processor. Responses are written to
+// `out` as they complete, so they may come out of order. Returns when
+// `in` is closed and all requests have been answered.
+bool RpcServer_serve(struct RpcServer* server, HANDLE in, HANDLE out, uint32_t workers);
+
+// Serve clients of the named pipe `name`, one connection at a time. A
+// client that fails is disconnected and the next one accepted. Only returns
+// when the pipe cannot be created or connected.
+void RpcServer_serve_pipe(struct RpcServer* server, const wchar_t* name, uint32_t workers);
 
 #endif
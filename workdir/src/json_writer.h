@@ -0,0 +1,146 @@
+// Serializer body, included twice by json.c. With JSON_WRITER_PRETTY
+// defined the functions get a _pretty suffix and indent their output,
+// the compact instance contains no layout code at all.
+
+#ifdef JSON_WRITER_PRETTY
+#define JSON_WRITER(name) name##_pretty
+// Room for a separator or bracket and the line break before it
+#define JSON_WRITER_LINE(depth) (2 * (uint64_t)(depth) + 2)
+#else
+#define JSON_WRITER(name) name
+#define JSON_WRITER_LINE(depth) 1
+#endif
+
+static bool JSON_WRITER(JsonWriter_type)(JsonSink* sink, const JsonType* v, uint32_t depth) {
+    switch (v->type) {
+    case JSON_OBJECT: {
+        if (!JsonSink_reserve(sink, 1)) {
+            return false;
+        }
+        *sink->out++ = '{';
+        LinkedHashMapIterator it;
+        LinkedHashMapIter_Begin(&it, (LinkedHashMap*)&v->object.data);
+        LinkedHashElement* el;
+        uint32_t count = 0;
+        while ((el = LinkedHashMapIter_Next(&it)) != NULL) {
+            if (!JsonSink_reserve(sink, JSON_WRITER_LINE(depth + 1))) {
+                return false;
+            }
+            if (count > 0) {
+                *sink->out++ = ',';
+            }
+            ++count;
+#ifdef JSON_WRITER_PRETTY
+            sink->out = json_write_indent(sink->out, depth + 1);
+#endif
+            if (!JsonSink_string(sink, el->key, strlen(el->key)) || !JsonSink_reserve(sink, 2)) {
+                return false;
+            }
+            *sink->out++ = ':';
+#ifdef JSON_WRITER_PRETTY
+            *sink->out++ = ' ';
+#endif
+            if (!JSON_WRITER(JsonWriter_type)(sink, el->value, depth + 1)) {
+                return false;
+            }
+        }
+        if (!JsonSink_reserve(sink, JSON_WRITER_LINE(depth))) {
+            return false;
+        }
+#ifdef JSON_WRITER_PRETTY
+        if (count > 0) {
+            sink->out = json_write_indent(sink->out, depth);
+        }
+#endif
+        *sink->out++ = '}';
+        return true;
+    }
+    case JSON_LIST:
+        if (!JsonSink_reserve(sink, 1)) {
+            return false;
+        }
+        *sink->out++ = '[';
+        for (uint32_t i = 0; i < v->list.size; ++i) {
+            if (!JsonSink_reserve(sink, JSON_WRITER_LINE(depth + 1))) {
+                return false;
+            }
+            if (i > 0) {
+                *sink->out++ = ',';
+            }
+#ifdef JSON_WRITER_PRETTY
+            sink->out = json_write_indent(sink->out, depth + 1);
+#endif
+            if (!JSON_WRITER(JsonWriter_type)(sink, &v->list.data[i], depth + 1)) {
+                return false;
+            }
+        }
+        if (!JsonSink_reserve(sink, JSON_WRITER_LINE(depth))) {
+            return false;
+        }
+#ifdef JSON_WRITER_PRETTY
+        if (v->list.size > 0) {
+            sink->out = json_write_indent(sink->out, depth);
+        }
+#endif
+        *sink->out++ = ']';
+        return true;
+    case JSON_STRING:
+        return JsonSink_string(sink, v->string.buffer, v->string.length);
+    default:
+        return JsonSink_scalar(sink, v);
+    }
+}
+
+static bool JSON_WRITER(JsonWriter_tape)(JsonSink* sink, const JsonTape* tape, JsonTapeRef v,
+                                         uint32_t depth) {
+    JsonKind kind = JsonTape_type(tape, v);
+    if (kind != JSON_OBJECT && kind != JSON_LIST) {
+        return JsonSink_tape_scalar(sink, tape, v);
+    }
+    if (!JsonSink_reserve(sink, 1)) {
+        return false;
+    }
+    *sink->out++ = kind == JSON_OBJECT ? '{' : '[';
+    JsonTapeIter it;
+    JsonTapeIter_begin(&it, tape, v);
+    StrView key;
+    JsonTapeRef member;
+    uint32_t count = 0;
+    while (JsonTapeIter_next(&it, &key, &member)) {
+        if (!JsonSink_reserve(sink, JSON_WRITER_LINE(depth + 1))) {
+            return false;
+        }
+        if (count > 0) {
+            *sink->out++ = ',';
+        }
+        ++count;
+#ifdef JSON_WRITER_PRETTY
+        sink->out = json_write_indent(sink->out, depth + 1);
+#endif
+        if (kind == JSON_OBJECT) {
+            if (!JsonSink_string(sink, key.data, key.length) || !JsonSink_reserve(sink, 2)) {
+                return false;
+            }
+            *sink->out++ = ':';
+#ifdef JSON_WRITER_PRETTY
+            *sink->out++ = ' ';
+#endif
+        }
+        if (!JSON_WRITER(JsonWriter_tape)(sink, tape, member, depth + 1)) {
+            return false;
+        }
+    }
+    if (!JsonSink_reserve(sink, JSON_WRITER_LINE(depth))) {
+        return false;
+    }
+#ifdef JSON_WRITER_PRETTY
+    if (count > 0) {
+        sink->out = json_write_indent(sink->out, depth);
+    }
+#endif
+    *sink->out++ = kind == JSON_OBJECT ? '}' : ']';
+    return true;
+}
+
+#undef JSON_WRITER
+#undef JSON_WRITER_LINE
@@ -2,6 +2,10 @@
 #include "subprocess.h"
 #include "args.h"
 #include "printf.h"
+#include "mutex.h"
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
 
 WHashMap gNodes;
 
@@ -17,10 +21,74 @@ MatchNode* gRoot; // Root of autocomplete graph
 MatchNode* gAny_file; // Special node used for '>'
 MatchNode* gExisting_file; // Special node used for '<'
 
+// Blob of a graph loaded by MatchNode_load_graph, and its frozen map of
+// static matches, which is searched before gNodes
+static uint8_t* gGraph = NULL;
+static WHashMap* gGraph_map = NULL;
+
+// Output of one run of a dynamic match command. Shared by the cache and
+// the DynamicMatch it is installed in, freed with the last reference.
+typedef struct DynamicResult {
+    volatile LONG refs;
+    unsigned count;
+    wchar_t* matches[];
+} DynamicResult;
+
+// Cached output of a command in a working directory
+typedef struct DynamicEntry {
+    // Least recently used list, most recent first
+    struct DynamicEntry* prev;
+    struct DynamicEntry* next;
+    struct DynamicEntry* queue_next;
+    wchar_t* key;
+    wchar_t* cmd;
+    wchar_t separator;
+    // Latest output, NULL before the first run finishes or if it failed
+    DynamicResult* result;
+    // Prompt the last run was started at
+    uint32_t epoch;
+    bool started;
+    bool running;
+} DynamicEntry;
+
+// Guards the cache, the queue and all DynamicEntry members
+static Condition* gDynamic_cond = NULL;
+static WHashMap gDynamic_cache;
+static DynamicEntry* gDynamic_first = NULL;
+static DynamicEntry* gDynamic_last = NULL;
+static uint32_t gDynamic_cached = 0;
+static DynamicEntry* gDynamic_queue = NULL;
+static DynamicEntry* gDynamic_queue_last = NULL;
+static HANDLE gDynamic_workers[DYNAMIC_WORKERS];
+static uint32_t gDynamic_worker_count = 0;
+static bool gDynamic_closing = false;
+
+// Only used from the console thread
+static uint32_t gDynamic_epoch = 1;
+static uint32_t gDynamic_chdir_epoch = 1;
+static WString gDynamic_workdir;
+
+static void DynamicResult_release(DynamicResult* res) {
+    if (res != NULL && InterlockedDecrement(&res->refs) == 0) {
+        Mem_free(res);
+    }
+}
+
+static void DynamicEntry_free(DynamicEntry* e) {
+    DynamicResult_release(e->result);
+    Mem_free(e->key);
+    Mem_free(e->cmd);
+    Mem_free(e);
+}
+
 
 
 void MatchNode_init() {
     WHashMap_Create(&gNodes);
+    WHashMap_Create(&gDynamic_cache);
+    WString_create(&gDynamic_workdir);
+    // Without it dynamic matches are never evaluated
+    gDynamic_cond = Condition_create();
 
     NodeBuilder b;
     NodeBuilder_create(&b);
@@ -34,19 +102,21 @@ void MatchNode_init() {
     gExisting_file = NodeBuilder_finalize(&b);
 }
 
-void MatchNode_reset() {
-    WHashMap_Clear(&gNodes);
-
+static void dynamic_matches_free() {
     for (uint32_t ix = 0; ix < gDynamic_count; ++ix) {
         DynamicMatch* dyn = gDynamic_matches[ix];
-        if (dyn->matches != NULL && dyn->match_count != 0) {
-            Mem_free(dyn->matches);
-        }
+        // The cache is kept, so reloading does not rerun commands
+        DynamicResult_release(dyn->result);
         Mem_free(dyn->cmd);
         Mem_free(dyn->nodes);
         Mem_free(dyn);
     }
     gDynamic_count = 0;
+}
+
+void MatchNode_reset() {
+    WHashMap_Clear(&gNodes);
+    dynamic_matches_free();
 
     for (uint32_t ix = 0; ix < gNode_count; ++ix) {
         MatchNode* node = gNode_list[ix];
@@ -60,10 +130,38 @@ void MatchNode_reset() {
     }
     gNode_count = 0;
     gRoot = NULL;
+
+    if (gGraph != NULL) {
+        Mem_free(gGraph);
+        gGraph = NULL;
+        gGraph_map = NULL;
+    }
 }
 
 void MatchNode_free() {
     MatchNode_reset();
+    if (gDynamic_cond != NULL) {
+        Condition_aquire(gDynamic_cond);
+        gDynamic_closing = true;
+        Condition_notify_all(gDynamic_cond);
+        Condition_release(gDynamic_cond);
+        for (uint32_t ix = 0; ix < gDynamic_worker_count; ++ix) {
+            WaitForSingleObject(gDynamic_workers[ix], INFINITE);
+            CloseHandle(gDynamic_workers[ix]);
+        }
+        gDynamic_worker_count = 0;
+        while (gDynamic_first != NULL) {
+            DynamicEntry* next = gDynamic_first->next;
+            DynamicEntry_free(gDynamic_first);
+            gDynamic_first = next;
+        }
+        gDynamic_last = NULL;
+        gDynamic_cached = 0;
+        WHashMap_Free(&gDynamic_cache);
+        WString_free(&gDynamic_workdir);
+        Condition_free(gDynamic_cond);
+        gDynamic_cond = NULL;
+    }
     WHashMap_Free(&gNodes);
     Mem_free(gNode_list);
     Mem_free(gDynamic_matches);
@@ -119,6 +217,70 @@ bool has_prefix(const wchar_t* s, const wchar_t* prefix) {
     return true;
 }
 
+// Compare case-insensitively, folding like has_prefix
+static int fold_cmp(const wchar_t* a, const wchar_t* b) {
+    unsigned ix = 0;
+    while (a[ix] != L'\0' && tolower(a[ix]) == tolower(b[ix])) {
+        ++ix;
+    }
+    return (int)tolower(a[ix]) - (int)tolower(b[ix]);
+}
+
+// Gives the string an element is ordered by
+typedef const wchar_t* (*FoldKey)(const void* elem);
+
+static const wchar_t* match_key(const void* elem) {
+    return ((const Match*)elem)->static_match;
+}
+
+static const wchar_t* string_key(const void* elem) {
+    return *(wchar_t* const*)elem;
+}
+
+// Stable sort of `n` elements of `size` bytes by the fold_cmp order of
+// their keys, `tmp` has room for `n / 2` elements
+static void fold_sort(uint8_t* base, uint8_t* tmp, unsigned n, size_t size, FoldKey key) {
+    if (n < 2) {
+        return;
+    }
+    unsigned half = n / 2;
+    fold_sort(base, tmp, half, size, key);
+    fold_sort(base + half * size, tmp, n - half, size, key);
+    if (fold_cmp(key(base + (half - 1) * size), key(base + half * size)) <= 0) {
+        return;
+    }
+    memcpy(tmp, base, half * size);
+    unsigned a = 0, b = half, out = 0;
+    while (a < half && b < n) {
+        if (fold_cmp(key(base + b * size), key(tmp + a * size)) < 0) {
+            memcpy(base + out * size, base + b * size, size);
+            ++b;
+        } else {
+            memcpy(base + out * size, tmp + a * size, size);
+            ++a;
+        }
+        ++out;
+    }
+    memcpy(base + out * size, tmp + a * size, (half - a) * size);
+}
+
+// Index of the first element with `prefix` among `n` sorted by fold_sort,
+// all others with it follow directly
+static unsigned fold_lower_bound(const uint8_t* base, unsigned n, size_t size, FoldKey key,
+                                 const wchar_t* prefix) {
+    unsigned lo = 0;
+    while (n > 0) {
+        unsigned half = n / 2;
+        if (fold_cmp(key(base + (lo + half) * size), prefix) < 0) {
+            lo += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+    return lo;
+}
+
 bool char_needs_quotes(wchar_t c) {
     return c == L' ' || c == L'+' || c == L'=' || c == L'(' || c == L')' || 
             c == L'{' || c == '}' || c == L'%' || c == L'[' || c == L']';
@@ -143,6 +305,9 @@ void NodeIterator_begin(NodeIterator* it, MatchNode* node, const wchar_t* prefix
     unsigned len = wcslen(prefix);
     WString_create_capacity(&it->prefix, len);
     WString_append_count(&it->prefix, prefix, len); 
+    it->static_start = fold_lower_bound((uint8_t*)node->matches, node->static_count,
+                                        sizeof(Match), match_key, it->prefix.buffer);
+    it->static_ix = it->static_start;
 
     it->path_start = find_path_start(it->prefix.buffer, len);
     unsigned path_len = len - (it->path_start - it->prefix.buffer);
@@ -150,21 +315,31 @@ void NodeIterator_begin(NodeIterator* it, MatchNode* node, const wchar_t* prefix
 }
 
 const wchar_t* NodeIterator_next(NodeIterator* it) {
+    // Static matches with the prefix are a single range of the sorted ones
+    if (it->static_ix < it->node->static_count) {
+        const wchar_t* s = it->node->matches[it->static_ix].static_match;
+        if (has_prefix(s, it->prefix.buffer)) {
+            it->static_ix += 1;
+            return s;
+        }
+        it->static_ix = it->node->static_count;
+    }
     while (1) {
         if (it->ix >= it->node->match_count) {
             return NULL;
         }
         Match* match = &it->node->matches[it->ix];
         unsigned type = match->type;
-        if (type == MATCH_ANY) {
+        if (type == MATCH_ANY || (type == MATCH_STATIC && it->ix < it->node->static_count)) {
             it->ix += 1;
             continue;
         }
         if (type == MATCH_STATIC) {
+            // Left unsorted when NodeBuilder_finalize ran out of memory
             it->ix += 1;
             if (!has_prefix(match->static_match, it->prefix.buffer)) {
                 continue;
-            } 
+            }
             return match->static_match;
         }
         if (type == MATCH_ANY_FILE || type == MATCH_EXISTING_FILE) {
@@ -223,21 +398,22 @@ const wchar_t* NodeIterator_next(NodeIterator* it) {
             WString_insert_count(&path->path, 0, it->prefix.buffer, count);
             return path->path.buffer;
         }
-        // DynamicMatch left
+        // DynamicMatch left, its results are sorted like the static index.
+        // dyn_ix is one past the current result, 0 before evaluating.
         DynamicMatch* dyn = match->dynamic_match;
         if (it->dyn_ix == 0) {
             DynamicMatch_evaluate(dyn);
+            it->dyn_ix = fold_lower_bound((uint8_t*)dyn->matches, dyn->match_count,
+                                          sizeof(wchar_t*), string_key, it->prefix.buffer) + 1;
         }
-        if (it->dyn_ix >= dyn->match_count) {
+        if (it->dyn_ix > dyn->match_count ||
+            !has_prefix(dyn->matches[it->dyn_ix - 1], it->prefix.buffer)) {
             it->ix += 1;
             it->dyn_ix = 0;
             continue;
         }
         it->dyn_ix += 1;
-        if (!has_prefix(dyn->matches[it->dyn_ix - 1], it->prefix.buffer)) {
-            continue;
-        }
-        return dyn->matches[it->dyn_ix - 1];
+        return dyn->matches[it->dyn_ix - 2];
     }
 }
 
@@ -250,6 +426,8 @@ void NodeIterator_stop(NodeIterator* it) {
     it->node = NULL;
     it->ix = 0;
     it->dyn_ix = 0;
+    it->static_ix = 0;
+    it->static_start = 0;
     WString_free(&it->prefix);
     it->dir_separator = NULL;
 }
@@ -260,6 +438,7 @@ void NodeIterator_restart(NodeIterator* it) {
     }
     it->ix = 0;
     it->dyn_ix = 0;
+    it->static_ix = it->static_start;
 }
 
 bool is_filelike(const wchar_t* str, unsigned len) {
@@ -318,6 +497,286 @@ bool reserve(void** dst, unsigned* cap, unsigned size, size_t elem_size) {
 #define RESERVE(ptr, cap, size, type) reserve((void**)ptr, cap, size, sizeof(type))
 
 
+// Scores of a fuzzy match, following fzf
+#define FUZZY_MATCH 16
+#define FUZZY_GAP_START 3
+#define FUZZY_GAP_EXTEND 1
+#define FUZZY_BOUNDARY 8
+#define FUZZY_CAMEL 7
+#define FUZZY_CONSECUTIVE 4
+#define FUZZY_NO_MATCH INT_MIN
+
+// Bit of a character in candidate masks, folded like has_prefix
+static unsigned fuzzy_bit(wchar_t c) {
+    c = tolower(c);
+    if (c >= L'a' && c <= L'z') {
+        return c - L'a';
+    }
+    if (c >= L'0' && c <= L'9') {
+        return 26 + c - L'0';
+    }
+    if (c < 0x80) {
+        return 36 + c % 27;
+    }
+    return 63;
+}
+
+static uint64_t fuzzy_mask(const wchar_t* s, unsigned len) {
+    uint64_t mask = 0;
+    for (unsigned ix = 0; ix < len; ++ix) {
+        mask |= 1ULL << fuzzy_bit(s[ix]);
+    }
+    return mask;
+}
+
+static int fuzzy_bonus(const wchar_t* s, unsigned ix) {
+    if (ix == 0) {
+        return FUZZY_BOUNDARY;
+    }
+    wchar_t prev = s[ix - 1];
+    if (prev == L'\\' || prev == L'/' || prev == L' ' || prev == L'-' ||
+        prev == L'_' || prev == L'.' || prev == L':' || prev == L'=' || prev == L'"') {
+        return FUZZY_BOUNDARY;
+    }
+    if (prev >= L'a' && prev <= L'z' && s[ix] >= L'A' && s[ix] <= L'Z') {
+        return FUZZY_CAMEL;
+    }
+    return 0;
+}
+
+// Score of `query` as a subsequence of `s`, or FUZZY_NO_MATCH. The first
+// occurrence found scanning forwards is tightened by scanning backwards
+// from its end, which finds most of the optimal alignments cheaply.
+static int fuzzy_score(const wchar_t* s, unsigned len, const wchar_t* query, unsigned qlen) {
+    if (qlen == 0) {
+        return 0;
+    }
+    unsigned qi = 0;
+    unsigned end = 0;
+    for (unsigned ix = 0; ix < len; ++ix) {
+        if (tolower(s[ix]) == tolower(query[qi])) {
+            ++qi;
+            if (qi == qlen) {
+                end = ix + 1;
+                break;
+            }
+        }
+    }
+    if (qi < qlen) {
+        return FUZZY_NO_MATCH;
+    }
+    unsigned start = end;
+    while (qi > 0) {
+        --start;
+        if (tolower(s[start]) == tolower(query[qi - 1])) {
+            --qi;
+        }
+    }
+
+    int score = 0;
+    bool consecutive = false;
+    for (unsigned ix = start; ix < end; ++ix) {
+        if (qi < qlen && tolower(s[ix]) == tolower(query[qi])) {
+            int bonus = fuzzy_bonus(s, ix);
+            if (qi == 0) {
+                bonus *= 2;
+            } else if (consecutive && bonus < FUZZY_CONSECUTIVE) {
+                bonus = FUZZY_CONSECUTIVE;
+            }
+            score += FUZZY_MATCH + bonus;
+            consecutive = true;
+            ++qi;
+        } else {
+            score -= consecutive ? FUZZY_GAP_START : FUZZY_GAP_EXTEND;
+            consecutive = false;
+        }
+    }
+    return score;
+}
+
+// Write the indices of the masks containing all bits of `need` to `out`,
+// returning how many there are
+static unsigned fuzzy_filter(const uint64_t* masks, unsigned count, uint64_t need, FuzzyRank* out) {
+    unsigned n = 0;
+    unsigned ix = 0;
+#if defined(__AVX2__)
+    __m256i q = _mm256_set1_epi64x(need);
+    for (; ix + 4 <= count; ix += 4) {
+        __m256i m = _mm256_loadu_si256((const __m256i*)(masks + ix));
+        __m256i miss = _mm256_andnot_si256(m, q);
+        unsigned ok = _mm256_movemask_pd(_mm256_castsi256_pd(
+            _mm256_cmpeq_epi64(miss, _mm256_setzero_si256())));
+        for (unsigned b = 0; ok != 0; ++b, ok >>= 1) {
+            if (ok & 1) {
+                out[n++].ix = ix + b;
+            }
+        }
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    __m128i q = _mm_set1_epi64x(need);
+    for (; ix + 2 <= count; ix += 2) {
+        __m128i m = _mm_loadu_si128((const __m128i*)(masks + ix));
+        __m128i eq = _mm_cmpeq_epi32(_mm_andnot_si128(m, q), _mm_setzero_si128());
+        // Both halves of a lane have to be zero
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        unsigned ok = _mm_movemask_pd(_mm_castsi128_pd(eq));
+        if (ok & 1) {
+            out[n++].ix = ix;
+        }
+        if (ok & 2) {
+            out[n++].ix = ix + 1;
+        }
+    }
+#endif
+    for (; ix < count; ++ix) {
+        if ((need & ~masks[ix]) == 0) {
+            out[n++].ix = ix;
+        }
+    }
+    return n;
+}
+
+static int fuzzy_rank_cmp(const void* a, const void* b) {
+    const FuzzyRank* x = a;
+    const FuzzyRank* y = b;
+    if (x->score != y->score) {
+        return x->score > y->score ? -1 : 1;
+    }
+    if (x->length != y->length) {
+        return x->length < y->length ? -1 : 1;
+    }
+    return x->ix < y->ix ? -1 : x->ix > y->ix;
+}
+
+void FuzzyMatcher_init(FuzzyMatcher* f) {
+    memset(f, 0, sizeof(FuzzyMatcher));
+    WString_create(&f->base);
+    WString_create(&f->query);
+    WString_create(&f->text);
+}
+
+void FuzzyMatcher_free(FuzzyMatcher* f) {
+    WString_free(&f->base);
+    WString_free(&f->query);
+    WString_free(&f->text);
+    if (f->capacity > 0) {
+        Mem_free(f->candidates);
+    }
+    if (f->mask_capacity > 0) {
+        Mem_free(f->masks);
+    }
+    if (f->ranked_capacity > 0) {
+        Mem_free(f->ranked);
+    }
+    memset(f, 0, sizeof(FuzzyMatcher));
+}
+
+static void FuzzyMatcher_collect(FuzzyMatcher* f) {
+    f->count = 0;
+    WString_clear(&f->text);
+    NodeIterator it;
+    NodeIterator_begin(&it, f->node, f->base.buffer);
+    const wchar_t* s;
+    while (f->count < FUZZY_MAX_CANDIDATES && (s = NodeIterator_next(&it)) != NULL) {
+        unsigned len = wcslen(s);
+        if (!RESERVE(&f->candidates, &f->capacity, f->count + 1, FuzzyCandidate) ||
+            !RESERVE(&f->masks, &f->mask_capacity, f->count + 1, uint64_t)) {
+            break;
+        }
+        unsigned offset = f->text.length;
+        if (!WString_append_count(&f->text, s, len) || !WString_append(&f->text, L'\0')) {
+            break;
+        }
+        FuzzyCandidate* c = &f->candidates[f->count];
+        c->offset = offset;
+        c->length = len;
+        c->start = 0;
+        if (has_prefix(s, f->base.buffer)) {
+            c->start = f->base.length;
+        } else if (s[0] == L'"' && has_prefix(s + 1, f->base.buffer)) {
+            c->start = f->base.length + 1;
+        }
+        f->masks[f->count] = fuzzy_mask(s + c->start, len - c->start);
+        f->count += 1;
+    }
+    NodeIterator_stop(&it);
+}
+
+// Score the candidates matching `query`, only looking at the previous
+// matches with `narrow`
+static void FuzzyMatcher_rank(FuzzyMatcher* f, bool narrow) {
+    uint64_t need = fuzzy_mask(f->query.buffer, f->query.length);
+    unsigned n = 0;
+    if (narrow) {
+        for (unsigned ix = 0; ix < f->ranked_count; ++ix) {
+            unsigned c = f->ranked[ix].ix;
+            if ((need & ~f->masks[c]) == 0) {
+                f->ranked[n++].ix = c;
+            }
+        }
+    } else {
+        if (!RESERVE(&f->ranked, &f->ranked_capacity, f->count, FuzzyRank)) {
+            f->ranked_count = 0;
+            return;
+        }
+        n = fuzzy_filter(f->masks, f->count, need, f->ranked);
+    }
+
+    unsigned kept = 0;
+    for (unsigned ix = 0; ix < n; ++ix) {
+        FuzzyCandidate* c = &f->candidates[f->ranked[ix].ix];
+        const wchar_t* s = f->text.buffer + c->offset + c->start;
+        int score = fuzzy_score(s, c->length - c->start, f->query.buffer, f->query.length);
+        if (score == FUZZY_NO_MATCH) {
+            continue;
+        }
+        f->ranked[kept].ix = f->ranked[ix].ix;
+        f->ranked[kept].score = score;
+        f->ranked[kept].length = c->length;
+        ++kept;
+    }
+    f->ranked_count = kept;
+    qsort(f->ranked, kept, sizeof(FuzzyRank), fuzzy_rank_cmp);
+}
+
+void FuzzyMatcher_begin(FuzzyMatcher* f, MatchNode* node, const wchar_t* word) {
+    unsigned len = wcslen(word);
+    wchar_t* path_start = find_path_start((wchar_t*)word, len);
+    wchar_t* dir_separator = find_parent_dir(path_start, len - (path_start - word));
+    unsigned base_len = (dir_separator != NULL ? dir_separator + 1 : path_start) - word;
+
+    bool same = f->active && f->node == node && f->base.length == base_len &&
+                memcmp(f->base.buffer, word, base_len * sizeof(wchar_t)) == 0;
+    if (!same) {
+        f->node = node;
+        WString_clear(&f->base);
+        WString_append_count(&f->base, word, base_len);
+        FuzzyMatcher_collect(f);
+        f->ranked_count = 0;
+    }
+    // Whatever matches the longer query also matched the shorter one
+    bool narrow = same && f->query.length <= len - base_len &&
+                  memcmp(f->query.buffer, word + base_len, f->query.length * sizeof(wchar_t)) == 0;
+    WString_clear(&f->query);
+    WString_append_count(&f->query, word + base_len, len - base_len);
+    FuzzyMatcher_rank(f, narrow);
+    f->active = true;
+    f->pos = 0;
+}
+
+const wchar_t* FuzzyMatcher_next(FuzzyMatcher* f) {
+    if (f->ranked_count == 0) {
+        return NULL;
+    }
+    if (f->pos >= f->ranked_count) {
+        f->pos = 0;
+    }
+    FuzzyRank* r = &f->ranked[f->pos];
+    f->pos += 1;
+    return f->text.buffer + f->candidates[r->ix].offset;
+}
+
+
 // Adds to global structures
 DynamicMatch* DynamicMatch_create(wchar_t* cmd, enum Invalidation invalidation, wchar_t sep) {
     DynamicMatch* n = Mem_alloc(sizeof(DynamicMatch));
@@ -326,6 +785,8 @@ DynamicMatch* DynamicMatch_create(wchar_t* cmd, enum Invalidation invalidation,
     }
     n->match_count = 0;
     n->matches = NULL;
+    n->result = NULL;
+    n->stale = false;
     n->invalidation = invalidation;
     n->separator = sep;
     n->cmd = cmd;
@@ -347,88 +808,291 @@ DynamicMatch* DynamicMatch_create(wchar_t* cmd, enum Invalidation invalidation,
     return n;
 }
 
-// Adds to global structures
-void DynamicMatch_evaluate(DynamicMatch* ptr) {
-    // Already valid
-    if (ptr->matches != NULL) {
-        return;
-    }
-
-    static wchar_t* empty_match = L"";
-    ptr->match_count = 0;
-    String out;
-    String_create(&out);
-    unsigned long exit_code;
-    if (!subprocess_run(ptr->cmd, &out, 1000, &exit_code, SUBPROCESS_STDERR_NONE)) {
-        String_free(&out);
-        ptr->matches = &empty_match;
-        return;
-    }
-
+// Split the output of a command on `separator` and null characters
+static DynamicResult* DynamicResult_parse(const String* out, wchar_t separator) {
     WString buf;
     if (!WString_create(&buf) ||
-        !WString_from_utf8_bytes(&buf, out.buffer, out.length)) {
-        String_free(&out);
-        ptr->matches = &empty_match;
-        return;
+        !WString_from_utf8_bytes(&buf, out->buffer, out->length)) {
+        return NULL;
     }
-    String_free(&out);
 
-    unsigned size = 0;
+    unsigned count = 0;
+    size_t size = 0;
     unsigned len = 0;
     for (unsigned ix = 0; ix <= buf.length; ++ix) {
-        if (ptr->separator == L'\n' && buf.buffer[ix] == L'\r') {
+        if (separator == L'\n' && buf.buffer[ix] == L'\r') {
             buf.buffer[ix] = L'\n';
         }
-        if (buf.buffer[ix] == L'0' || buf.buffer[ix] == ptr->separator) {
-            if (len == 0) {
-                continue;
+        if (buf.buffer[ix] == L'\0' || buf.buffer[ix] == separator) {
+            if (len > 0 && len <= 0xffff) {
+                size += len + 1;
+                count += 1;
             }
-            size += sizeof(wchar_t*) + sizeof(wchar_t);
             len = 0;
-            ptr->match_count += 1;
             continue;
         }
-        size += sizeof(wchar_t);
         len += 1;
     }
 
-    if (ptr->match_count == 0) { // This avoids potential memory leak of zero-sized allocation.
+    DynamicResult* res = Mem_alloc(sizeof(DynamicResult) + count * sizeof(wchar_t*) +
+                                   size * sizeof(wchar_t));
+    if (res == NULL) {
         WString_free(&buf);
-        ptr->matches = &empty_match;
+        return NULL;
+    }
+    res->refs = 1;
+    res->count = 0;
+    wchar_t* data = (wchar_t*)(res->matches + count);
+    unsigned start = 0;
+    for (unsigned ix = 0; ix <= buf.length; ++ix) {
+        if (buf.buffer[ix] != L'\0' && buf.buffer[ix] != separator) {
+            continue;
+        }
+        len = ix - start;
+        if (len > 0 && len <= 0xffff) {
+            memcpy(data, buf.buffer + start, len * sizeof(wchar_t));
+            data[len] = L'\0';
+            res->matches[res->count] = data;
+            res->count += 1;
+            data += len + 1;
+        }
+        start = ix + 1;
+    }
+    WString_free(&buf);
+
+    // Sorted for prefix lookup in NodeIterator_next
+    uint8_t* tmp = Mem_alloc((res->count / 2 + 1) * sizeof(wchar_t*));
+    if (tmp == NULL) {
+        DynamicResult_release(res);
+        return NULL;
+    }
+    fold_sort((uint8_t*)res->matches, tmp, res->count, sizeof(wchar_t*), string_key);
+    Mem_free(tmp);
+    return res;
+}
+
+static DynamicResult* DynamicResult_run(const wchar_t* cmd, wchar_t separator) {
+    String out;
+    if (!String_create(&out)) {
+        return NULL;
+    }
+    unsigned long exit_code;
+    DynamicResult* res = NULL;
+    if (subprocess_run(cmd, &out, 1000, &exit_code, SUBPROCESS_STDERR_NONE)) {
+        res = DynamicResult_parse(&out, separator);
+    }
+    String_free(&out);
+    return res;
+}
+
+DWORD DynamicCache_worker(void* unused) {
+    Condition_aquire(gDynamic_cond);
+    while (1) {
+        while (gDynamic_queue == NULL && !gDynamic_closing) {
+            Condition_wait(gDynamic_cond, INFINITE);
+        }
+        DynamicEntry* e = gDynamic_queue;
+        if (e == NULL) {
+            break;
+        }
+        gDynamic_queue = e->queue_next;
+        if (gDynamic_queue == NULL) {
+            gDynamic_queue_last = NULL;
+        }
+        Condition_release(gDynamic_cond);
+
+        // Running entries are never evicted, and cmd is never modified
+        DynamicResult* res = DynamicResult_run(e->cmd, e->separator);
+
+        Condition_aquire(gDynamic_cond);
+        e->running = false;
+        DynamicResult_release(e->result);
+        e->result = res;
+        Condition_notify_all(gDynamic_cond);
+    }
+    Condition_release(gDynamic_cond);
+    return 0;
+}
+
+// Move `e` to the front of the lru list, or add it there
+static void DynamicCache_touch(DynamicEntry* e, bool linked) {
+    if (linked) {
+        if (e == gDynamic_first) {
+            return;
+        }
+        e->prev->next = e->next;
+        if (e->next != NULL) {
+            e->next->prev = e->prev;
+        } else {
+            gDynamic_last = e->prev;
+        }
+    }
+    e->prev = NULL;
+    e->next = gDynamic_first;
+    if (gDynamic_first != NULL) {
+        gDynamic_first->prev = e;
+    } else {
+        gDynamic_last = e;
+    }
+    gDynamic_first = e;
+}
+
+// Drop least recently used entries that are not running
+static void DynamicCache_evict() {
+    DynamicEntry* e = gDynamic_last;
+    while (gDynamic_cached > DYNAMIC_CACHE_SIZE && e != NULL) {
+        DynamicEntry* prev = e->prev;
+        if (!e->running) {
+            if (prev != NULL) {
+                prev->next = e->next;
+            } else {
+                gDynamic_first = e->next;
+            }
+            if (e->next != NULL) {
+                e->next->prev = prev;
+            } else {
+                gDynamic_last = prev;
+            }
+            WHashMap_Remove(&gDynamic_cache, e->key);
+            DynamicEntry_free(e);
+            gDynamic_cached -= 1;
+        }
+        e = prev;
+    }
+}
+
+// Find or create the entry of `ptr` for the current working directory
+static DynamicEntry* DynamicCache_find(DynamicMatch* ptr) {
+    WString key;
+    if (!WString_create(&key)) {
+        return NULL;
+    }
+    WString_append(&key, ptr->separator);
+    WString_extend(&key, ptr->cmd);
+    if (ptr->invalidation != INVALID_NEVER) {
+        WString_append(&key, L'\x1');
+        WString_append_count(&key, gDynamic_workdir.buffer, gDynamic_workdir.length);
+    }
+
+    WHashElement* elem = WHashMap_Get(&gDynamic_cache, key.buffer);
+    if (elem == NULL) {
+        WString_free(&key);
+        return NULL;
+    }
+    DynamicEntry* e = elem->value;
+    if (e != NULL) {
+        WString_free(&key);
+        DynamicCache_touch(e, true);
+        return e;
+    }
+
+    WString cmd;
+    e = Mem_alloc(sizeof(DynamicEntry));
+    if (e == NULL) {
+        goto fail;
+    }
+    if (!WString_create(&cmd)) {
+        Mem_free(e);
+        goto fail;
+    }
+    if (!WString_extend(&cmd, ptr->cmd)) {
+        WString_free(&cmd);
+        Mem_free(e);
+        goto fail;
+    }
+    e->key = key.buffer;
+    e->cmd = cmd.buffer;
+    e->separator = ptr->separator;
+    e->result = NULL;
+    e->epoch = 0;
+    e->started = false;
+    e->running = false;
+    e->queue_next = NULL;
+    elem->value = e;
+    DynamicCache_touch(e, false);
+    gDynamic_cached += 1;
+    DynamicCache_evict();
+    return e;
+fail:
+    WHashMap_Remove(&gDynamic_cache, key.buffer);
+    WString_free(&key);
+    return NULL;
+}
+
+// Queue a run of `e` unless its output is still valid under `invalidation`
+static void DynamicCache_revalidate(DynamicEntry* e, enum Invalidation invalidation) {
+    if (e->running) {
+        return;
+    }
+    if (e->started) {
+        if (invalidation == INVALID_NEVER) {
+            return;
+        }
+        if (invalidation == INVALID_CHDIR && e->epoch >= gDynamic_chdir_epoch) {
+            return;
+        }
+        if (invalidation == INVALID_ALWAYS && e->epoch == gDynamic_epoch) {
+            return;
+        }
+    }
+    if (gDynamic_worker_count < DYNAMIC_WORKERS) {
+        HANDLE t = CreateThread(NULL, 0, DynamicCache_worker, NULL, 0, NULL);
+        if (t != NULL) {
+            gDynamic_workers[gDynamic_worker_count++] = t;
+        }
+    }
+    if (gDynamic_worker_count == 0) {
         return;
     }
+    e->started = true;
+    e->running = true;
+    e->epoch = gDynamic_epoch;
+    e->queue_next = NULL;
+    if (gDynamic_queue_last == NULL) {
+        gDynamic_queue = e;
+    } else {
+        gDynamic_queue_last->queue_next = e;
+    }
+    gDynamic_queue_last = e;
+    Condition_notify_all(gDynamic_cond);
+}
 
-    unsigned char* b = Mem_alloc(size);
-    if (b == 0) {
-        WString_free(&buf);
-        ptr->matches = &empty_match;
+void DynamicMatch_prefetch(DynamicMatch* ptr) {
+    if (gDynamic_cond == NULL) {
         return;
     }
-    wchar_t* data = (wchar_t*)(b + ptr->match_count * sizeof(wchar_t*));
-    ptr->matches = (wchar_t**) b;
+    Condition_aquire(gDynamic_cond);
+    DynamicEntry* e = DynamicCache_find(ptr);
+    if (e != NULL) {
+        DynamicCache_revalidate(e, ptr->invalidation);
+    }
+    Condition_release(gDynamic_cond);
+}
 
-    ptr->match_count = 0;
-    wchar_t* last_data = data;
-    len = 0;
-    for (unsigned ix = 0; ix <= buf.length; ++ix) {
-        if (buf.buffer[ix] == L'0' || buf.buffer[ix] == ptr->separator) {
-            if (len == 0 || len > 0xffff) {
-                continue;
-            }
-            ptr->matches[ptr->match_count] = last_data;
-            ptr->match_count += 1;
-            *data = L'\0';
-            ++data;
-            last_data = data;
-            len = 0;
-            continue;
+void MatchNode_prefetch(MatchNode* node) {
+    for (unsigned ix = 0; ix < node->match_count; ++ix) {
+        if (node->matches[ix].type == MATCH_DYNAMIC) {
+            DynamicMatch_prefetch(node->matches[ix].dynamic_match);
         }
-        *data = buf.buffer[ix];
-        ++data;
-        len += 1;
     }
+}
+
+// Point `matches` at `res` and add them to global structures
+static void DynamicMatch_install(DynamicMatch* ptr, DynamicResult* res) {
+    static wchar_t* empty_match = L"";
+    ptr->result = res;
+    if (res == NULL || res->count == 0) {
+        ptr->matches = &empty_match;
+        ptr->match_count = 0;
+        return;
+    }
+    ptr->matches = res->matches;
+    ptr->match_count = res->count;
 
+    WString buf;
+    if (!WString_create(&buf)) {
+        return;
+    }
     for (int j = 0; j < ptr->node_count; ++j) {
         wchar_t* hash_postfix = ptr->nodes[j].parent->hash_postfix;
         for (unsigned ix = 0; ix < ptr->match_count; ++ix) {
@@ -437,21 +1101,70 @@ void DynamicMatch_evaluate(DynamicMatch* ptr) {
             WString_append_count(&buf, hash_postfix, HASH_POSTFIX_LEN);
 
             WHashElement* entry = WHashMap_Get(&gNodes, buf.buffer);
-            if (entry->value == NULL) {
+            if (entry != NULL && entry->value == NULL) {
                 entry->value = ptr->nodes[j].match;
             }
         }
     }
-
     WString_free(&buf);
 }
 
-void DynamicMatch_invalidate_many(bool chdir) {
+void DynamicMatch_evaluate(DynamicMatch* ptr) {
+    if (ptr->matches != NULL && !ptr->stale) {
+        return;
+    }
+    if (gDynamic_cond == NULL) {
+        return;
+    }
+
+    Condition_aquire(gDynamic_cond);
+    DynamicEntry* e = DynamicCache_find(ptr);
+    DynamicResult* res = NULL;
+    bool running = false;
+    if (e != NULL) {
+        DynamicCache_revalidate(e, ptr->invalidation);
+        // Nothing to serve yet, wait for the first run
+        uint64_t deadline = GetTickCount64() + 1000;
+        while (e->running && e->result == NULL) {
+            uint64_t now = GetTickCount64();
+            if (now >= deadline || !Condition_wait(gDynamic_cond, deadline - now)) {
+                break;
+            }
+        }
+        res = e->result;
+        running = e->running;
+        if (res != NULL) {
+            InterlockedIncrement(&res->refs);
+        }
+    }
+    Condition_release(gDynamic_cond);
+
+    // Keep checking for the output of a run in progress
+    ptr->stale = running;
+    if (ptr->matches != NULL && res == ptr->result) {
+        DynamicResult_release(res);
+        return;
+    }
+    DynamicMatch_invalidate(ptr);
+    DynamicMatch_install(ptr, res);
+}
+
+void DynamicMatch_invalidate_many(bool chdir, const wchar_t* workdir) {
+    gDynamic_epoch += 1;
+    if (chdir) {
+        gDynamic_chdir_epoch = gDynamic_epoch;
+        WString_clear(&gDynamic_workdir);
+        WString_extend(&gDynamic_workdir, workdir);
+    }
     for (unsigned ix = 0; ix < gDynamic_count; ++ix) {
         DynamicMatch* dyn = gDynamic_matches[ix];
         if (dyn->invalidation == INVALID_ALWAYS ||
             (chdir && dyn->invalidation == INVALID_CHDIR)) {
-            DynamicMatch_invalidate(dyn);
+            dyn->stale = true;
+            // Refresh the ones that have been used while the user types
+            if (dyn->matches != NULL) {
+                DynamicMatch_prefetch(dyn);
+            }
         }
     }
 }
@@ -460,10 +1173,6 @@ void DynamicMatch_invalidate(DynamicMatch* ptr) {
     if (ptr->matches == NULL) {
         return;
     }
-    if (ptr->match_count == 0) {
-        ptr->matches = NULL;
-        return;
-    }
     WString buf;
     WString_create_capacity(&buf, 20);
 
@@ -482,7 +1191,8 @@ void DynamicMatch_invalidate(DynamicMatch* ptr) {
     }
 
     WString_free(&buf);
-    Mem_free(ptr->matches);
+    DynamicResult_release(ptr->result);
+    ptr->result = NULL;
     ptr->matches = NULL;
     ptr->match_count = 0;
 }
@@ -505,6 +1215,7 @@ bool NodeBuilder_create(NodeBuilder* builder) {
     node->match_count = 0;
     node->file_ix = -1;
     node->any_ix = -1;
+    node->static_count = 0;
 
     builder->node = node;
     builder->node_cap = 0;
@@ -604,6 +1315,7 @@ void NodeBuilder_abort(NodeBuilder* builder) {
         if (m->type == MATCH_STATIC) {
             WString s;
             s.buffer = m->static_match;
+            s.allocator = NULL;
             WString_free(&s);
         }
     }
@@ -622,11 +1334,46 @@ MatchNode* NodeBuilder_finalize(NodeBuilder* builder) {
     WString hashbuf;
     WString_create(&hashbuf);
 
+    node->id = UINT_MAX;
     if (RESERVE(&gNode_list, &gNode_capacity, gNode_count + 1, MatchNode*)) {
+        node->id = gNode_count;
         gNode_list[gNode_count] = node;
         gNode_count += 1;
     }
 
+    // Move static matches first and sort them. Without memory for this
+    // they are just searched linearly.
+    Match* tmp = NULL;
+    if (node->match_count > 0) {
+        tmp = Mem_alloc(node->match_count * sizeof(Match));
+    }
+    if (tmp != NULL) {
+        unsigned count = 0;
+        for (unsigned i = 0; i < node->match_count; ++i) {
+            if (node->matches[i].type == MATCH_STATIC) {
+                tmp[count++] = node->matches[i];
+            }
+        }
+        node->static_count = count;
+        for (unsigned i = 0; i < node->match_count; ++i) {
+            if (node->matches[i].type != MATCH_STATIC) {
+                tmp[count++] = node->matches[i];
+            }
+        }
+        memcpy(node->matches, tmp, node->match_count * sizeof(Match));
+        fold_sort((uint8_t*)node->matches, (uint8_t*)tmp, node->static_count, sizeof(Match),
+                  match_key);
+        Mem_free(tmp);
+        for (unsigned i = node->static_count; i < node->match_count; ++i) {
+            unsigned type = node->matches[i].type;
+            if (type == MATCH_ANY_FILE || type == MATCH_EXISTING_FILE) {
+                node->file_ix = i;
+            } else if (type == MATCH_ANY) {
+                node->any_ix = i;
+            }
+        }
+    }
+
     for (unsigned i = 0; i < node->match_count; ++i) {
         if (node->matches[i].type == MATCH_STATIC) {
             WString_extend(&hashbuf, node->matches[i].static_match);
@@ -665,7 +1412,13 @@ Match* find_next_match(MatchNode* current, wchar_t* str, unsigned len) {
     str[len + 4] = current->hash_postfix[4];
     str[len + 5] = L'\0';
     // This finds all static and dynamic matches
-    Match* match = WHashMap_Value(&gNodes, str);
+    Match* match = NULL;
+    if (gGraph_map != NULL) {
+        match = WHashMap_Value(gGraph_map, str);
+    }
+    if (match == NULL) {
+        match = WHashMap_Value(&gNodes, str);
+    }
     str[len] = L'\0';
     if (match != NULL) {
         return match;
@@ -700,12 +1453,6 @@ MatchNode* find_final(const wchar_t *cmd, size_t* offset, WString* rem) {
     unsigned options = ARG_OPTION_TERMINAL_OPERANDS | 
                        ARG_OPTION_BACKSLASH_ESCAPE;
 
-    for (unsigned ix = 0; ix < current->match_count; ++ix) {
-        if (current->matches[ix].type == MATCH_DYNAMIC) {
-            DynamicMatch_evaluate(current->matches[ix].dynamic_match);
-        }
-    }
-
     while (get_arg_len(cmd, &pos, &len, &quoted, options)) {
         if (cmd[pos] == L'\0') {
             // This argument should be prefix for final
@@ -752,17 +1499,441 @@ MatchNode* find_final(const wchar_t *cmd, size_t* offset, WString* rem) {
             }
         }
 
+        // Dynamic matches have to be hashed to find the next node
+        for (unsigned ix = 0; ix < current->match_count; ++ix) {
+            if (current->matches[ix].type == MATCH_DYNAMIC) {
+                DynamicMatch_evaluate(current->matches[ix].dynamic_match);
+            }
+        }
         Match* next = find_next_match(current, rem->buffer, len);
         if (next != NULL) {
             current = next->child;
-            for (unsigned ix = 0; ix < current->match_count; ++ix) {
-                if (current->matches[ix].type == MATCH_DYNAMIC) {
-                    DynamicMatch_evaluate(current->matches[ix].dynamic_match);
-                }
-            }
+            // Start the commands of the next word, which are only waited
+            // for once they are needed
+            MatchNode_prefetch(current);
         }
     }
     *offset = pos;
     WString_clear(rem);
     return current;
 }
+
+
+#define GRAPH_MAGIC 0x47504341
+#define GRAPH_VERSION 1
+#define GRAPH_MAX_SIZE 0x40000000
+
+// Start of a compiled graph. Pointers in the sections are stored as
+// indices, or for strings as offsets into the string section, and are
+// replaced on load. Sections are 8 byte aligned.
+typedef struct GraphHeader {
+    uint32_t magic;
+    uint32_t version;
+    // The blob is only read by the same build that wrote it
+    uint32_t node_size;
+    uint32_t match_size;
+    uint64_t size;
+    GraphStamp stamp;
+
+    uint64_t nodes;
+    uint64_t matches;
+    uint64_t dynamics;
+    uint64_t map;
+    uint64_t buckets;
+    uint64_t elements;
+    uint64_t strings;
+    uint32_t node_count;
+    uint32_t match_count;
+    uint32_t dynamic_count;
+    uint32_t bucket_count;
+    uint32_t element_count;
+    uint32_t string_count;
+    uint32_t root;
+} GraphHeader;
+
+typedef struct GraphDynamic {
+    uint64_t cmd;
+    uint32_t invalidation;
+    uint32_t separator;
+} GraphDynamic;
+
+#define GRAPH_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+static uint64_t graph_add_string(wchar_t* strings, uint64_t* pos, const wchar_t* s) {
+    uint64_t start = *pos;
+    uint64_t len = wcslen(s) + 1;
+    memcpy(strings + start, s, len * sizeof(wchar_t));
+    *pos += len;
+    return start;
+}
+
+static bool graph_write(const wchar_t* path, const uint8_t* blob, uint64_t size) {
+    WString tmp;
+    if (!WString_create(&tmp)) {
+        return false;
+    }
+    WString_extend(&tmp, path);
+    WString_extend(&tmp, L".tmp");
+    // Without sharing, so concurrent writers fail instead of mixing
+    HANDLE file = CreateFileW(tmp.buffer, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        WString_free(&tmp);
+        return false;
+    }
+    uint64_t written = 0;
+    while (written < size) {
+        DWORD w;
+        DWORD chunk = size - written > 0x1000000 ? 0x1000000 : size - written;
+        if (!WriteFile(file, blob + written, chunk, &w, NULL) || w == 0) {
+            break;
+        }
+        written += w;
+    }
+    CloseHandle(file);
+    bool res = written == size && MoveFileExW(tmp.buffer, path, MOVEFILE_REPLACE_EXISTING);
+    if (!res) {
+        DeleteFileW(tmp.buffer);
+    }
+    WString_free(&tmp);
+    return res;
+}
+
+bool MatchNode_save_graph(const wchar_t* path, const GraphStamp* stamp) {
+    if (gRoot == NULL || gGraph != NULL || gRoot->id >= gNode_count) {
+        return false;
+    }
+
+    // Static part of gNodes, rebuilt with global match indices as values
+    WHashMap map;
+    if (!WHashMap_Create(&map)) {
+        return false;
+    }
+    uint8_t* blob = NULL;
+    uint64_t match_count = 0;
+    uint64_t string_count = 0;
+    WString hashbuf;
+    WString_create(&hashbuf);
+    for (uint32_t ix = 0; ix < gNode_count; ++ix) {
+        MatchNode* node = gNode_list[ix];
+        // Their children are changed while completing
+        if (node == gAny_file || node == gExisting_file) {
+            continue;
+        }
+        for (unsigned i = 0; i < node->match_count; ++i) {
+            Match* m = &node->matches[i];
+            if (m->child->id >= gNode_count || gNode_list[m->child->id] != m->child) {
+                goto fail;
+            }
+            if (m->type == MATCH_STATIC) {
+                string_count += wcslen(m->static_match) + 1;
+                WString_clear(&hashbuf);
+                WString_extend(&hashbuf, m->static_match);
+                WString_append_count(&hashbuf, node->hash_postfix, HASH_POSTFIX_LEN);
+                if (!WHashMap_Insert(&map, hashbuf.buffer, (void*)(uintptr_t)(match_count + i))) {
+                    goto fail;
+                }
+            }
+        }
+        match_count += node->match_count;
+    }
+    for (uint32_t b = 0; b < map.bucket_count; ++b) {
+        for (uint32_t e = 0; e < map.buckets[b].size; ++e) {
+            string_count += wcslen(map.buckets[b].data[e].key) + 1;
+        }
+    }
+    for (uint32_t ix = 0; ix < gDynamic_count; ++ix) {
+        string_count += wcslen(gDynamic_matches[ix]->cmd) + 1;
+    }
+
+    GraphHeader h;
+    memset(&h, 0, sizeof(h));
+    h.magic = GRAPH_MAGIC;
+    h.version = GRAPH_VERSION;
+    h.node_size = sizeof(MatchNode);
+    h.match_size = sizeof(Match);
+    h.stamp = *stamp;
+    h.node_count = gNode_count;
+    h.match_count = match_count;
+    h.dynamic_count = gDynamic_count;
+    h.bucket_count = map.bucket_count;
+    h.element_count = map.element_count;
+    h.string_count = string_count;
+    h.root = gRoot->id;
+    h.nodes = GRAPH_ALIGN(sizeof(GraphHeader));
+    h.matches = GRAPH_ALIGN(h.nodes + h.node_count * sizeof(MatchNode));
+    h.dynamics = GRAPH_ALIGN(h.matches + match_count * sizeof(Match));
+    h.map = GRAPH_ALIGN(h.dynamics + h.dynamic_count * sizeof(GraphDynamic));
+    h.buckets = GRAPH_ALIGN(h.map + sizeof(WHashMap));
+    h.elements = GRAPH_ALIGN(h.buckets + h.bucket_count * sizeof(WHashBucket));
+    h.strings = GRAPH_ALIGN(h.elements + h.element_count * sizeof(WHashElement));
+    h.size = GRAPH_ALIGN(h.strings + string_count * sizeof(wchar_t));
+    if (h.size > GRAPH_MAX_SIZE) {
+        goto fail;
+    }
+    blob = Mem_alloc(h.size);
+    if (blob == NULL) {
+        goto fail;
+    }
+    memset(blob, 0, h.size);
+    memcpy(blob, &h, sizeof(h));
+
+    MatchNode* nodes = (MatchNode*)(blob + h.nodes);
+    Match* matches = (Match*)(blob + h.matches);
+    GraphDynamic* dynamics = (GraphDynamic*)(blob + h.dynamics);
+    wchar_t* strings = (wchar_t*)(blob + h.strings);
+    uint64_t string_pos = 0;
+    uint64_t match_pos = 0;
+    for (uint32_t ix = 0; ix < gNode_count; ++ix) {
+        MatchNode* node = gNode_list[ix];
+        nodes[ix] = *node;
+        nodes[ix].matches = (Match*)(uintptr_t)match_pos;
+        if (node == gAny_file || node == gExisting_file) {
+            nodes[ix].match_count = 0;
+            nodes[ix].static_count = 0;
+            nodes[ix].file_ix = -1;
+            nodes[ix].any_ix = -1;
+            continue;
+        }
+        for (unsigned i = 0; i < node->match_count; ++i) {
+            Match* m = &matches[match_pos + i];
+            *m = node->matches[i];
+            m->child = (MatchNode*)(uintptr_t)node->matches[i].child->id;
+            if (m->type == MATCH_STATIC) {
+                uint64_t off = graph_add_string(strings, &string_pos, m->static_match);
+                m->static_match = (wchar_t*)(uintptr_t)off;
+            } else if (m->type == MATCH_DYNAMIC) {
+                uint32_t d = 0;
+                while (gDynamic_matches[d] != m->dynamic_match) {
+                    ++d;
+                }
+                m->dynamic_match = (DynamicMatch*)(uintptr_t)d;
+            }
+        }
+        match_pos += node->match_count;
+    }
+    for (uint32_t ix = 0; ix < gDynamic_count; ++ix) {
+        DynamicMatch* dyn = gDynamic_matches[ix];
+        dynamics[ix].cmd = graph_add_string(strings, &string_pos, dyn->cmd);
+        dynamics[ix].invalidation = dyn->invalidation;
+        dynamics[ix].separator = dyn->separator;
+    }
+
+    WHashMap* frozen = (WHashMap*)(blob + h.map);
+    WHashBucket* buckets = (WHashBucket*)(blob + h.buckets);
+    WHashElement* elements = (WHashElement*)(blob + h.elements);
+    frozen->bucket_count = map.bucket_count;
+    frozen->element_count = map.element_count;
+    uint32_t elem_pos = 0;
+    for (uint32_t b = 0; b < map.bucket_count; ++b) {
+        buckets[b].data = (WHashElement*)(uintptr_t)elem_pos;
+        buckets[b].size = map.buckets[b].size;
+        for (uint32_t e = 0; e < map.buckets[b].size; ++e) {
+            uint64_t off = graph_add_string(strings, &string_pos, map.buckets[b].data[e].key);
+            WHashElement el = {(wchar_t*)(uintptr_t)off, map.buckets[b].data[e].value};
+            memcpy(&elements[elem_pos], &el, sizeof(WHashElement));
+            ++elem_pos;
+        }
+    }
+
+    bool res = graph_write(path, blob, h.size);
+    Mem_free(blob);
+    WString_free(&hashbuf);
+    WHashMap_Free(&map);
+    return res;
+fail:
+    WString_free(&hashbuf);
+    WHashMap_Free(&map);
+    return false;
+}
+
+// Turn the indices and offsets of `blob` into pointers, checking that all
+// of them are in bounds
+static bool graph_relocate(uint8_t* blob) {
+    GraphHeader* h = (GraphHeader*)blob;
+    if (h->nodes < sizeof(GraphHeader) ||
+        h->nodes + (uint64_t)h->node_count * sizeof(MatchNode) > h->matches ||
+        h->matches + (uint64_t)h->match_count * sizeof(Match) > h->dynamics ||
+        h->dynamics + (uint64_t)h->dynamic_count * sizeof(GraphDynamic) > h->map ||
+        h->map + sizeof(WHashMap) > h->buckets ||
+        h->buckets + (uint64_t)h->bucket_count * sizeof(WHashBucket) > h->elements ||
+        h->elements + (uint64_t)h->element_count * sizeof(WHashElement) > h->strings ||
+        h->strings + (uint64_t)h->string_count * sizeof(wchar_t) > h->size ||
+        ((h->nodes | h->matches | h->dynamics | h->map | h->buckets | h->elements) & 7) != 0) {
+        return false;
+    }
+    // Every string ends inside the section
+    wchar_t* strings = (wchar_t*)(blob + h->strings);
+    if ((h->string_count > 0 && strings[h->string_count - 1] != L'\0') ||
+        h->root >= h->node_count || h->bucket_count == 0) {
+        return false;
+    }
+
+    MatchNode* nodes = (MatchNode*)(blob + h->nodes);
+    Match* matches = (Match*)(blob + h->matches);
+    // Matches are stored node after node, so no match is shared by two nodes
+    uint64_t next = 0;
+    for (uint32_t ix = 0; ix < h->node_count; ++ix) {
+        MatchNode* node = &nodes[ix];
+        uint64_t first = (uintptr_t)node->matches;
+        if (first != next || node->match_count > h->match_count - first ||
+            node->static_count > node->match_count ||
+            node->file_ix < -1 || node->file_ix >= (int)node->match_count ||
+            node->any_ix < -1 || node->any_ix >= (int)node->match_count) {
+            return false;
+        }
+        // Lookups trust the types these point at
+        Match* own = matches + first;
+        for (unsigned i = 0; i < node->static_count; ++i) {
+            if (own[i].type != MATCH_STATIC) {
+                return false;
+            }
+        }
+        if ((node->file_ix >= 0 && own[node->file_ix].type != MATCH_EXISTING_FILE &&
+             own[node->file_ix].type != MATCH_ANY_FILE) ||
+            (node->any_ix >= 0 && own[node->any_ix].type != MATCH_ANY)) {
+            return false;
+        }
+        node->matches = own;
+        node->id = ix;
+        next += node->match_count;
+    }
+    for (uint32_t ix = 0; ix < h->match_count; ++ix) {
+        Match* m = &matches[ix];
+        uint64_t child = (uintptr_t)m->child;
+        if (child >= h->node_count || m->type > MATCH_ANY) {
+            return false;
+        }
+        m->child = &nodes[child];
+        if (m->type == MATCH_STATIC) {
+            uint64_t off = (uintptr_t)m->static_match;
+            if (off >= h->string_count) {
+                return false;
+            }
+            m->static_match = strings + off;
+        } else if (m->type == MATCH_DYNAMIC && (uintptr_t)m->dynamic_match >= h->dynamic_count) {
+            return false;
+        }
+    }
+    GraphDynamic* dynamics = (GraphDynamic*)(blob + h->dynamics);
+    for (uint32_t ix = 0; ix < h->dynamic_count; ++ix) {
+        if (dynamics[ix].cmd >= h->string_count || dynamics[ix].invalidation > INVALID_CHDIR) {
+            return false;
+        }
+    }
+
+    WHashMap* map = (WHashMap*)(blob + h->map);
+    WHashBucket* buckets = (WHashBucket*)(blob + h->buckets);
+    WHashElement* elements = (WHashElement*)(blob + h->elements);
+    if (map->bucket_count != h->bucket_count || map->element_count != h->element_count) {
+        return false;
+    }
+    for (uint32_t b = 0; b < h->bucket_count; ++b) {
+        uint64_t first = (uintptr_t)buckets[b].data;
+        if (first > h->element_count || buckets[b].size > h->element_count - first) {
+            return false;
+        }
+        buckets[b].data = elements + first;
+        buckets[b].capacity = 0;
+    }
+    for (uint32_t e = 0; e < h->element_count; ++e) {
+        uint64_t key = (uintptr_t)elements[e].key;
+        uint64_t value = (uintptr_t)elements[e].value;
+        if (key >= h->string_count || value >= h->match_count) {
+            return false;
+        }
+        WHashElement el = {strings + key, matches + value};
+        memcpy(&elements[e], &el, sizeof(WHashElement));
+    }
+    map->buckets = buckets;
+    map->allocator = NULL;
+    return true;
+}
+
+bool MatchNode_load_graph(const wchar_t* path, GraphStamp* stamp) {
+    if (gRoot != NULL || gGraph != NULL || gDynamic_count != 0) {
+        return false;
+    }
+    HANDLE file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                              FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    GraphHeader h;
+    DWORD r;
+    uint8_t* blob = NULL;
+    if (!ReadFile(file, &h, sizeof(h), &r, NULL) || r != sizeof(h) ||
+        h.magic != GRAPH_MAGIC || h.version != GRAPH_VERSION ||
+        h.node_size != sizeof(MatchNode) || h.match_size != sizeof(Match) ||
+        h.stamp.mtime != stamp->mtime || h.stamp.size != stamp->size ||
+        h.size < sizeof(h) || h.size > GRAPH_MAX_SIZE) {
+        goto fail;
+    }
+    blob = Mem_alloc(h.size);
+    if (blob == NULL) {
+        goto fail;
+    }
+    memcpy(blob, &h, sizeof(h));
+    uint64_t read = sizeof(h);
+    while (read < h.size) {
+        if (!ReadFile(file, blob + read, h.size - read, &r, NULL) || r == 0) {
+            goto fail;
+        }
+        read += r;
+    }
+    CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+    if (!graph_relocate(blob)) {
+        goto fail;
+    }
+
+    // Dynamic matches keep their own state, so they are the only part
+    // that is allocated
+    GraphDynamic* dynamics = (GraphDynamic*)(blob + h.dynamics);
+    wchar_t* strings = (wchar_t*)(blob + h.strings);
+    for (uint32_t ix = 0; ix < h.dynamic_count; ++ix) {
+        WString cmd;
+        if (!WString_create(&cmd) || !WString_extend(&cmd, strings + dynamics[ix].cmd)) {
+            goto fail;
+        }
+        if (DynamicMatch_create(cmd.buffer, dynamics[ix].invalidation,
+                                dynamics[ix].separator) == NULL) {
+            WString_free(&cmd);
+            goto fail;
+        }
+    }
+    MatchNode* nodes = (MatchNode*)(blob + h.nodes);
+    for (uint32_t ix = 0; ix < h.node_count; ++ix) {
+        MatchNode* node = &nodes[ix];
+        for (unsigned i = 0; i < node->match_count; ++i) {
+            Match* m = &node->matches[i];
+            if (m->type != MATCH_DYNAMIC) {
+                continue;
+            }
+            DynamicMatch* dyn = gDynamic_matches[(uintptr_t)m->dynamic_match];
+            m->dynamic_match = dyn;
+            if (!RESERVE(&dyn->nodes, &dyn->node_capacity, dyn->node_count + 1, *dyn->nodes)) {
+                goto fail;
+            }
+            dyn->nodes[dyn->node_count].parent = node;
+            dyn->nodes[dyn->node_count].match = m;
+            dyn->node_count += 1;
+        }
+    }
+
+    memcpy(stamp->extra, h.stamp.extra, sizeof(stamp->extra));
+    gGraph = blob;
+    gGraph_map = (WHashMap*)(blob + h.map);
+    gRoot = &nodes[h.root];
+    return true;
+fail:
+    if (file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file);
+    }
+    // Dynamic matches created so far point into the blob
+    dynamic_matches_free();
+    if (blob != NULL) {
+        Mem_free(blob);
+    }
+    return false;
+}
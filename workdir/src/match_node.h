@@ -15,15 +15,23 @@ enum Invalidation {
 
 #define HASH_POSTFIX_LEN 5
 
+// Number of (cmd, workdir) outputs kept by the dynamic match cache
+#define DYNAMIC_CACHE_SIZE 64
+// Threads running dynamic match commands in the background
+#define DYNAMIC_WORKERS 2
+
 struct MatchNode;
 struct Match;
+struct DynamicResult;
 
 typedef struct DynamicMatch {
-    // First is length of first string, followed by first string
-    // After that, length of second string etc...
     wchar_t** matches; // NULL when invalidated
     wchar_t* cmd;
     unsigned match_count;
+    // Cached output `matches` points into, NULL if there is none
+    struct DynamicResult* result;
+    // Look for newer output in the cache on next use
+    bool stale;
 
     // List of postfix and child for all nodes contaning this 
     struct {
@@ -56,13 +64,21 @@ typedef struct MatchNode {
     int file_ix;
     int any_ix;
 
+    // The first `static_count` matches are MATCH_STATIC, sorted
+    // case-insensitively so the ones with a given prefix form a range
+    unsigned static_count;
+
     wchar_t hash_postfix[HASH_POSTFIX_LEN]; // Postfix used in global hashmap for finding next node
+
+    unsigned id; // Index in the list of all nodes
 } MatchNode;
 
 typedef struct NodeIterator {
     MatchNode* node;
     unsigned ix;
     unsigned dyn_ix;
+    unsigned static_ix;
+    unsigned static_start;
     bool walk_ongoing;
     WalkCtx walk_ctx;
     WString prefix;
@@ -70,6 +86,52 @@ typedef struct NodeIterator {
     wchar_t* path_start;
 } NodeIterator;
 
+// Upper limit of candidates gathered by FuzzyMatcher
+#define FUZZY_MAX_CANDIDATES (1 << 20)
+
+typedef struct FuzzyCandidate {
+    unsigned offset; // Into `text` of the matcher
+    unsigned length;
+    unsigned start; // Matching starts after the part given by `base`
+} FuzzyCandidate;
+
+typedef struct FuzzyRank {
+    int score;
+    unsigned length;
+    unsigned ix;
+} FuzzyRank;
+
+// Ranks the candidates of a node by how well the typed word matches them
+// as a subsequence. Candidates are gathered once for the directory part
+// of the word, `base`, and only re-filtered while the rest changes.
+typedef struct FuzzyMatcher {
+    MatchNode* node;
+    WString base;
+    WString query;
+
+    WString text; // Null-terminated candidates
+    FuzzyCandidate* candidates;
+    uint64_t* masks; // Characters present in each candidate
+    unsigned count;
+    unsigned capacity;
+    unsigned mask_capacity;
+
+    // Candidates matching `query`, best first
+    FuzzyRank* ranked;
+    unsigned ranked_count;
+    unsigned ranked_capacity;
+    unsigned pos;
+    bool active;
+} FuzzyMatcher;
+
+// Identifies the source of a compiled graph
+typedef struct GraphStamp {
+    uint64_t mtime;
+    uint64_t size;
+    // Stored with the graph and returned unchanged
+    uint8_t extra[8];
+} GraphStamp;
+
 typedef struct NodeBuilder {
     MatchNode* node;
     unsigned node_cap;
@@ -88,14 +150,33 @@ void MatchNode_free();
 
 void MatchNode_set_root(MatchNode* root);
 
+// Write the graph built with NodeBuilder to `path` as one relocatable
+// blob, together with its static part of `gNodes`
+bool MatchNode_save_graph(const wchar_t* path, const GraphStamp* stamp);
+
+// Replace the empty graph with the one in `path`, if it was saved with
+// the same mtime and size as `stamp`. Fills in `stamp->extra`.
+bool MatchNode_load_graph(const wchar_t* path, GraphStamp* stamp);
+
 
 DynamicMatch* DynamicMatch_create(wchar_t* cmd, enum Invalidation invalidation, wchar_t sep);
 
+// Make `matches` valid. Serves cached output even if it is stale, only
+// waits for the command when nothing is cached for it yet.
 void DynamicMatch_evaluate(DynamicMatch* ptr);
 
+// Start running the command in the background unless the cached output
+// is still valid
+void DynamicMatch_prefetch(DynamicMatch* ptr);
+
 void DynamicMatch_invalidate(DynamicMatch* ptr);
 
-void DynamicMatch_invalidate_many(bool chdir);
+// Called for every new prompt. Marks matches stale according to their
+// Invalidation and revalidates the ones in use in the background.
+void DynamicMatch_invalidate_many(bool chdir, const wchar_t* workdir);
+
+// Prefetch all dynamic matches of `node`
+void MatchNode_prefetch(MatchNode* node);
 
 
 void NodeIterator_begin(NodeIterator* it, MatchNode* node, const wchar_t* prefix);
@@ -106,6 +187,15 @@ void NodeIterator_stop(NodeIterator* it);
 
 void NodeIterator_restart(NodeIterator* it);
 
+void FuzzyMatcher_init(FuzzyMatcher* f);
+// Rank the candidates of `node` for `word`, reusing the ones from the
+// previous call when possible
+void FuzzyMatcher_begin(FuzzyMatcher* f, MatchNode* node, const wchar_t* word);
+// Next candidate by rank, starting over after the last one. Returns NULL
+// if nothing matches.
+const wchar_t* FuzzyMatcher_next(FuzzyMatcher* f);
+void FuzzyMatcher_free(FuzzyMatcher* f);
+
 
 bool NodeBuilder_create(NodeBuilder* builder);
 
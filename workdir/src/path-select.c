@@ -240,6 +240,7 @@ int main() {
     buf.buffer = NULL;
     buf.length = 0;
     buf.capacity = 0;
+    buf.allocator = NULL;
     if (get_envvar(L"PATH", 2048, &buf)) {
         unsigned count;
         wchar_t** path_parts = split_path(&buf, &count);
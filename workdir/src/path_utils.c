@@ -120,6 +120,7 @@ OString *read_envvar(const ochar_t* name, EnvBuffer *env) {
     env->vars[env->size].val.buffer = NULL;
     env->vars[env->size].val.capacity = 100;
     env->vars[env->size].val.length = 0;
+    env->vars[env->size].val.allocator = NULL;
     if (get_envvar(name, 0, &(env->vars[env->size].val))) {
         DWORD len = (ostrlen(name) + 1) * sizeof(ochar_t);
         ochar_t* new_name = Mem_alloc(len);
@@ -364,6 +365,7 @@ OpStatus path_prune(PathBuffer *path) {
     path->buffer = res.buffer;
     path->length = res.length;
     path->capacity = res.capacity;
+    path->allocator = res.allocator;
 
     return final_status;
 }
@@ -1927,6 +1927,7 @@ void Regex_free(Regex *regex) {
     Mem_free(regex->nfa.edges);
     String s;
     s.buffer = regex->chars;
+    s.allocator = NULL;
     String_free(&s);
     if (regex->dfa != NULL) {
         for (uint32_t i = 0; i < regex->dfa_nodes; ++i) {
@@ -0,0 +1,140 @@
+#include "match_node.h"
+#include "printf.h"
+#include "dynamic_string.h"
+
+
+#define ASSERT_TRUE(b, ...) if (!(b)) {              \
+    _wprintf(L"Test failed at %S:%u, ", __FILE__, __LINE__); \
+    _wprintf(__VA_ARGS__); _wprintf(L"\n");          \
+    ExitProcess(1);                                  \
+}
+
+static MatchNode* build_node(const wchar_t** words, unsigned count) {
+    NodeBuilder b;
+    ASSERT_TRUE(NodeBuilder_create(&b), L"Out of memory");
+    for (unsigned ix = 0; ix < count; ++ix) {
+        ASSERT_TRUE(NodeBuilder_add_fixed(&b, words[ix], wcslen(words[ix]), NULL),
+                    L"Out of memory");
+    }
+    MatchNode* node = NodeBuilder_finalize(&b);
+    ASSERT_TRUE(node != NULL, L"Out of memory");
+    return node;
+}
+
+// The ranked candidates of `f` are exactly `expected`, in order
+static void assert_ranked(FuzzyMatcher* f, const wchar_t* query, const wchar_t** expected,
+                          unsigned count) {
+    ASSERT_TRUE(f->ranked_count == count, L"Expected %u matches for '%s', got %u", count,
+                query, f->ranked_count);
+    for (unsigned ix = 0; ix < count; ++ix) {
+        const wchar_t* s = FuzzyMatcher_next(f);
+        ASSERT_TRUE(s != NULL && wcscmp(s, expected[ix]) == 0,
+                    L"Expected '%s' at %u for '%s', got '%s'", expected[ix], ix, query,
+                    s == NULL ? L"(null)" : s);
+    }
+}
+
+static void test_ranking(void) {
+    const wchar_t* words[] = {L"checkout", L"cherry-pick", L"commit", L"clean", L"config",
+                              L"check-ignore", L"fetch"};
+    MatchNode* node = build_node(words, 7);
+    FuzzyMatcher f;
+    FuzzyMatcher_init(&f);
+
+    // Prefix matches first, shorter ones before longer ones
+    FuzzyMatcher_begin(&f, node, L"ch");
+    const wchar_t* ch[] = {L"checkout", L"cherry-pick", L"check-ignore", L"fetch"};
+    assert_ranked(&f, L"ch", ch, 4);
+    // Starting over after the last one
+    ASSERT_TRUE(wcscmp(FuzzyMatcher_next(&f), L"checkout") == 0, L"Expected to wrap around");
+
+    FuzzyMatcher_begin(&f, node, L"cf");
+    const wchar_t* cf[] = {L"config"};
+    assert_ranked(&f, L"cf", cf, 1);
+
+    // Matching ignores case
+    FuzzyMatcher_begin(&f, node, L"CMT");
+    const wchar_t* cmt[] = {L"commit"};
+    assert_ranked(&f, L"CMT", cmt, 1);
+
+    FuzzyMatcher_begin(&f, node, L"xyz");
+    ASSERT_TRUE(FuzzyMatcher_next(&f) == NULL, L"Nothing should match 'xyz'");
+    FuzzyMatcher_free(&f);
+
+    // Matches at word boundaries and camel case humps beat shorter
+    // candidates matching inside a word
+    const wchar_t* boundary[] = {L"fetchall", L"foobar", L"fetch-all", L"fooBar"};
+    node = build_node(boundary, 4);
+    FuzzyMatcher_init(&f);
+    FuzzyMatcher_begin(&f, node, L"fal");
+    const wchar_t* fal[] = {L"fetch-all", L"fetchall"};
+    assert_ranked(&f, L"fal", fal, 2);
+    FuzzyMatcher_begin(&f, node, L"fb");
+    const wchar_t* fb[] = {L"fooBar", L"foobar"};
+    assert_ranked(&f, L"fb", fb, 2);
+    FuzzyMatcher_free(&f);
+}
+
+// Narrowing and widening the query re-filters the previous candidates,
+// which has to rank like starting over
+static void test_refilter(void) {
+    NodeBuilder b;
+    ASSERT_TRUE(NodeBuilder_create(&b), L"Out of memory");
+    WString word;
+    ASSERT_TRUE(WString_create(&word), L"Out of memory");
+    for (unsigned ix = 0; ix < 2000; ++ix) {
+        WString_clear(&word);
+        ASSERT_TRUE(WString_format(&word, L"module_%u_file_%u.c", ix % 97, ix), L"Out of memory");
+        ASSERT_TRUE(NodeBuilder_add_fixed(&b, word.buffer, word.length, NULL), L"Out of memory");
+    }
+    WString_free(&word);
+    MatchNode* node = NodeBuilder_finalize(&b);
+    ASSERT_TRUE(node != NULL, L"Out of memory");
+
+    const wchar_t* queries[] = {L"m", L"m1", L"m12", L"m12f", L"m12f9", L"m12f", L"m1", L"x",
+                                L"m12f1"};
+    FuzzyMatcher f;
+    FuzzyMatcher_init(&f);
+    for (unsigned q = 0; q < sizeof(queries) / sizeof(queries[0]); ++q) {
+        FuzzyMatcher_begin(&f, node, queries[q]);
+        FuzzyMatcher fresh;
+        FuzzyMatcher_init(&fresh);
+        FuzzyMatcher_begin(&fresh, node, queries[q]);
+        ASSERT_TRUE(f.ranked_count == fresh.ranked_count,
+                    L"Re-filtered '%s' has %u matches, expected %u", queries[q],
+                    f.ranked_count, fresh.ranked_count);
+        for (unsigned ix = 0; ix < f.ranked_count; ++ix) {
+            const wchar_t* a = FuzzyMatcher_next(&f);
+            const wchar_t* b = FuzzyMatcher_next(&fresh);
+            ASSERT_TRUE(wcscmp(a, b) == 0, L"Re-filtered '%s' ranks '%s' where '%s' belongs",
+                        queries[q], a, b);
+        }
+        FuzzyMatcher_free(&fresh);
+    }
+    FuzzyMatcher_free(&f);
+}
+
+// Only the part after the directory is matched fuzzily
+static void test_base(void) {
+    const wchar_t* paths[] = {L"src\\main.c", L"src\\mod.c", L"doc\\main.md", L"src\\xmc.c"};
+    MatchNode* node = build_node(paths, 4);
+    FuzzyMatcher f;
+    FuzzyMatcher_init(&f);
+    FuzzyMatcher_begin(&f, node, L"src\\mc");
+    const wchar_t* mc[] = {L"src\\mod.c", L"src\\main.c", L"src\\xmc.c"};
+    assert_ranked(&f, L"src\\mc", mc, 3);
+    FuzzyMatcher_begin(&f, node, L"src\\s");
+    ASSERT_TRUE(FuzzyMatcher_next(&f) == NULL, L"The directory should not be matched");
+    FuzzyMatcher_free(&f);
+}
+
+int main() {
+    MatchNode_init();
+    test_ranking();
+    test_refilter();
+    test_base();
+    MatchNode_free();
+
+    _wprintf(L"All tests successfull\n");
+    ExitProcess(0);
+}
@@ -0,0 +1,148 @@
+#include "history.h"
+#include "printf.h"
+#include "dynamic_string.h"
+
+
+#define ASSERT_TRUE(b, ...) if (!(b)) {              \
+    _wprintf(L"Test failed at %S:%u, ", __FILE__, __LINE__); \
+    _wprintf(__VA_ARGS__); _wprintf(L"\n");          \
+    ExitProcess(1);                                  \
+}
+
+#define HISTORY_PATH L"test_history.txt"
+
+static void add(History* h, const wchar_t* cmd) {
+    ASSERT_TRUE(History_add(h, cmd, wcslen(cmd)), L"Failed adding '%s'", cmd);
+}
+
+// Number of entries History_find steps through for `query`, newest first
+static uint32_t count_matches(History* h, const wchar_t* query) {
+    int64_t ix = -1;
+    uint32_t count = 0;
+    const wchar_t* res = History_find(h, query, &ix, 0);
+    while (res != NULL) {
+        ++count;
+        int64_t prev = ix;
+        res = History_find(h, query, &ix, 1);
+        ASSERT_TRUE(res == NULL || ix < prev, L"Older match of '%s' has higher index", query);
+    }
+    return count;
+}
+
+static void test_dedup(void) {
+    History h;
+    ASSERT_TRUE(History_open(&h, HISTORY_PATH), L"Failed opening history");
+    add(&h, L"git status");
+    add(&h, L"git status");
+    ASSERT_TRUE(h.live_count == 1 && h.entry_count == 1,
+                L"Repeating the newest entry added %u entries", h.entry_count);
+    add(&h, L"dir");
+    add(&h, L"GIT commit -m x");
+    add(&h, L"git status");
+    ASSERT_TRUE(h.live_count == 3, L"Expected 3 live entries, got %u", h.live_count);
+    ASSERT_TRUE(count_matches(&h, L"git status") == 1, L"Older copy of repeat still found");
+    ASSERT_TRUE(count_matches(&h, L"GIT") == 2, L"Expected 2 matches for 'GIT'");
+    ASSERT_TRUE(count_matches(&h, L"xyz") == 0, L"Expected no match for 'xyz'");
+
+    // The repeat replaced the older copy, so it is the newest match
+    int64_t ix = -1;
+    const wchar_t* res = History_find(&h, L"git", &ix, 0);
+    ASSERT_TRUE(res != NULL && wcscmp(res, L"git status") == 0, L"Wrong newest match");
+    History_close(&h);
+
+    // The replaced copy stays out after reading the file again
+    ASSERT_TRUE(History_open(&h, HISTORY_PATH), L"Failed reopening history");
+    ASSERT_TRUE(h.live_count == 3, L"Expected 3 live entries after reopen, got %u",
+                h.live_count);
+    ASSERT_TRUE(count_matches(&h, L"status") == 1, L"Repeat duplicated on reopen");
+    History_close(&h);
+    DeleteFileW(HISTORY_PATH);
+}
+
+static void test_find(void) {
+    History h;
+    ASSERT_TRUE(History_open(&h, HISTORY_PATH), L"Failed opening history");
+    add(&h, L"make test");
+    add(&h, L"cd src");
+    add(&h, L"make all");
+    add(&h, L"Make install");
+
+    int64_t ix = -1;
+    const wchar_t* res = History_find(&h, L"make", &ix, 1);
+    ASSERT_TRUE(res != NULL && wcscmp(res, L"Make install") == 0,
+                L"First step should find the newest match");
+    res = History_find(&h, L"make", &ix, 0);
+    ASSERT_TRUE(res != NULL && wcscmp(res, L"Make install") == 0,
+                L"Step 0 should keep a matching entry");
+    res = History_find(&h, L"make", &ix, 1);
+    ASSERT_TRUE(res != NULL && wcscmp(res, L"make all") == 0, L"Expected 'make all'");
+    res = History_find(&h, L"make", &ix, 1);
+    ASSERT_TRUE(res != NULL && wcscmp(res, L"make test") == 0, L"Expected 'make test'");
+    int64_t oldest = ix;
+    ASSERT_TRUE(History_find(&h, L"make", &ix, 1) == NULL && ix == oldest,
+                L"Stepping past the oldest match should fail and keep the index");
+    res = History_find(&h, L"make", &ix, -1);
+    ASSERT_TRUE(res != NULL && wcscmp(res, L"make all") == 0, L"Expected 'make all' again");
+
+    // Narrowing the query keeps the entry if it still matches, and
+    // otherwise starts from the newest match
+    res = History_find(&h, L"make a", &ix, 0);
+    ASSERT_TRUE(res != NULL && wcscmp(res, L"make all") == 0, L"Step 0 left a matching entry");
+    res = History_find(&h, L"make t", &ix, 0);
+    ASSERT_TRUE(res != NULL && wcscmp(res, L"make test") == 0, L"Expected 'make test'");
+    res = History_find(&h, L"make i", &ix, -1);
+    ASSERT_TRUE(res != NULL && wcscmp(res, L"Make install") == 0, L"Expected 'Make install'");
+    ASSERT_TRUE(History_find(&h, L"make i", &ix, -1) == NULL, L"Nothing newer matches");
+    res = History_find(&h, L"SRC", &ix, 0);
+    ASSERT_TRUE(res != NULL && wcscmp(res, L"cd src") == 0, L"Matching should ignore case");
+    History_close(&h);
+    DeleteFileW(HISTORY_PATH);
+}
+
+static void test_compact(void) {
+    History h;
+    ASSERT_TRUE(History_open(&h, HISTORY_PATH), L"Failed opening history");
+    WString cmd;
+    ASSERT_TRUE(WString_create(&cmd), L"Out of memory");
+    // Enough distinct entries to pass HISTORY_MAX_SIZE
+    uint32_t count = 0;
+    uint64_t size = 0;
+    while (size <= HISTORY_MAX_SIZE + HISTORY_FLUSH_SIZE) {
+        WString_clear(&cmd);
+        ASSERT_TRUE(WString_format(&cmd, L"echo command number %u with some padding", count),
+                    L"Out of memory");
+        add(&h, cmd.buffer);
+        size += (cmd.length + 2) * sizeof(wchar_t);
+        ++count;
+    }
+    History_flush(&h, true);
+    History_close(&h);
+
+    ASSERT_TRUE(History_open(&h, HISTORY_PATH), L"Failed reopening history");
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    ASSERT_TRUE(GetFileAttributesExW(HISTORY_PATH, GetFileExInfoStandard, &attr),
+                L"History file missing after compaction");
+    ASSERT_TRUE(attr.nFileSizeHigh == 0 && attr.nFileSizeLow <= HISTORY_MAX_SIZE,
+                L"History file not compacted, %u bytes", attr.nFileSizeLow);
+    ASSERT_TRUE(h.live_count < count, L"Compaction kept all %u entries", count);
+
+    WString_clear(&cmd);
+    ASSERT_TRUE(WString_format(&cmd, L"number %u with", count - 1), L"Out of memory");
+    ASSERT_TRUE(count_matches(&h, cmd.buffer) == 1, L"Newest entry dropped");
+    ASSERT_TRUE(count_matches(&h, L"number 0 with") == 0, L"Oldest entry kept");
+    ASSERT_TRUE(GetFileAttributesW(HISTORY_PATH L".tmp") == INVALID_FILE_ATTRIBUTES,
+                L"Temporary file left behind");
+    WString_free(&cmd);
+    History_close(&h);
+    DeleteFileW(HISTORY_PATH);
+}
+
+int main() {
+    DeleteFileW(HISTORY_PATH);
+    test_dedup();
+    test_find();
+    test_compact();
+
+    _wprintf(L"All tests successfull\n");
+    ExitProcess(0);
+}
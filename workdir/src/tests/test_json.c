@@ -0,0 +1,439 @@
+#include "json.h"
+#include "arena.h"
+#include "printf.h"
+#include "dynamic_string.h"
+
+
+#define ASSERT_TRUE(b, ...) if (!(b)) {              \
+    _wprintf(L"Test failed at %S:%u, ", __FILE__, __LINE__); \
+    _wprintf(__VA_ARGS__); _wprintf(L"\n");          \
+    ExitProcess(1);                                  \
+}
+
+#define START_PERF(loop_count) { LARGE_INTEGER freq, start, end; \
+    QueryPerformanceFrequency(&freq); \
+    QueryPerformanceCounter(&start);    \
+    for (uint64_t loop_count_i = 0; loop_count_i < (loop_count); ++loop_count_i) {
+
+#define END_PERF(msg, bytes) } \
+    QueryPerformanceCounter(&end); \
+    uint64_t ms = (end.QuadPart - start.QuadPart) * 1000 / freq.QuadPart; \
+    _wprintf(L##msg L": %llu ms, %llu MB/s\n", ms, \
+             ms == 0 ? 0 : (bytes) / 1000 / ms); }
+
+// Parse with the chunked reader only, the path documents took before
+// the structural index
+bool reader_parse(const char* s, JsonType* val, String_noinit* errormsg,
+                  const Allocator* allocator) {
+    JsonReader r;
+    JsonReader_create_str(&r, s, allocator);
+    bool res = JsonReader_read(&r, val) == JSON_EVENT_DONE;
+    if (!res) {
+        String_create(errormsg);
+        String_extend(errormsg, JsonReader_error(&r));
+    }
+    JsonReader_free(&r);
+    return res;
+}
+
+// Feed `s` to a reader `chunk` bytes at a time
+bool chunked_parse(const char* s, size_t chunk, JsonType* val) {
+    JsonReader r;
+    JsonReader_create(&r, NULL);
+    size_t len = strlen(s);
+    size_t pos = 0;
+    JsonEvent e;
+    while ((e = JsonReader_read(&r, val)) == JSON_EVENT_NONE) {
+        if (pos == len) {
+            JsonReader_finish(&r);
+            continue;
+        }
+        size_t n = len - pos < chunk ? len - pos : chunk;
+        ASSERT_TRUE(JsonReader_feed(&r, s + pos, n), L"Out of memory");
+        pos += n;
+    }
+    JsonReader_free(&r);
+    return e == JSON_EVENT_DONE;
+}
+
+// The indexed parser, the reader and the tape agree on `doc`
+void assert_same(const char* doc) {
+    JsonType a, b;
+    JsonTape t;
+    String ea, eb, et;
+    bool ok_a = json_parse_type(doc, &a, &ea);
+    bool ok_b = reader_parse(doc, &b, &eb, NULL);
+    bool ok_t = json_parse_tape(doc, &t, &et);
+    ASSERT_TRUE(ok_a == ok_b && ok_a == ok_t, L"Parsers disagree on '%S'", doc);
+    if (!ok_a) {
+        ASSERT_TRUE(strcmp(ea.buffer, eb.buffer) == 0 && strcmp(ea.buffer, et.buffer) == 0,
+                    L"Different errors '%S', '%S', '%S'", ea.buffer, eb.buffer, et.buffer);
+        String_free(&ea);
+        String_free(&eb);
+        String_free(&et);
+        return;
+    }
+    String sa, sb, st;
+    String_create(&sa);
+    String_create(&sb);
+    String_create(&st);
+    json_type_to_string(&a, &sa);
+    json_type_to_string(&b, &sb);
+    json_tape_to_string(&t, JSON_TAPE_ROOT, &st);
+    ASSERT_TRUE(strcmp(sa.buffer, sb.buffer) == 0 && strcmp(sa.buffer, st.buffer) == 0,
+                L"Different trees for '%S'", doc);
+    String_free(&sa);
+    String_free(&sb);
+    String_free(&st);
+    JsonType_free(&a);
+    JsonType_free(&b);
+    JsonTape_free(&t);
+}
+
+// Config shaped document of about `size` bytes
+void make_config(String* s, uint64_t size) {
+    String_extend(s, "{\"root\": {");
+    for (uint64_t i = 0; s->length < size; ++i) {
+        if (i > 0) {
+            String_append(s, ',');
+        }
+        String_format_append(s, "\n  \"cmd%llu\": {\"name\": \"command \\\"%llu\\\"\", "
+                             "\"path\": \"C:\\\\Program Files\\\\tool%llu\\\\bin\", "
+                             "\"weight\": %llu.5, \"enabled\": true, \"args\": "
+                             "[\"--flag\", \"--other\", null, 1.25e3, false]}", i, i, i, i);
+    }
+    String_extend(s, "\n}}");
+}
+
+int main() {
+    assert_same("{\"Hello\": [0.5, -0.0, true, null, {\"This\": \"Is the fin\\\"al\"}]}");
+    assert_same("  [\"a\\\\\", \"\\\\\\\"\", \"{[,:]}\"]  ");
+    assert_same("[1.5 2.5]");
+    assert_same("{\"a\": 1.5,}");
+    assert_same("{\"a\" 1.5}");
+    assert_same("[truex]");
+    assert_same("\"unterminated");
+    assert_same("[0, -1123, 9223372036854775807, -9223372036854775808, 1e400, -0.0]");
+    assert_same("[12345678901234567890, 0.1000000000000000055511151231257827, 5e-324]");
+    // Repeated keys keep their first position and last value everywhere
+    assert_same("{\"b\": 1, \"a\": [true], \"b\": {\"c\": 2, \"d\": 0, \"c\": 3}, \"b\": 4}");
+
+    // Backslash runs and quotes around every 64 byte block boundary
+    for (uint32_t pad = 0; pad < 70; ++pad) {
+        for (uint32_t count = 0; count < 70; ++count) {
+            String doc;
+            String_create(&doc);
+            String_append(&doc, '[');
+            for (uint32_t i = 0; i < pad; ++i) {
+                String_append(&doc, ' ');
+            }
+            String_append(&doc, '"');
+            for (uint32_t i = 0; i < count; ++i) {
+                String_append(&doc, '\\');
+            }
+            if (count % 2 == 1) {
+                String_append(&doc, '"');
+            }
+            String_extend(&doc, "x\", 2.5]");
+            assert_same(doc.buffer);
+            String_free(&doc);
+        }
+    }
+
+    JsonType val;
+    String err;
+    ASSERT_TRUE(!json_parse_type("[\"\xff\"]", &val, &err), L"Accepted invalid utf-8");
+    String_free(&err);
+    ASSERT_TRUE(!reader_parse("[\"ok\", \"\xc3\"]", &val, &err, NULL) &&
+                !chunked_parse("{\"\xed\xa0\x80\": 1}", 3, &val),
+                L"Reader accepted invalid utf-8");
+    String_free(&err);
+
+    // Strings with escapes split at every position between chunks
+    const char* escape_doc = "{\"k\\\"ey\": [\"a\\\\b\\\"c\\u00e9\\n\", \"\xc3\xa9\\/\"], \"x\": \"\\\\\"}";
+    ASSERT_TRUE(json_parse_type(escape_doc, &val, &err), L"Failed parsing escapes");
+    String whole;
+    String_create(&whole);
+    json_type_to_string(&val, &whole);
+    JsonType_free(&val);
+    for (size_t chunk = 1; chunk <= strlen(escape_doc); ++chunk) {
+        ASSERT_TRUE(chunked_parse(escape_doc, chunk, &val), L"Failed parsing %llu byte chunks", chunk);
+        String chunked;
+        String_create(&chunked);
+        json_type_to_string(&val, &chunked);
+        ASSERT_TRUE(String_equals(&whole, &chunked), L"Chunks of %llu bytes changed strings", chunk);
+        String_free(&chunked);
+        JsonType_free(&val);
+    }
+    String_free(&whole);
+
+    // Keys are kept while nested objects parse their own keys
+    const char* nested_doc = "{\"a\": {\"b\": 1, \"c\": {\"d\": [{\"e\": 2}]}}, \"f\": {\"g\": 3}}";
+    for (uint32_t i = 0; i < 2; ++i) {
+        bool ok = i == 0 ? json_parse_type(nested_doc, &val, &err) :
+                           reader_parse(nested_doc, &val, &err, NULL);
+        ASSERT_TRUE(ok && val.type == JSON_OBJECT, L"Failed parsing nested objects");
+        JsonObject* a = JsonObject_get_obj(&val.object, "a");
+        JsonObject* f = JsonObject_get_obj(&val.object, "f");
+        ASSERT_TRUE(a != NULL && f != NULL && val.object.data.element_count == 2, L"Wrong outer keys");
+        JsonObject* c = JsonObject_get_obj(a, "c");
+        int64_t* b = JsonObject_get_int(a, "b");
+        int64_t* g = JsonObject_get_int(f, "g");
+        ASSERT_TRUE(c != NULL && b != NULL && *b == 1 && g != NULL && *g == 3 &&
+                    JsonObject_get_list(c, "d") != NULL, L"Wrong nested keys");
+        JsonType_free(&val);
+    }
+
+    // Lookups in small and indexed objects, the last of repeated keys wins
+    JsonTape tape;
+    ASSERT_TRUE(json_parse_tape("{\"b\": 1, \"a\": [true, \"x\", {}], \"b\": 2}", &tape, &err),
+                L"Failed parsing tape");
+    int64_t n;
+    StrView str;
+    JsonTapeRef a = JsonTapeObject_get_list(&tape, JSON_TAPE_ROOT, "a");
+    ASSERT_TRUE(JsonTapeObject_get_int(&tape, JSON_TAPE_ROOT, "b", &n) && n == 2, L"Wrong value of b");
+    ASSERT_TRUE(a != JSON_TAPE_NONE && JsonTape_size(&tape, a) == 3, L"Wrong list");
+    ASSERT_TRUE(JsonTapeList_get_string(&tape, a, 1, &str) && str.length == 1 && str.data[0] == 'x',
+                L"Wrong list element");
+    ASSERT_TRUE(JsonTapeList_get_obj(&tape, a, 2) != JSON_TAPE_NONE &&
+                JsonTapeList_get(&tape, a, 3) == JSON_TAPE_NONE, L"Wrong list end");
+    JsonTape_free(&tape);
+
+    String large;
+    String_create(&large);
+    String_append(&large, '{');
+    for (uint32_t i = 0; i < 100; ++i) {
+        String_format_append(&large, "\"key%u\": %u, ", (i * 37) % 100, i);
+    }
+    String_extend(&large, "\"key7\": {\"deep\": null}}");
+    assert_same(large.buffer);
+    ASSERT_TRUE(json_parse_tape(large.buffer, &tape, &err), L"Failed parsing tape");
+    ASSERT_TRUE(JsonTape_size(&tape, JSON_TAPE_ROOT) == 100, L"Repeated key counted twice");
+    String name;
+    String_create(&name);
+    for (uint32_t i = 0; i < 100; ++i) {
+        String_clear(&name);
+        String_format_append(&name, "key%u", i);
+        const char* key = name.buffer;
+        if (i == 7) {
+            JsonTapeRef deep = JsonTapeObject_get_obj(&tape, JSON_TAPE_ROOT, key);
+            ASSERT_TRUE(deep != JSON_TAPE_NONE && JsonTapeObject_get_null(&tape, deep, "deep"),
+                        L"Wrong value of repeated key");
+            continue;
+        }
+        // key(i * 37 % 100) was written with value i, and 37 * 73 % 100 == 1
+        ASSERT_TRUE(JsonTapeObject_get_int(&tape, JSON_TAPE_ROOT, key, &n) && n == (i * 73) % 100,
+                    L"Wrong value of %S", key);
+    }
+    ASSERT_TRUE(JsonTapeObject_get(&tape, JSON_TAPE_ROOT, "key100") == JSON_TAPE_NONE &&
+                JsonTapeObject_get(&tape, JSON_TAPE_ROOT, "") == JSON_TAPE_NONE, L"Found missing key");
+    JsonTape_free(&tape);
+
+    // Long strings without escapes point into the input
+    String_clear(&large);
+    String_extend(&large, "{\"short\": \"x\", \"long\": \"");
+    for (uint32_t i = 0; i < 100; ++i) {
+        String_append(&large, 'a' + i % 26);
+    }
+    String_extend(&large, "\", \"escaped\": \"");
+    for (uint32_t i = 0; i < 100; ++i) {
+        String_extend(&large, "\\n");
+    }
+    String_extend(&large, "\"}");
+    ASSERT_TRUE(json_parse_tape_borrowed(large.buffer, &tape, &err, NULL), L"Failed parsing tape");
+    ASSERT_TRUE(JsonTapeObject_get_string(&tape, JSON_TAPE_ROOT, "long", &str) && str.length == 100 &&
+                str.data > large.buffer && str.data < large.buffer + large.length,
+                L"Long string not borrowed");
+    // Long strings with escapes are borrowed raw, and unescaped on request
+    JsonTapeRef escaped = JsonTapeObject_get(&tape, JSON_TAPE_ROOT, "escaped");
+    str = JsonTape_string(&tape, escaped);
+    ASSERT_TRUE(JsonTape_string_escaped(&tape, escaped) && str.length == 200 &&
+                str.data > large.buffer && str.data < large.buffer + large.length &&
+                str.data[0] == '\\' && str.data[1] == 'n', L"Escaped string not borrowed raw");
+    String unescaped;
+    String_create(&unescaped);
+    ASSERT_TRUE(JsonTape_string_unescape(&tape, escaped, &unescaped) &&
+                unescaped.length == 100 && unescaped.buffer[99] == '\n',
+                L"Wrong unescaped string");
+    String_free(&unescaped);
+    ASSERT_TRUE(!JsonTape_string_escaped(&tape, JsonTapeObject_get(&tape, JSON_TAPE_ROOT, "long")),
+                L"Long string marked escaped");
+    ASSERT_TRUE(JsonTapeObject_get_string(&tape, JSON_TAPE_ROOT, "short", &str) &&
+                str.length == 1 && str.data[1] == '\0', L"Short string not copied");
+    String_clear(&name);
+    json_tape_to_string(&tape, JSON_TAPE_ROOT, &name);
+    JsonTape_free(&tape);
+    ASSERT_TRUE(json_parse_tape(large.buffer, &tape, &err), L"Failed parsing tape");
+    String copied;
+    String_create(&copied);
+    json_tape_to_string(&tape, JSON_TAPE_ROOT, &copied);
+    ASSERT_TRUE(strcmp(name.buffer, copied.buffer) == 0, L"Borrowed tape differs");
+    JsonTape_free(&tape);
+    // Escapes of borrowed strings are still checked
+    String_clear(&large);
+    String_extend(&large, "[\"");
+    for (uint32_t i = 0; i < 100; ++i) {
+        String_extend(&large, "\\q");
+    }
+    String_extend(&large, "\"]");
+    ASSERT_TRUE(!json_parse_tape_borrowed(large.buffer, &tape, &err, NULL),
+                L"Invalid escape in borrowed string accepted");
+    String_free(&copied);
+    String_free(&large);
+    String_free(&name);
+
+    // Every byte below 0x80 survives escaping, around the SIMD block size
+    String raw;
+    String_create(&raw);
+    for (uint32_t i = 1; i < 0x80; ++i) {
+        String_append(&raw, (char)i);
+    }
+    String_extend(&raw, "\"\\\"\\ end");
+    JsonType strval;
+    strval.type = JSON_STRING;
+    strval.string = raw;
+    String text;
+    String_create(&text);
+    ASSERT_TRUE(json_type_to_string(&strval, &text), L"Failed formatting string");
+    ASSERT_TRUE(json_parse_type(text.buffer, &val, &err), L"Failed parsing escaped string");
+    ASSERT_TRUE(val.type == JSON_STRING && String_equals(&val.string, &raw), L"Escaping changed string");
+    JsonType_free(&val);
+    String_free(&raw);
+
+    // Pretty output parses back to the same document
+    const char* pretty_doc = "{\"a\": [1, {}, [], {\"b\": [null, \"x\\n\"]}], \"c\": {\"d\": 2.5}}";
+    ASSERT_TRUE(json_parse_type(pretty_doc, &val, &err) && json_parse_tape(pretty_doc, &tape, &err),
+                L"Failed parsing pretty document");
+    String compact, pretty, tape_pretty;
+    String_create(&compact);
+    String_create(&pretty);
+    String_create(&tape_pretty);
+    json_type_to_string(&val, &compact);
+    String exact;
+    ASSERT_TRUE(json_type_to_new_string(&val, &exact) && String_equals(&exact, &compact),
+                L"Wrong single allocation output");
+    String_free(&exact);
+    ASSERT_TRUE(json_type_to_string_pretty(&val, &pretty) &&
+                json_tape_to_string_pretty(&tape, JSON_TAPE_ROOT, &tape_pretty),
+                L"Failed pretty printing");
+    ASSERT_TRUE(strcmp(pretty.buffer, tape_pretty.buffer) == 0, L"Pretty tape differs");
+    ASSERT_TRUE(strcmp(pretty.buffer, "{\n  \"a\": [\n    1,\n    {},\n    [],\n    {\n"
+                       "      \"b\": [\n        null,\n        \"x\\n\"\n      ]\n    }\n  ],\n"
+                       "  \"c\": {\n    \"d\": 2.5\n  }\n}") == 0, L"Wrong pretty output");
+    JsonType_free(&val);
+    JsonTape_free(&tape);
+    ASSERT_TRUE(json_parse_type(pretty.buffer, &val, &err), L"Failed parsing pretty output");
+    String_clear(&pretty);
+    json_type_to_string(&val, &pretty);
+    ASSERT_TRUE(strcmp(pretty.buffer, compact.buffer) == 0, L"Pretty output changed document");
+    JsonType_free(&val);
+    String_free(&compact);
+    String_free(&pretty);
+    String_free(&tape_pretty);
+
+    // Doubles survive a round trip bit for bit
+    JsonList numbers;
+    JsonList_create(&numbers);
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+    for (uint32_t i = 0; i < 1000000; ++i) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        double d;
+        if (i % 2 == 0) {
+            // Coordinate like
+            d = ((double)(rng >> 11) / (1ull << 53) - 0.5) * 360.0;
+        } else {
+            uint64_t bits = rng & ~(0x7FFull << 52);
+            bits |= ((rng >> 40) % 0x7FF) << 52;
+            memcpy(&d, &bits, sizeof(d));
+        }
+        ASSERT_TRUE(JsonList_append_double(&numbers, d), L"Out of memory");
+    }
+    JsonType list;
+    list.type = JSON_LIST;
+    list.list = numbers;
+    String_clear(&text);
+    ASSERT_TRUE(json_type_to_string(&list, &text), L"Failed formatting numbers");
+    JsonType parsed;
+    ASSERT_TRUE(json_parse_type(text.buffer, &parsed, &err), L"Failed parsing numbers");
+    ASSERT_TRUE(parsed.type == JSON_LIST && parsed.list.size == numbers.size, L"Wrong number count");
+    for (uint32_t i = 0; i < numbers.size; ++i) {
+        ASSERT_TRUE(parsed.list.data[i].type == JSON_DOUBLE &&
+                    memcmp(&parsed.list.data[i].dbl, &numbers.data[i].dbl, sizeof(double)) == 0,
+                    L"Double %u did not round trip", i);
+    }
+    JsonType_free(&parsed);
+
+    _wprintf(L"All tests successfull\n");
+
+    START_PERF(10);
+        String_clear(&text);
+        json_type_to_string(&list, &text);
+    END_PERF("Format numbers", 10 * text.length);
+
+    START_PERF(10);
+        JsonType v;
+        String e;
+        ASSERT_TRUE(json_parse_type(text.buffer, &v, &e), L"Failed parsing numbers");
+        JsonType_free(&v);
+    END_PERF("Parse numbers", 10 * text.length);
+    JsonType_free(&list);
+    String_free(&text);
+
+    String config;
+    String_create(&config);
+    make_config(&config, 8 * 1000 * 1000);
+
+    // Parsed into an arena like the RPC server and autocmp do, so the
+    // numbers are not dominated by the heap
+    Arena arena;
+    ASSERT_TRUE(Arena_create(&arena, 0x40000000, NULL, NULL), L"Failed creating arena");
+    Allocator allocator;
+    Arena_allocator(&arena, &allocator);
+
+    START_PERF(10);
+        JsonType v;
+        ASSERT_TRUE(json_parse_type_with(config.buffer, &v, NULL, &allocator),
+                    L"Failed parsing config");
+        Arena_release(&arena);
+    END_PERF("Structural index", 10 * config.length);
+
+    START_PERF(10);
+        JsonType v;
+        String e;
+        ASSERT_TRUE(reader_parse(config.buffer, &v, &e, &allocator), L"Failed parsing config");
+        Arena_release(&arena);
+    END_PERF("Reader", 10 * config.length);
+
+    JsonType tree;
+    JsonTape tree_tape;
+    ASSERT_TRUE(json_parse_type(config.buffer, &tree, NULL) &&
+                json_parse_tape(config.buffer, &tree_tape, NULL), L"Failed parsing config");
+    START_PERF(10);
+        String out;
+        String_create(&out);
+        ASSERT_TRUE(json_type_to_string(&tree, &out), L"Failed formatting config");
+        String_free(&out);
+    END_PERF("Serialize", 10 * config.length);
+
+    START_PERF(10);
+        String out;
+        String_create(&out);
+        ASSERT_TRUE(json_tape_to_string(&tree_tape, JSON_TAPE_ROOT, &out), L"Failed formatting config");
+        String_free(&out);
+    END_PERF("Serialize tape", 10 * config.length);
+    JsonType_free(&tree);
+    JsonTape_free(&tree_tape);
+
+    START_PERF(10);
+        JsonTape t;
+        ASSERT_TRUE(json_parse_tape_with(config.buffer, &t, NULL, &allocator),
+                    L"Failed parsing config");
+        Arena_release(&arena);
+    END_PERF("Tape", 10 * config.length);
+
+    Arena_free(&arena);
+    String_free(&config);
+    ExitProcess(0);
+}
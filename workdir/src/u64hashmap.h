@@ -27,6 +27,7 @@
 #undef HashMap_Allocate
 #undef HashMap_Clear
 #undef HashMap_Create
+#undef HashMap_CreateWith
 #undef HashMap_Insert
 #undef HashMap_Find
 #undef HashMap_Get